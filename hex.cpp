@@ -36,6 +36,8 @@ const char *hex::syscallEnumToStr(Syscall syscall) {
     case Syscall::EXIT:  return "EXIT";
     case Syscall::WRITE: return "WRITE";
     case Syscall::READ:  return "READ";
+    case Syscall::WRITEBLOCK: return "WRITEBLOCK";
+    case Syscall::READBLOCK:  return "READBLOCK";
     default:             return "UNKNOWN";
   }
 }
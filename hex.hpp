@@ -33,9 +33,11 @@ enum OprInstr {
 };
 
 enum class Syscall {
-  EXIT  = 0,
-  WRITE = 1,
-  READ  = 2,
+  EXIT       = 0,
+  WRITE      = 1,
+  READ       = 2,
+  WRITEBLOCK = 3,
+  READBLOCK  = 4,
   NUM_VALUES
 };
 
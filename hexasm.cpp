@@ -1,4 +1,7 @@
+#include <chrono>
+
 #include "hexasm.hpp"
+#include "hexcache.hpp"
 
 //===---------------------------------------------------------------------===//
 // Driver
@@ -14,6 +17,9 @@ static void help(const char *argv[]) {
   std::cout << "  --tokens          Tokenise the input only\n";
   std::cout << "  --instrs          Display the instruction sequence only\n";
   std::cout << "  -o,--output file  Specify a file for binary output (default a.out)\n";
+  std::cout << "  --cache-dir DIR   Reuse binaries from a cache in DIR (default: $HEX_CACHE_DIR)\n";
+  std::cout << "  --cache-stats     Report cache hits and misses on stderr\n";
+  std::cout << "  --stats           Report assembly times and label resolution on stderr\n";
 }
 
 int main(int argc, const char *argv[]) {
@@ -27,6 +33,9 @@ int main(int argc, const char *argv[]) {
     bool instrsOnly = false;
     const char *filename = nullptr;
     const char *outputFilename = "a.out";
+    const char *cacheDirectory = hex::BuildCache::getEnvironmentDirectory();
+    bool cacheStats = false;
+    bool stats = false;
     for (int i = 1; i < argc; ++i) {
       if (std::strcmp(argv[i], "-h") == 0 ||
           std::strcmp(argv[i], "--help") == 0) {
@@ -39,6 +48,12 @@ int main(int argc, const char *argv[]) {
       } else if (std::strcmp(argv[i], "--output") == 0 ||
                  std::strcmp(argv[i], "-o") == 0) {
         outputFilename = argv[++i];
+      } else if (std::strcmp(argv[i], "--cache-dir") == 0) {
+        cacheDirectory = argv[++i];
+      } else if (std::strcmp(argv[i], "--cache-stats") == 0) {
+        cacheStats = true;
+      } else if (std::strcmp(argv[i], "--stats") == 0) {
+        stats = true;
       } else if (argv[i][0] == '-') {
           throw std::runtime_error(std::string("unrecognised argument: ")+argv[i]);
       } else {
@@ -65,11 +80,32 @@ int main(int argc, const char *argv[]) {
       return 0;
     }
 
+    // Reuse a binary from the cache.
+    std::unique_ptr<hex::BuildCache> buildCache;
+    hex::BuildCache::Key cacheKey;
+    if (cacheDirectory && !instrsOnly && !stats) {
+      buildCache = std::make_unique<hex::BuildCache>(cacheDirectory);
+      cacheKey = hex::BuildCache::getKey("hexasm", "", lexer.getSource());
+      std::string binary;
+      if (buildCache->lookup(cacheKey, binary)) {
+        hex::writeBinaryFile(outputFilename, binary);
+        if (cacheStats) {
+          buildCache->reportStats(std::cerr);
+        }
+        return 0;
+      }
+    }
+
     // Parse the program.
+    auto start = std::chrono::steady_clock::now();
     auto program = parser.parseProgram();
+    auto parsed = std::chrono::steady_clock::now();
 
     // Initialise code generation from the parsed program.
     hexasm::CodeGen codeGen(program);
+    auto resolved = std::chrono::steady_clock::now();
+    size_t numDirectives = program.size();
+    size_t programBytes = codeGen.getProgramSize();
 
     // Print program summary only.
     if (instrsOnly) {
@@ -78,7 +114,27 @@ int main(int argc, const char *argv[]) {
     }
 
     // Emit the binary file.
-    codeGen.emitBin(outputFilename);
+    auto binary = codeGen.emitBinImage();
+    if (buildCache) {
+      buildCache->store(cacheKey, binary);
+      if (cacheStats) {
+        buildCache->reportStats(std::cerr);
+      }
+    }
+    hex::writeBinaryFile(outputFilename, binary);
+
+    // Report the assembly.
+    if (stats) {
+      std::chrono::duration<double, std::milli> parseTime = parsed - start;
+      std::chrono::duration<double, std::milli> resolveTime = resolved - parsed;
+      std::chrono::duration<double, std::milli> emitTime = std::chrono::steady_clock::now() - resolved;
+      std::cerr << boost::format("%-18s %d\n") % "Directives" % numDirectives;
+      std::cerr << boost::format("%-18s %d\n") % "Program bytes" % programBytes;
+      std::cerr << boost::format("%-18s %d\n") % "Relax iterations" % codeGen.getRelaxIterations();
+      std::cerr << boost::format("%-18s %.3f\n") % "Parse (ms)" % parseTime.count();
+      std::cerr << boost::format("%-18s %.3f\n") % "Resolve (ms)" % resolveTime.count();
+      std::cerr << boost::format("%-18s %.3f\n") % "Emit (ms)" % emitTime.count();
+    }
 
   } catch (const hexutil::Error &e) {
     if (e.hasLocation()) {
@@ -1,21 +1,27 @@
 #ifndef HEX_ASM_HPP
 #define HEX_ASM_HPP
 
+#include <algorithm>
 #include <cctype>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <istream>
 #include <fstream>
 #include <sstream>
 #include <iostream>
 #include <memory>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 #include <map>
 #include <boost/format.hpp>
 
 #include "hex.hpp"
+#include "hexbinary.hpp"
 #include "util.hpp"
 
 // An assembler for the Hex instruction set, based on xhexb.x and with
@@ -55,7 +61,7 @@ namespace hexasm {
 // Token enumeration and helper functions
 //===---------------------------------------------------------------------===//
 
-enum class Token {
+enum class Token : uint8_t {
   // Lexer tokens.
   NUMBER,
   MINUS,
@@ -89,6 +95,8 @@ enum class Token {
   LDAI_FB,
   LDBI_FB,
   STAI_FB,
+  DATA_BEGIN,
+  DATA_END,
   // Error/unexpected.
   NONE
 };
@@ -125,6 +133,8 @@ static const char *tokenEnumStr(Token token) {
   case Token::LDAI_FB:     return "LDAI_FB";
   case Token::LDBI_FB:     return "LDBI_FB";
   case Token::STAI_FB:     return "STAI_FB";
+  case Token::DATA_BEGIN:  return "DATA_BEGIN";
+  case Token::DATA_END:    return "DATA_END";
   case Token::NONE:        return "NONE";
   default:
     throw std::runtime_error(std::string("unexpected token: ")+std::to_string(static_cast<int>(token)));
@@ -224,271 +234,362 @@ static int numNibbles(int value) {
   return n;
 }
 
-/// Return the length of an instruction that has a relative label reference.
-/// The length of the encoding depends on the distance to the label, which in
-/// turn depends on the length of the instruction. Calculate the value by
-/// increasing the length until they match. Note that for positive references,
-/// the length of the encoding reduces the range that must be represented, and
-/// for negative references the encoding length adds to the range that must be
-/// represented.
-static int instrLen(int labelOffset, int byteOffset) {
-  int length = 1;
-  while (length < numNibbles(labelOffset - byteOffset - length)) {
-    length++;
-  }
-  return length;
-}
-
 //===---------------------------------------------------------------------===//
 // Directive data types.
 //===---------------------------------------------------------------------===//
 
-int numNibbles(int value);
+/// Return the encoded size of an immediate value.
+inline size_t immSize(int value) {
+  return (value < 0 && numNibbles(value) == 1) ? 2 : numNibbles(value);
+}
 
-// Base class for all directives.
-class Directive {
-  Location location;
-  Token token;
-  int byteOffset;
-  bool assembled;
-public:
-  Directive(Token token) :
-      token(token), byteOffset(0), assembled(false) {}
-  Directive(Location location, Token token) :
-      location(location), token(token), byteOffset(0), assembled(false) {}
-  virtual ~Directive() = default;
-  const Location &getLocation() const { return location; }
-  Token getToken() const { return token; }
-  void setByteOffset(unsigned value) { assembled = true; byteOffset = value; }
-  unsigned getByteOffset() const { return byteOffset; }
-  bool isAssembled() const { return assembled; }
-  virtual bool operandIsLabel() const = 0;
-  virtual size_t getSize() const = 0;
-  virtual int getValue() const = 0;
-  virtual std::string toString() const = 0;
-};
+/// Label names, each interned once and referred to by a dense id.
+class LabelTable {
+  // The names, in order of their ids, which do not move as names are added.
+  std::deque<std::string> names;
+  // Views of the names, so a name is only copied when it is first added.
+  std::unordered_map<std::string_view, uint32_t> ids;
 
-class Data : public Directive {
-  int value;
 public:
-  Data(Token token, int value) :
-      Directive(token), value(value) {}
-  Data(Location location, Token token, int value) :
-      Directive(location, token), value(value) {}
-  bool operandIsLabel() const { return false; }
-  size_t getSize() const { return 4; } // Data entries are always one word.
-  int getValue() const { return value; }
-  std::string toString() const {
-    return "DATA " + std::to_string(value);
+  static constexpr uint32_t NO_LABEL = 0xFFFFFFFF;
+
+  LabelTable() = default;
+  LabelTable(LabelTable&&) = default;
+  LabelTable &operator=(LabelTable&&) = default;
+  LabelTable(const LabelTable&) = delete;
+  LabelTable &operator=(const LabelTable&) = delete;
+
+  /// Return the id of a name, adding it if it is new.
+  uint32_t intern(std::string_view name) {
+    auto it = ids.find(name);
+    if (it != ids.end()) {
+      return it->second;
+    }
+    names.emplace_back(name);
+    ids.emplace(names.back(), names.size() - 1);
+    return names.size() - 1;
   }
-};
 
-class Label : public Directive {
-  std::string label;
-  int labelValue;
-public:
-  Label(Token token, std::string label) :
-      Directive(token), label(label), labelValue(0) {}
-  Label(Location location, Token token, std::string label) :
-      Directive(location, token), label(label), labelValue(0) {}
-  bool operandIsLabel() const { return false; }
-  size_t getSize() const { return 0; }
-  /// Update the label value and return true if it was changed.
-  bool setLabelValue(int newValue) {
-    int oldValue = labelValue;
-    labelValue = newValue;
-    return oldValue != newValue;
-  }
-  int getValue() const { return labelValue; }
-  const std::string &getLabel() const { return label; }
-  std::string toString() const { return label; }
+  const std::string &getName(uint32_t id) const { return names[id]; }
+  size_t size() const { return names.size(); }
 };
 
-class Func : public Label {
-  std::string identifier;
+/// A program as a stream of directives, held as a structure of arrays with
+/// one element per directive in each, so that a directive costs no allocation
+/// of its own and the passes over a program read only the fields they use.
+/// The fields of a directive are:
+///  - its token: DATA, a label (IDENTIFIER, FUNC or PROC), an instruction,
+///    PADDING, or one of the intermediate directives of xcmp;
+///  - its value: the value of DATA, the byte offset of a label, the operand of
+///    an instruction, the OPR token of OPR, or the value of an intermediate
+///    directive;
+///  - the id of the label it defines or refers to, or NO_LABEL;
+///  - its flags, marking a label operand and whether it is relative;
+///  - its size and byte offset, once assembled;
+///  - its source location, if it has one, for reporting errors.
+class DirectiveStream {
 public:
-  Func(Token token, std::string identifier) :
-      Label(token, identifier) {}
-  Func(Location location, Token token, std::string identifier) :
-      Label(location, token, identifier) {}
-  const std::string &getName() const { return getLabel(); }
-  std::string toString() const {
-    return "FUNC " + getLabel();
-  }
-};
+  static constexpr uint32_t NO_LABEL = LabelTable::NO_LABEL;
+
+private:
+  enum Flags : uint8_t {
+    LABEL_OPERAND = 1 << 0,
+    RELATIVE      = 1 << 1
+  };
+
+  LabelTable labels;
+  std::vector<Token> tokens;
+  std::vector<int> values;
+  std::vector<uint32_t> labelIds;
+  std::vector<uint8_t> flags;
+  std::vector<uint8_t> sizes;
+  std::vector<uint32_t> byteOffsets;
+  // Locations are only held up to the last directive that has one, so that
+  // a stream generated without them (by xcmp) does not hold any.
+  std::vector<Location> locations;
+  bool assembled;
 
-class Proc : public Label {
-  std::string identifier;
-public:
-  Proc(Token token, std::string identifier) :
-      Label(token, identifier) {}
-  Proc(Location location, Token token, std::string identifier) :
-      Label(location, token, identifier) {}
-  const std::string &getName() const { return getLabel(); }
-  std::string toString() const {
-    return "PROC " + getLabel();
+  void add(Token token, int value, uint32_t label, uint8_t flag,
+           size_t size, Location location) {
+    tokens.push_back(token);
+    values.push_back(value);
+    labelIds.push_back(label);
+    flags.push_back(flag);
+    sizes.push_back(size);
+    byteOffsets.push_back(0);
+    if (!location.isNull()) {
+      locations.resize(tokens.size());
+      locations.back() = location;
+    }
   }
-};
 
-class InstrImm : public Directive {
-  int immValue;
-public:
-  InstrImm(Token token, int immValue) :
-      Directive(token), immValue(immValue) {}
-  InstrImm(Location location, Token token, int immValue) :
-      Directive(location, token), immValue(immValue) {}
-  bool operandIsLabel() const { return false; }
-  size_t getSize() const {
-    return (immValue < 0 && numNibbles(immValue) == 1) ? 2 : numNibbles(immValue);
-  }
-  int getValue() const { return immValue; }
-  std::string toString() const {
-    return std::string(tokenEnumStr(getToken())) + " " + std::to_string(immValue);
+  template<typename T>
+  static void appendRange(std::vector<T> &column, size_t begin, size_t end) {
+    size_t size = column.size();
+    column.resize(size + end - begin);
+    std::copy(column.begin() + begin, column.begin() + end, column.begin() + size);
   }
-};
 
-class InstrLabel : public Directive {
-  std::string label;
-  int labelValue;
-  bool relative;
 public:
-  InstrLabel(Token token, std::string label, bool relative) :
-      Directive(token), label(label), relative(relative) {}
-  InstrLabel(Location location, Token token, std::string label, bool relative) :
-      Directive(location, token), label(label), relative(relative) {}
-  void setLabelValue(int newValue) { labelValue = newValue; }
-  bool operandIsLabel() const { return true; }
-  bool isRelative() const { return relative; }
-  size_t getSize() const {
-    return (labelValue < 0 && numNibbles(labelValue) == 1) ? 2 : numNibbles(labelValue);
-  }
-  int getValue() const { return labelValue; }
-  std::string getLabel() const { return label; }
-  std::string toString() const {
-    auto str = std::string(tokenEnumStr(getToken())) + " " + label;
-    if (isAssembled()) {
-      str += " (" + std::to_string(labelValue) + ")";
-    }
-    return str;
-  }
-};
+  DirectiveStream() : assembled(false) {}
 
-class InstrOp : public Directive {
-  Token opcode;
-public:
-  InstrOp(Token token, Token opcode) :
-      Directive(token), opcode(opcode) {
-    if (opcode != Token::BRB &&
-        opcode != Token::ADD &&
-        opcode != Token::SUB &&
-        opcode != Token::SVC) {
-      throw InvalidOprError(opcode);
-    }
+  /// Directive generation -------------------------------------------------///
+  void addData(int value, Location location=Location()) {
+    add(Token::DATA, value, NO_LABEL, 0, 4, location); // Data entries are always one word.
+  }
+  void addLabel(Token token, std::string_view name, Location location=Location()) {
+    add(token, 0, labels.intern(name), 0, 0, location);
+  }
+  void addInstrImm(Token token, int value, Location location=Location()) {
+    add(token, value, NO_LABEL, 0, immSize(value), location);
+  }
+  void addInstrLabel(Token token, std::string_view label, bool relative,
+                     Location location=Location()) {
+    add(token, 0, labels.intern(label), LABEL_OPERAND | (relative ? RELATIVE : 0), 1, location);
   }
-  InstrOp(Location location, Token token, Token opcode) :
-      Directive(location, token), opcode(opcode) {
+  void addInstrOp(Token opcode, Location location=Location()) {
     if (opcode != Token::BRB &&
         opcode != Token::ADD &&
         opcode != Token::SUB &&
         opcode != Token::SVC) {
       throw InvalidOprError(location, opcode);
     }
+    add(Token::OPR, static_cast<int>(opcode), NO_LABEL, 0, 1, location);
   }
-  bool operandIsLabel() const { return false; }
-  size_t getSize() const { return 1; }
-  int getValue() const { return tokenToOprInstrOpc(opcode); }
-  std::string toString() const {
-    return std::string("OPR ") + tokenEnumStr(opcode);
+  void addPadding(size_t numBytes) {
+    add(Token::PADDING, 0, NO_LABEL, 0, numBytes, Location());
+  }
+  /// Add a marker of the beginning or end of the static data, DATA_BEGIN or
+  /// DATA_END, which is recorded in the debug information.
+  void addDataMarker(Token token) {
+    add(token, 0, NO_LABEL, 0, 0, Location());
+  }
+  /// Add a directive that is lowered before assembly, with a value and
+  /// optionally a label that are given meaning by the pass that lowers it.
+  void addIntermediate(Token token, int value, std::string_view label="") {
+    add(token, value, label.empty() ? NO_LABEL : labels.intern(label), 0, 0, Location());
   }
-};
 
-class Padding : public Directive {
-  size_t numBytes;
-public:
-  Padding(size_t numBytes) : Directive(Token::PADDING), numBytes(numBytes) {}
-  bool operandIsLabel() const { return false; }
-  size_t getSize() const { return numBytes; }
-  int getValue() const { return tokenToOprInstrOpc(Token::PADDING); }
-  std::string toString() const {
-    return std::string("PADDING ") + std::to_string(numBytes);
+  /// Replace a directive with an instruction with an immediate operand.
+  void setInstrImm(size_t index, Token token, int value) {
+    tokens[index] = token;
+    values[index] = value;
+    labelIds[index] = NO_LABEL;
+    flags[index] = 0;
+    sizes[index] = immSize(value);
   }
-};
 
-//===---------------------------------------------------------------------===//
-// Lexer
-//===---------------------------------------------------------------------===//
+  /// Append a copy of a directive from this or another stream.
+  void append(const DirectiveStream &other, size_t index) {
+    uint32_t label = other.labelIds[index];
+    if (&other != this && label != NO_LABEL) {
+      label = labels.intern(other.labels.getName(label));
+    }
+    add(other.tokens[index], other.values[index], label, other.flags[index],
+        other.sizes[index], other.getLocation(index));
+    byteOffsets.back() = other.byteOffsets[index];
+  }
 
-class Table {
-  std::map<std::string, Token> table;
+  /// Append copies of the directives in the range [begin, end) of this
+  /// stream.
+  void appendRange(size_t begin, size_t end) {
+    appendRange(tokens, begin, end);
+    appendRange(values, begin, end);
+    appendRange(labelIds, begin, end);
+    appendRange(flags, begin, end);
+    appendRange(sizes, begin, end);
+    appendRange(byteOffsets, begin, end);
+    if (begin < locations.size()) {
+      locations.resize(tokens.size());
+      for (size_t i=begin; i<end; i++) {
+        locations[tokens.size() - end + i] = getLocation(i);
+      }
+    }
+  }
 
-public:
-  void insert(const std::string &name, const Token token) {
-    table.insert(std::make_pair(name, token));
+  /// Overwrite a directive with another in this stream, to compact it.
+  void move(size_t to, size_t from) {
+    tokens[to] = tokens[from];
+    values[to] = values[from];
+    labelIds[to] = labelIds[from];
+    flags[to] = flags[from];
+    sizes[to] = sizes[from];
+    byteOffsets[to] = byteOffsets[from];
+    if (from < locations.size()) {
+      locations[to] = locations[from];
+    } else if (to < locations.size()) {
+      locations[to] = Location();
+    }
   }
 
-  /// Lookup a token type by identifier.
-  Token lookup(const std::string &name) {
-    auto it = table.find(name);
-    if(it != table.end()) {
-      return it->second;
+  /// Remove the directives in the range [begin, end).
+  void erase(size_t begin, size_t end) {
+    tokens.erase(tokens.begin() + begin, tokens.begin() + end);
+    values.erase(values.begin() + begin, values.begin() + end);
+    labelIds.erase(labelIds.begin() + begin, labelIds.begin() + end);
+    flags.erase(flags.begin() + begin, flags.begin() + end);
+    sizes.erase(sizes.begin() + begin, sizes.begin() + end);
+    byteOffsets.erase(byteOffsets.begin() + begin, byteOffsets.begin() + end);
+    if (begin < locations.size()) {
+      locations.erase(locations.begin() + begin,
+                      locations.begin() + std::min(end, locations.size()));
+    }
+  }
+
+  void reserve(size_t numDirectives) {
+    tokens.reserve(numDirectives);
+    values.reserve(numDirectives);
+    labelIds.reserve(numDirectives);
+    flags.reserve(numDirectives);
+    sizes.reserve(numDirectives);
+    byteOffsets.reserve(numDirectives);
+  }
+
+  /// Member access --------------------------------------------------------///
+  size_t size() const { return tokens.size(); }
+  bool empty() const { return tokens.empty(); }
+  Token getToken(size_t index) const { return tokens[index]; }
+  bool isLabel(size_t index) const {
+    return tokens[index] == Token::IDENTIFIER ||
+           tokens[index] == Token::FUNC ||
+           tokens[index] == Token::PROC;
+  }
+  bool operandIsLabel(size_t index) const { return flags[index] & LABEL_OPERAND; }
+  bool isRelative(size_t index) const { return flags[index] & RELATIVE; }
+  bool isOpr(size_t index, Token opcode) const {
+    return tokens[index] == Token::OPR && values[index] == static_cast<int>(opcode);
+  }
+  /// Return the value of a directive, with the opcode of OPR.
+  int getValue(size_t index) const {
+    if (tokens[index] == Token::OPR) {
+      return tokenToOprInstrOpc(static_cast<Token>(values[index]));
+    }
+    return values[index];
+  }
+  void setValue(size_t index, int value) { values[index] = value; }
+  uint32_t getLabel(size_t index) const { return labelIds[index]; }
+  /// Redirect a label operand to another label.
+  void setLabel(size_t index, uint32_t label) { labelIds[index] = label; }
+  const std::string &getLabelName(size_t index) const { return labels.getName(labelIds[index]); }
+  const LabelTable &getLabels() const { return labels; }
+  size_t getSize(size_t index) const { return sizes[index]; }
+  void setSize(size_t index, size_t value) { sizes[index] = value; }
+  unsigned getByteOffset(size_t index) const { return byteOffsets[index]; }
+  void setByteOffset(size_t index, unsigned value) { byteOffsets[index] = value; }
+  Location getLocation(size_t index) const {
+    return index < locations.size() ? locations[index] : Location();
+  }
+  /// Mark the label operands as resolved, to report their values.
+  void setAssembled() { assembled = true; }
+
+  std::string toString(size_t index) const {
+    auto token = tokens[index];
+    switch (token) {
+    case Token::DATA:       return "DATA " + std::to_string(values[index]);
+    case Token::IDENTIFIER: return getLabelName(index);
+    case Token::FUNC:       return "FUNC " + getLabelName(index);
+    case Token::PROC:       return "PROC " + getLabelName(index);
+    case Token::OPR:        return std::string("OPR ") + tokenEnumStr(static_cast<Token>(values[index]));
+    case Token::PADDING:    return "PADDING " + std::to_string(sizes[index]);
+    case Token::SP_VALUE:   return "SP_VALUE";
+    case Token::DATA_BEGIN: return "DATA_BEGIN";
+    case Token::DATA_END:   return "DATA_END";
+    case Token::PROLOGUE:   return "PROLOGUE " + getLabelName(index);
+    case Token::EPILOGUE:   return "EPILOGUE " + getLabelName(index);
+    default: {
+      auto str = std::string(tokenEnumStr(token)) + " ";
+      if (!operandIsLabel(index)) {
+        return str + std::to_string(values[index]);
+      }
+      str += getLabelName(index);
+      if (assembled) {
+        str += " (" + std::to_string(values[index]) + ")";
+      }
+      return str;
+    }
     }
-    table.insert(std::make_pair(name, Token::IDENTIFIER));
-    return Token::IDENTIFIER;
   }
 };
 
+//===---------------------------------------------------------------------===//
+// Lexer
+//===---------------------------------------------------------------------===//
+
+constexpr hexutil::KeywordTable<Token, 20> keywords({
+  {"ADD",  Token::ADD},
+  {"BRN",  Token::BRN},
+  {"BR",   Token::BR},
+  {"BRB",  Token::BRB},
+  {"BRZ",  Token::BRZ},
+  {"DATA", Token::DATA},
+  {"FUNC", Token::FUNC},
+  {"LDAC", Token::LDAC},
+  {"LDAI", Token::LDAI},
+  {"LDAM", Token::LDAM},
+  {"LDAP", Token::LDAP},
+  {"LDBC", Token::LDBC},
+  {"LDBI", Token::LDBI},
+  {"LDBM", Token::LDBM},
+  {"OPR",  Token::OPR},
+  {"PROC", Token::PROC},
+  {"STAI", Token::STAI},
+  {"STAM", Token::STAM},
+  {"SUB",  Token::SUB},
+  {"SVC",  Token::SVC},
+});
+
+/// The lexer scans a source buffer in place, so identifiers are views of the
+/// buffer, which are valid for the lifetime of the lexer. The current line,
+/// for reporting errors, is also a view, from the start of the line to the
+/// last character read.
 class Lexer {
 
-  Table                         table;
-  std::unique_ptr<std::istream> file;
+  hexutil::SourceBuffer         buffer;
+  const char                   *data;
+  size_t                        size;
+  // The position of the next character to read.
+  size_t                        position;
+  size_t                        lineStart;
   char                          lastChar;
-  std::string                   identifier;
+  std::string_view              identifier;
   unsigned                      value;
   Token                         lastToken;
   size_t                        currentLineNumber;
   size_t                        currentCharNumber;
-  std::string                   currentLine;
-
-  void declareKeywords() {
-    table.insert("ADD",  Token::ADD);
-    table.insert("BRN",  Token::BRN);
-    table.insert("BR",   Token::BR);
-    table.insert("BRB",  Token::BRB);
-    table.insert("BRZ",  Token::BRZ);
-    table.insert("DATA", Token::DATA);
-    table.insert("FUNC", Token::FUNC);
-    table.insert("LDAC", Token::LDAC);
-    table.insert("LDAI", Token::LDAI);
-    table.insert("LDAM", Token::LDAM);
-    table.insert("LDAP", Token::LDAP);
-    table.insert("LDBC", Token::LDBC);
-    table.insert("LDBI", Token::LDBI);
-    table.insert("LDBM", Token::LDBM);
-    table.insert("OPR",  Token::OPR);
-    table.insert("PROC", Token::PROC);
-    table.insert("STAI", Token::STAI);
-    table.insert("STAM", Token::STAM);
-    table.insert("SUB",  Token::SUB);
-    table.insert("SVC",  Token::SVC);
-  }
 
   int readChar() {
-    file->get(lastChar);
-    currentLine += lastChar;
-    if (file->eof()) {
-      lastChar = EOF;
-    }
+    lastChar = position < size ? data[position] : EOF;
+    position++;
     currentCharNumber++;
     return lastChar;
   }
 
+  void newLine() {
+    currentLineNumber++;
+    currentCharNumber = 0;
+    lineStart = position;
+  }
+
+  /// The characters from a position up to the last character read.
+  std::string_view readFrom(size_t start) const {
+    return std::string_view(data + start, std::min(position - 1, size) - start);
+  }
+
+  void start() {
+    data = buffer.view().data();
+    size = buffer.view().size();
+    position = 0;
+    lineStart = 0;
+    currentLineNumber = 0;
+    currentCharNumber = 0;
+    readChar();
+  }
+
   Token readToken() {
     // Skip whitespace.
     while (std::isspace(lastChar)) {
       if (lastChar == '\n') {
-        currentLineNumber++;
-        currentCharNumber = 0;
-        currentLine.clear();
+        newLine();
       }
       readChar();
     }
@@ -498,28 +599,23 @@ class Lexer {
         readChar();
       } while (lastChar != EOF && lastChar != '\n');
       if (lastChar == '\n') {
-        currentLineNumber++;
-        currentCharNumber = 0;
-        currentLine.clear();
+        newLine();
         readChar();
       }
       return readToken();
     }
     // Identifier.
     if (std::isalpha(lastChar)) {
-      identifier = std::string(1, lastChar);
-      while (std::isalnum(readChar()) || lastChar == '_') {
-        identifier += lastChar;
-      }
-      return table.lookup(identifier);
+      size_t start = position - 1;
+      while (std::isalnum(readChar()) || lastChar == '_') {}
+      identifier = readFrom(start);
+      return keywords.lookup(identifier, Token::IDENTIFIER);
     }
     // Number.
     if (std::isdigit(lastChar)) {
-      std::string number(1, lastChar);
-      while (std::isdigit(readChar())) {
-        number += lastChar;
-      }
-      value = std::strtoul(number.c_str(), nullptr, 10);
+      size_t start = position - 1;
+      while (std::isdigit(readChar())) {}
+      value = std::strtoul(std::string(readFrom(start)).c_str(), nullptr, 10);
       return Token::NUMBER;
     }
     // Symbols.
@@ -529,10 +625,7 @@ class Lexer {
     }
     // End of file.
     if (lastChar == EOF) {
-      if (auto ifstream = dynamic_cast<std::ifstream*>(file.get())) {
-        ifstream->close();
-      }
-      currentLine.clear();
+      lineStart = position;
       return Token::END_OF_FILE;
     }
     readChar();
@@ -541,35 +634,32 @@ class Lexer {
 
 public:
 
-  Lexer() : currentLineNumber(0), currentCharNumber(0) {
-    declareKeywords();
-  }
+  Lexer() : data(""), size(0), position(0), lineStart(0),
+            currentLineNumber(0), currentCharNumber(0) {}
 
   Token getNextToken() {
     return lastToken = readToken();
   }
 
-  /// Open a file using ifstream.
+  /// Map a file and read its first character.
   void openFile(const char *filename) {
-    auto ifstream = std::make_unique<std::ifstream>();
-    ifstream->open(filename, std::ifstream::in);
-    if (!ifstream->is_open()) {
-      throw std::runtime_error("could not open file");
-    }
-    file.reset(ifstream.release());
-    readChar();
+    buffer.open(filename);
+    start();
   }
 
   void openFile(const std::string &filename) {
     openFile(filename.c_str());
   }
 
-  /// Load a string using istringstream.
-  void loadBuffer(const std::string &buffer) {
-    file = std::make_unique<std::istringstream>(buffer);
-    readChar();
+  /// Load a copy of a string and read its first character.
+  void loadBuffer(const std::string &input) {
+    buffer.load(input);
+    start();
   }
 
+  /// The source being lexed.
+  std::string_view getSource() const { return buffer.view(); }
+
   /// Tokenise the input only and report the tokens.
   void emitTokens(std::ostream &out) {
     while (true) {
@@ -590,12 +680,15 @@ public:
     }
   }
 
-  const std::string &getIdentifier() const { return identifier; }
+  std::string_view getIdentifier() const { return identifier; }
   unsigned getNumber() const { return value; }
   Token getLastToken() const { return lastToken; }
   size_t getLineNumber() const { return currentLineNumber; }
-  bool hasLine() const { return !currentLine.empty(); }
-  const std::string &getLine() const { return currentLine; }
+  bool hasLine() const { return std::min(position, size) > lineStart; }
+  std::string_view getLine() const {
+    return hasLine() ? std::string_view(data + lineStart, std::min(position, size) - lineStart)
+                     : std::string_view();
+  }
   const Location getLocation() const { return Location(currentLineNumber,
                                                        currentCharNumber); }
 };
@@ -627,25 +720,30 @@ class Parser {
     return lexer.getNumber();
   }
 
-  std::string parseIdentifier() {
+  std::string_view parseIdentifier() {
     lexer.getNextToken();
     return lexer.getIdentifier();
   }
 
-  std::unique_ptr<Directive> parseDirective() {
+  void parseDirective(DirectiveStream &program) {
     auto location = lexer.getLocation();
     switch (lexer.getLastToken()) {
       case Token::DATA:
         lexer.getNextToken();
-        return std::make_unique<Data>(location, Token::DATA, parseInteger());
+        program.addData(parseInteger(), location);
+        break;
       case Token::FUNC:
-        return std::make_unique<Func>(location, Token::FUNC, parseIdentifier());
+        program.addLabel(Token::FUNC, parseIdentifier(), location);
+        break;
       case Token::PROC:
-        return std::make_unique<Proc>(location, Token::PROC, parseIdentifier());
+        program.addLabel(Token::PROC, parseIdentifier(), location);
+        break;
       case Token::IDENTIFIER:
-        return std::make_unique<Label>(location, Token::IDENTIFIER, lexer.getIdentifier());
+        program.addLabel(Token::IDENTIFIER, lexer.getIdentifier(), location);
+        break;
       case Token::OPR:
-        return std::make_unique<InstrOp>(location, Token::OPR, lexer.getNextToken());
+        program.addInstrOp(lexer.getNextToken(), location);
+        break;
       case Token::LDAM:
       case Token::LDBM:
       case Token::STAM:
@@ -653,10 +751,11 @@ class Parser {
       case Token::LDBC: {
         auto opcode = lexer.getLastToken();
         if (lexer.getNextToken() == Token::IDENTIFIER) {
-          return std::make_unique<InstrLabel>(location, opcode, lexer.getIdentifier(), false);
+          program.addInstrLabel(opcode, lexer.getIdentifier(), false, location);
         } else {
-          return std::make_unique<InstrImm>(location, opcode, parseInteger());
+          program.addInstrImm(opcode, parseInteger(), location);
         }
+        break;
       }
       case Token::LDAP:
       case Token::LDAI:
@@ -667,10 +766,11 @@ class Parser {
       case Token::BRZ: {
         auto opcode = lexer.getLastToken();
         if (lexer.getNextToken() == Token::IDENTIFIER) {
-          return std::make_unique<InstrLabel>(location, opcode, lexer.getIdentifier(), true);
+          program.addInstrLabel(opcode, lexer.getIdentifier(), true, location);
         } else {
-          return std::make_unique<InstrImm>(location, opcode, parseInteger());
+          program.addInstrImm(opcode, parseInteger(), location);
         }
+        break;
       }
       case Token::PROLOGUE:
       case Token::EPILOGUE:
@@ -685,10 +785,10 @@ class Parser {
 public:
   Parser(Lexer &lexer) : lexer(lexer) {}
 
-  std::vector<std::unique_ptr<Directive>> parseProgram() {
-    std::vector<std::unique_ptr<Directive>> program;
+  DirectiveStream parseProgram() {
+    DirectiveStream program;
     while (lexer.getNextToken() != Token::END_OF_FILE) {
-      program.push_back(parseDirective());
+      parseDirective(program);
     }
     return program;
   }
@@ -700,214 +800,308 @@ public:
 
 class CodeGen {
 
-  std::vector<std::unique_ptr<Directive>> &program;
-  std::map<std::string, Label*> labelMap;
+  static constexpr size_t NO_DIRECTIVE = ~size_t(0);
+
+  /// A reference from an instruction to a label, by directive index.
+  struct LabelRef {
+    size_t directive;
+    size_t target;
+    bool relative;
+    // The range of directives whose sizes the encoding depends on, and
+    // whether it contains data, which is aligned.
+    size_t begin;
+    size_t end;
+    bool spansData;
+  };
+
+  DirectiveStream &program;
+  // The index of the directive defining each label, by label id.
+  std::vector<size_t> labelMap;
+  std::vector<LabelRef> labelRefs;
   std::vector<std::pair<std::string, unsigned>> debugInfo;
+  // The byte offsets of the static data, if it is marked.
+  unsigned dataBegin;
+  unsigned dataEnd;
   size_t programSizeBytes;
+  // The number of rounds of relaxation label resolution took.
+  size_t relaxIterations;
 
-  /// Create a map of label strings to label Directives.
+  /// Map each label id to the index of the directive defining it.
   void createLabelMap() {
-    for (auto &directive : program) {
-      switch (directive->getToken()) {
-      case Token::FUNC: {
-        auto func = dynamic_cast<Func*>(directive.get());
-        labelMap[func->getName()] = func;
-        break;
+    labelMap.assign(program.getLabels().size(), NO_DIRECTIVE);
+    for (size_t i=0; i<program.size(); i++) {
+      if (program.isLabel(i)) {
+        labelMap[program.getLabel(i)] = i;
       }
-      case Token::PROC: {
-        auto proc = dynamic_cast<Proc*>(directive.get());
-        labelMap[proc->getName()] = proc;
-        break;
+    }
+  }
+
+  /// Resolve each label reference to the index of its label, once.
+  void createLabelRefs() {
+    std::vector<size_t> numData(program.size() + 1, 0);
+    for (size_t i=0; i<program.size(); i++) {
+      numData[i + 1] = numData[i] + (program.getToken(i) == Token::DATA);
+    }
+    for (size_t i=0; i<program.size(); i++) {
+      if (!program.operandIsLabel(i)) {
+        continue;
       }
-      case Token::IDENTIFIER: {
-        auto label = dynamic_cast<Label*>(directive.get());
-        labelMap[label->getLabel()] = label;
-        break;
+      size_t target = labelMap[program.getLabel(i)];
+      if (target == NO_DIRECTIVE) {
+        throw UnknownLabelError(program.getLocation(i), program.getLabelName(i));
       }
-      default: break;
+      // A relative reference depends on the sizes between the instruction and
+      // the label, and an absolute reference on the sizes before the label.
+      bool relative = program.isRelative(i);
+      size_t begin = relative ? std::min(i, target) : 0;
+      size_t end = relative ? std::max(i, target) + 1 : target;
+      labelRefs.push_back(LabelRef{i, target, relative, begin, end,
+                                   numData[end] != numData[begin]});
+    }
+  }
+
+  /// Return the operand of a label reference with the current layout, which
+  /// for a relative reference is the distance from the end of the instruction.
+  int labelRefValue(const LabelRef &ref) const {
+    if (ref.relative) {
+      return static_cast<int>(program.getByteOffset(ref.target)) -
+             static_cast<int>(program.getByteOffset(ref.directive)) -
+             static_cast<int>(program.getSize(ref.directive));
+    }
+    return program.getByteOffset(ref.target) >> 2;
+  }
+
+  /// Lay out the directives with their current sizes, aligning data to words.
+  void layout() {
+    unsigned byteOffset = 0;
+    for (size_t i=0; i<program.size(); i++) {
+      if (program.getToken(i) == Token::DATA && (byteOffset & 0x3)) {
+        byteOffset += 4 - (byteOffset & 0x3);
       }
+      program.setByteOffset(i, byteOffset);
+      byteOffset += program.getSize(i);
     }
   }
 
-  /// Iteratively update label values until the program size does not change.
-  /// Return the final size of the program.
-  void resolveLabels() {
-    int lastSize = -1;
-    int byteOffset = 0;
-    //int count = 0;
-    while (lastSize != byteOffset) {
-      //std::cout << "Resolving labels iteration " << count++ << "\n";
-      lastSize = byteOffset;
-      byteOffset = 0;
-      for (auto &directive : program) {
-        if (directive->getToken() == Token::DATA) {
-          // Data must be on 4-byte boundaries.
-          if (byteOffset & 0x3) {
-            byteOffset += 4 - (byteOffset & 0x3);
-          }
-        }
-        // Update the label value.
-        if (directive->getToken() == Token::IDENTIFIER ||
-            directive->getToken() == Token::FUNC ||
-            directive->getToken() == Token::PROC) {
-          dynamic_cast<Label*>(directive.get())->setLabelValue(byteOffset);
+  /// Relax the sizes of the label references from their smallest encodings.
+  /// Each round lays out the program and grows the references on a worklist
+  /// that need longer encodings, then the next worklist holds only the
+  /// references whose range contains a directive that grew, or that contains
+  /// data, which moves with the alignment of anything grown before it.
+  void relaxLabelRefs() {
+    for (auto &ref : labelRefs) {
+      program.setSize(ref.directive, 1);
+    }
+    std::vector<const LabelRef*> worklist;
+    for (auto &ref : labelRefs) {
+      worklist.push_back(&ref);
+    }
+    std::vector<size_t> grown;
+    while (!worklist.empty()) {
+      relaxIterations++;
+      layout();
+      grown.clear();
+      for (auto ref : worklist) {
+        size_t size = immSize(labelRefValue(*ref));
+        if (size > program.getSize(ref->directive)) {
+          program.setSize(ref->directive, size);
+          grown.push_back(ref->directive);
         }
-        // Update the label operand value of an instruction, accounting for
-        // relative and absolute references.
-        if (directive->operandIsLabel()) {
-          auto instrLabel = dynamic_cast<InstrLabel*>(directive.get());
-          if (labelMap.count(instrLabel->getLabel()) == 0) {
-            throw UnknownLabelError(directive->getLocation(), instrLabel->getLabel());
-          }
-          int labelValue = labelMap[instrLabel->getLabel()]->getValue();
-          if (instrLabel->isRelative()) {
-            int offset = labelValue - byteOffset;
-            //std::cout << "label value " << labelValue
-            //          << " byteOffset " << byteOffset
-            //          << " offset " << offset
-            //          << " instrlen " << instrLen(labelValue, byteOffset) << "\n";
-            if (offset >= 0) {
-              instrLabel->setLabelValue(offset - instrLen(labelValue, byteOffset));
-            } else {
-              instrLabel->setLabelValue(offset - instrLen(labelValue, byteOffset));
-            }
-          } else {
-            assert((labelValue & 0x3) == 0 && "absolute label value is not word aligned");
-            instrLabel->setLabelValue(labelValue >> 2);
-          }
+      }
+      worklist.clear();
+      if (grown.empty()) {
+        break;
+      }
+      layout();
+      std::sort(grown.begin(), grown.end());
+      for (auto &ref : labelRefs) {
+        auto first = std::lower_bound(grown.begin(), grown.end(), ref.begin);
+        bool grownWithin = first != grown.end() && *first < ref.end;
+        bool grownBefore = first != grown.begin();
+        if (grownWithin || (ref.spansData && grownBefore)) {
+          worklist.push_back(&ref);
         }
-        directive->setByteOffset(byteOffset);
-        byteOffset += directive->getSize();
       }
     }
   }
 
+  /// Set the label values and operands of the directives from the relaxed
+  /// layout. A range containing data can shrink as the alignment of the data
+  /// changes, leaving an operand that would fit a shorter encoding than its
+  /// size, which is padded with leading prefixes instead of relaxing again.
+  void assignLabels() {
+    for (size_t i=0; i<program.size(); i++) {
+      if (program.isLabel(i)) {
+        program.setValue(i, program.getByteOffset(i));
+      }
+    }
+    // Update the label operand value of each instruction, accounting for
+    // relative and absolute references.
+    for (auto &ref : labelRefs) {
+      assert((ref.relative || (program.getByteOffset(ref.target) & 0x3) == 0) &&
+             "absolute label value is not word aligned");
+      program.setValue(ref.directive, labelRefValue(ref));
+    }
+    program.setAssembled();
+  }
+
+  /// Resolve the label values and the sizes of the instructions that refer
+  /// to them, so that each encoding is long enough for the distance to its
+  /// label.
+  void resolveLabels() {
+    createLabelRefs();
+    relaxLabelRefs();
+    layout();
+    assignLabels();
+  }
+
+  static void appendWord(std::string &buffer, uint32_t value) {
+    buffer.append(reinterpret_cast<const char*>(&value), sizeof(uint32_t));
+  }
+
 public:
 
   /// Constructor.
-  CodeGen(std::vector<std::unique_ptr<Directive>> &program) :
-      program(program), programSizeBytes(0) {
+  CodeGen(DirectiveStream &program) :
+      program(program), dataBegin(0), dataEnd(0), programSizeBytes(0),
+      relaxIterations(0) {
 
     // Iteratively resolve label values.
     createLabelMap();
     resolveLabels();
 
     // Determine the size of the program.
-    programSizeBytes = getProgramSize();
+    if (!program.empty()) {
+      programSizeBytes = program.getByteOffset(program.size() - 1) +
+                         program.getSize(program.size() - 1);
+    }
 
     // Add space for padding bytes at the end.
     auto paddingBytes = ((programSizeBytes + 3U) & ~3U) - programSizeBytes;
-    program.push_back(std::make_unique<Padding>(paddingBytes));
+    program.addPadding(paddingBytes);
     programSizeBytes += paddingBytes;
   }
 
-  /// Return the size of the program in bytes (after resolveLabels()).
-  size_t getProgramSize() {
-    return program.back()->getByteOffset() + program.back()->getSize();
-  }
+  /// Return the number of rounds of relaxation in resolveLabels().
+  size_t getRelaxIterations() const { return relaxIterations; }
+
+  /// Return the size of the program in bytes, including padding.
+  size_t getProgramSize() const { return programSizeBytes; }
 
   /// Emit the program to an output stream.
   void emitProgramText(std::ostream &out) {
     size_t programSize = 0;
-    for (auto &directive : program) {
-      programSize += directive->getSize();
+    for (size_t i=0; i<program.size(); i++) {
+      programSize += program.getSize(i);
       out << boost::format("%#08x %-20s (%d bytes)\n")
-               % directive->getByteOffset()
-               % directive->toString()
-               % directive->getSize();
+               % program.getByteOffset(i)
+               % program.toString(i)
+               % program.getSize(i);
     }
     out << boost::format("%d bytes\n") % programSize;
   }
 
-  /// Emit each directive of the program as binary.
-  void emitProgramBin(std::ostream &outputFile) {
-    int byteOffset = 0;
-    for (auto &directive : program) {
-      size_t size = directive->getSize();
-      // Func
-      if (directive->getToken() == Token::FUNC) {
-        auto funcDirective = dynamic_cast<Func*>(directive.get());
-        debugInfo.push_back(std::make_pair(funcDirective->getLabel(), byteOffset));
-      // Proc
-      } else if (directive->getToken() == Token::PROC) {
-        auto procDirective = dynamic_cast<Proc*>(directive.get());
-        debugInfo.push_back(std::make_pair(procDirective->getLabel(), byteOffset));
+  /// Append each directive of the program to a buffer as binary.
+  void emitProgramBin(std::string &buffer) {
+    debugInfo.clear();
+    dataBegin = dataEnd = 0;
+    size_t byteOffset = 0;
+    for (size_t i=0; i<program.size(); i++) {
+      auto token = program.getToken(i);
+      size_t size = program.getSize(i);
+      // Func and proc
+      if (token == Token::FUNC || token == Token::PROC) {
+        debugInfo.push_back(std::make_pair(program.getLabelName(i), byteOffset));
+      // Static data markers, where data begins after its alignment.
+      } else if (token == Token::DATA_BEGIN) {
+        dataBegin = (byteOffset + 3U) & ~3U;
+      } else if (token == Token::DATA_END) {
+        dataEnd = byteOffset;
       // Padding
-      } else if (directive->getToken() == Token::PADDING) {
-        for (size_t i=0; i<directive->getSize(); i++) {
-          outputFile.put(0);
-        }
+      } else if (token == Token::PADDING) {
+        buffer.append(size, '\0');
       // Data
-      } else if (directive->getToken() == Token::DATA) {
+      } else if (token == Token::DATA) {
         // Add padding for 4-byte data alignment.
         if (byteOffset & 0x3) {
-          int paddingBytes = 4 - (byteOffset & 0x3);
-          int paddingValue = 0;
-          outputFile.write(reinterpret_cast<const char*>(&paddingValue), paddingBytes);
+          size_t paddingBytes = 4 - (byteOffset & 0x3);
+          buffer.append(paddingBytes, '\0');
           byteOffset += paddingBytes;
         }
-        auto dataDirective = dynamic_cast<Data*>(directive.get());
-        auto value = dataDirective->getValue();
-        outputFile.write(reinterpret_cast<const char*>(&value), size);
+        appendWord(buffer, program.getValue(i));
         byteOffset += size;
       // Instruction
       } else if (size > 0) {
+        int value = program.getValue(i);
         if (size > 1) {
           // Output PFIX/NFIX to extend the immediate value.
-          hex::Instr instr = (directive->getValue() < 0) ? hex::Instr::NFIX : hex::Instr::PFIX;
-          char instrValue = instrToInstrOpc(instr) << 4 |
-                            ((directive->getValue() >> ((size - 1) * 4)) & 0xF);
-          outputFile.put(instrValue);
-          byteOffset++;
+          hex::Instr instr = (value < 0) ? hex::Instr::NFIX : hex::Instr::PFIX;
+          buffer.push_back(instrToInstrOpc(instr) << 4 |
+                           ((value >> ((size - 1) * 4)) & 0xF));
         }
-        if (size > 2) {
-          for (size_t i=size-2; i>0; i--) {
-            char instrValue = instrToInstrOpc(hex::Instr::PFIX) << 4 |
-                              ((directive->getValue() >> (i * 4)) & 0xF);
-            outputFile.put(instrValue);
-            byteOffset++;
-          }
+        for (size_t j=size-1; j>1; j--) {
+          buffer.push_back(instrToInstrOpc(hex::Instr::PFIX) << 4 |
+                           ((value >> ((j - 1) * 4)) & 0xF));
         }
         // Output the instruction
-        char instrValue = (tokenToInstrOpc(directive->getToken()) & 0xF) << 4 |
-                          (directive->getValue() & 0xF);
-        outputFile.put(instrValue);
-        byteOffset++;
+        buffer.push_back((tokenToInstrOpc(token) & 0xF) << 4 | (value & 0xF));
+        byteOffset += size;
       }
     }
   }
 
-  /// Emit debug information.
-  void emitDebugInfo(std::ostream &outputFile) {
+  /// Emit each directive of the program as binary to an output stream.
+  void emitProgramBin(std::ostream &outputFile) {
+    std::string buffer;
+    emitProgramBin(buffer);
+    outputFile.write(buffer.data(), buffer.size());
+  }
+
+  /// Append the debug information to a buffer (after emitProgramBin()).
+  void emitDebugInfo(std::string &buffer) {
     uint32_t tableSize = debugInfo.size();
     // Symbol string table (concatenate null-terminated strings).
-    outputFile.write(reinterpret_cast<const char*>(&tableSize), sizeof(uint32_t));
+    appendWord(buffer, tableSize);
     for (const auto &pair : debugInfo) {
-      auto name = pair.first;
-      outputFile.write(name.c_str(), name.length()+1);
+      buffer.append(pair.first.c_str(), pair.first.length()+1);
     }
     // Symbols -> address map (index, byte offset) in ascending offsets.
-    outputFile.write(reinterpret_cast<const char*>(&tableSize), sizeof(uint32_t));
+    appendWord(buffer, tableSize);
     uint32_t tableIndex = 0;
     for (const auto &pair : debugInfo) {
-      uint32_t byteOffset = pair.second;
-      outputFile.write(reinterpret_cast<const char*>(&tableIndex), sizeof(uint32_t));
-      outputFile.write(reinterpret_cast<const char*>(&byteOffset), sizeof(uint32_t));
+      appendWord(buffer, tableIndex);
+      appendWord(buffer, pair.second);
       tableIndex++;
     }
+    // Static data (begin, end) byte offsets, if marked.
+    if (dataEnd > dataBegin) {
+      appendWord(buffer, dataBegin);
+      appendWord(buffer, dataEnd);
+    }
   }
 
-  /// Emit the binary.
-  void emitBin(std::string outputFilename) {
-    std::fstream outputFile(outputFilename, std::ios::out | std::ios::binary);
+  /// Return the binary: the program size, the program and the debug
+  /// information, assembled into one buffer.
+  std::string emitBinImage() {
+    std::string buffer;
+    buffer.reserve(sizeof(uint32_t) + programSizeBytes);
     // The first four bytes are the remaining binary size.
-    uint32_t programSizeWords = programSizeBytes >> 2;
-    outputFile.write(reinterpret_cast<const char*>(&programSizeWords), sizeof(uint32_t));
+    appendWord(buffer, programSizeBytes >> 2);
     // Emit the program.
-    emitProgramBin(outputFile);
-    emitDebugInfo(outputFile);
-    // Done.
-    outputFile.close();
+    emitProgramBin(buffer);
+    emitDebugInfo(buffer);
+    return buffer;
+  }
+
+  /// Emit the binary to a file, which is replaced atomically.
+  void emitBin(const std::string &outputFilename) {
+    hex::writeBinaryFile(outputFilename, emitBinImage());
+  }
+
+  /// Emit the binary to an output stream.
+  void emitBin(std::ostream &outputFile) {
+    auto image = emitBinImage();
+    outputFile.write(image.data(), image.size());
   }
 };
 
@@ -0,0 +1,218 @@
+#ifndef HEX_BINARY_HPP
+#define HEX_BINARY_HPP
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace hex {
+
+/// A Hex binary file, mapped read-only, or a binary held in memory, as
+/// assembled by hexasm::CodeGen::emitBin(). The file is the program size in
+/// words, the program, and optionally debug information: a table of
+/// null-terminated strings, then (string index, byte offset) pairs, then
+/// optionally the (begin, end) byte offsets of the static data. The header
+/// and the debug information are checked against the size of the file when
+/// it is opened, and the program and symbol names are views of the mapping,
+/// so a binary is not copied until it is loaded into a memory.
+class BinaryImage {
+public:
+  struct Symbol {
+    std::string_view name;
+    uint32_t offset;
+  };
+
+private:
+  std::string filename;
+  const char *data;
+  size_t fileSize;
+  size_t programSizeBytes;
+  std::vector<Symbol> symbols;
+  uint32_t dataBegin;
+  uint32_t dataEnd;
+  bool mapped;
+  // The contents of a binary held in memory, instead of a mapping.
+  std::string contents;
+
+  [[noreturn]] void invalid(const std::string &reason) const {
+    throw std::runtime_error("invalid binary "+filename+": "+reason);
+  }
+
+  uint32_t readWord(size_t &offset) const {
+    if (fileSize - offset < sizeof(uint32_t)) {
+      invalid("truncated debug information");
+    }
+    uint32_t value;
+    std::memcpy(&value, data + offset, sizeof(uint32_t));
+    offset += sizeof(uint32_t);
+    return value;
+  }
+
+  void readDebugInfo(size_t offset) {
+    // Strings.
+    uint32_t numStrings = readWord(offset);
+    std::vector<std::string_view> strings;
+    for (size_t i=0; i<numStrings; i++) {
+      auto end = static_cast<const char*>(std::memchr(data + offset, '\0', fileSize - offset));
+      if (!end) {
+        invalid("unterminated symbol string");
+      }
+      strings.emplace_back(data + offset, end - (data + offset));
+      offset = end - data + 1;
+    }
+    // Symbols.
+    uint32_t numSymbols = readWord(offset);
+    if (numSymbols > (fileSize - offset) / (2 * sizeof(uint32_t))) {
+      invalid("truncated symbol table");
+    }
+    symbols.reserve(numSymbols);
+    for (size_t i=0; i<numSymbols; i++) {
+      uint32_t strIndex = readWord(offset);
+      uint32_t byteOffset = readWord(offset);
+      if (strIndex >= strings.size()) {
+        invalid("symbol string index out of range");
+      }
+      symbols.push_back(Symbol{strings[strIndex], byteOffset});
+    }
+    // Static data.
+    if (offset < fileSize) {
+      dataBegin = readWord(offset);
+      dataEnd = readWord(offset);
+      if (dataBegin > dataEnd || dataEnd > programSizeBytes) {
+        invalid("static data out of range");
+      }
+    }
+  }
+
+  void parse() {
+    try {
+      if (fileSize < sizeof(uint32_t)) {
+        invalid("missing program size");
+      }
+      uint32_t programSizeWords;
+      std::memcpy(&programSizeWords, data, sizeof(uint32_t));
+      programSizeBytes = static_cast<size_t>(programSizeWords) << 2;
+      // The last word of a program may be truncated by the end of the file,
+      // and reads as zeros from the rest of the mapped page.
+      size_t remainingFileSize = (fileSize - sizeof(uint32_t) + 3U) & ~size_t(3);
+      if (programSizeBytes > remainingFileSize) {
+        invalid("program of "+std::to_string(programSizeBytes)+
+                " bytes exceeds the file size of "+std::to_string(fileSize));
+      }
+      // Read debug data (if present).
+      if (remainingFileSize > programSizeBytes) {
+        readDebugInfo(sizeof(uint32_t) + programSizeBytes);
+      }
+    } catch (...) {
+      unmap();
+      throw;
+    }
+  }
+
+  void unmap() {
+    if (mapped) {
+      ::munmap(const_cast<char*>(data), fileSize);
+      data = nullptr;
+      mapped = false;
+    }
+  }
+
+public:
+  BinaryImage(const char *filename) :
+      filename(filename), data(nullptr), fileSize(0), programSizeBytes(0),
+      dataBegin(0), dataEnd(0), mapped(false) {
+    int fd = ::open(filename, O_RDONLY);
+    struct stat status;
+    if (fd < 0 || ::fstat(fd, &status) != 0) {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+      throw std::runtime_error(std::string("could not open ")+filename);
+    }
+    fileSize = status.st_size;
+    if (fileSize > 0) {
+      void *mapping = ::mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      if (mapping == MAP_FAILED) {
+        throw std::runtime_error(std::string("could not map ")+filename);
+      }
+      data = static_cast<const char*>(mapping);
+      mapped = true;
+    } else {
+      ::close(fd);
+    }
+    parse();
+  }
+
+  /// Adopt the contents of a binary, named for error messages.
+  BinaryImage(std::string binary, const std::string &name) :
+      filename(name), data(nullptr), fileSize(binary.size()), programSizeBytes(0),
+      dataBegin(0), dataEnd(0), mapped(false), contents(std::move(binary)) {
+    // Pad a truncated last word with zeros, as a mapping would be.
+    contents.resize((fileSize + 3U) & ~size_t(3), '\0');
+    data = contents.data();
+    parse();
+  }
+
+  BinaryImage(const BinaryImage&) = delete;
+  BinaryImage &operator=(const BinaryImage&) = delete;
+
+  ~BinaryImage() {
+    unmap();
+  }
+
+  /// The program words, which directly follow the size word, and are
+  /// therefore aligned in the page-aligned mapping.
+  const uint32_t *getWords() const {
+    return reinterpret_cast<const uint32_t*>(data + sizeof(uint32_t));
+  }
+  size_t getNumWords() const { return programSizeBytes >> 2; }
+  size_t getProgramSizeBytes() const { return programSizeBytes; }
+  const std::vector<Symbol> &getSymbols() const { return symbols; }
+  /// The byte offsets of the static data, which are equal if it is not
+  /// recorded.
+  uint32_t getDataBegin() const { return dataBegin; }
+  uint32_t getDataEnd() const { return dataEnd; }
+  const std::string &getFilename() const { return filename; }
+};
+
+/// Write a binary to a file, through a temporary file in the same directory
+/// that is renamed over it, so that a reader of the file sees either its old
+/// contents or all of the new ones.
+inline void writeBinaryFile(const std::string &filename, const std::string &contents) {
+  std::string tempFilename = filename + ".tmp" + std::to_string(::getpid());
+  int fd = ::open(tempFilename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    throw std::runtime_error("could not open "+tempFilename);
+  }
+  const char *data = contents.data();
+  size_t remaining = contents.size();
+  while (remaining > 0) {
+    ssize_t written = ::write(fd, data, remaining);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      break;
+    }
+    data += written;
+    remaining -= written;
+  }
+  if (::close(fd) != 0 || remaining > 0 ||
+      ::rename(tempFilename.c_str(), filename.c_str()) != 0) {
+    ::unlink(tempFilename.c_str());
+    throw std::runtime_error("could not write "+filename);
+  }
+}
+
+} // End namespace hex
+
+#endif // HEX_BINARY_HPP
@@ -0,0 +1,163 @@
+#ifndef HEX_CACHE_HPP
+#define HEX_CACHE_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <boost/format.hpp>
+
+#include "hexbinary.hpp"
+
+namespace hex {
+
+#ifndef HEX_BUILD_ID
+#error "HEX_BUILD_ID must be defined by the build"
+#endif
+
+/// The header of a cache entry.
+constexpr char CACHE_MAGIC[8] = {'H', 'E', 'X', 'C', 'A', 'C', 'H', 'E'};
+
+/// An opt-in cache of assembled binaries, including their debug
+/// information, in a directory shared by the tools. An entry is keyed by the
+/// tool, its build (HEX_BUILD_ID, a hash of the tool sources set by CMake),
+/// the options that affect its output and the source bytes, and is named by
+/// a hash of them and the size of the source. An entry holds the whole key
+/// and a checksum of the binary, which are checked on lookup, so an entry
+/// whose name collides with another key, or that has been truncated or
+/// corrupted, is a miss. An entry is written with writeBinaryFile(), through
+/// a temporary file that is renamed into place, so concurrent processes
+/// sharing the directory only ever read complete entries, and two processes
+/// that miss on the same key just write the same entry twice.
+class BuildCache {
+public:
+  /// The key of a binary: the name of its entry, and the inputs it is
+  /// built from, each followed by its length.
+  struct Key {
+    std::string name;
+    std::string inputs;
+  };
+
+private:
+  std::string directory;
+  size_t hits;
+  size_t misses;
+
+  std::string getPath(const Key &key) const {
+    return directory + "/" + key.name + ".bin";
+  }
+
+  static uint64_t hash(std::string_view bytes) {
+    // FNV-1a.
+    uint64_t value = 0xcbf29ce484222325ULL;
+    for (unsigned char byte : bytes) {
+      value = (value ^ byte) * 0x100000001b3ULL;
+    }
+    return value;
+  }
+
+  static void append(std::string &inputs, std::string_view bytes) {
+    uint64_t length = bytes.size();
+    inputs.append(bytes);
+    inputs.append(reinterpret_cast<const char*>(&length), sizeof(length));
+  }
+
+  static uint64_t readWord(const std::string &entry, size_t offset) {
+    uint64_t value;
+    std::memcpy(&value, entry.data() + offset, sizeof(value));
+    return value;
+  }
+
+  static void appendWord(std::string &entry, uint64_t value) {
+    entry.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+
+  /// The magic number, the lengths of the key inputs and the binary, and the
+  /// checksum of the binary.
+  static constexpr size_t HEADER_SIZE = sizeof(CACHE_MAGIC) + 3 * sizeof(uint64_t);
+
+public:
+  BuildCache(const std::string &directory) :
+      directory(directory), hits(0), misses(0) {
+    if (::mkdir(directory.c_str(), 0777) != 0 && errno != EEXIST) {
+      throw std::runtime_error("could not create cache directory "+directory);
+    }
+  }
+
+  /// The directory named by the HEX_CACHE_DIR environment variable, which
+  /// enables the cache, or null.
+  static const char *getEnvironmentDirectory() {
+    auto directory = std::getenv("HEX_CACHE_DIR");
+    return directory && *directory ? directory : nullptr;
+  }
+
+  /// Return the key of the output of a tool for a source.
+  static Key getKey(std::string_view tool, std::string_view options,
+                    std::string_view source) {
+    Key key;
+    append(key.inputs, tool);
+    append(key.inputs, HEX_BUILD_ID);
+    append(key.inputs, options);
+    append(key.inputs, source);
+    key.name = (boost::format("%016x-%d") % hash(key.inputs) % source.size()).str();
+    return key;
+  }
+
+  /// Read the binary of a key, returning true if there is a valid entry.
+  bool lookup(const Key &key, std::string &binary) {
+    std::ifstream file(getPath(key), std::ios::binary);
+    std::string entry;
+    if (file) {
+      entry.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    if (entry.size() < HEADER_SIZE ||
+        !std::equal(CACHE_MAGIC, CACHE_MAGIC + sizeof(CACHE_MAGIC), entry.data())) {
+      misses++;
+      return false;
+    }
+    uint64_t inputsLength = readWord(entry, sizeof(CACHE_MAGIC));
+    uint64_t binaryLength = readWord(entry, sizeof(CACHE_MAGIC) + sizeof(uint64_t));
+    uint64_t checksum = readWord(entry, sizeof(CACHE_MAGIC) + 2 * sizeof(uint64_t));
+    std::string_view contents(entry.data() + HEADER_SIZE, entry.size() - HEADER_SIZE);
+    if (inputsLength != key.inputs.size() || contents.size() < inputsLength ||
+        binaryLength != contents.size() - inputsLength ||
+        contents.substr(0, inputsLength) != key.inputs ||
+        hash(contents.substr(inputsLength)) != checksum) {
+      misses++;
+      return false;
+    }
+    binary.assign(contents.substr(inputsLength));
+    hits++;
+    return true;
+  }
+
+  /// Write the binary of a key.
+  void store(const Key &key, const std::string &binary) {
+    std::string entry(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    appendWord(entry, key.inputs.size());
+    appendWord(entry, binary.size());
+    appendWord(entry, hash(binary));
+    entry.append(key.inputs);
+    entry.append(binary);
+    writeBinaryFile(getPath(key), entry);
+  }
+
+  size_t getHits() const { return hits; }
+  size_t getMisses() const { return misses; }
+
+  void reportStats(std::ostream &out) const {
+    out << boost::format("Cache %s: %d hits, %d misses\n") % directory % hits % misses;
+  }
+};
+
+} // End namespace hex
+
+#endif // HEX_CACHE_HPP
@@ -1,3 +1,4 @@
+#include <chrono>
 #include <cstdarg>
 #include <cstdio>
 #include <cstring>
@@ -5,12 +6,30 @@
 #include <iostream>
 
 #include "hexsim.hpp"
+#include "hexsimbatch.hpp"
 #include "hexsimio.hpp"
 
 //===---------------------------------------------------------------------===//
 // Driver
 //===---------------------------------------------------------------------===//
 
+/// Print batch results as they complete, counting the failures.
+struct BatchReporter {
+  const std::vector<hexsim::BatchJob> &jobs;
+  size_t failures;
+  BatchReporter(const std::vector<hexsim::BatchJob> &jobs) : jobs(jobs), failures(0) {}
+  void operator()(const hexsim::BatchResult &result) {
+    if (!result.passed) {
+      failures++;
+    }
+    std::cout << boost::format("%-6d %-4s %s exit %d cycles %d%s\n")
+                   % result.index % (result.passed ? "PASS" : "FAIL")
+                   % jobs[result.index].binary % result.exitCode % result.cycles
+                   % (result.error.empty() ? "" : " error: "+result.error);
+    std::cout.flush();
+  }
+};
+
 static void help(const char *argv[]) {
   std::cout << "Hex processor simulator\n\n";
   std::cout << "Usage: " << argv[0] << " file\n\n";
@@ -20,7 +39,22 @@ static void help(const char *argv[]) {
   std::cout << "  -h,--help       Display this message\n";
   std::cout << "  -d,--dump       Dump the binary file contents\n";
   std::cout << "  -t,--trace      Enable instruction tracing\n";
+  std::cout << "  --trace-bin FILE Write a binary instruction trace to FILE (see hextrace)\n";
+  std::cout << "  --trace-compress Delta-compress the binary trace\n";
   std::cout << "  --max-cycles N  Limit the number of simulation cycles (default: 0)\n";
+  std::cout << "  --memory-size N Set the size of memory in words (default: 200000)\n";
+  std::cout << "  --snapshot-at N Run to the cycle limit N, as --max-cycles, and write a snapshot\n";
+  std::cout << "  --snapshot FILE Name the snapshot file (default: hexsim.snapshot)\n";
+  std::cout << "  --resume FILE   Continue the simulation of the binary from a snapshot FILE\n";
+  std::cout << "  --stats         Report execution statistics on stderr\n";
+  std::cout << "  --profile FILE  Report cycles per symbol on stderr and write folded stacks to FILE\n";
+  std::cout << "  --io-dir DIR    Create and read the simin/simout channel files in DIR\n";
+  std::cout << "  --simin NAME    Name input channel files NAME<N> (default: simin)\n";
+  std::cout << "  --simout NAME   Name output channel files NAME<N> (default: simout)\n";
+  std::cout << "  --batch FILE    Run the jobs in a manifest FILE of lines: binary [stdin [expected [max-cycles]]]\n";
+  std::cout << "  --jobs N        Run batch jobs on N threads (default: one per hardware thread)\n";
+  std::cout << "  --engine=E      Select the engine: switch, threaded or block (default: switch)\n";
+  std::cout << "  --timing        Report the cycles and CPI of the pipelined core on stderr\n";
 }
 
 int main(int argc, const char *argv[]) {
@@ -28,7 +62,22 @@ int main(int argc, const char *argv[]) {
     const char *filename = nullptr;
     bool dumpBinary = false;
     bool trace = false;
+    const char *traceFilename = nullptr;
+    bool traceCompress = false;
     size_t maxCycles = 0;
+    size_t memorySize = hex::MAX_MEMORY_SIZE_WORDS;
+    size_t snapshotCycles = 0;
+    const char *snapshotFilename = "hexsim.snapshot";
+    const char *resumeFilename = nullptr;
+    bool stats = false;
+    const char *profileFilename = nullptr;
+    hexsim::Engine engine = hexsim::Engine::SWITCH;
+    const char *ioDirectory = nullptr;
+    const char *inputName = nullptr;
+    const char *outputName = nullptr;
+    const char *batchFilename = nullptr;
+    size_t numThreads = 0;
+    bool timing = false;
     for (int i = 1; i < argc; ++i) {
       if (std::strcmp(argv[i], "-d") == 0 ||
           std::strcmp(argv[i], "--dump") == 0) {
@@ -36,8 +85,44 @@ int main(int argc, const char *argv[]) {
       } else if (std::strcmp(argv[i], "-t") == 0 ||
                  std::strcmp(argv[i], "--trace") == 0) {
         trace = true;
+      } else if (std::strcmp(argv[i], "--trace-bin") == 0) {
+        traceFilename = argv[++i];
+      } else if (std::strcmp(argv[i], "--trace-compress") == 0) {
+        traceCompress = true;
       } else if (std::strcmp(argv[i], "--max-cycles") == 0) {
         maxCycles = std::stoull(argv[++i]);
+      } else if (std::strcmp(argv[i], "--memory-size") == 0) {
+        memorySize = std::stoull(argv[++i]);
+      } else if (std::strcmp(argv[i], "--snapshot-at") == 0) {
+        snapshotCycles = std::stoull(argv[++i]);
+      } else if (std::strcmp(argv[i], "--snapshot") == 0) {
+        snapshotFilename = argv[++i];
+      } else if (std::strcmp(argv[i], "--resume") == 0) {
+        resumeFilename = argv[++i];
+      } else if (std::strcmp(argv[i], "--stats") == 0) {
+        stats = true;
+      } else if (std::strcmp(argv[i], "--profile") == 0) {
+        profileFilename = argv[++i];
+      } else if (std::strcmp(argv[i], "--io-dir") == 0) {
+        ioDirectory = argv[++i];
+      } else if (std::strcmp(argv[i], "--simin") == 0) {
+        inputName = argv[++i];
+      } else if (std::strcmp(argv[i], "--simout") == 0) {
+        outputName = argv[++i];
+      } else if (std::strcmp(argv[i], "--batch") == 0) {
+        batchFilename = argv[++i];
+      } else if (std::strcmp(argv[i], "--jobs") == 0) {
+        numThreads = std::stoull(argv[++i]);
+      } else if (std::strcmp(argv[i], "--engine=switch") == 0) {
+        engine = hexsim::Engine::SWITCH;
+      } else if (std::strcmp(argv[i], "--engine=threaded") == 0) {
+        engine = hexsim::Engine::THREADED;
+      } else if (std::strcmp(argv[i], "--engine=block") == 0) {
+        engine = hexsim::Engine::BLOCK;
+      } else if (std::strcmp(argv[i], "--timing") == 0) {
+        timing = true;
+      } else if (std::strncmp(argv[i], "--engine=", 9) == 0) {
+        throw std::runtime_error(std::string("unknown engine: ")+(argv[i]+9));
       } else if (std::strcmp(argv[i], "-h") == 0 ||
                  std::strcmp(argv[i], "--help") == 0) {
         help(argv);
@@ -50,18 +135,73 @@ int main(int argc, const char *argv[]) {
         }
       }
     }
+    // Run a batch of jobs.
+    if (batchFilename) {
+      auto jobs = hexsim::readBatchManifest(batchFilename);
+      hexsim::BatchRunner runner(jobs);
+      BatchReporter reporter(jobs);
+      runner.run(std::ref(reporter), numThreads);
+      return reporter.failures ? 1 : 0;
+    }
     // A file must be specified.
     if (!filename) {
       help(argv);
       return 1;
     }
-    hexsim::Processor p(std::cin, std::cout, maxCycles);
+    if (snapshotCycles) {
+      if (maxCycles) {
+        throw std::runtime_error("cannot specify both --max-cycles and --snapshot-at");
+      }
+      maxCycles = snapshotCycles;
+    }
+    hexsim::Processor p(std::cin, std::cout, maxCycles, memorySize);
     p.setTracing(trace);
+    p.setEngine(engine);
+    p.setStats(stats);
+    p.setProfiling(profileFilename != nullptr);
+    if (ioDirectory) {
+      p.getIO().setDirectory(ioDirectory);
+    }
+    if (inputName) {
+      p.getIO().setInputName(inputName);
+    }
+    if (outputName) {
+      p.getIO().setOutputName(outputName);
+    }
     p.load(filename, dumpBinary);
     if (dumpBinary) {
       return 0;
     }
-    return p.run();
+    if (resumeFilename) {
+      p.restoreSnapshot(resumeFilename);
+    }
+    if (traceFilename) {
+      p.setTraceFile(traceFilename, traceCompress);
+    }
+    auto start = std::chrono::steady_clock::now();
+    hexsim::PipelineModel model;
+    int exitCode = timing ? p.runModel(model) : p.run();
+    // A program that exits before the snapshot cycle has nothing to resume.
+    if (snapshotCycles && p.isRunning()) {
+      p.saveSnapshot(snapshotFilename);
+    } else if (snapshotCycles) {
+      std::cerr << "Warning: the program exited after " << p.getCycles()
+                << " cycles, before the snapshot at cycle " << snapshotCycles
+                << ", which was not written\n";
+    }
+    if (stats) {
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      p.getStats().report(std::cerr, p.getCycles(), elapsed.count());
+    }
+    if (timing) {
+      model.report(std::cerr, p.getCycles());
+    }
+    if (profileFilename) {
+      p.getProfiler()->report(std::cerr);
+      std::ofstream profileFile(profileFilename);
+      p.getProfiler()->writeFoldedStacks(profileFile);
+    }
+    return exitCode;
   } catch (std::exception &e) {
     std::cerr << "Error: " << e.what() << "\n";
     return 1;
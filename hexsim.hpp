@@ -1,6 +1,7 @@
 #ifndef HEX_SIM_HPP
 #define HEX_SIM_HPP
 
+#include <algorithm>
 #include <array>
 #include <cstdarg>
 #include <cstdint>
@@ -10,17 +11,161 @@
 #include <map>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <vector>
 #include <boost/format.hpp>
 
 #include "hex.hpp"
 #include "hexsimio.hpp"
+#include "hexsimmemory.hpp"
+#include "hexsimprofile.hpp"
+#include "hexsimsnapshot.hpp"
+#include "hexsimsymbols.hpp"
+#include "hexsimtiming.hpp"
+#include "hexsimtrace.hpp"
 
 namespace hexsim {
 
+/// A pre-decoded instruction. The PFIX/NFIX prefix chain leading to an
+/// instruction is folded into a single entry that records the opcode of the
+/// terminating instruction, its full operand value and the number of bytes
+/// (and therefore cycles) the chain occupies.
+struct DecodedInstr {
+  uint32_t operand;
+  uint8_t  opcode;
+  uint8_t  length; // Zero if the entry has not been decoded.
+};
+
+/// The instruction dispatch engine used for untraced runs.
+enum class Engine {
+  SWITCH,   // A switch over the decoded opcode.
+  THREADED, // Threaded code with a dispatch at the end of each handler.
+  BLOCK     // Translated basic blocks of fused operations.
+};
+
+/// The operations of a translated basic block. These are the Hex
+/// instructions with their operands resolved, fused pairs of instructions
+/// that commonly occur together, and the branches that end a block.
+enum class BlockOpKind : uint8_t {
+  LDAM, LDBM, STAM, LDAC, LDBC, LDAI, LDBI, STAI, ADD, SUB,
+  // Fused pairs.
+  LDAM_LDAI, // areg = mem[mem[a] + b]
+  LDBM_LDBI, // breg = mem[mem[a] + b]
+  LDBM_STAI, // breg = mem[a]; mem[breg + b] = areg
+  LDAC_ADD,  // areg = a + breg
+  LDAC_SUB,  // areg = a - breg
+  LDBC_ADD,  // breg = a; areg = areg + breg
+  LDBC_SUB,  // breg = a; areg = areg - breg
+  // Block terminators.
+  BR,        // pc = a
+  BRZ,       // pc = areg == 0 ? a : nextPC
+  BRN,       // pc = areg < 0 ? a : nextPC
+  BRB,       // pc = breg
+  SVC,       // syscall; pc = nextPC
+  NEXT       // pc = nextPC, for blocks that end without a branch
+};
+
+/// An operation in a translated basic block. Relative branch targets and
+/// LDAP are resolved to absolute values when the block is translated.
+struct BlockOp {
+  uint32_t a;
+  uint32_t b;
+  uint32_t nextPC; // The address following the operation.
+  BlockOpKind kind;
+};
+
+/// A translated basic block: a straight-line sequence of operations from
+/// an entry address, ending with a terminator.
+struct Block {
+  std::vector<BlockOp> ops;
+  uint32_t entryPC;
+  size_t cycles; // The number of bytes, and therefore cycles, covered.
+};
+
+/// Counters of the events in a simulation, which are collected when enabled
+/// with setStats() and have no cost otherwise.
+struct Statistics {
+  /// Regions of memory that loads and stores are attributed to: the program
+  /// image, the globals, which are the static data recorded in the binary
+  /// (the stack pointer, scalar globals, constants and strings) and the
+  /// arrays above the initial stack pointer, and the stack below it.
+  enum Region { PROGRAM, GLOBALS, STACK, NUM_REGIONS };
+
+  std::array<size_t, 16> instrs; // Excluding prefixes.
+  std::array<size_t, 4> oprs;
+  size_t prefixCycles;
+  std::array<size_t, NUM_REGIONS> loads;
+  std::array<size_t, NUM_REGIONS> stores;
+  std::array<size_t, static_cast<size_t>(hex::Syscall::NUM_VALUES)> syscalls;
+
+  Statistics() :
+    instrs(), oprs(), prefixCycles(0), loads(), stores(), syscalls() {}
+
+  static double percent(size_t count, size_t total) {
+    return total ? 100.0 * count / total : 0.0;
+  }
+
+  size_t numInstrs() const {
+    size_t total = 0;
+    for (auto count : instrs) {
+      total += count;
+    }
+    return total;
+  }
+
+  /// Print a report of the counters, given the elapsed cycles and seconds.
+  void report(std::ostream &out, size_t cycles, double seconds) const {
+    const char *regionNames[NUM_REGIONS] = {"program", "globals", "stack"};
+    size_t total = numInstrs();
+    out << boost::format("%-16s %d\n") % "Cycles" % cycles;
+    out << boost::format("%-16s %d\n") % "Instructions" % total;
+    out << boost::format("%-16s %d (%.1f%%)\n") % "Prefix cycles"
+             % prefixCycles % percent(prefixCycles, cycles);
+    out << boost::format("%-16s %.3f\n") % "Seconds" % seconds;
+    out << boost::format("%-16s %.2f\n") % "MIPS"
+             % (seconds > 0 ? total / seconds / 1e6 : 0.0);
+    out << "Instructions:\n";
+    for (size_t i=0; i<instrs.size(); i++) {
+      if (instrs[i]) {
+        out << boost::format("  %-14s %12d %5.1f%%\n")
+                 % hex::instrEnumToStr(static_cast<hex::Instr>(i))
+                 % instrs[i] % percent(instrs[i], total);
+      }
+    }
+    out << "Operations:\n";
+    for (size_t i=0; i<oprs.size(); i++) {
+      out << boost::format("  %-14s %12d\n")
+               % hex::oprInstrEnumToStr(static_cast<hex::OprInstr>(i)) % oprs[i];
+    }
+    out << "Loads:\n";
+    for (size_t i=0; i<NUM_REGIONS; i++) {
+      out << boost::format("  %-14s %12d\n") % regionNames[i] % loads[i];
+    }
+    out << "Stores:\n";
+    for (size_t i=0; i<NUM_REGIONS; i++) {
+      out << boost::format("  %-14s %12d\n") % regionNames[i] % stores[i];
+    }
+    out << "Syscalls:\n";
+    for (size_t i=0; i<syscalls.size(); i++) {
+      out << boost::format("  %-14s %12d\n")
+               % hex::syscallEnumToStr(static_cast<hex::Syscall>(i)) % syscalls[i];
+    }
+  }
+};
+
 class Processor {
 
   // Constants.
-  static const size_t MEMORY_SIZE_WORDS = hex::MAX_MEMORY_SIZE_WORDS;
+  // The longest prefix chain that is folded: seven prefixes are sufficient to
+  // construct any 32-bit operand.
+  static constexpr size_t MAX_DECODED_LENGTH = 8;
+  // Opcode marking a byte address that cannot be decoded, which is handled by
+  // stepping the instructions one byte at a time. 0xC is not a Hex opcode.
+  static constexpr uint8_t UNDECODABLE = 0xC;
+  // The number of times an address is executed as a block entry before it is
+  // translated, and the maximum number of operations in a block.
+  static constexpr uint8_t HOT_BLOCK_THRESHOLD = 8;
+  static constexpr size_t MAX_BLOCK_OPS = 64;
 
   // State.
   uint32_t pc;
@@ -29,8 +174,23 @@ class Processor {
   uint32_t oreg;
   uint32_t instr;
 
+  // Decoded instruction cache, with one entry per byte of the loaded program.
+  std::vector<DecodedInstr> decoded;
+  // Words containing bytes of a decoded entry, so that stores to data do not
+  // pay for invalidation.
+  std::vector<bool> decodedWords;
+  size_t codeSizeBytes;
+
+  // Translated blocks, indexed by entry address, with an execution count for
+  // each address that has not been translated. The generation is incremented
+  // each time the blocks are flushed.
+  std::vector<Block> blocks;
+  std::vector<int32_t> blockIndex;
+  std::vector<uint8_t> blockHeat;
+  size_t blockGeneration;
+
   // Memory.
-  std::array<uint32_t, MEMORY_SIZE_WORDS> memory;
+  Memory memory;
 
   // IO.
   hex::HexSimIO io;
@@ -45,97 +205,99 @@ class Processor {
   // Control.
   bool running;
   bool tracing;
+  bool collectStats;
+  bool profiling;
+  Engine engine;
   int exitCode;
 
+  // Statistics, and the word addresses bounding the regions: the static
+  // data, and the initial stack pointer.
+  Statistics stats;
+  uint32_t dataBegin;
+  uint32_t dataEnd;
+  uint32_t stackBase;
+
+  // Profiling, created when a run starts from the loaded debug information.
+  std::unique_ptr<Profiler> profiler;
+
+  // Staging for the characters of block syscalls.
+  std::vector<char> blockBuffer;
+
+  // A binary trace file, written instead of printing the trace.
+  std::unique_ptr<TraceWriter> traceWriter;
+
   // State for tracing.
   uint32_t lastPC;
   size_t cycles;
   size_t maxCycles;
   hex::Instr instrEnum;
-  std::vector<std::pair<std::string, unsigned>> debugInfo;
-  std::map<std::string, unsigned> debugInfoMap;
+  SymbolIndex symbols;
 
-  /// Lookup a symbol name given the current PC.
-  const char *lookupSymbol() {
-    if (lastPC < debugInfo[0].second) {
-      return nullptr;
-    }
-    for (size_t i=0; i<debugInfo.size(); i++) {
-      if (i == debugInfo.size() - 1 && lastPC >= debugInfo[i].second) {
-        return debugInfo[i].first.c_str();
-      }
-      if (lastPC >= debugInfo[i].second && lastPC < debugInfo[i+1].second) {
-        return debugInfo[i].first.c_str();
-      }
-    }
-    return nullptr;
+  /// Reset the decoded instruction and block caches to cover the program.
+  void resetCaches() {
+    decoded.assign(codeSizeBytes, DecodedInstr{0, 0, 0});
+    decodedWords.assign((codeSizeBytes + 3) >> 2, false);
+    blocks.clear();
+    blockIndex.assign(codeSizeBytes, -1);
+    blockHeat.assign(codeSizeBytes, 0);
   }
 
 public:
 
-  Processor(std::istream &in, std::ostream &out, size_t maxCycles=0) :
-    pc(0), areg(0), breg(0), oreg(0),
+  Processor(std::istream &in, std::ostream &out, size_t maxCycles=0,
+            size_t memorySizeWords=hex::MAX_MEMORY_SIZE_WORDS) :
+    pc(0), areg(0), breg(0), oreg(0), codeSizeBytes(0),
+    blockGeneration(0), memory(memorySizeWords),
     io(in, out), truncateInputs(true), out(out),
-    running(true), tracing(false), lastPC(0), cycles(0),
+    running(true), tracing(false), collectStats(false), profiling(false),
+    engine(Engine::SWITCH), exitCode(0), dataBegin(0), dataEnd(0),
+    stackBase(0), lastPC(0), cycles(0),
     maxCycles(maxCycles) {}
 
   void setTracing(bool value) { tracing = value; }
+  void setEngine(Engine value) { engine = value; }
+  void setStats(bool value) { collectStats = value; }
+  void setProfiling(bool value) { profiling = value; }
+  void setTraceFile(const char *filename, bool compressed) {
+    traceWriter = std::make_unique<TraceWriter>(filename, symbols, compressed);
+    tracing = true;
+  }
+  Profiler *getProfiler() { return profiler.get(); }
+  hex::HexSimIO &getIO() { return io; }
+  const Statistics &getStats() const { return stats; }
+  size_t getCycles() const { return cycles; }
+  uint32_t getPC() const { return pc; }
+  uint32_t getAreg() const { return areg; }
+  uint32_t getBreg() const { return breg; }
+  uint32_t getOreg() const { return oreg; }
+  bool isRunning() const { return running; }
+  int getExitCode() const { return exitCode; }
+  const Memory &getMemory() const { return memory; }
   void setTruncateInputs(bool value) { truncateInputs = value; }
 
   void load(const char *filename, bool dumpContents=false) {
-    // Load the binary file.
-    std::streampos fileSize;
-    std::ifstream file(filename, std::ios::binary);
-
-    // Get length of file.
-    file.seekg(0, std::ios::end);
-    fileSize = file.tellg();
-    file.seekg(0, std::ios::beg);
-
-    // Check the file length matches.
-    unsigned remainingFileSize = static_cast<unsigned>(fileSize) - 4;
-    remainingFileSize = (remainingFileSize + 3U) & ~3U; // Round up to multiple of 4.
-    unsigned programSize;
-    file.read(reinterpret_cast<char*>(&programSize), 4);
-    programSize <<= 2;
-    //if (programSize != remainingFileSize) {
-    //  std::cerr << boost::format("Warning: mismatching program size %d != %d\n")
-    //                 % programSize % remainingFileSize;
-    //}
-
-    // Read the instructions into memory.
-    file.read(reinterpret_cast<char*>(memory.data()), programSize);
-
-    // Read debug data (if present).
-    if (remainingFileSize > programSize) {
-      // Strings.
-      uint32_t numStrings;
-      file.read(reinterpret_cast<char*>(&numStrings), sizeof(uint32_t));
-      //std::cout << std::to_string(numStrings) << " strings\n";
-      std::vector<std::string> strings;
-      for (size_t i=0; i<numStrings; i++) {
-        char c = file.get();
-        std::string s;
-        while (c != '\0') {
-          s += c;
-          c = file.get();
-        }
-        strings.push_back(s);
-      }
-      // Symbols
-      uint32_t numSymbols;
-      file.read(reinterpret_cast<char*>(&numSymbols), sizeof(uint32_t));
-      //std::cout << std::to_string(numSymbols) << " symbols\n";
-      for (size_t i=0; i<numSymbols; i++) {
-        uint32_t strIndex;
-        uint32_t byteOffset;
-        file.read(reinterpret_cast<char*>(&strIndex), sizeof(uint32_t));
-        file.read(reinterpret_cast<char*>(&byteOffset), sizeof(uint32_t));
-        //std::cout << "symbol " << strings[strIndex] << " " << std::to_string(byteOffset) << "\n";
-        debugInfo.push_back(std::make_pair(strings[strIndex], byteOffset));
-        debugInfoMap[strings[strIndex]] = byteOffset;
-      }
+    MemoryImage image(filename);
+    load(image, dumpContents);
+  }
+
+  /// Load a program image, which may be shared with other processors.
+  void load(const MemoryImage &image, bool dumpContents=false) {
+    memory.load(image);
+    // The stack pointer is set by the program in word 1, and the stack grows
+    // down from the word it initially points to.
+    if (memory.size() < 2 || memory[1] >= memory.size()) {
+      auto message = boost::format("memory of %d words does not hold the stack "
+                                   "of the program at word %d")
+                       % memory.size() % (memory.size() < 2 ? 0 : memory[1]);
+      throw std::runtime_error(message.str());
     }
+    size_t programSize = image.getProgramSizeBytes();
+    codeSizeBytes = programSize;
+    resetCaches();
+    dataBegin = image.getDataBegin() >> 2;
+    dataEnd = image.getDataEnd() >> 2;
+    stackBase = memory[1];
+    symbols = image.getSymbols();
 
     // Print the contents of the binary.
     if (dumpContents) {
@@ -146,219 +308,1058 @@ public:
     }
   }
 
+  /// Return the state of the simulation.
+  Snapshot getSnapshot() const {
+    Snapshot snapshot;
+    snapshot.pc = pc;
+    snapshot.areg = areg;
+    snapshot.breg = breg;
+    snapshot.oreg = oreg;
+    snapshot.running = running;
+    snapshot.exitCode = exitCode;
+    snapshot.cycles = cycles;
+    snapshot.inputPositions = io.getInputPositions();
+    snapshot.outputPositions = io.getOutputPositions();
+    snapshot.setMemory(memory.data(), memory.size());
+    return snapshot;
+  }
+
+  /// Save the state of the simulation to a file.
+  void saveSnapshot(const char *filename) {
+    getSnapshot().write(filename);
+  }
+
+  /// Continue a simulation from a state of the program that is loaded.
+  void restoreSnapshot(const Snapshot &snapshot) {
+    memory.clear();
+    snapshot.getMemory(memory.data(), memory.size());
+    pc = snapshot.pc;
+    areg = snapshot.areg;
+    breg = snapshot.breg;
+    oreg = snapshot.oreg;
+    running = snapshot.running;
+    exitCode = snapshot.exitCode;
+    cycles = snapshot.cycles;
+    io.setInputPositions(snapshot.inputPositions);
+    io.setOutputPositions(snapshot.outputPositions);
+    resetCaches();
+  }
+
+  /// Continue a simulation from a snapshot file of the program that is loaded.
+  void restoreSnapshot(const char *filename) {
+    Snapshot snapshot;
+    snapshot.read(filename);
+    restoreSnapshot(snapshot);
+  }
+
   void traceSyscall() {
-    unsigned spWordIndex = memory[1];
+    unsigned spWordIndex = memory.at(1);
+    TraceRecord record;
     switch (static_cast<hex::Syscall>(areg)) {
       case hex::Syscall::EXIT:
-        out << boost::format("exit %d\n") % memory[spWordIndex+2];
+        record = TraceRecord::syscall(cycles, lastPC, hex::Syscall::EXIT,
+                                      0, memory.at(spWordIndex+2));
         break;
       case hex::Syscall::WRITE:
-        out << boost::format("write %d to simout(%d)\n") % memory[spWordIndex+2] % memory[spWordIndex+3];
+        record = TraceRecord::syscall(cycles, lastPC, hex::Syscall::WRITE,
+                                      memory.at(spWordIndex+3), memory.at(spWordIndex+2));
         break;
       case hex::Syscall::READ:
-        out << boost::format("read %d to mem[%08x]\n") % memory[spWordIndex+1] % (spWordIndex+1);
+        record = TraceRecord::syscall(cycles, lastPC, hex::Syscall::READ,
+                                      spWordIndex+1, memory.at(spWordIndex+1));
+        break;
+      case hex::Syscall::WRITEBLOCK:
+      case hex::Syscall::READBLOCK:
+        record = TraceRecord::syscall(cycles, lastPC, static_cast<hex::Syscall>(areg),
+                                      memory.at(spWordIndex+2), memory.at(spWordIndex+1));
+        record.oreg = memory.at(spWordIndex+4);
         break;
-      default: break;
+      default:
+        return;
     }
+    writeTrace(record);
   }
 
-  void trace(uint32_t instr, hex::Instr instrEnum) {
-    if (debugInfo.size()) {
-      auto symbolName = lookupSymbol();
-      std::string symbolInfo;
-      if (symbolName) {
-        auto symbolOffset = lastPC - debugInfoMap[symbolName];
-        symbolInfo = (boost::format("%s+%d") % symbolName % symbolOffset).str();
-      }
-      out << boost::format("%-6d %-6d %-12s %-4s %-2d ")
-               % cycles % lastPC % symbolInfo % instrEnumToStr(instrEnum) % (instr & 0xF);
+  void trace(uint32_t instr) {
+    writeTrace(TraceRecord::instruction(cycles, lastPC, instr, oreg, areg, breg,
+                                        memory.data(), memory.size()));
+  }
+
+  /// Write a trace record to the binary trace file if there is one, or print
+  /// it otherwise.
+  void writeTrace(const TraceRecord &record) {
+    if (traceWriter) {
+      traceWriter->write(record);
     } else {
-      out << boost::format("%-6d %-6d %-4s %-2d ")
-               % cycles % lastPC % instrEnumToStr(instrEnum) % (instr & 0xF);
+      // Keep program output on the console in order with the trace.
+      io.flush();
+      TracePrinter(out, symbols).print(record);
+    }
+  }
+
+  /// Write a word to memory, invalidating any decoded instructions that
+  /// overlap it.
+  void store(uint32_t address, uint32_t value) {
+    memory.at(address) = value;
+    if (address < decodedWords.size() && decodedWords[address]) {
+      invalidate(address);
+    }
+  }
+
+  /// Invalidate the decoded instructions that include a byte in a word. Since
+  /// a decoded entry spans at most MAX_DECODED_LENGTH bytes, only the entries
+  /// starting in the word or just before it can be affected.
+  void invalidate(uint32_t address) {
+    size_t end = std::min<size_t>((address << 2) + 4, codeSizeBytes);
+    size_t begin = address << 2;
+    begin = begin > MAX_DECODED_LENGTH - 1 ? begin - (MAX_DECODED_LENGTH - 1) : 0;
+    for (size_t i=begin; i<end; i++) {
+      decoded[i].length = 0;
+    }
+    decodedWords[address] = false;
+    if (!blocks.empty()) {
+      flushBlocks();
+    }
+  }
+
+  /// Discard all of the translated blocks. Blocks only contain decoded
+  /// instructions, so this is called whenever a decoded word is written.
+  void flushBlocks() {
+    blocks.clear();
+    std::fill(blockIndex.begin(), blockIndex.end(), -1);
+    std::fill(blockHeat.begin(), blockHeat.end(), 0);
+    blockGeneration++;
+  }
+
+  /// Decode the instruction at a byte address, folding any prefixes.
+  const DecodedInstr &decode(uint32_t address) {
+    uint32_t operand = 0;
+    uint32_t byteAddress = address;
+    for (size_t length=1; length<=MAX_DECODED_LENGTH; length++) {
+      if (byteAddress >= codeSizeBytes) {
+        break;
+      }
+      uint32_t byte = (memory.at(byteAddress >> 2) >> ((byteAddress & 0x3) << 3)) & 0xFF;
+      operand = operand | (byte & 0xF);
+      switch (static_cast<hex::Instr>((byte >> 4) & 0xF)) {
+        case hex::Instr::PFIX:
+          operand = operand << 4;
+          break;
+        case hex::Instr::NFIX:
+          operand = 0xFFFFFF00 | (operand << 4);
+          break;
+        default:
+          for (uint32_t i=address>>2; i<=byteAddress>>2; i++) {
+            decodedWords[i] = true;
+          }
+          decoded[address] = DecodedInstr{operand,
+                                          static_cast<uint8_t>((byte >> 4) & 0xF),
+                                          static_cast<uint8_t>(length)};
+          return decoded[address];
+      }
+      byteAddress++;
+    }
+    // Chains that are too long or run off the end of the program are executed
+    // one byte at a time.
+    decoded[address] = DecodedInstr{0, UNDECODABLE, 1};
+    return decoded[address];
+  }
+
+  /// Return the region of memory that a word address is in.
+  Statistics::Region memoryRegion(uint32_t address) {
+    if (address >= dataBegin && address < dataEnd) {
+      return Statistics::GLOBALS;
+    }
+    if (address < (codeSizeBytes + 3) >> 2) {
+      return Statistics::PROGRAM;
+    }
+    return address > stackBase ? Statistics::GLOBALS : Statistics::STACK;
+  }
+
+  void countLoad(uint32_t address) { stats.loads[memoryRegion(address)]++; }
+  void countStore(uint32_t address) { stats.stores[memoryRegion(address)]++; }
+
+  /// Count an executed instruction, with its operand and the number of
+  /// prefix cycles preceding it.
+  void countInstr(hex::Instr opcode, uint32_t operand, size_t prefixes) {
+    stats.instrs[opcode]++;
+    stats.prefixCycles += prefixes;
+    if (opcode == hex::Instr::OPR && operand < stats.oprs.size()) {
+      stats.oprs[operand]++;
+      if (operand == hex::OprInstr::SVC && areg < stats.syscalls.size()) {
+        stats.syscalls[areg]++;
+      }
+    }
+  }
+
+  void syscall() {
+    unsigned spWordIndex = memory.at(1);
+    switch (static_cast<hex::Syscall>(areg)) {
+      case hex::Syscall::EXIT:
+        exitCode = memory.at(spWordIndex+2);
+        running = false;
+        io.flush();
+        break;
+      case hex::Syscall::WRITE:
+        io.output(memory.at(spWordIndex+2), memory.at(spWordIndex+3));
+        break;
+      case hex::Syscall::READ: {
+        auto value = io.input(memory.at(spWordIndex+2));
+        store(spWordIndex+1, truncateInputs ? value & 0xFF : value);
+        break;
+      }
+      case hex::Syscall::WRITEBLOCK: {
+        // Write the low byte of each word of a block, returning the length.
+        uint32_t address = memory.at(spWordIndex+2);
+        uint32_t length = memory.at(spWordIndex+3);
+        checkBlock(address, length);
+        blockBuffer.resize(length);
+        for (size_t i=0; i<length; i++) {
+          blockBuffer[i] = memory.at(address+i);
+        }
+        io.output(blockBuffer.data(), length, memory.at(spWordIndex+4));
+        store(spWordIndex+1, length);
+        break;
+      }
+      case hex::Syscall::READBLOCK: {
+        // Read characters into each word of a block, returning the number
+        // read, which is less than the length only at the end of the stream.
+        uint32_t address = memory.at(spWordIndex+2);
+        uint32_t length = memory.at(spWordIndex+3);
+        checkBlock(address, length);
+        blockBuffer.resize(length);
+        size_t count = io.input(blockBuffer.data(), length, memory.at(spWordIndex+4));
+        for (size_t i=0; i<count; i++) {
+          char value = blockBuffer[i];
+          store(address+i, truncateInputs ? value & 0xFF : value);
+        }
+        store(spWordIndex+1, count);
+        break;
+      }
+      default:
+        throw std::runtime_error("invalid syscall: " + std::to_string(areg));
+    }
+  }
+
+  /// Check that a block syscall's range of words is within memory.
+  void checkBlock(uint32_t address, uint32_t length) {
+    if (address > memory.size() || length > memory.size() - address) {
+      throw std::runtime_error((boost::format("block of %d words at %#08x is outside memory")
+                                  % length % address).str());
+    }
+  }
+
+  /// Execute a single instruction byte, accumulating any prefix in oreg.
+  template<bool Tracing, bool Stats, bool Profile>
+  void step() {
+    instr = (memory.at(pc >> 2) >> ((pc & 0x3) << 3)) & 0xFF;
+    lastPC = pc;
+    pc = pc + 1;
+    oreg = oreg | (instr & 0xF);
+    instrEnum = static_cast<hex::Instr>((instr >> 4) & 0xF);
+    if constexpr (Tracing) {
+      trace(instr);
+    }
+    if constexpr (Profile) {
+      profiler->charge(lastPC, 1);
+    }
+    if constexpr (Stats) {
+      if (instrEnum == hex::Instr::PFIX || instrEnum == hex::Instr::NFIX) {
+        stats.prefixCycles++;
+      } else {
+        countInstr(instrEnum, oreg, 0);
+      }
     }
     switch (instrEnum) {
       case hex::Instr::LDAM:
-        out << boost::format("areg = mem[oreg (%#08x)] (%d)\n") % oreg % memory[oreg];
+        areg = memory.at(oreg);
+        if constexpr (Stats) {
+          countLoad(oreg);
+        }
+        oreg = 0;
         break;
       case hex::Instr::LDBM:
-        out << boost::format("breg = mem[oreg (%#08x)] (%d)\n") % oreg % memory[oreg];
+        breg = memory.at(oreg);
+        if constexpr (Stats) {
+          countLoad(oreg);
+        }
+        oreg = 0;
         break;
       case hex::Instr::STAM:
-        out << boost::format("mem[oreg (%#08x)] = areg %d\n") % oreg % areg;
+        store(oreg, areg);
+        if constexpr (Stats) {
+          countStore(oreg);
+        }
+        oreg = 0;
         break;
       case hex::Instr::LDAC:
-        out << boost::format("areg = oreg %d\n") % oreg;
+        areg = oreg;
+        oreg = 0;
         break;
       case hex::Instr::LDBC:
-        out << boost::format("breg = oreg %d\n") % oreg;
+        breg = oreg;
+        oreg = 0;
         break;
       case hex::Instr::LDAP:
-        out << boost::format("areg = pc (%d) + oreg (%d) %d\n") % pc % oreg % (pc + oreg);
+        areg = pc + oreg;
+        oreg = 0;
         break;
       case hex::Instr::LDAI:
-        out << boost::format("areg = mem[areg (%d) + oreg (%d) = %#08x] (%d)\n") % areg % oreg % (areg+oreg) % memory[areg+oreg];
+        if constexpr (Stats) {
+          countLoad(areg + oreg);
+        }
+        areg = memory.at(areg + oreg);
+        oreg = 0;
         break;
       case hex::Instr::LDBI:
-        out << boost::format("breg = mem[breg (%d) + oreg (%d) = %#08x] (%d)\n") % breg % oreg % (breg+oreg) % memory[breg+oreg];
+        if constexpr (Stats) {
+          countLoad(breg + oreg);
+        }
+        breg = memory.at(breg + oreg);
+        oreg = 0;
         break;
       case hex::Instr::STAI:
-        out << boost::format("mem[breg (%d) + oreg (%d) = %#08x] = areg (%d)\n") % breg % oreg % (breg+oreg) % areg;
+        store(breg + oreg, areg);
+        if constexpr (Stats) {
+          countStore(breg + oreg);
+        }
+        oreg = 0;
         break;
       case hex::Instr::BR:
-        out << boost::format("pc = pc + oreg (%d) (%#08x)\n") % oreg % (pc + oreg);
+        pc = pc + oreg;
+        if constexpr (Profile) {
+          profiler->branch(pc, areg);
+        }
+        oreg = 0;
         break;
       case hex::Instr::BRZ:
-        out << boost::format("pc = areg == zero ? pc + oreg (%d) (%#08x) : pc\n") % oreg % (pc + oreg);
+        if (areg == 0) {
+          pc = pc + oreg;
+          if constexpr (Profile) {
+            profiler->branch(pc, areg);
+          }
+        }
+        oreg = 0;
         break;
       case hex::Instr::BRN:
-        out << boost::format("pc = areg < zero ? pc + oreg (%d) (%#08x) : pc\n") % oreg % (pc + oreg);
+        if ((int)areg < 0) {
+          pc = pc + oreg;
+          if constexpr (Profile) {
+            profiler->branch(pc, areg);
+          }
+        }
+        oreg = 0;
         break;
       case hex::Instr::PFIX:
-        out << boost::format("oreg = oreg (%d) << 4 (%#08x)\n") % oreg % (oreg << 4);
+        oreg = oreg << 4;
         break;
       case hex::Instr::NFIX:
-        out << boost::format("oreg = 0xFFFFFF00 | oreg (%d) << 4 (%#08x)\n") % oreg % (0xFFFFFF00 | (oreg << 4));
+        oreg = 0xFFFFFF00 | (oreg << 4);
         break;
       case hex::Instr::OPR:
         switch (static_cast<hex::OprInstr>(oreg)) {
           case hex::OprInstr::BRB:
-            out << boost::format("BRB pc = breg (%#08x)\n") % breg;
+            pc = breg;
+            if constexpr (Profile) {
+              profiler->indirectBranch(pc);
+            }
+            oreg = 0;
             break;
           case hex::OprInstr::ADD:
-           out << boost::format("ADD areg = areg (%d) + breg (%d) (%d)\n") % areg % breg % (areg + breg);
+            areg = areg + breg;
+            oreg = 0;
             break;
           case hex::OprInstr::SUB:
-           out << boost::format("SUB areg = areg (%d) - breg (%d) (%d)\n") % areg % breg % (areg - breg);
+            areg = areg - breg;
+            oreg = 0;
             break;
           case hex::OprInstr::SVC:
+            syscall();
+            if constexpr (Tracing) {
+              traceSyscall();
+            }
             break;
+          default:
+            throw std::runtime_error("invalid OPR: " + std::to_string(oreg));
         };
+        oreg = 0;
         break;
-   }
+      default:
+        throw std::runtime_error("invalid instruction");
+    }
+    cycles++;
   }
 
-  void syscall() {
-    unsigned spWordIndex = memory[1];
-    switch (static_cast<hex::Syscall>(areg)) {
-      case hex::Syscall::EXIT:
-        exitCode = memory[spWordIndex+2];
-        running = false;
-        break;
-      case hex::Syscall::WRITE:
-        io.output(memory[spWordIndex+2], memory[spWordIndex+3]);
-        break;
-      case hex::Syscall::READ: {
-        auto value = io.input(memory[spWordIndex+2]);
-        memory[spWordIndex+1] = truncateInputs ? value & 0xFF : value;
-        break;
-      }
-      default:
-        throw std::runtime_error("invalid syscall: " + std::to_string(areg));
+  /// Execute a single instruction byte, to run in lockstep with another
+  /// model of the processor.
+  void stepInstr() {
+    step<false, false, false>();
+  }
+
+  /// Run the program a byte at a time, feeding each to a timing model,
+  /// specialised like run() on tracing, statistics and profiling.
+  template<bool Tracing, bool Stats, bool Profile>
+  int runModel(PipelineModel &model) {
+    while (running && (maxCycles > 0 ? cycles <= maxCycles : true)) {
+      uint32_t instrPC = pc;
+      uint32_t instrAreg = areg;
+      uint32_t instrBreg = breg;
+      step<Tracing, Stats, Profile>();
+      model.step(instrPC, instr, instrAreg, instrBreg, pc);
     }
+    return exitCode;
   }
 
+  /// Run loop specialised on whether instructions are traced, whether the
+  /// cycle count is limited, whether statistics are collected and whether
+  /// the run is profiled, so none of these are tested per instruction when
+  /// off.
+  /// Tracing reports each prefix separately, so it steps through bytes.
+  /// Otherwise the decoded instruction cache is used to execute each prefix
+  /// chain and its instruction in one dispatch. The state is held in locals
+  /// so that it can stay in registers, and is written back when falling back
+  /// to step().
+  template<bool Tracing, bool Limited, bool Stats, bool Profile>
   int run() {
-    while (running &&
-           (maxCycles > 0 ? cycles <= maxCycles : true)) {
-      instr = (memory[pc >> 2] >> ((pc & 0x3) << 3)) & 0xFF;
-      lastPC = pc;
-      pc = pc + 1;
-      oreg = oreg | (instr & 0xF);
-      instrEnum = static_cast<hex::Instr>((instr >> 4) & 0xF);
-      if (tracing) {
-        trace(instr, instrEnum);
+    if constexpr (Tracing) {
+      while (running && (Limited ? cycles <= maxCycles : true)) {
+        step<true, Stats, Profile>();
+      }
+      return exitCode;
+    }
+    uint32_t pc = this->pc;
+    uint32_t areg = this->areg;
+    uint32_t breg = this->breg;
+    size_t cycles = this->cycles;
+    while (running && (Limited ? cycles <= maxCycles : true)) {
+      DecodedInstr entry{0, UNDECODABLE, 1};
+      if (oreg == 0 && pc < codeSizeBytes) {
+        entry = decoded[pc];
+        if (entry.length == 0) {
+          entry = decode(pc);
+        }
       }
-      switch (instrEnum) {
+      // Step a single byte if a prefix is pending, the address could not be
+      // decoded or the chain would run past the cycle limit.
+      if (entry.opcode == UNDECODABLE ||
+          (Limited && cycles + entry.length - 1 > maxCycles)) {
+        this->pc = pc;
+        this->areg = areg;
+        this->breg = breg;
+        this->cycles = cycles;
+        step<false, Stats, Profile>();
+        pc = this->pc;
+        areg = this->areg;
+        breg = this->breg;
+        cycles = this->cycles;
+        continue;
+      }
+      if constexpr (Profile) {
+        profiler->charge(pc, entry.length);
+      }
+      pc = pc + entry.length;
+      cycles += entry.length;
+      uint32_t operand = entry.operand;
+      if constexpr (Stats) {
+        this->areg = areg;
+        countInstr(static_cast<hex::Instr>(entry.opcode), operand, entry.length - 1);
+      }
+      switch (static_cast<hex::Instr>(entry.opcode)) {
         case hex::Instr::LDAM:
-          areg = memory[oreg];
-          oreg = 0;
+          areg = memory.at(operand);
+          if constexpr (Stats) {
+            countLoad(operand);
+          }
           break;
         case hex::Instr::LDBM:
-          breg = memory[oreg];
-          oreg = 0;
+          breg = memory.at(operand);
+          if constexpr (Stats) {
+            countLoad(operand);
+          }
           break;
         case hex::Instr::STAM:
-          memory[oreg] = areg;
-          oreg = 0;
+          store(operand, areg);
+          if constexpr (Stats) {
+            countStore(operand);
+          }
           break;
         case hex::Instr::LDAC:
-          areg = oreg;
-          oreg = 0;
+          areg = operand;
           break;
         case hex::Instr::LDBC:
-          breg = oreg;
-          oreg = 0;
+          breg = operand;
           break;
         case hex::Instr::LDAP:
-          areg = pc + oreg;
-          oreg = 0;
+          areg = pc + operand;
           break;
         case hex::Instr::LDAI:
-          areg = memory[areg + oreg];
-          oreg = 0;
+          if constexpr (Stats) {
+            countLoad(areg + operand);
+          }
+          areg = memory.at(areg + operand);
           break;
         case hex::Instr::LDBI:
-          breg = memory[breg + oreg];
-          oreg = 0;
+          if constexpr (Stats) {
+            countLoad(breg + operand);
+          }
+          breg = memory.at(breg + operand);
           break;
         case hex::Instr::STAI:
-          memory[breg + oreg] = areg;
-          oreg = 0;
+          store(breg + operand, areg);
+          if constexpr (Stats) {
+            countStore(breg + operand);
+          }
           break;
         case hex::Instr::BR:
-          pc = pc + oreg;
-          oreg = 0;
+          pc = pc + operand;
+          if constexpr (Profile) {
+            profiler->branch(pc, areg);
+          }
           break;
         case hex::Instr::BRZ:
           if (areg == 0) {
-            pc = pc + oreg;
+            pc = pc + operand;
+            if constexpr (Profile) {
+              profiler->branch(pc, areg);
+            }
           }
-          oreg = 0;
           break;
         case hex::Instr::BRN:
           if ((int)areg < 0) {
-            pc = pc + oreg;
+            pc = pc + operand;
+            if constexpr (Profile) {
+              profiler->branch(pc, areg);
+            }
           }
-          oreg = 0;
-          break;
-        case hex::Instr::PFIX:
-          oreg = oreg << 4;
-          break;
-        case hex::Instr::NFIX:
-          oreg = 0xFFFFFF00 | (oreg << 4);
           break;
         case hex::Instr::OPR:
-          switch (static_cast<hex::OprInstr>(oreg)) {
+          switch (static_cast<hex::OprInstr>(operand)) {
             case hex::OprInstr::BRB:
               pc = breg;
-              oreg = 0;
+              if constexpr (Profile) {
+                profiler->indirectBranch(pc);
+              }
               break;
             case hex::OprInstr::ADD:
               areg = areg + breg;
-              oreg = 0;
               break;
             case hex::OprInstr::SUB:
               areg = areg - breg;
-              oreg = 0;
               break;
             case hex::OprInstr::SVC:
+              this->areg = areg;
               syscall();
-              if (tracing) {
-                traceSyscall();
-              }
               break;
             default:
-              throw std::runtime_error("invalid OPR: " + std::to_string(oreg));
+              throw std::runtime_error("invalid OPR: " + std::to_string(operand));
           };
-          oreg = 0;
           break;
         default:
           throw std::runtime_error("invalid instruction");
       }
-      cycles++;
+    }
+    this->pc = pc;
+    this->areg = areg;
+    this->breg = breg;
+    this->cycles = cycles;
+    return exitCode;
+  }
+
+  /// Run loop using threaded code for untraced runs. Each handler ends with
+  /// its own dispatch to the handler of the next decoded instruction, giving
+  /// the branch predictor one indirect branch per opcode rather than a single
+  /// shared one. This relies on the GCC labels-as-values extension, and falls
+  /// back to the switch engine when it is not available.
+  template<bool Limited>
+  int runThreaded() {
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+    static const void *const handlers[16] = {
+      &&LDAM, &&LDBM, &&STAM, &&LDAC, &&LDBC, &&LDAP, &&LDAI, &&LDBI,
+      &&STAI, &&BR, &&BRZ, &&BRN, &&STEP, &&OPR, &&STEP, &&STEP
+    };
+    uint32_t pc = this->pc;
+    uint32_t areg = this->areg;
+    uint32_t breg = this->breg;
+    size_t cycles = this->cycles;
+    uint32_t operand;
+    DecodedInstr entry;
+
+// Fetch the next decoded instruction and jump to its handler, or fall back to
+// stepping a byte under the same conditions as run().
+#define HEXSIM_DISPATCH()                                                   \
+    do {                                                                    \
+      if (Limited && cycles > maxCycles) {                                  \
+        goto EXIT;                                                          \
+      }                                                                     \
+      if (pc >= codeSizeBytes) {                                            \
+        goto STEP;                                                          \
+      }                                                                     \
+      entry = decoded[pc];                                                  \
+      if (entry.length == 0) {                                              \
+        entry = decode(pc);                                                 \
+      }                                                                     \
+      if (Limited && cycles + entry.length - 1 > maxCycles) {               \
+        goto STEP;                                                          \
+      }                                                                     \
+      operand = entry.operand;                                              \
+      goto *handlers[entry.opcode];                                         \
+    } while (0)
+
+    if (!running) {
+      goto EXIT;
+    }
+    // A run can resume with a prefix pending.
+    if (oreg != 0) {
+      goto STEP;
+    }
+    HEXSIM_DISPATCH();
+
+  LDAM:
+    pc = pc + entry.length;
+    cycles += entry.length;
+    areg = memory.at(operand);
+    HEXSIM_DISPATCH();
+  LDBM:
+    pc = pc + entry.length;
+    cycles += entry.length;
+    breg = memory.at(operand);
+    HEXSIM_DISPATCH();
+  STAM:
+    pc = pc + entry.length;
+    cycles += entry.length;
+    store(operand, areg);
+    HEXSIM_DISPATCH();
+  LDAC:
+    pc = pc + entry.length;
+    cycles += entry.length;
+    areg = operand;
+    HEXSIM_DISPATCH();
+  LDBC:
+    pc = pc + entry.length;
+    cycles += entry.length;
+    breg = operand;
+    HEXSIM_DISPATCH();
+  LDAP:
+    pc = pc + entry.length;
+    cycles += entry.length;
+    areg = pc + operand;
+    HEXSIM_DISPATCH();
+  LDAI:
+    pc = pc + entry.length;
+    cycles += entry.length;
+    areg = memory.at(areg + operand);
+    HEXSIM_DISPATCH();
+  LDBI:
+    pc = pc + entry.length;
+    cycles += entry.length;
+    breg = memory.at(breg + operand);
+    HEXSIM_DISPATCH();
+  STAI:
+    pc = pc + entry.length;
+    cycles += entry.length;
+    store(breg + operand, areg);
+    HEXSIM_DISPATCH();
+  BR:
+    pc = pc + entry.length;
+    cycles += entry.length;
+    pc = pc + operand;
+    HEXSIM_DISPATCH();
+  BRZ:
+    pc = pc + entry.length;
+    cycles += entry.length;
+    if (areg == 0) {
+      pc = pc + operand;
+    }
+    HEXSIM_DISPATCH();
+  BRN:
+    pc = pc + entry.length;
+    cycles += entry.length;
+    if ((int)areg < 0) {
+      pc = pc + operand;
+    }
+    HEXSIM_DISPATCH();
+  OPR:
+    pc = pc + entry.length;
+    cycles += entry.length;
+    switch (static_cast<hex::OprInstr>(operand)) {
+      case hex::OprInstr::BRB:
+        pc = breg;
+        break;
+      case hex::OprInstr::ADD:
+        areg = areg + breg;
+        break;
+      case hex::OprInstr::SUB:
+        areg = areg - breg;
+        break;
+      case hex::OprInstr::SVC:
+        this->areg = areg;
+        syscall();
+        if (!running) {
+          goto EXIT;
+        }
+        break;
+      default:
+        throw std::runtime_error("invalid OPR: " + std::to_string(operand));
+    };
+    HEXSIM_DISPATCH();
+  STEP:
+    // Step bytes until any prefix chain is complete.
+    this->pc = pc;
+    this->areg = areg;
+    this->breg = breg;
+    this->cycles = cycles;
+    do {
+      step<false, false, false>();
+    } while (oreg != 0 && running && (Limited ? this->cycles <= maxCycles : true));
+    pc = this->pc;
+    areg = this->areg;
+    breg = this->breg;
+    cycles = this->cycles;
+    if (!running || oreg != 0) {
+      goto EXIT;
+    }
+    HEXSIM_DISPATCH();
+  EXIT:
+#undef HEXSIM_DISPATCH
+#pragma GCC diagnostic pop
+    this->pc = pc;
+    this->areg = areg;
+    this->breg = breg;
+    this->cycles = cycles;
+    return exitCode;
+#else
+    return run<false, Limited, false, false>();
+#endif
+  }
+
+  /// Append an operation to a block being translated, fusing it with the
+  /// previous operation where possible.
+  void appendBlockOp(Block &block, BlockOp op) {
+    if (!block.ops.empty()) {
+      BlockOp &last = block.ops.back();
+      BlockOpKind fused = op.kind;
+      if (last.kind == BlockOpKind::LDAM && op.kind == BlockOpKind::LDAI) {
+        fused = BlockOpKind::LDAM_LDAI;
+      } else if (last.kind == BlockOpKind::LDBM && op.kind == BlockOpKind::LDBI) {
+        fused = BlockOpKind::LDBM_LDBI;
+      } else if (last.kind == BlockOpKind::LDBM && op.kind == BlockOpKind::STAI) {
+        fused = BlockOpKind::LDBM_STAI;
+      } else if (last.kind == BlockOpKind::LDAC && op.kind == BlockOpKind::ADD) {
+        fused = BlockOpKind::LDAC_ADD;
+      } else if (last.kind == BlockOpKind::LDAC && op.kind == BlockOpKind::SUB) {
+        fused = BlockOpKind::LDAC_SUB;
+      } else if (last.kind == BlockOpKind::LDBC && op.kind == BlockOpKind::ADD) {
+        fused = BlockOpKind::LDBC_ADD;
+      } else if (last.kind == BlockOpKind::LDBC && op.kind == BlockOpKind::SUB) {
+        fused = BlockOpKind::LDBC_SUB;
+      }
+      if (fused != op.kind) {
+        last = BlockOp{last.a, op.a, op.nextPC, fused};
+        return;
+      }
+    }
+    block.ops.push_back(op);
+  }
+
+  /// Translate the basic block at an address, returning its index or -1 if
+  /// the first instruction cannot be translated.
+  int32_t translateBlock(uint32_t entryPC) {
+    Block block;
+    block.entryPC = entryPC;
+    uint32_t pc = entryPC;
+    bool terminated = false;
+    while (!terminated) {
+      if (pc >= codeSizeBytes || block.ops.size() >= MAX_BLOCK_OPS) {
+        break;
+      }
+      DecodedInstr entry = decoded[pc];
+      if (entry.length == 0) {
+        entry = decode(pc);
+      }
+      // Leave undecodable addresses and invalid operations to step().
+      if (entry.opcode == UNDECODABLE ||
+          (static_cast<hex::Instr>(entry.opcode) == hex::Instr::OPR &&
+           entry.operand > static_cast<uint32_t>(hex::OprInstr::SVC))) {
+        break;
+      }
+      uint32_t nextPC = pc + entry.length;
+      uint32_t operand = entry.operand;
+      switch (static_cast<hex::Instr>(entry.opcode)) {
+        case hex::Instr::LDAM:
+          appendBlockOp(block, BlockOp{operand, 0, nextPC, BlockOpKind::LDAM});
+          break;
+        case hex::Instr::LDBM:
+          appendBlockOp(block, BlockOp{operand, 0, nextPC, BlockOpKind::LDBM});
+          break;
+        case hex::Instr::STAM:
+          appendBlockOp(block, BlockOp{operand, 0, nextPC, BlockOpKind::STAM});
+          break;
+        case hex::Instr::LDAC:
+          appendBlockOp(block, BlockOp{operand, 0, nextPC, BlockOpKind::LDAC});
+          break;
+        case hex::Instr::LDBC:
+          appendBlockOp(block, BlockOp{operand, 0, nextPC, BlockOpKind::LDBC});
+          break;
+        case hex::Instr::LDAP:
+          appendBlockOp(block, BlockOp{nextPC + operand, 0, nextPC, BlockOpKind::LDAC});
+          break;
+        case hex::Instr::LDAI:
+          appendBlockOp(block, BlockOp{operand, 0, nextPC, BlockOpKind::LDAI});
+          break;
+        case hex::Instr::LDBI:
+          appendBlockOp(block, BlockOp{operand, 0, nextPC, BlockOpKind::LDBI});
+          break;
+        case hex::Instr::STAI:
+          appendBlockOp(block, BlockOp{operand, 0, nextPC, BlockOpKind::STAI});
+          break;
+        case hex::Instr::BR:
+          appendBlockOp(block, BlockOp{nextPC + operand, 0, nextPC, BlockOpKind::BR});
+          terminated = true;
+          break;
+        case hex::Instr::BRZ:
+          appendBlockOp(block, BlockOp{nextPC + operand, 0, nextPC, BlockOpKind::BRZ});
+          terminated = true;
+          break;
+        case hex::Instr::BRN:
+          appendBlockOp(block, BlockOp{nextPC + operand, 0, nextPC, BlockOpKind::BRN});
+          terminated = true;
+          break;
+        case hex::Instr::OPR:
+          switch (static_cast<hex::OprInstr>(operand)) {
+            case hex::OprInstr::BRB:
+              appendBlockOp(block, BlockOp{0, 0, nextPC, BlockOpKind::BRB});
+              terminated = true;
+              break;
+            case hex::OprInstr::ADD:
+              appendBlockOp(block, BlockOp{0, 0, nextPC, BlockOpKind::ADD});
+              break;
+            case hex::OprInstr::SUB:
+              appendBlockOp(block, BlockOp{0, 0, nextPC, BlockOpKind::SUB});
+              break;
+            case hex::OprInstr::SVC:
+              appendBlockOp(block, BlockOp{0, 0, nextPC, BlockOpKind::SVC});
+              terminated = true;
+              break;
+          };
+          break;
+        default:
+          break;
+      }
+      pc = nextPC;
+    }
+    if (block.ops.empty()) {
+      return -1;
+    }
+    if (!terminated) {
+      block.ops.push_back(BlockOp{0, 0, pc, BlockOpKind::NEXT});
+    }
+    block.cycles = pc - entryPC;
+    blocks.push_back(std::move(block));
+    blockIndex[entryPC] = static_cast<int32_t>(blocks.size() - 1);
+    return blockIndex[entryPC];
+  }
+
+  /// Execute a translated block. If a store in the block causes the blocks
+  /// to be flushed, execution stops after the store since the remainder of
+  /// the block may have been overwritten.
+  void executeBlock(const Block &block) {
+    uint32_t areg = this->areg;
+    uint32_t breg = this->breg;
+    uint32_t entryPC = block.entryPC;
+    size_t generation = blockGeneration;
+    const BlockOp *op = block.ops.data();
+    BlockOp current;
+    uint32_t nextPC = 0;
+    bool stop = false;
+    while (!stop) {
+      current = *op++;
+      switch (current.kind) {
+        case BlockOpKind::LDAM:
+          areg = memory.at(current.a);
+          break;
+        case BlockOpKind::LDBM:
+          breg = memory.at(current.a);
+          break;
+        case BlockOpKind::STAM:
+          store(current.a, areg);
+          stop = blockGeneration != generation;
+          nextPC = current.nextPC;
+          break;
+        case BlockOpKind::LDAC:
+          areg = current.a;
+          break;
+        case BlockOpKind::LDBC:
+          breg = current.a;
+          break;
+        case BlockOpKind::LDAI:
+          areg = memory.at(areg + current.a);
+          break;
+        case BlockOpKind::LDBI:
+          breg = memory.at(breg + current.a);
+          break;
+        case BlockOpKind::STAI:
+          store(breg + current.a, areg);
+          stop = blockGeneration != generation;
+          nextPC = current.nextPC;
+          break;
+        case BlockOpKind::ADD:
+          areg = areg + breg;
+          break;
+        case BlockOpKind::SUB:
+          areg = areg - breg;
+          break;
+        case BlockOpKind::LDAM_LDAI:
+          areg = memory.at(memory.at(current.a) + current.b);
+          break;
+        case BlockOpKind::LDBM_LDBI:
+          breg = memory.at(memory.at(current.a) + current.b);
+          break;
+        case BlockOpKind::LDBM_STAI:
+          breg = memory.at(current.a);
+          store(breg + current.b, areg);
+          stop = blockGeneration != generation;
+          nextPC = current.nextPC;
+          break;
+        case BlockOpKind::LDAC_ADD:
+          areg = current.a + breg;
+          break;
+        case BlockOpKind::LDAC_SUB:
+          areg = current.a - breg;
+          break;
+        case BlockOpKind::LDBC_ADD:
+          breg = current.a;
+          areg = areg + breg;
+          break;
+        case BlockOpKind::LDBC_SUB:
+          breg = current.a;
+          areg = areg - breg;
+          break;
+        case BlockOpKind::BR:
+          nextPC = current.a;
+          stop = true;
+          break;
+        case BlockOpKind::BRZ:
+          nextPC = areg == 0 ? current.a : current.nextPC;
+          stop = true;
+          break;
+        case BlockOpKind::BRN:
+          nextPC = (int)areg < 0 ? current.a : current.nextPC;
+          stop = true;
+          break;
+        case BlockOpKind::BRB:
+          nextPC = breg;
+          stop = true;
+          break;
+        case BlockOpKind::SVC:
+          this->areg = areg;
+          syscall();
+          nextPC = current.nextPC;
+          stop = true;
+          break;
+        case BlockOpKind::NEXT:
+          nextPC = current.nextPC;
+          stop = true;
+          break;
+      }
+    }
+    // The operations executed cover contiguous bytes from the entry address.
+    cycles += current.nextPC - entryPC;
+    this->areg = areg;
+    this->breg = breg;
+    pc = nextPC;
+  }
+
+  /// Run loop using translated basic blocks. An address is translated once
+  /// it has been the entry to a block HOT_BLOCK_THRESHOLD times, and until
+  /// then its instructions are stepped. A block is only executed if all of
+  /// its cycles are within the cycle limit.
+  template<bool Limited>
+  int runBlocks() {
+    while (running && (Limited ? cycles <= maxCycles : true)) {
+      int32_t index = -1;
+      if (oreg == 0 && pc < codeSizeBytes) {
+        index = blockIndex[pc];
+        if (index < 0) {
+          if (blockHeat[pc] < HOT_BLOCK_THRESHOLD) {
+            blockHeat[pc]++;
+          } else {
+            index = translateBlock(pc);
+          }
+        }
+      }
+      if (index < 0 ||
+          (Limited && cycles + blocks[index].cycles - 1 > maxCycles)) {
+        // Step the bytes of one instruction.
+        do {
+          step<false, false, false>();
+        } while (oreg != 0 && running && (Limited ? cycles <= maxCycles : true));
+        continue;
+      }
+      executeBlock(blocks[index]);
     }
     return exitCode;
   }
+
+  /// Select the run() specialisation for the tracing, cycle limit,
+  /// statistics and profiling settings, one template argument at a time.
+  template<bool... Flags>
+  int selectRun() {
+    constexpr size_t numFlags = sizeof...(Flags);
+    if constexpr (numFlags == 4) {
+      return run<Flags...>();
+    } else {
+      bool flag = numFlags == 0 ? tracing :
+                  numFlags == 1 ? maxCycles > 0 :
+                  numFlags == 2 ? collectStats : profiling;
+      return flag ? selectRun<Flags..., true>() : selectRun<Flags..., false>();
+    }
+  }
+
+  /// Select the runModel() specialisation for the tracing, statistics and
+  /// profiling settings, one template argument at a time.
+  template<bool... Flags>
+  int selectRunModel(PipelineModel &model) {
+    constexpr size_t numFlags = sizeof...(Flags);
+    if constexpr (numFlags == 3) {
+      return runModel<Flags...>(model);
+    } else {
+      bool flag = numFlags == 0 ? tracing :
+                  numFlags == 1 ? collectStats : profiling;
+      return flag ? selectRunModel<Flags..., true>(model) :
+                    selectRunModel<Flags..., false>(model);
+    }
+  }
+
+  /// Run the program a byte at a time through a timing model.
+  int runModel(PipelineModel &model) {
+    if (profiling && !profiler) {
+      profiler = std::make_unique<Profiler>(symbols);
+    }
+    int result = selectRunModel<>(model);
+    io.flush();
+    return result;
+  }
+
+  /// Run the program, selecting the engine and specialised run loop once.
+  /// Statistics and profiles are only collected by the switch engine.
+  int run() {
+    if (profiling && !profiler) {
+      profiler = std::make_unique<Profiler>(symbols);
+    }
+    int result;
+    if (!tracing && !collectStats && !profiling && engine == Engine::THREADED) {
+      result = maxCycles > 0 ? runThreaded<true>() : runThreaded<false>();
+    } else if (!tracing && !collectStats && !profiling && engine == Engine::BLOCK) {
+      result = maxCycles > 0 ? runBlocks<true>() : runBlocks<false>();
+    } else {
+      result = selectRun<>();
+    }
+    // Write out any output left buffered by a run that did not exit.
+    io.flush();
+    return result;
+  }
 };
 
 } // End namespace hexsim
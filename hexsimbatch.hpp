@@ -0,0 +1,208 @@
+#ifndef HEX_SIM_BATCH_HPP
+#define HEX_SIM_BATCH_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "hexsim.hpp"
+#include "hexsimmemory.hpp"
+
+namespace hexsim {
+
+/// A simulation in a batch: a binary to run with the contents of a file on
+/// stdin, and optionally a file containing the expected stdout.
+struct BatchJob {
+  std::string binary;
+  std::string inputFile;
+  std::string expectedFile;
+  size_t maxCycles;
+};
+
+/// The outcome of a batch job.
+struct BatchResult {
+  size_t index;
+  int exitCode;
+  size_t cycles;
+  bool passed;
+  std::string output;
+  std::string error;
+};
+
+/// Read a manifest of batch jobs, one per line as:
+///   binary [stdin-file [expected-output-file [max-cycles]]]
+/// with '-' for no file, and '#' starting a comment.
+inline std::vector<BatchJob> readBatchManifest(const char *filename) {
+  std::ifstream file(filename);
+  if (!file) {
+    throw std::runtime_error(std::string("could not open manifest ")+filename);
+  }
+  std::vector<BatchJob> jobs;
+  std::string line;
+  while (std::getline(file, line)) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream fields(line);
+    BatchJob job{"", "-", "-", 0};
+    if (!(fields >> job.binary)) {
+      continue;
+    }
+    fields >> job.inputFile >> job.expectedFile >> job.maxCycles;
+    jobs.push_back(job);
+  }
+  return jobs;
+}
+
+/// Run batch jobs on a pool of threads, each with its own Processor and
+/// in-memory streams. Each binary is loaded once, by the first job that runs
+/// it, as an image shared copy-on-write by the processors that run it, and a
+/// binary that cannot be loaded fails only its own jobs. The jobs are dealt out to a
+/// queue per thread, and a thread whose queue is empty steals from the back
+/// of another's, so long jobs do not leave threads idle. Results are passed
+/// to a callback as they complete, one at a time.
+class BatchRunner {
+
+  struct WorkQueue {
+    std::mutex mutex;
+    std::deque<size_t> jobs;
+  };
+
+  /// The image of a binary, or the error loading it.
+  struct ImageEntry {
+    std::once_flag loaded;
+    std::unique_ptr<MemoryImage> image;
+    std::string error;
+  };
+
+  const std::vector<BatchJob> &jobs;
+  std::map<std::string, std::unique_ptr<ImageEntry>> images;
+  std::vector<std::unique_ptr<WorkQueue>> queues;
+  std::function<void(const BatchResult&)> callback;
+  std::mutex callbackMutex;
+
+  static std::string readFile(const std::string &filename) {
+    if (filename == "-") {
+      return "";
+    }
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) {
+      throw std::runtime_error("could not open "+filename);
+    }
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+  }
+
+  /// Return the image of a binary, loading it if this is its first job.
+  const MemoryImage &getImage(const std::string &binary) {
+    auto &entry = *images.at(binary);
+    std::call_once(entry.loaded, [&entry, &binary] {
+      try {
+        auto image = std::make_unique<MemoryImage>(binary.c_str());
+        image->share();
+        entry.image = std::move(image);
+      } catch (std::exception &e) {
+        entry.error = e.what();
+      }
+    });
+    if (!entry.image) {
+      throw std::runtime_error(entry.error);
+    }
+    return *entry.image;
+  }
+
+  /// Take the next job for a thread, from its own queue or another's.
+  bool nextJob(size_t thread, size_t &index) {
+    for (size_t i=0; i<queues.size(); i++) {
+      auto &queue = *queues[(thread + i) % queues.size()];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (!queue.jobs.empty()) {
+        if (i == 0) {
+          index = queue.jobs.front();
+          queue.jobs.pop_front();
+        } else {
+          index = queue.jobs.back();
+          queue.jobs.pop_back();
+        }
+        return true;
+      }
+    }
+    return false;
+  }
+
+  BatchResult runJob(size_t index) {
+    auto &job = jobs[index];
+    BatchResult result{index, 0, 0, false, "", ""};
+    try {
+      std::istringstream in(readFile(job.inputFile));
+      std::ostringstream out;
+      Processor processor(in, out, job.maxCycles);
+      // Keep any channel files of different jobs apart.
+      processor.getIO().setOutputName("job"+std::to_string(index)+".simout");
+      processor.load(getImage(job.binary));
+      result.exitCode = processor.run();
+      result.cycles = processor.getCycles();
+      result.output = out.str();
+      result.passed = job.expectedFile == "-" || result.output == readFile(job.expectedFile);
+    } catch (std::exception &e) {
+      result.error = e.what();
+    }
+    return result;
+  }
+
+  void worker(size_t thread) {
+    size_t index;
+    while (nextJob(thread, index)) {
+      auto result = runJob(index);
+      std::lock_guard<std::mutex> lock(callbackMutex);
+      callback(result);
+    }
+  }
+
+public:
+
+  BatchRunner(const std::vector<BatchJob> &jobs) : jobs(jobs) {
+    for (auto &job : jobs) {
+      if (images.count(job.binary) == 0) {
+        images[job.binary] = std::make_unique<ImageEntry>();
+      }
+    }
+  }
+
+  /// Run all of the jobs on a number of threads, or one per hardware thread.
+  void run(std::function<void(const BatchResult&)> resultCallback,
+           size_t numThreads=0) {
+    callback = resultCallback;
+    if (numThreads == 0) {
+      numThreads = std::max<size_t>(1, std::thread::hardware_concurrency());
+    }
+    numThreads = std::max<size_t>(1, std::min(numThreads, jobs.size()));
+    queues.clear();
+    for (size_t i=0; i<numThreads; i++) {
+      queues.push_back(std::make_unique<WorkQueue>());
+    }
+    for (size_t i=0; i<jobs.size(); i++) {
+      queues[i % numThreads]->jobs.push_back(i);
+    }
+    std::vector<std::thread> threads;
+    for (size_t i=0; i<numThreads; i++) {
+      threads.emplace_back(&BatchRunner::worker, this, i);
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+  }
+};
+
+} // End namespace hexsim
+
+#endif // HEX_SIM_BATCH_HPP
@@ -1,53 +1,275 @@
 #ifndef HEX_SIM_IO_HPP
 #define HEX_SIM_IO_HPP
 
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <istream>
 #include <ostream>
+#include <stdexcept>
 #include <string>
 #include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace hex {
 
+/// The character streams of a simulated program. Streams below 256 are the
+/// console (in and out), and bits 8-10 of other streams select one of eight
+/// file channels, named <directory>/<inputName><N> for input and
+/// <directory>/<outputName><N> for output ("simin<N>" and "simout<N>" in the
+/// current directory by default).
+/// Output is collected in a buffer per channel and written when the buffer
+/// fills, when output switches to another channel, before the console is read
+/// and on flush(), which the simulator calls on EXIT. Input files are memory
+/// mapped. The positions reached in each channel can be saved and restored,
+/// so a resumed simulation continues reading and writing the files where it
+/// left off.
 class HexSimIO {
 
+  static constexpr size_t NUM_CHANNELS = 8;
+  static constexpr size_t BUFFER_SIZE = 1 << 16;
+  static constexpr size_t CONSOLE = NUM_CHANNELS;
+
+  struct OutputChannel {
+    std::ofstream file;
+    std::vector<char> buffer;
+    uint64_t position;
+    bool connected;
+    OutputChannel() : position(0), connected(false) {}
+  };
+
+  struct InputChannel {
+    const char *data;
+    size_t size;
+    size_t position;
+    bool connected;
+    InputChannel() : data(nullptr), size(0), position(0), connected(false) {}
+  };
+
   std::istream &in;
   std::ostream &out;
-  std::array<std::fstream, 8> fileIO;
-  std::array<bool, 8> connected;
+  // Output channels, with the console last.
+  std::array<OutputChannel, NUM_CHANNELS + 1> outputs;
+  std::array<InputChannel, NUM_CHANNELS> inputs;
+  size_t lastOutput;
+  uint64_t consolePosition;
+  std::string directory;
+  std::string inputName;
+  std::string outputName;
+
+  static size_t channelIndex(int stream) {
+    return stream < 256 ? CONSOLE : (stream >> 8) & 7;
+  }
+
+  std::string path(const std::string &name, size_t index) const {
+    std::string filename = name + std::to_string(index);
+    return directory.empty() ? filename : directory + "/" + filename;
+  }
+
+  OutputChannel &openOutput(size_t index) {
+    auto &channel = outputs[index];
+    if (!channel.connected) {
+      if (index != CONSOLE) {
+        auto filename = path(outputName, index);
+        if (channel.position == 0) {
+          channel.file.open(filename, std::fstream::out | std::fstream::binary);
+        } else {
+          // Continue from a restored position, discarding anything after it.
+          channel.file.open(filename, std::fstream::app | std::fstream::binary);
+          if (!channel.file || ::truncate(filename.c_str(), channel.position) != 0) {
+            throw std::runtime_error("could not resume output file "+filename);
+          }
+        }
+      }
+      channel.buffer.reserve(BUFFER_SIZE);
+      channel.connected = true;
+    }
+    // Write out the previous channel so that the order of output across
+    // channels is kept.
+    if (index != lastOutput) {
+      flush(lastOutput);
+      lastOutput = index;
+    }
+    return channel;
+  }
+
+  InputChannel &openInput(size_t index) {
+    auto &channel = inputs[index];
+    if (!channel.connected) {
+      int fd = ::open(path(inputName, index).c_str(), O_RDONLY);
+      struct stat status;
+      if (fd >= 0 && ::fstat(fd, &status) == 0 && status.st_size > 0) {
+        void *data = ::mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+          channel.data = static_cast<const char*>(data);
+          channel.size = status.st_size;
+        }
+      }
+      if (fd >= 0) {
+        ::close(fd);
+      }
+      channel.connected = true;
+    }
+    return channel;
+  }
+
+  void flush(size_t index) {
+    auto &channel = outputs[index];
+    if (channel.buffer.empty()) {
+      return;
+    }
+    if (index == CONSOLE) {
+      out.write(channel.buffer.data(), channel.buffer.size());
+      out.flush();
+    } else {
+      channel.file.write(channel.buffer.data(), channel.buffer.size());
+      channel.file.flush();
+    }
+    channel.buffer.clear();
+  }
 
 public:
 
   HexSimIO(std::istream &in, std::ostream &out) :
-      in(in), out(out), connected({false, false, false, false, false, false, false, false}) {}
+      in(in), out(out), lastOutput(CONSOLE), consolePosition(0),
+      inputName("simin"), outputName("simout") {}
+
+  HexSimIO(const HexSimIO&) = delete;
+  HexSimIO &operator=(const HexSimIO&) = delete;
+
+  ~HexSimIO() {
+    flush();
+    for (auto &channel : inputs) {
+      if (channel.data) {
+        ::munmap(const_cast<char*>(channel.data), channel.size);
+      }
+    }
+  }
+
+  /// Set the directory of the channel files.
+  void setDirectory(const std::string &value) { directory = value; }
+
+  /// Set the names of the channel files, to which the channel number is
+  /// appended.
+  void setInputName(const std::string &value) { inputName = value; }
+  void setOutputName(const std::string &value) { outputName = value; }
 
   /// Output a character to ostream or a file.
   void output(char value, int stream) {
-    if (stream < 256) {
-      out << value;
-    } else {
-      size_t index = (stream >> 8) & 7;
-      if (!connected[index]) {
-        fileIO[index].open(std::string("simout")+std::to_string(index),
-                           std::fstream::out);
-        connected[index] = true;
-      }
-      fileIO[index].put(value);
+    auto &channel = openOutput(channelIndex(stream));
+    if (channel.buffer.size() == BUFFER_SIZE) {
+      flush(lastOutput);
+    }
+    channel.buffer.push_back(value);
+    channel.position++;
+  }
+
+  /// Output a block of characters to ostream or a file.
+  void output(const char *data, size_t length, int stream) {
+    auto &channel = openOutput(channelIndex(stream));
+    if (channel.buffer.size() + length > BUFFER_SIZE) {
+      flush(lastOutput);
     }
+    channel.buffer.insert(channel.buffer.end(), data, data + length);
+    channel.position += length;
   }
 
-  /// Input a character from stdin or a file.
+  /// Input a character from stdin or a file, or EOF (as a char) at the end.
   char input(int stream) {
-    if (stream < 256) {
-      return in.get();
-    } else {
-      size_t index = (stream >> 8) & 7;
-      if (!connected[index]) {
-        fileIO[index].open(std::string("simin")+std::to_string(index),
-                           std::fstream::in);
-        connected[index] = true;
+    size_t index = channelIndex(stream);
+    if (index == CONSOLE) {
+      flush(CONSOLE);
+      consolePosition++;
+      return in.rdbuf()->sbumpc();
+    }
+    auto &channel = openInput(index);
+    if (channel.position < channel.size) {
+      return channel.data[channel.position++];
+    }
+    return std::char_traits<char>::eof();
+  }
+
+  /// Input up to a block of characters from stdin or a file, returning the
+  /// number read.
+  size_t input(char *data, size_t length, int stream) {
+    size_t index = channelIndex(stream);
+    if (index == CONSOLE) {
+      flush(CONSOLE);
+      size_t count = in.rdbuf()->sgetn(data, length);
+      consolePosition += count;
+      return count;
+    }
+    auto &channel = openInput(index);
+    length = std::min(length, channel.size - channel.position);
+    if (length) {
+      std::memcpy(data, channel.data + channel.position, length);
+      channel.position += length;
+    }
+    return length;
+  }
+
+  /// Return the number of characters read from each input channel, with the
+  /// console last.
+  std::vector<uint64_t> getInputPositions() const {
+    std::vector<uint64_t> positions;
+    for (auto &channel : inputs) {
+      positions.push_back(channel.position);
+    }
+    positions.push_back(consolePosition);
+    return positions;
+  }
+
+  /// Continue reading each input channel from a position, skipping over the
+  /// characters before it on the console. Reads at the end of the console
+  /// also count, so its position can be past the end of the input.
+  void setInputPositions(const std::vector<uint64_t> &positions) {
+    for (size_t i=0; i<std::min(positions.size(), inputs.size()); i++) {
+      if (positions[i] == 0) {
+        continue;
       }
-      return fileIO[index].get();
+      auto &channel = openInput(i);
+      if (positions[i] > channel.size) {
+        throw std::runtime_error("input position "+std::to_string(positions[i])+
+                                 " is past the end of "+path(inputName, i));
+      }
+      channel.position = positions[i];
+    }
+    if (positions.size() > inputs.size()) {
+      uint64_t position = positions[inputs.size()];
+      while (consolePosition < position &&
+             in.rdbuf()->sbumpc() != std::char_traits<char>::eof()) {
+        consolePosition++;
+      }
+      consolePosition = position;
+    }
+  }
+
+  /// Return the number of characters written to each output channel file.
+  std::vector<uint64_t> getOutputPositions() const {
+    std::vector<uint64_t> positions;
+    for (size_t i=0; i<NUM_CHANNELS; i++) {
+      positions.push_back(outputs[i].position);
+    }
+    return positions;
+  }
+
+  /// Continue writing each output channel file from a position, keeping the
+  /// output before it. This must be called before any output.
+  void setOutputPositions(const std::vector<uint64_t> &positions) {
+    for (size_t i=0; i<std::min(positions.size(), NUM_CHANNELS); i++) {
+      outputs[i].position = positions[i];
+    }
+  }
+
+  /// Write out any buffered output.
+  void flush() {
+    for (size_t i=0; i<outputs.size(); i++) {
+      flush(i);
     }
   }
 };
@@ -0,0 +1,167 @@
+#ifndef HEX_SIM_MEMORY_HPP
+#define HEX_SIM_MEMORY_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "hexbinary.hpp"
+#include "hexsimsymbols.hpp"
+
+namespace hexsim {
+
+/// Round a number of bytes up to a whole number of pages.
+inline size_t roundUpToPage(size_t bytes) {
+  size_t pageSize = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+  return (bytes + pageSize - 1) & ~(pageSize - 1);
+}
+
+/// A program loaded from a binary file: the instruction words, which are a
+/// view of the mapped binary, and the debug symbols. An image can be shared,
+/// which copies its words into an unlinked temporary file, so that the
+/// memories of many processors can map it copy-on-write instead of each
+/// holding a copy.
+class MemoryImage {
+
+  hex::BinaryImage binary;
+  SymbolIndex symbols;
+  std::FILE *file;
+
+public:
+
+  MemoryImage(const char *filename) : binary(filename), file(nullptr) {
+    symbols.build(binary.getSymbols());
+  }
+
+  /// Adopt a binary assembled in memory.
+  MemoryImage(std::string contents, const std::string &name) :
+      binary(std::move(contents), name), file(nullptr) {
+    symbols.build(binary.getSymbols());
+  }
+
+  MemoryImage(const MemoryImage&) = delete;
+  MemoryImage &operator=(const MemoryImage&) = delete;
+
+  ~MemoryImage() {
+    if (file) {
+      std::fclose(file);
+    }
+  }
+
+  /// Write the words to a temporary file so they can be mapped.
+  void share() {
+    if (file) {
+      return;
+    }
+    file = std::tmpfile();
+    if (!file ||
+        std::fwrite(getWords(), sizeof(uint32_t), getNumWords(), file) != getNumWords() ||
+        std::fflush(file) != 0 ||
+        ::ftruncate(fileno(file), roundUpToPage(getProgramSizeBytes())) != 0) {
+      throw std::runtime_error("could not create a shared memory image");
+    }
+  }
+
+  bool isShared() const { return file != nullptr; }
+  int getFileDescriptor() const { return fileno(file); }
+  const uint32_t *getWords() const { return binary.getWords(); }
+  size_t getNumWords() const { return binary.getNumWords(); }
+  size_t getProgramSizeBytes() const { return binary.getProgramSizeBytes(); }
+  uint32_t getDataBegin() const { return binary.getDataBegin(); }
+  uint32_t getDataEnd() const { return binary.getDataEnd(); }
+  const SymbolIndex &getSymbols() const { return symbols; }
+};
+
+/// The memory of a processor, as a single anonymous mapping of its size in
+/// words. Pages are only allocated when they are first touched, so a large
+/// memory costs only what a program uses, and a shared image is mapped over
+/// the start of it copy-on-write, so only the pages of the image that a
+/// program writes are copied. Accesses are to a flat array, so this costs
+/// nothing in the simulator loops.
+class Memory {
+
+  uint32_t *words;
+  size_t numWords;
+  size_t mappedBytes;
+
+  [[noreturn]] void outOfRange(size_t index) const {
+    throw std::runtime_error("memory access to word "+std::to_string(index)+
+                             " is outside memory of "+std::to_string(mappedBytes / sizeof(uint32_t))+" words");
+  }
+
+  void *mapZeros(void *address, size_t bytes) {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | (address ? MAP_FIXED : 0);
+    void *data = ::mmap(address, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (data == MAP_FAILED) {
+      throw std::runtime_error("could not map "+std::to_string(bytes)+" bytes of memory");
+    }
+    return data;
+  }
+
+public:
+
+  Memory(size_t numWords) :
+      numWords(numWords), mappedBytes(roundUpToPage(numWords * sizeof(uint32_t))) {
+    words = static_cast<uint32_t*>(mapZeros(nullptr, mappedBytes));
+  }
+
+  Memory(const Memory&) = delete;
+  Memory &operator=(const Memory&) = delete;
+
+  ~Memory() {
+    ::munmap(words, mappedBytes);
+  }
+
+  uint32_t &operator[](size_t index) { return words[index]; }
+  const uint32_t &operator[](size_t index) const { return words[index]; }
+
+  /// Return a word accessed by a program, checking that it is in memory.
+  /// The words that round the size up to a whole page are also accessible,
+  /// which the syscall frame above the initial stack pointer of a program
+  /// that starts its stack at the top of memory relies on.
+  uint32_t &at(size_t index) {
+    if (index >= mappedBytes / sizeof(uint32_t)) {
+      outOfRange(index);
+    }
+    return words[index];
+  }
+  uint32_t *data() { return words; }
+  const uint32_t *data() const { return words; }
+  size_t size() const { return numWords; }
+
+  /// Release every page, so the memory reads as zeros.
+  void clear() {
+    mapZeros(words, mappedBytes);
+  }
+
+  /// Clear the memory and load an image into the start of it, mapping it if
+  /// it is shared or copying it otherwise.
+  void load(const MemoryImage &image) {
+    if (image.getNumWords() > numWords) {
+      throw std::runtime_error("program of "+std::to_string(image.getNumWords())+
+                               " words does not fit in memory");
+    }
+    clear();
+    if (image.getNumWords() == 0) {
+      return;
+    }
+    if (image.isShared()) {
+      size_t bytes = roundUpToPage(image.getProgramSizeBytes());
+      void *data = ::mmap(words, bytes, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_FIXED, image.getFileDescriptor(), 0);
+      if (data == MAP_FAILED) {
+        throw std::runtime_error("could not map the shared memory image");
+      }
+    } else {
+      std::memcpy(words, image.getWords(), image.getProgramSizeBytes());
+    }
+  }
+};
+
+} // End namespace hexsim
+
+#endif // HEX_SIM_MEMORY_HPP
@@ -0,0 +1,172 @@
+#ifndef HEX_SIM_PROFILE_HPP
+#define HEX_SIM_PROFILE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <boost/format.hpp>
+#include "hexsimsymbols.hpp"
+
+namespace hexsim {
+
+/// A profiler that charges simulated cycles to the FUNC and PROC symbols in
+/// a binary's debug information. Self cycles are charged to the symbol
+/// enclosing each instruction. Calls are inferred from the calling convention
+/// that xcmp emits: a branch to the first instruction of a symbol is a call,
+/// with the return address in areg (set by LDAP), and an OPR BRB to the
+/// return address of a frame on the call stack returns from it. Cycles are
+/// also charged to a tree of call stacks, which gives inclusive cycles and a
+/// folded-stacks output for flame graphs.
+class Profiler {
+
+  struct Symbol {
+    std::string name;
+    size_t calls;
+    size_t selfCycles;
+    size_t totalCycles;
+    Symbol(const std::string &name) :
+      name(name), calls(0), selfCycles(0), totalCycles(0) {}
+  };
+
+  /// A node in the tree of call stacks.
+  struct Node {
+    size_t symbol;
+    Node *parent;
+    std::map<size_t, std::unique_ptr<Node>> children;
+    size_t cycles;
+    uint32_t returnAddress;
+    Node(size_t symbol, Node *parent) :
+      symbol(symbol), parent(parent), cycles(0), returnAddress(0) {}
+  };
+
+  // The counters of symbol i of the index are held in symbols[i + 1]. The
+  // first symbol covers any code before the first FUNC or PROC, and is the
+  // root of the call stacks.
+  SymbolIndex &index;
+  std::vector<Symbol> symbols;
+  Node root;
+  Node *current;
+
+  static bool selfCyclesGreater(const Symbol *a, const Symbol *b) {
+    return a->selfCycles > b->selfCycles;
+  }
+
+  static double percent(size_t cycles, size_t total) {
+    return total ? 100.0 * cycles / total : 0.0;
+  }
+
+  /// Return the index of the symbol enclosing an address.
+  size_t lookup(uint32_t address) {
+    // Addresses before the first symbol give NONE, which wraps to the entry.
+    return index.lookup(address) + 1;
+  }
+
+  /// Accumulate the total cycles of each symbol, counting each node's
+  /// subtree once for a symbol that recurses.
+  size_t accumulate(Node &node, std::vector<unsigned> &active) {
+    size_t total = node.cycles;
+    active[node.symbol]++;
+    for (auto &child : node.children) {
+      total += accumulate(*child.second, active);
+    }
+    active[node.symbol]--;
+    if (active[node.symbol] == 0) {
+      symbols[node.symbol].totalCycles += total;
+    }
+    return total;
+  }
+
+  void writeFoldedStacks(std::ostream &out, const Node &node,
+                         const std::string &prefix) const {
+    std::string stack = prefix.empty() ? symbols[node.symbol].name
+                                       : prefix + ";" + symbols[node.symbol].name;
+    if (node.cycles) {
+      out << stack << " " << node.cycles << "\n";
+    }
+    for (auto &child : node.children) {
+      writeFoldedStacks(out, *child.second, stack);
+    }
+  }
+
+public:
+
+  Profiler(SymbolIndex &index) :
+      index(index), root(0, nullptr), current(&root) {
+    symbols.emplace_back("[entry]");
+    for (size_t i = 0; i < index.size(); i++) {
+      symbols.emplace_back(index[i].name);
+    }
+  }
+
+  /// Charge cycles spent executing an instruction at an address.
+  void charge(uint32_t address, size_t cycles) {
+    symbols[lookup(address)].selfCycles += cycles;
+    current->cycles += cycles;
+  }
+
+  /// Record a taken relative branch, which is a call if it targets the start
+  /// of a symbol.
+  void branch(uint32_t target, uint32_t returnAddress) {
+    size_t symbol = lookup(target);
+    if (symbol == 0 || index[symbol - 1].offset != target) {
+      return;
+    }
+    auto &child = current->children[symbol];
+    if (!child) {
+      child = std::make_unique<Node>(symbol, current);
+    }
+    child->returnAddress = returnAddress;
+    current = child.get();
+    symbols[symbol].calls++;
+  }
+
+  /// Record an OPR BRB, which returns from the innermost frame with a
+  /// matching return address.
+  void indirectBranch(uint32_t target) {
+    for (Node *node = current; node != &root; node = node->parent) {
+      if (node->returnAddress == target) {
+        current = node->parent;
+        return;
+      }
+    }
+  }
+
+  /// Print a table of the symbols ordered by self cycles.
+  void report(std::ostream &out) {
+    for (auto &symbol : symbols) {
+      symbol.totalCycles = 0;
+    }
+    std::vector<unsigned> active(symbols.size(), 0);
+    size_t totalCycles = accumulate(root, active);
+    std::vector<const Symbol*> sorted;
+    for (auto &symbol : symbols) {
+      if (symbol.selfCycles || symbol.calls) {
+        sorted.push_back(&symbol);
+      }
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), selfCyclesGreater);
+    out << boost::format("%-24s %10s %14s %7s %14s %7s\n")
+             % "Symbol" % "Calls" % "Self cycles" % "Self%"
+             % "Total cycles" % "Total%";
+    for (auto symbol : sorted) {
+      out << boost::format("%-24s %10d %14d %6.2f%% %14d %6.2f%%\n")
+               % symbol->name % symbol->calls
+               % symbol->selfCycles % percent(symbol->selfCycles, totalCycles)
+               % symbol->totalCycles % percent(symbol->totalCycles, totalCycles);
+    }
+  }
+
+  /// Write the cycles of each call stack in the folded format read by
+  /// flamegraph.pl, one "outer;...;inner cycles" line per stack.
+  void writeFoldedStacks(std::ostream &out) const {
+    writeFoldedStacks(out, root, "");
+  }
+};
+
+} // End namespace hexsim
+
+#endif // HEX_SIM_PROFILE_HPP
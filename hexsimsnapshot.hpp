@@ -0,0 +1,179 @@
+#ifndef HEX_SIM_SNAPSHOT_HPP
+#define HEX_SIM_SNAPSHOT_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace hexsim {
+
+/// The header of a snapshot file.
+constexpr char SNAPSHOT_MAGIC[8] = {'H', 'E', 'X', 'S', 'N', 'A', 'P', '\0'};
+constexpr uint32_t SNAPSHOT_VERSION = 2;
+
+/// The state of a simulation at a cycle, from which it can be resumed: the
+/// registers, the positions reached in each input and output channel and the
+/// memory. Only the pages of memory that contain a non-zero word are held, so
+/// a snapshot of a small program in a large memory is small. A snapshot does
+/// not hold the output written before it was taken, which a resumed
+/// simulation keeps in the channel files and does not repeat on the console,
+/// or the program's debug information, which is read again from the binary
+/// when resuming.
+struct Snapshot {
+  static constexpr size_t PAGE_WORDS = 1024;
+
+  uint32_t memorySizeWords;
+  uint32_t pc;
+  uint32_t areg;
+  uint32_t breg;
+  uint32_t oreg;
+  uint32_t running;
+  int32_t exitCode;
+  uint64_t cycles;
+  std::vector<uint64_t> inputPositions;
+  std::vector<uint64_t> outputPositions;
+  // The page numbers, and the words of each page in turn.
+  std::vector<uint32_t> pages;
+  std::vector<uint32_t> pageWords;
+
+  Snapshot() :
+    memorySizeWords(0), pc(0), areg(0), breg(0), oreg(0), running(1),
+    exitCode(0), cycles(0) {}
+
+  /// Copy the non-zero pages of a memory.
+  void setMemory(const uint32_t *memory, size_t numWords) {
+    memorySizeWords = numWords;
+    pages.clear();
+    pageWords.clear();
+    for (size_t base=0; base<numWords; base+=PAGE_WORDS) {
+      size_t end = std::min(base + PAGE_WORDS, numWords);
+      size_t i = base;
+      while (i < end && memory[i] == 0) {
+        i++;
+      }
+      if (i == end) {
+        continue;
+      }
+      pages.push_back(base / PAGE_WORDS);
+      pageWords.insert(pageWords.end(), memory + base, memory + end);
+      pageWords.resize(pages.size() * PAGE_WORDS, 0);
+    }
+  }
+
+  /// Write the pages into a memory that reads as zeros and is at least as
+  /// large as the one the snapshot was taken of.
+  void getMemory(uint32_t *memory, size_t numWords) const {
+    if (numWords < memorySizeWords) {
+      throw std::runtime_error("snapshot of "+std::to_string(memorySizeWords)+
+                               " words does not fit in a memory of "+
+                               std::to_string(numWords)+" words");
+    }
+    for (size_t i=0; i<pages.size(); i++) {
+      size_t base = static_cast<size_t>(pages[i]) * PAGE_WORDS;
+      size_t length = std::min(PAGE_WORDS, memorySizeWords - base);
+      std::copy(&pageWords[i * PAGE_WORDS], &pageWords[i * PAGE_WORDS] + length,
+                memory + base);
+    }
+  }
+
+  void write(const char *filename) const {
+    std::ofstream file(filename, std::ios::binary);
+    if (!file) {
+      throw std::runtime_error(std::string("could not open snapshot file ")+filename);
+    }
+    uint32_t numPositions = inputPositions.size();
+    uint32_t numOutputPositions = outputPositions.size();
+    uint32_t numPages = pages.size();
+    file.write(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    put(file, SNAPSHOT_VERSION);
+    put(file, memorySizeWords);
+    put(file, pc);
+    put(file, areg);
+    put(file, breg);
+    put(file, oreg);
+    put(file, running);
+    put(file, exitCode);
+    put(file, cycles);
+    put(file, numPositions);
+    file.write(reinterpret_cast<const char*>(inputPositions.data()),
+               numPositions * sizeof(uint64_t));
+    put(file, numOutputPositions);
+    file.write(reinterpret_cast<const char*>(outputPositions.data()),
+               numOutputPositions * sizeof(uint64_t));
+    put(file, numPages);
+    file.write(reinterpret_cast<const char*>(pages.data()),
+               numPages * sizeof(uint32_t));
+    file.write(reinterpret_cast<const char*>(pageWords.data()),
+               pageWords.size() * sizeof(uint32_t));
+    if (!file) {
+      throw std::runtime_error(std::string("could not write snapshot file ")+filename);
+    }
+  }
+
+  void read(const char *filename) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) {
+      throw std::runtime_error(std::string("could not open snapshot file ")+filename);
+    }
+    char magic[sizeof(SNAPSHOT_MAGIC)];
+    uint32_t version = 0;
+    file.read(magic, sizeof(magic));
+    get(file, version);
+    if (!file || !std::equal(magic, magic + sizeof(magic), SNAPSHOT_MAGIC) ||
+        version != SNAPSHOT_VERSION) {
+      throw std::runtime_error(std::string(filename)+" is not a snapshot file");
+    }
+    uint32_t numPositions = 0;
+    uint32_t numOutputPositions = 0;
+    uint32_t numPages = 0;
+    get(file, memorySizeWords);
+    get(file, pc);
+    get(file, areg);
+    get(file, breg);
+    get(file, oreg);
+    get(file, running);
+    get(file, exitCode);
+    get(file, cycles);
+    get(file, numPositions);
+    inputPositions.resize(numPositions);
+    file.read(reinterpret_cast<char*>(inputPositions.data()),
+              numPositions * sizeof(uint64_t));
+    get(file, numOutputPositions);
+    outputPositions.resize(numOutputPositions);
+    file.read(reinterpret_cast<char*>(outputPositions.data()),
+              numOutputPositions * sizeof(uint64_t));
+    get(file, numPages);
+    pages.resize(numPages);
+    pageWords.resize(static_cast<size_t>(numPages) * PAGE_WORDS);
+    file.read(reinterpret_cast<char*>(pages.data()), numPages * sizeof(uint32_t));
+    file.read(reinterpret_cast<char*>(pageWords.data()),
+              pageWords.size() * sizeof(uint32_t));
+    if (!file) {
+      throw std::runtime_error(std::string("truncated snapshot file ")+filename);
+    }
+    for (auto page : pages) {
+      if (static_cast<size_t>(page) * PAGE_WORDS >= memorySizeWords) {
+        throw std::runtime_error(std::string("invalid page in snapshot file ")+filename);
+      }
+    }
+  }
+
+private:
+
+  template<typename T>
+  static void put(std::ofstream &file, T value) {
+    file.write(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  template<typename T>
+  static void get(std::ifstream &file, T &value) {
+    file.read(reinterpret_cast<char*>(&value), sizeof(T));
+  }
+};
+
+} // End namespace hexsim
+
+#endif // HEX_SIM_SNAPSHOT_HPP
@@ -0,0 +1,81 @@
+#ifndef HEX_SIM_SYMBOLS_HPP
+#define HEX_SIM_SYMBOLS_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "hexbinary.hpp"
+
+namespace hexsim {
+
+/// An index of the FUNC and PROC symbols in a binary's debug information by
+/// address range. Each symbol covers the addresses from its offset up to the
+/// offset of the next symbol. Lookups use a binary search, after checking
+/// the symbol of the previous lookup, which usually matches since
+/// consecutive lookups are for nearby PCs. The index is shared by tracing
+/// and profiling.
+class SymbolIndex {
+public:
+  struct Symbol {
+    std::string name;
+    uint32_t offset;
+  };
+
+  static constexpr size_t NONE = static_cast<size_t>(-1);
+
+private:
+  // Symbols in ascending order of address.
+  std::vector<Symbol> symbols;
+  size_t lastHit;
+
+  static bool addressBefore(uint32_t address, const Symbol &symbol) {
+    return address < symbol.offset;
+  }
+
+  static bool offsetLess(const Symbol &a, const Symbol &b) {
+    return a.offset < b.offset;
+  }
+
+public:
+  SymbolIndex() : lastHit(0) {}
+
+  /// Build the index from the symbols of a binary.
+  void build(const std::vector<hex::BinaryImage::Symbol> &binarySymbols) {
+    symbols.clear();
+    for (auto &symbol : binarySymbols) {
+      symbols.push_back(Symbol{std::string(symbol.name), symbol.offset});
+    }
+    std::stable_sort(symbols.begin(), symbols.end(), offsetLess);
+    lastHit = 0;
+  }
+
+  /// Return the index of the symbol containing an address, or NONE if the
+  /// address precedes all of the symbols.
+  size_t lookup(uint32_t address) {
+    if (symbols.empty()) {
+      return NONE;
+    }
+    if (address >= symbols[lastHit].offset &&
+        (lastHit + 1 == symbols.size() ||
+         address < symbols[lastHit + 1].offset)) {
+      return lastHit;
+    }
+    auto it = std::upper_bound(symbols.begin(), symbols.end(), address,
+                               addressBefore);
+    if (it == symbols.begin()) {
+      return NONE;
+    }
+    lastHit = std::distance(symbols.begin(), it) - 1;
+    return lastHit;
+  }
+
+  const Symbol &operator[](size_t index) const { return symbols[index]; }
+  size_t size() const { return symbols.size(); }
+  bool empty() const { return symbols.empty(); }
+};
+
+} // End namespace hexsim
+
+#endif // HEX_SIM_SYMBOLS_HPP
@@ -0,0 +1,172 @@
+#ifndef HEX_SIM_TIMING_HPP
+#define HEX_SIM_TIMING_HPP
+
+#include <array>
+#include <cstdint>
+#include <ostream>
+#include <boost/format.hpp>
+
+#include "hex.hpp"
+
+namespace hexsim {
+
+/// A cycle-accurate timing model of the pipelined core in
+/// verilog/processor_pipelined.sv, driven by the bytes that hexsim executes,
+/// so that its cycles and CPI can be predicted without RTL simulation.
+///
+/// The core has a fetch stage and an execute stage. Each cycle, fetch reads
+/// the word holding the fetch address and consumes the prefixes from it up
+/// to and including the next instruction, so an instruction takes one fetch
+/// cycle for each word its prefix chain spans, and prefixes in the same word
+/// as their instruction are free. Fetch follows BR to its target, predicts
+/// BRZ and BRN with a table of two-bit counters indexed by the low bits of
+/// their address, and predicts that OPR BRB falls through. Execute takes one
+/// cycle, and a mispredicted next address, or a store to the word of the next
+/// instruction, squashes the fetch of that cycle. A counter is updated at the
+/// end of the cycle its branch executes, which is the first fetch cycle of
+/// the next instruction.
+class PipelineModel {
+public:
+  static constexpr size_t BHT_ENTRIES = 256;
+  /// The bits of an address in the core, hex_pkg::MEM_ADDR_WIDTH.
+  static constexpr uint32_t PC_MASK = (1U << 21) - 1;
+  /// The bits of a word address in the core.
+  static constexpr uint32_t WORD_MASK = PC_MASK >> 2;
+
+private:
+  std::array<uint8_t, BHT_ENTRIES> counters;
+
+  // The instruction being fetched.
+  bool fetching;
+  uint32_t startPC;
+  uint32_t oreg;
+
+  // The counter update of the last instruction, and whether it redirected
+  // fetch.
+  bool pendingUpdate;
+  size_t pendingIndex;
+  bool pendingTaken;
+  bool lastRedirected;
+
+  // Counters.
+  uint64_t cycles;
+  uint64_t instrs;
+  uint64_t fetchCycles;
+  uint64_t branches;
+  uint64_t branchMispredicts;
+  uint64_t indirectMispredicts;
+  uint64_t storeRefetches;
+
+  void update() {
+    auto &counter = counters[pendingIndex];
+    if (pendingTaken && counter < 3) {
+      counter++;
+    } else if (!pendingTaken && counter > 0) {
+      counter--;
+    }
+    pendingUpdate = false;
+  }
+
+public:
+  PipelineModel() :
+      fetching(false), startPC(0), oreg(0), pendingUpdate(false),
+      pendingIndex(0), pendingTaken(false), lastRedirected(false),
+      cycles(0), instrs(0), fetchCycles(0), branches(0),
+      branchMispredicts(0), indirectMispredicts(0), storeRefetches(0) {
+    // Weakly not taken, as on reset.
+    counters.fill(1);
+  }
+
+  /// Account for an executed byte, given its address, the values of areg and
+  /// breg before it executed and the address that followed it.
+  void step(uint32_t pc, uint8_t instr, uint32_t areg, uint32_t breg,
+            uint32_t nextPC) {
+    if (!fetching) {
+      startPC = pc;
+      fetching = true;
+    }
+    auto opcode = static_cast<hex::Instr>((instr >> 4) & 0xF);
+    oreg = oreg | (instr & 0xF);
+    if (opcode == hex::Instr::PFIX) {
+      oreg = oreg << 4;
+      return;
+    }
+    if (opcode == hex::Instr::NFIX) {
+      oreg = 0xFFFFFF00 | (oreg << 4);
+      return;
+    }
+    uint32_t operand = oreg;
+    oreg = 0;
+    fetching = false;
+    uint64_t words = (pc >> 2) - (startPC >> 2) + 1;
+    // Apply the last update before the lookup if it was written before the
+    // final fetch cycle of this instruction.
+    if (pendingUpdate && (words > 1 || lastRedirected)) {
+      update();
+    }
+    uint32_t fallThrough = (pc + 1) & PC_MASK;
+    uint32_t target = (fallThrough + operand) & PC_MASK;
+    uint32_t predicted = fallThrough;
+    size_t index = pc & (BHT_ENTRIES - 1);
+    bool conditional = opcode == hex::Instr::BRZ || opcode == hex::Instr::BRN;
+    if (opcode == hex::Instr::BR ||
+        (conditional && counters[index] >= 2)) {
+      predicted = target;
+    }
+    if (pendingUpdate) {
+      update();
+    }
+    if (conditional) {
+      pendingUpdate = true;
+      pendingIndex = index;
+      pendingTaken = opcode == hex::Instr::BRZ ? areg == 0 : static_cast<int32_t>(areg) < 0;
+    }
+    bool mispredicted = predicted != (nextPC & PC_MASK);
+    if (conditional) {
+      branches++;
+      branchMispredicts += mispredicted;
+    } else if (mispredicted) {
+      indirectMispredicts++;
+    }
+    // Fetch reads the word of the next instruction while a store executes.
+    bool storeHazard = false;
+    if (opcode == hex::Instr::STAM || opcode == hex::Instr::STAI) {
+      uint32_t address = opcode == hex::Instr::STAM ? operand : breg + operand;
+      storeHazard = (address & WORD_MASK) == ((nextPC & PC_MASK) >> 2);
+      storeRefetches += storeHazard;
+    }
+    lastRedirected = mispredicted || storeHazard;
+    instrs++;
+    fetchCycles += words;
+    cycles += words + lastRedirected;
+  }
+
+  /// The cycles to the last instruction entering execute, which is when the
+  /// testbench stops on an exit.
+  uint64_t getCycles() const {
+    return cycles - lastRedirected;
+  }
+  uint64_t getInstrs() const { return instrs; }
+  uint64_t getStoreRefetches() const { return storeRefetches; }
+
+  /// Print the predicted cycles and CPI, and the speedup over the multi-cycle
+  /// core, which takes a cycle for each byte.
+  void report(std::ostream &out, size_t byteCycles) const {
+    auto ratio = [](double a, double b) { return b ? a / b : 0.0; };
+    out << "Pipelined core model:\n";
+    out << boost::format("  %-20s %d\n") % "Cycles" % getCycles();
+    out << boost::format("  %-20s %d\n") % "Instructions" % instrs;
+    out << boost::format("  %-20s %.3f\n") % "CPI" % ratio(getCycles(), instrs);
+    out << boost::format("  %-20s %d\n") % "Fetch cycles" % fetchCycles;
+    out << boost::format("  %-20s %d of %d (%.1f%%)\n") % "Branch mispredicts"
+             % branchMispredicts % branches % (100.0 * ratio(branchMispredicts, branches));
+    out << boost::format("  %-20s %d\n") % "Indirect mispredicts" % indirectMispredicts;
+    out << boost::format("  %-20s %d\n") % "Store refetches" % storeRefetches;
+    out << boost::format("  %-20s %d\n") % "Multi-cycle cycles" % byteCycles;
+    out << boost::format("  %-20s %.3f\n") % "Speedup" % ratio(byteCycles, getCycles());
+  }
+};
+
+} // End namespace hexsim
+
+#endif // HEX_SIM_TIMING_HPP
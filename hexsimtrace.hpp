@@ -0,0 +1,407 @@
+#ifndef HEX_SIM_TRACE_HPP
+#define HEX_SIM_TRACE_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/format.hpp>
+
+#include "hex.hpp"
+#include "hexsimsymbols.hpp"
+
+namespace hexsim {
+
+/// The kinds of trace record.
+enum class TraceKind : uint8_t {
+  INSTR,
+  SYSCALL
+};
+
+/// A fixed-size trace record. An INSTR record holds the state seen by an
+/// instruction byte before it executes, with oreg including the byte's
+/// operand, and the memory address and value it loads or stores. A SYSCALL
+/// record follows the OPR SVC that made the call, with the syscall number in
+/// instr and its operand address and value. For the block syscalls, the
+/// address is the start of the block, value is the number of words
+/// transferred and oreg is the stream.
+struct TraceRecord {
+  uint64_t cycle;
+  uint32_t pc;
+  uint32_t oreg;
+  uint32_t areg;
+  uint32_t breg;
+  uint32_t address;
+  uint32_t value;
+  uint8_t instr;
+  TraceKind kind;
+
+  /// Create the record of an instruction byte from the processor state.
+  static TraceRecord instruction(uint64_t cycle, uint32_t pc, uint8_t instr,
+                                 uint32_t oreg, uint32_t areg, uint32_t breg,
+                                 const uint32_t *memory, size_t memorySize) {
+    TraceRecord record{cycle, pc, oreg, areg, breg, 0, 0, instr, TraceKind::INSTR};
+    switch (static_cast<hex::Instr>((instr >> 4) & 0xF)) {
+      case hex::Instr::LDAM:
+      case hex::Instr::LDBM:
+        record.address = oreg;
+        record.value = oreg < memorySize ? memory[oreg] : 0;
+        break;
+      case hex::Instr::LDAI:
+        record.address = areg + oreg;
+        record.value = record.address < memorySize ? memory[record.address] : 0;
+        break;
+      case hex::Instr::LDBI:
+        record.address = breg + oreg;
+        record.value = record.address < memorySize ? memory[record.address] : 0;
+        break;
+      case hex::Instr::STAM:
+        record.address = oreg;
+        record.value = areg;
+        break;
+      case hex::Instr::STAI:
+        record.address = breg + oreg;
+        record.value = areg;
+        break;
+      default:
+        break;
+    }
+    return record;
+  }
+
+  /// Create the record of a syscall.
+  static TraceRecord syscall(uint64_t cycle, uint32_t pc, hex::Syscall number,
+                             uint32_t address, uint32_t value) {
+    return TraceRecord{cycle, pc, 0, 0, 0, address, value,
+                       static_cast<uint8_t>(number), TraceKind::SYSCALL};
+  }
+};
+
+/// The header of a trace file, followed by the symbol table and the records.
+/// The records are either fixed-size copies of TraceRecord or, when
+/// compressed, the difference of each field from the previous record as
+/// zigzag varints, which is one byte for most fields of most records.
+constexpr char TRACE_MAGIC[8] = {'H', 'E', 'X', 'T', 'R', 'A', 'C', 'E'};
+constexpr uint32_t TRACE_VERSION = 1;
+constexpr uint32_t TRACE_COMPRESSED = 1;
+constexpr size_t TRACE_BUFFER_SIZE = 1 << 16;
+
+/// Write trace records to a file through a buffer.
+class TraceWriter {
+
+  std::ofstream file;
+  std::vector<char> buffer;
+  bool compressed;
+  TraceRecord last;
+
+  void put(const void *data, size_t size) {
+    if (buffer.size() + size > TRACE_BUFFER_SIZE) {
+      flush();
+    }
+    auto bytes = static_cast<const char*>(data);
+    buffer.insert(buffer.end(), bytes, bytes + size);
+  }
+
+  void putWord(uint32_t value) {
+    put(&value, sizeof(uint32_t));
+  }
+
+  void putVarint(uint64_t value) {
+    char bytes[10];
+    size_t length = 0;
+    while (value >= 0x80) {
+      bytes[length++] = static_cast<char>(value | 0x80);
+      value >>= 7;
+    }
+    bytes[length++] = static_cast<char>(value);
+    put(bytes, length);
+  }
+
+  void putDelta(uint32_t value, uint32_t previous) {
+    int32_t delta = static_cast<int32_t>(value - previous);
+    putVarint((static_cast<uint32_t>(delta) << 1) ^ static_cast<uint32_t>(delta >> 31));
+  }
+
+public:
+
+  TraceWriter(const char *filename, const SymbolIndex &symbols, bool compressed) :
+      file(filename, std::ios::binary), compressed(compressed), last() {
+    if (!file) {
+      throw std::runtime_error(std::string("could not open trace file ")+filename);
+    }
+    buffer.reserve(TRACE_BUFFER_SIZE);
+    put(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    putWord(TRACE_VERSION);
+    putWord(compressed ? TRACE_COMPRESSED : 0);
+    putWord(symbols.size());
+    for (size_t i=0; i<symbols.size(); i++) {
+      putWord(symbols[i].offset);
+      putWord(symbols[i].name.size());
+      put(symbols[i].name.data(), symbols[i].name.size());
+    }
+  }
+
+  ~TraceWriter() {
+    flush();
+  }
+
+  void write(const TraceRecord &record) {
+    if (!compressed) {
+      // Copy the fields so that the padding is written as zeros.
+      TraceRecord copy;
+      std::memset(&copy, 0, sizeof(TraceRecord));
+      copy.cycle = record.cycle;
+      copy.pc = record.pc;
+      copy.oreg = record.oreg;
+      copy.areg = record.areg;
+      copy.breg = record.breg;
+      copy.address = record.address;
+      copy.value = record.value;
+      copy.instr = record.instr;
+      copy.kind = record.kind;
+      put(&copy, sizeof(TraceRecord));
+      return;
+    }
+    putVarint(record.cycle - last.cycle);
+    putDelta(record.pc, last.pc);
+    putDelta(record.oreg, last.oreg);
+    putDelta(record.areg, last.areg);
+    putDelta(record.breg, last.breg);
+    putDelta(record.address, last.address);
+    putDelta(record.value, last.value);
+    char bytes[2] = {static_cast<char>(record.instr), static_cast<char>(record.kind)};
+    put(bytes, sizeof(bytes));
+    last = record;
+  }
+
+  void flush() {
+    file.write(buffer.data(), buffer.size());
+    file.flush();
+    buffer.clear();
+  }
+};
+
+/// Read the records of a trace file.
+class TraceReader {
+
+  std::ifstream file;
+  SymbolIndex symbols;
+  bool compressed;
+  TraceRecord last;
+
+  uint32_t getWord() {
+    uint32_t value = 0;
+    file.read(reinterpret_cast<char*>(&value), sizeof(uint32_t));
+    return value;
+  }
+
+  uint64_t getVarint() {
+    uint64_t value = 0;
+    for (unsigned shift=0; shift<64; shift+=7) {
+      int byte = file.get();
+      if (byte == std::char_traits<char>::eof()) {
+        break;
+      }
+      value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+      if ((byte & 0x80) == 0) {
+        break;
+      }
+    }
+    return value;
+  }
+
+  uint32_t getDelta(uint32_t previous) {
+    uint32_t zigzag = static_cast<uint32_t>(getVarint());
+    uint32_t delta = (zigzag >> 1) ^ (0U - (zigzag & 1));
+    return previous + delta;
+  }
+
+public:
+
+  TraceReader(const char *filename) :
+      file(filename, std::ios::binary), last() {
+    if (!file) {
+      throw std::runtime_error(std::string("could not open trace file ")+filename);
+    }
+    char magic[sizeof(TRACE_MAGIC)];
+    file.read(magic, sizeof(magic));
+    if (!file || std::memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+      throw std::runtime_error(std::string("not a trace file ")+filename);
+    }
+    if (getWord() != TRACE_VERSION) {
+      throw std::runtime_error(std::string("unsupported trace version in ")+filename);
+    }
+    compressed = getWord() & TRACE_COMPRESSED;
+    uint32_t numSymbols = getWord();
+    // Read the names, then index them as the symbols of a binary.
+    std::vector<std::string> names(numSymbols);
+    std::vector<uint32_t> offsets(numSymbols);
+    for (size_t i=0; i<numSymbols; i++) {
+      offsets[i] = getWord();
+      names[i].resize(getWord());
+      file.read(&names[i][0], names[i].size());
+    }
+    std::vector<hex::BinaryImage::Symbol> binarySymbols;
+    for (size_t i=0; i<numSymbols; i++) {
+      binarySymbols.push_back(hex::BinaryImage::Symbol{names[i], offsets[i]});
+    }
+    symbols.build(binarySymbols);
+  }
+
+  SymbolIndex &getSymbols() { return symbols; }
+
+  /// Read the next record, returning false at the end of the trace.
+  bool next(TraceRecord &record) {
+    if (!compressed) {
+      file.read(reinterpret_cast<char*>(&record), sizeof(TraceRecord));
+      return file.gcount() == sizeof(TraceRecord);
+    }
+    if (file.peek() == std::char_traits<char>::eof()) {
+      return false;
+    }
+    record.cycle = last.cycle + getVarint();
+    record.pc = getDelta(last.pc);
+    record.oreg = getDelta(last.oreg);
+    record.areg = getDelta(last.areg);
+    record.breg = getDelta(last.breg);
+    record.address = getDelta(last.address);
+    record.value = getDelta(last.value);
+    record.instr = static_cast<uint8_t>(file.get());
+    record.kind = static_cast<TraceKind>(file.get());
+    if (!file) {
+      return false;
+    }
+    last = record;
+    return true;
+  }
+};
+
+/// Print trace records in the human-readable format of hexsim --trace.
+class TracePrinter {
+
+  std::ostream &out;
+  SymbolIndex &symbols;
+
+public:
+
+  TracePrinter(std::ostream &out, SymbolIndex &symbols) :
+      out(out), symbols(symbols) {}
+
+  void print(const TraceRecord &record) {
+    if (record.kind == TraceKind::SYSCALL) {
+      printSyscall(record);
+    } else {
+      printInstr(record);
+    }
+  }
+
+  void printSyscall(const TraceRecord &record) {
+    switch (static_cast<hex::Syscall>(record.instr)) {
+      case hex::Syscall::EXIT:
+        out << boost::format("exit %d\n") % record.value;
+        break;
+      case hex::Syscall::WRITE:
+        out << boost::format("write %d to simout(%d)\n") % record.value % record.address;
+        break;
+      case hex::Syscall::READ:
+        out << boost::format("read %d to mem[%08x]\n") % record.value % record.address;
+        break;
+      case hex::Syscall::WRITEBLOCK:
+        out << boost::format("write %d words from mem[%08x] to simout(%d)\n")
+                 % record.value % record.address % record.oreg;
+        break;
+      case hex::Syscall::READBLOCK:
+        out << boost::format("read %d words to mem[%08x] from simin(%d)\n")
+                 % record.value % record.address % record.oreg;
+        break;
+      default: break;
+    }
+  }
+
+  void printInstr(const TraceRecord &record) {
+    auto instrEnum = static_cast<hex::Instr>((record.instr >> 4) & 0xF);
+    uint32_t pc = record.pc + 1;
+    uint32_t oreg = record.oreg;
+    uint32_t areg = record.areg;
+    uint32_t breg = record.breg;
+    if (!symbols.empty()) {
+      size_t symbol = symbols.lookup(record.pc);
+      std::string symbolInfo;
+      if (symbol != SymbolIndex::NONE) {
+        auto symbolOffset = record.pc - symbols[symbol].offset;
+        symbolInfo = (boost::format("%s+%d") % symbols[symbol].name % symbolOffset).str();
+      }
+      out << boost::format("%-6d %-6d %-12s %-4s %-2d ")
+               % record.cycle % record.pc % symbolInfo % instrEnumToStr(instrEnum) % (record.instr & 0xF);
+    } else {
+      out << boost::format("%-6d %-6d %-4s %-2d ")
+               % record.cycle % record.pc % instrEnumToStr(instrEnum) % (record.instr & 0xF);
+    }
+    switch (instrEnum) {
+      case hex::Instr::LDAM:
+        out << boost::format("areg = mem[oreg (%#08x)] (%d)\n") % oreg % record.value;
+        break;
+      case hex::Instr::LDBM:
+        out << boost::format("breg = mem[oreg (%#08x)] (%d)\n") % oreg % record.value;
+        break;
+      case hex::Instr::STAM:
+        out << boost::format("mem[oreg (%#08x)] = areg %d\n") % oreg % areg;
+        break;
+      case hex::Instr::LDAC:
+        out << boost::format("areg = oreg %d\n") % oreg;
+        break;
+      case hex::Instr::LDBC:
+        out << boost::format("breg = oreg %d\n") % oreg;
+        break;
+      case hex::Instr::LDAP:
+        out << boost::format("areg = pc (%d) + oreg (%d) %d\n") % pc % oreg % (pc + oreg);
+        break;
+      case hex::Instr::LDAI:
+        out << boost::format("areg = mem[areg (%d) + oreg (%d) = %#08x] (%d)\n") % areg % oreg % (areg+oreg) % record.value;
+        break;
+      case hex::Instr::LDBI:
+        out << boost::format("breg = mem[breg (%d) + oreg (%d) = %#08x] (%d)\n") % breg % oreg % (breg+oreg) % record.value;
+        break;
+      case hex::Instr::STAI:
+        out << boost::format("mem[breg (%d) + oreg (%d) = %#08x] = areg (%d)\n") % breg % oreg % (breg+oreg) % areg;
+        break;
+      case hex::Instr::BR:
+        out << boost::format("pc = pc + oreg (%d) (%#08x)\n") % oreg % (pc + oreg);
+        break;
+      case hex::Instr::BRZ:
+        out << boost::format("pc = areg == zero ? pc + oreg (%d) (%#08x) : pc\n") % oreg % (pc + oreg);
+        break;
+      case hex::Instr::BRN:
+        out << boost::format("pc = areg < zero ? pc + oreg (%d) (%#08x) : pc\n") % oreg % (pc + oreg);
+        break;
+      case hex::Instr::PFIX:
+        out << boost::format("oreg = oreg (%d) << 4 (%#08x)\n") % oreg % (oreg << 4);
+        break;
+      case hex::Instr::NFIX:
+        out << boost::format("oreg = 0xFFFFFF00 | oreg (%d) << 4 (%#08x)\n") % oreg % (0xFFFFFF00 | (oreg << 4));
+        break;
+      case hex::Instr::OPR:
+        switch (static_cast<hex::OprInstr>(oreg)) {
+          case hex::OprInstr::BRB:
+            out << boost::format("BRB pc = breg (%#08x)\n") % breg;
+            break;
+          case hex::OprInstr::ADD:
+           out << boost::format("ADD areg = areg (%d) + breg (%d) (%d)\n") % areg % breg % (areg + breg);
+            break;
+          case hex::OprInstr::SUB:
+           out << boost::format("SUB areg = areg (%d) - breg (%d) (%d)\n") % areg % breg % (areg - breg);
+            break;
+          case hex::OprInstr::SVC:
+            break;
+        };
+        break;
+    }
+  }
+};
+
+} // End namespace hexsim
+
+#endif // HEX_SIM_TRACE_HPP
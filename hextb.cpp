@@ -3,6 +3,7 @@
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <sstream>
 #include <exception>
 #include <boost/format.hpp>
 #include <verilated.h>
@@ -12,76 +13,136 @@
 #include "Vhex_pkg_memory.h"
 #include "Vhex_pkg_processor.h"
 #include "hex.hpp"
+#include "hexbinary.hpp"
+#include "hexsim.hpp"
 #include "hexsimio.hpp"
+#include "hexsimsnapshot.hpp"
+#include "hexsimsymbols.hpp"
+#include "hexsimtrace.hpp"
 
 double sc_time_stamp() { return 0; }
 
-constexpr size_t RESET_BEGIN = 1;
-constexpr size_t RESET_END = 10;
+/// The bits of a pc in the model, hex_pkg::MEM_ADDR_WIDTH.
+constexpr uint32_t PC_MASK = (1U << 21) - 1;
 
-hex::HexSimIO io(std::cin, std::cout);
+hex::HexSimIO *io;
+hexsim::SymbolIndex symbols;
+std::unique_ptr<hexsim::TraceWriter> traceWriter;
+std::unique_ptr<hexsim::Snapshot> snapshot;
 
 void load(const char *filename,
           const std::unique_ptr<Vhex_pkg> &top) {
+  hex::BinaryImage binary(filename);
+  size_t programSize = binary.getProgramSizeBytes();
 
-  // Load the binary file.
-  std::streampos fileSize;
-  std::ifstream file(filename, std::ios::binary);
-
-  // Get length of file.
-  file.seekg(0, std::ios::end);
-  fileSize = file.tellg();
-  file.seekg(0, std::ios::beg);
-
-  // Check the file length matches.
-  unsigned remainingFileSize = static_cast<unsigned>(fileSize) - 4;
-  remainingFileSize = (remainingFileSize + 3U) & ~3U; // Round up to multiple of 4.
-  unsigned programSize;
-  file.read(reinterpret_cast<char*>(&programSize), 4);
-  programSize <<= 2;
-  if (programSize != remainingFileSize) {
-    std::cerr << boost::format("Warning: mismatching program size %d != %d\n")
-                   % programSize % remainingFileSize;
+  // Write program to DUT memory.
+  auto &memory = top->hex->u_memory->memory_q;
+  if (programSize > sizeof(memory)) {
+    throw std::runtime_error("program of "+std::to_string(programSize)+
+                             " bytes does not fit in memory");
   }
+  std::memcpy(memory.data(), binary.getWords(), programSize);
 
-  // Read the file contents.
-  std::vector<uint32_t> buffer(remainingFileSize);
-  file.read(reinterpret_cast<char*>(buffer.data()), remainingFileSize);
-
-  // Write program to DUT memory.
-  std::memcpy(top->hex->u_memory->memory_q.data(), buffer.data(), buffer.size());
+  // The symbols of a binary trace.
+  symbols.build(binary.getSymbols());
 
   std::cout << "Wrote " << programSize << " bytes to memory\n";
 }
 
+/// Replace the memory contents and channel positions with those of a state.
+void restoreMemory(const hexsim::Snapshot &state,
+                   const std::unique_ptr<Vhex_pkg> &top) {
+  auto &memory = top->hex->u_memory->memory_q;
+  std::memset(memory.data(), 0, sizeof(memory));
+  state.getMemory(memory.data(), sizeof(memory) / sizeof(uint32_t));
+  io->setInputPositions(state.inputPositions);
+  io->setOutputPositions(state.outputPositions);
+}
+
+/// Replace the memory contents with those of a snapshot.
+void loadSnapshot(const char *filename,
+                  const std::unique_ptr<Vhex_pkg> &top) {
+  snapshot = std::make_unique<hexsim::Snapshot>();
+  snapshot->read(filename);
+  restoreMemory(*snapshot, top);
+}
+
 void handleSyscall(hex::Syscall syscall,
                    const std::unique_ptr<Vhex_pkg> &top,
                    int &exitCode,
-                   bool trace) {
+                   bool trace,
+                   uint64_t cycle,
+                   uint32_t pc) {
   unsigned spWordIndex = top->hex->u_memory->memory_q[1];
   switch (syscall) {
     case hex::Syscall::EXIT:
       exitCode = top->hex->u_memory->memory_q[spWordIndex+2];
-      if (trace) {
+      io->flush();
+      if (traceWriter) {
+        traceWriter->write(hexsim::TraceRecord::syscall(cycle, pc, syscall, 0, exitCode));
+      } else if (trace) {
         std::cout << boost::format("exit %d\n") % exitCode;
       }
       break;
     case hex::Syscall::WRITE: {
       char value = top->hex->u_memory->memory_q[spWordIndex+2];
       int stream = top->hex->u_memory->memory_q[spWordIndex+3];
-      if (trace) {
+      if (traceWriter) {
+        traceWriter->write(hexsim::TraceRecord::syscall(cycle, pc, syscall, stream,
+                                                        top->hex->u_memory->memory_q[spWordIndex+2]));
+      } else if (trace) {
         std::cout << boost::format("output(%c, %d)\n") % value % stream;
       }
-      io.output(value, stream);
+      io->output(value, stream);
       break;
     }
     case hex::Syscall::READ: {
       int stream = top->hex->u_memory->memory_q[spWordIndex+2];
-      if (trace) {
+      if (trace && !traceWriter) {
         std::cout << boost::format("input(%d)\n") % stream;
       }
       // Truncated inputs (ie not sign extended).
-      top->hex->u_memory->memory_q[spWordIndex+1] = io.input(stream) & 0xFF;
+      top->hex->u_memory->memory_q[spWordIndex+1] = io->input(stream) & 0xFF;
+      if (traceWriter) {
+        traceWriter->write(hexsim::TraceRecord::syscall(cycle, pc, syscall, spWordIndex+1,
+                                                        top->hex->u_memory->memory_q[spWordIndex+1]));
+      }
+      break;
+    }
+    case hex::Syscall::WRITEBLOCK:
+    case hex::Syscall::READBLOCK: {
+      auto &memory = top->hex->u_memory->memory_q;
+      uint32_t address = memory[spWordIndex+2];
+      uint32_t length = memory[spWordIndex+3];
+      int stream = memory[spWordIndex+4];
+      size_t memorySize = sizeof(memory) / sizeof(uint32_t);
+      if (address > memorySize || length > memorySize - address) {
+        throw std::runtime_error("block syscall outside memory");
+      }
+      std::vector<char> buffer(length);
+      size_t count = length;
+      if (syscall == hex::Syscall::WRITEBLOCK) {
+        for (size_t i=0; i<length; i++) {
+          buffer[i] = memory[address+i];
+        }
+        io->output(buffer.data(), length, stream);
+      } else {
+        count = io->input(buffer.data(), length, stream);
+        // Truncated inputs (ie not sign extended).
+        for (size_t i=0; i<count; i++) {
+          memory[address+i] = buffer[i] & 0xFF;
+        }
+      }
+      memory[spWordIndex+1] = count;
+      if (traceWriter) {
+        auto record = hexsim::TraceRecord::syscall(cycle, pc, syscall, address, count);
+        record.oreg = stream;
+        traceWriter->write(record);
+      } else if (trace) {
+        std::cout << boost::format("%s(%d, %d, %d)\n")
+                       % (syscall == hex::Syscall::WRITEBLOCK ? "outputblock" : "inputblock")
+                       % address % length % stream;
+      }
       break;
     }
     default:
@@ -89,58 +150,361 @@ void handleSyscall(hex::Syscall syscall,
   }
 }
 
+/// Seed the architectural state directly, instead of simulating reset
+/// cycles: the registers are zero or those of a snapshot, and the logic is
+/// settled so the first instruction is visible before the first edge. The
+/// registers and memory are public_flat_rw, so eval() re-evaluates the logic
+/// that reads them after they are written, also when a co-simulation replay
+/// seeds a model that has already run.
+void reset(const std::unique_ptr<Vhex_pkg> &top,
+           const hexsim::Snapshot *state) {
+  auto processor = top->hex->u_processor;
+  top->i_clk = 0;
+#if HEX_PIPELINED
+  // Reset the branch history, then start fetching from the pc.
+  top->i_rst = 1;
+  top->eval();
+  top->i_rst = 0;
+  processor->fpc_q = state ? state->pc : 0;
+  processor->foreg_q = state ? state->oreg : 0;
+  processor->valid_q = 0;
+#else
+  top->i_rst = 0;
+  processor->pc_q = state ? state->pc : 0;
+  processor->oreg_q = state ? state->oreg : 0;
+#endif
+  processor->areg_q = state ? state->areg : 0;
+  processor->breg_q = state ? state->breg : 0;
+  top->eval();
+}
+
+/// Whether an instruction is about to execute, which is every cycle of the
+/// multi-cycle core, and every cycle without a bubble in the pipelined core,
+/// whose instructions include their prefixes.
+inline bool executing(const std::unique_ptr<Vhex_pkg> &top) {
+#if HEX_PIPELINED
+  return top->hex->u_processor->valid_q;
+#else
+  (void)top;
+  return true;
+#endif
+}
+
+/// Advance one clock cycle, evaluating the rising and falling edges.
+inline void tick(VerilatedContext *contextp, Vhex_pkg *top) {
+  contextp->timeInc(1);
+  top->i_clk = 1;
+  top->eval();
+  contextp->timeInc(1);
+  top->i_clk = 0;
+  top->eval();
+}
+
+/// Trace the instruction about to execute, numbering records from the
+/// first instruction so they line up with hexsim --trace-bin.
+void traceInstruction(const std::unique_ptr<VerilatedContext> &contextp,
+                      const std::unique_ptr<Vhex_pkg> &top,
+                      uint64_t count) {
+  auto processor = top->hex->u_processor;
+  if (traceWriter) {
+    auto &memory = top->hex->u_memory->memory_q;
+    traceWriter->write(hexsim::TraceRecord::instruction(
+        count, processor->pc_q, processor->instr,
+        processor->oreg_q | (processor->instr & 0xF),
+        processor->areg_q, processor->breg_q,
+        memory.data(), sizeof(memory) / sizeof(uint32_t)));
+  } else {
+    auto instr = instrEnumToStr(static_cast<hex::Instr>((processor->instr >> 4) & 0xF));
+    std::cout << boost::format("[%-6d] %-6d 0x%02x %-6s\n")
+                   % contextp->time()
+                   % processor->pc_q
+                   % static_cast<unsigned>(processor->instr)
+                   % instr;
+  }
+}
+
 int run(const std::unique_ptr<VerilatedContext> &contextp,
         const std::unique_ptr<Vhex_pkg> &top,
         bool trace,
-        size_t maxCycles) {
+        size_t maxCycles,
+        bool reportCycles) {
   uint64_t cycle_count = 0;
+  // Like hexsim, run the cycle numbered maxCycles, so traces line up.
+  uint64_t cycle_limit = maxCycles > 0 ? maxCycles + 1 : UINT64_MAX;
+  uint64_t traced_count = snapshot ? snapshot->cycles : 0;
+  bool tracing = trace || traceWriter;
   int exitCode = 0;
 
-  // Set input signals
-  top->i_rst = 0;
-  top->i_clk = 0;
+  // A snapshot of a program that has exited has nothing left to run.
+  if (snapshot && !snapshot->running) {
+    top->final();
+    return snapshot->exitCode;
+  }
 
-  while (!contextp->gotFinish() &&
-         (maxCycles > 0 ? cycle_count <= maxCycles : true)) {
-    contextp->timeInc(1);
-    // Toggle the clock.
-    top->i_clk = !top->i_clk;
-    // Assert reset initially.
-    if (top->i_clk) {
-      if (contextp->time() > RESET_BEGIN && contextp->time() < RESET_END) {
-        top->i_rst = 1; // Assert reset
-      } else {
-        top->i_rst = 0; // Deassert reset
-      }
+  reset(top, snapshot.get());
+
+  while (!contextp->gotFinish() && cycle_count < cycle_limit) {
+    if (tracing && executing(top)) {
+      traceInstruction(contextp, top, traced_count++);
     }
-    // Evaluate the design.
-    top->eval();
-    if (top->i_clk) {
-      cycle_count++;
-    }
-    // Trace
-    if (trace && top->i_clk && contextp->time() > RESET_END) {
-      auto instr = instrEnumToStr(static_cast<hex::Instr>((top->hex->u_processor->instr >> 4) & 0xF));
-      std::cout << boost::format("[%-6d] %-6d 0x%02x %-6s\n")
-                     % contextp->time()
-                     % top->hex->u_processor->pc_q
-                     % static_cast<unsigned>(top->hex->u_processor->instr)
-                     % instr;
-    }
-    // Handle syscalls
-    if (top->i_clk && top->o_syscall_valid) {
+    // Handle a syscall before the SVC instruction executes.
+    if (top->o_syscall_valid) {
       auto syscall = static_cast<hex::Syscall>(top->o_syscall);
-      handleSyscall(syscall, top, exitCode, trace);
+      handleSyscall(syscall, top, exitCode, trace,
+                    traced_count ? traced_count - 1 : 0,
+                    top->hex->u_processor->pc_q);
       if (syscall == hex::Syscall::EXIT) {
         break;
       }
     }
+    tick(contextp.get(), top.get());
+    cycle_count++;
+    // Without tracing, run cycles up to the next syscall, sampling only its
+    // valid signal.
+    if (!tracing) {
+      while (!top->o_syscall_valid && cycle_count < cycle_limit) {
+        tick(contextp.get(), top.get());
+        cycle_count++;
+      }
+    }
   }
 
+  if (reportCycles) {
+    std::cerr << boost::format("Cycles: %d\n") % cycle_count;
+  }
   top->final();
   return exitCode;
 }
 
+//===---------------------------------------------------------------------===//
+// Co-simulation with hexsim.
+//===---------------------------------------------------------------------===//
+
+/// The outcome of running the Verilated model for some cycles.
+struct RunState {
+  bool running;
+  int exitCode;
+  RunState() : running(true), exitCode(0) {}
+};
+
+/// Run the Verilated model for a number of cycles or until the program
+/// exits. The SVC of the exit is executed, so the cycles line up with
+/// hexsim::Processor::stepInstr().
+void runCycles(const std::unique_ptr<VerilatedContext> &contextp,
+               const std::unique_ptr<Vhex_pkg> &top,
+               RunState &state,
+               uint64_t cycles) {
+  for (uint64_t i=0; i<cycles && state.running; i++) {
+    if (top->o_syscall_valid) {
+      auto syscall = static_cast<hex::Syscall>(top->o_syscall);
+      handleSyscall(syscall, top, state.exitCode, false, 0,
+                    top->hex->u_processor->pc_q);
+      state.running = syscall != hex::Syscall::EXIT;
+    }
+    tick(contextp.get(), top.get());
+  }
+}
+
+/// Step hexsim for a number of instructions or until the program exits.
+void stepCycles(hexsim::Processor &processor, uint64_t cycles) {
+  for (uint64_t i=0; i<cycles && processor.isRunning(); i++) {
+    processor.stepInstr();
+  }
+}
+
+/// Compare the architectural state of the Verilated model and hexsim,
+/// returning a description of the differences, which is empty if they
+/// match. Memory is compared word for word, which is cheap next to the
+/// cycles of RTL simulation between checks.
+std::string compareState(const std::unique_ptr<Vhex_pkg> &top,
+                         const RunState &state,
+                         const hexsim::Processor &processor) {
+  std::ostringstream diff;
+  auto rtl = top->hex->u_processor;
+  auto compare = [&](const char *name, uint32_t rtlValue, uint32_t simValue) {
+    if (rtlValue != simValue) {
+      diff << boost::format("  %-7s rtl 0x%08x hexsim 0x%08x\n") % name % rtlValue % simValue;
+    }
+  };
+  compare("running", state.running, processor.isRunning());
+  if (!state.running || !processor.isRunning()) {
+    compare("exit", state.exitCode, processor.getExitCode());
+    return diff.str();
+  }
+  compare("pc", rtl->pc_q, processor.getPC() & PC_MASK);
+  compare("areg", rtl->areg_q, processor.getAreg());
+  compare("breg", rtl->breg_q, processor.getBreg());
+  compare("oreg", rtl->oreg_q, processor.getOreg());
+  auto &memory = top->hex->u_memory->memory_q;
+  auto &simMemory = processor.getMemory();
+  size_t numWords = std::min(sizeof(memory) / sizeof(uint32_t), simMemory.size());
+  if (std::memcmp(memory.data(), simMemory.data(), numWords * sizeof(uint32_t)) != 0) {
+    for (size_t i=0; i<numWords; i++) {
+      if (memory[i] != simMemory[i]) {
+        diff << boost::format("  mem[0x%06x] rtl 0x%08x hexsim 0x%08x\n")
+                  % i % memory[i] % simMemory[i];
+        break;
+      }
+    }
+  }
+  return diff.str();
+}
+
+/// Run the Verilated model and hexsim side by side on the same binary and
+/// input, comparing their state every interval of cycles. hexsim performs
+/// the program's IO, and the model reads the same recorded input and writes
+/// its output to discarded console and "cosim.simout<N>" channels. On a
+/// divergence, both are replayed from the last matching checkpoint, keeping
+/// the state at the midpoint of the interval whenever it still matches,
+/// until the first instruction whose effects differ is found. A replayed
+/// hexsim writes to "cosim.replay.simout<N>" channels, so the program's
+/// output is left as the checked run wrote it.
+class CoSimulation {
+  const std::unique_ptr<VerilatedContext> &contextp;
+  const std::unique_ptr<Vhex_pkg> &top;
+  const char *filename;
+  std::string directory;
+  std::string input;
+  size_t memorySizeWords;
+  uint64_t faultCycle;
+
+  /// The IO of the model and of a replayed hexsim.
+  struct ReplayIO {
+    std::istringstream in;
+    std::ostringstream out;
+    ReplayIO(const std::string &input) : in(input) {}
+  };
+
+  std::unique_ptr<hexsim::Processor> createProcessor(std::istream &in, std::ostream &out,
+                                                     const char *outputName) {
+    auto processor = std::make_unique<hexsim::Processor>(in, out, 0, memorySizeWords);
+    processor->getIO().setDirectory(directory);
+    processor->getIO().setOutputName(outputName);
+    processor->load(filename);
+    return processor;
+  }
+
+  /// Run both models for a number of cycles. If a fault is injected, the
+  /// last word of the model's memory, which programs do not use, is
+  /// corrupted after the instruction at the fault cycle, so the divergence
+  /// is reported at that cycle.
+  void advance(RunState &state, hexsim::Processor &processor, uint64_t cycles) {
+    uint64_t begin = processor.getCycles();
+    if (faultCycle < begin || faultCycle >= begin + cycles) {
+      runCycles(contextp, top, state, cycles);
+    } else {
+      uint64_t before = faultCycle + 1 - begin;
+      runCycles(contextp, top, state, before);
+      top->hex->u_memory->memory_q[memorySizeWords - 1] ^= 1;
+      runCycles(contextp, top, state, cycles - before);
+    }
+    stepCycles(processor, cycles);
+  }
+
+  std::unique_ptr<hex::HexSimIO> createIO(ReplayIO &replayIO) {
+    auto rtlIO = std::make_unique<hex::HexSimIO>(replayIO.in, replayIO.out);
+    rtlIO->setDirectory(directory);
+    rtlIO->setOutputName("cosim.simout");
+    return rtlIO;
+  }
+
+  /// Find the first cycle after a checkpoint at which the models differ,
+  /// given that they do after a number of cycles, and report it.
+  void bisect(const hexsim::Snapshot &checkpoint, uint64_t cycles) {
+    hexsim::Snapshot low = checkpoint;
+    uint64_t lowCycles = 0;
+    uint64_t highCycles = cycles;
+    // Replay both models from the low state for a number of cycles.
+    auto replay = [&](uint64_t count, auto &&inspect) {
+      ReplayIO rtlReplay(input), simReplay(input);
+      auto rtlIO = createIO(rtlReplay);
+      io = rtlIO.get();
+      auto processor = createProcessor(simReplay.in, simReplay.out, "cosim.replay.simout");
+      processor->restoreSnapshot(low);
+      restoreMemory(low, top);
+      reset(top, &low);
+      RunState state;
+      state.running = low.running;
+      state.exitCode = low.exitCode;
+      advance(state, *processor, count);
+      inspect(state, *processor);
+    };
+    while (highCycles - lowCycles > 1) {
+      uint64_t midCycles = lowCycles + (highCycles - lowCycles) / 2;
+      replay(midCycles - lowCycles, [&](RunState &state, hexsim::Processor &processor) {
+        if (compareState(top, state, processor).empty()) {
+          low = processor.getSnapshot();
+          lowCycles = midCycles;
+        } else {
+          highCycles = midCycles;
+        }
+      });
+    }
+    replay(0, [&](RunState &, hexsim::Processor &) {
+      auto pc = top->hex->u_processor->pc_q;
+      auto instr = static_cast<hex::Instr>((top->hex->u_processor->instr >> 4) & 0xF);
+      size_t symbol = symbols.lookup(pc);
+      std::string location = symbol == hexsim::SymbolIndex::NONE ? "" :
+        (boost::format(" (%s+%d)") % symbols[symbol].name % (pc - symbols[symbol].offset)).str();
+      std::cerr << boost::format("Divergence at cycle %d, pc %d%s, %s:\n")
+                     % low.cycles % pc % location % instrEnumToStr(instr);
+    });
+    replay(1, [&](RunState &state, hexsim::Processor &processor) {
+      std::cerr << compareState(top, state, processor);
+    });
+  }
+
+public:
+  CoSimulation(const std::unique_ptr<VerilatedContext> &contextp,
+               const std::unique_ptr<Vhex_pkg> &top,
+               const char *filename,
+               const char *directory,
+               uint64_t faultCycle) :
+      contextp(contextp), top(top), filename(filename),
+      directory(directory ? directory : ""),
+      memorySizeWords(sizeof(top->hex->u_memory->memory_q) / sizeof(uint32_t)),
+      faultCycle(faultCycle) {
+    // Record the input, so each model and replay can read it from the start.
+    input.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+  }
+
+  /// Run to the end of the program or a cycle limit, returning the exit
+  /// code, or 1 on a divergence.
+  int run(const char *resumeFilename, uint64_t interval, uint64_t maxCycles) {
+    ReplayIO rtlInput(input);
+    std::istringstream simInput(input);
+    auto rtlIO = createIO(rtlInput);
+    io = rtlIO.get();
+    auto processor = createProcessor(simInput, std::cout, "simout");
+    if (resumeFilename) {
+      processor->restoreSnapshot(resumeFilename);
+    }
+    auto checkpoint = processor->getSnapshot();
+    restoreMemory(checkpoint, top);
+    reset(top, &checkpoint);
+    RunState state;
+    state.running = checkpoint.running;
+    state.exitCode = checkpoint.exitCode;
+    uint64_t cycles = 0;
+    while (state.running && processor->isRunning() &&
+           (maxCycles > 0 ? cycles < maxCycles : true)) {
+      uint64_t count = maxCycles > 0 ? std::min(interval, maxCycles - cycles) : interval;
+      advance(state, *processor, count);
+      cycles += count;
+      if (!compareState(top, state, *processor).empty()) {
+        processor->getIO().flush();
+        bisect(checkpoint, count);
+        top->final();
+        return 1;
+      }
+      checkpoint = processor->getSnapshot();
+    }
+    processor->getIO().flush();
+    top->final();
+    return state.exitCode;
+  }
+};
+
 static void help(const char **argv) {
   std::cout << "Hex processor testbench\n\n";
   std::cout << "Usage: " << argv[0] << " file\n\n";
@@ -149,7 +513,15 @@ static void help(const char **argv) {
   std::cout << "Optional arguments:\n";
   std::cout << "  -h,--help       Display this message\n";
   std::cout << "  -t,--trace      Enable instruction tracing\n";
+  std::cout << "  --trace-bin FILE Write a binary instruction trace to FILE (see hextrace)\n";
+  std::cout << "  --trace-compress Delta-compress the binary trace\n";
+  std::cout << "  --io-dir DIR    Create and read the simin/simout channel files in DIR\n";
+  std::cout << "  --resume FILE   Start from a hexsim snapshot FILE of the binary\n";
   std::cout << "  --max-cycles N  Limit the number of simulation cycles (default: 0)\n";
+  std::cout << "  --threads N     Size of the thread pool of a multithreaded model\n";
+  std::cout << "  --cosim N       Check the model against hexsim every N cycles\n";
+  std::cout << "  --cosim-fault N Corrupt the model's memory after cycle N of a co-simulation\n";
+  std::cout << "  --cycles        Report the number of cycles simulated on stderr\n";
 }
 
 int main(int argc, const char** argv) {
@@ -157,7 +529,15 @@ int main(int argc, const char** argv) {
     // Handle arguments.
     const char *filename = nullptr;
     bool trace = false;
+    const char *traceFilename = nullptr;
+    bool traceCompress = false;
     size_t maxCycles = 0;
+    const char *resumeFilename = nullptr;
+    unsigned threads = 0;
+    size_t cosimInterval = 0;
+    uint64_t cosimFault = UINT64_MAX;
+    bool reportCycles = false;
+    const char *ioDirectory = nullptr;
     for (int i = 1; i < argc; ++i) {
       if (std::strcmp(argv[i], "-h") == 0 ||
           std::strcmp(argv[i], "--help") == 0) {
@@ -166,8 +546,24 @@ int main(int argc, const char** argv) {
       } else if (std::strcmp(argv[i], "-t") == 0 ||
                  std::strcmp(argv[i], "--trace") == 0) {
         trace = true;
+      } else if (std::strcmp(argv[i], "--trace-bin") == 0) {
+        traceFilename = argv[++i];
+      } else if (std::strcmp(argv[i], "--trace-compress") == 0) {
+        traceCompress = true;
+      } else if (std::strcmp(argv[i], "--io-dir") == 0) {
+        ioDirectory = argv[++i];
+      } else if (std::strcmp(argv[i], "--resume") == 0) {
+        resumeFilename = argv[++i];
       } else if (std::strcmp(argv[i], "--max-cycles") == 0) {
         maxCycles = std::stoull(argv[++i]);
+      } else if (std::strcmp(argv[i], "--threads") == 0) {
+        threads = std::stoul(argv[++i]);
+      } else if (std::strcmp(argv[i], "--cosim") == 0) {
+        cosimInterval = std::stoull(argv[++i]);
+      } else if (std::strcmp(argv[i], "--cosim-fault") == 0) {
+        cosimFault = std::stoull(argv[++i]);
+      } else if (std::strcmp(argv[i], "--cycles") == 0) {
+        reportCycles = true;
       } else if (argv[i][0] == '+') {
         // Skip plusargs.
         continue;
@@ -185,12 +581,35 @@ int main(int argc, const char** argv) {
     const std::unique_ptr<VerilatedContext> contextp{new VerilatedContext};
     contextp->debug(0);
     contextp->randReset(2);
+#if VM_TRACE
     contextp->traceEverOn(true);
+#endif
+    if (threads > 0) {
+      contextp->threads(threads);
+    }
     contextp->commandArgs(argc, argv);
     const std::unique_ptr<Vhex_pkg> top{new Vhex_pkg{contextp.get(), "TOP"}};
     // Run.
     load(filename, top);
-    return run(contextp, top, trace, maxCycles);
+    if (cosimInterval > 0) {
+#if HEX_PIPELINED
+      throw std::runtime_error("co-simulation needs a core that executes a byte each cycle");
+#endif
+      CoSimulation cosim(contextp, top, filename, ioDirectory, cosimFault);
+      return cosim.run(resumeFilename, cosimInterval, maxCycles);
+    }
+    hex::HexSimIO consoleIO(std::cin, std::cout);
+    io = &consoleIO;
+    if (ioDirectory) {
+      io->setDirectory(ioDirectory);
+    }
+    if (resumeFilename) {
+      loadSnapshot(resumeFilename, top);
+    }
+    if (traceFilename) {
+      traceWriter = std::make_unique<hexsim::TraceWriter>(traceFilename, symbols, traceCompress);
+    }
+    return run(contextp, top, trace, maxCycles, reportCycles);
   } catch (std::exception &e) {
     std::cerr << "Error: " << e.what() << "\n";
     return 1;
@@ -0,0 +1,79 @@
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <limits>
+#include <string>
+
+#include "hexsimtrace.hpp"
+
+//===---------------------------------------------------------------------===//
+// Driver
+//===---------------------------------------------------------------------===//
+
+static void help(const char *argv[]) {
+  std::cout << "Hex binary trace decoder\n\n";
+  std::cout << "Usage: " << argv[0] << " file\n\n";
+  std::cout << "Positional arguments:\n";
+  std::cout << "  file A binary trace written by hexsim --trace-bin or hextb --trace-bin\n\n";
+  std::cout << "Optional arguments:\n";
+  std::cout << "  -h,--help       Display this message\n";
+  std::cout << "  --symbol NAME   Only print instructions in the symbol NAME\n";
+  std::cout << "  --from N        Only print from cycle N (default: 0)\n";
+  std::cout << "  --to N          Only print up to and including cycle N\n";
+}
+
+int main(int argc, const char *argv[]) {
+  try {
+    const char *filename = nullptr;
+    const char *symbolName = nullptr;
+    uint64_t fromCycle = 0;
+    uint64_t toCycle = std::numeric_limits<uint64_t>::max();
+    for (int i = 1; i < argc; ++i) {
+      if (std::strcmp(argv[i], "--symbol") == 0) {
+        symbolName = argv[++i];
+      } else if (std::strcmp(argv[i], "--from") == 0) {
+        fromCycle = std::stoull(argv[++i]);
+      } else if (std::strcmp(argv[i], "--to") == 0) {
+        toCycle = std::stoull(argv[++i]);
+      } else if (std::strcmp(argv[i], "-h") == 0 ||
+                 std::strcmp(argv[i], "--help") == 0) {
+        help(argv);
+        return 1;
+      } else {
+        if (!filename) {
+          filename = argv[i];
+        } else {
+          throw std::runtime_error("cannot specify more than one file");
+        }
+      }
+    }
+    // A file must be specified.
+    if (!filename) {
+      help(argv);
+      return 1;
+    }
+    hexsim::TraceReader reader(filename);
+    hexsim::SymbolIndex &symbols = reader.getSymbols();
+    hexsim::TracePrinter printer(std::cout, symbols);
+    hexsim::TraceRecord record;
+    while (reader.next(record)) {
+      if (record.cycle < fromCycle || record.cycle > toCycle) {
+        continue;
+      }
+      if (symbolName) {
+        size_t symbol = symbols.lookup(record.pc);
+        if (symbol == hexsim::SymbolIndex::NONE ||
+            symbols[symbol].name != symbolName) {
+          continue;
+        }
+      }
+      printer.print(record);
+    }
+    return 0;
+  } catch (std::exception &e) {
+    std::cerr << "Error: " << e.what() << "\n";
+    return 1;
+  }
+  return 0;
+}
@@ -27,8 +27,8 @@ module processor (
 	output wire [31:0] o_d_data;
 	input wire [31:0] i_d_data;
 	output wire o_syscall_valid;
-	localparam hex_pkg_SYSCALL_OPC_WIDTH = 2;
-	output wire [1:0] o_syscall;
+	localparam hex_pkg_SYSCALL_OPC_WIDTH = 3;
+	output wire [2:0] o_syscall;
 	reg [20:0] pc_q;
 	reg [31:0] areg_q;
 	reg [31:0] breg_q;
@@ -129,8 +129,8 @@ module processor (
 	end
 	assign o_d_data = areg_q;
 	assign o_syscall_valid = instr_svc;
-	function automatic [1:0] sv2v_cast_6BA3B;
-		input reg [1:0] inp;
+	function automatic [2:0] sv2v_cast_6BA3B;
+		input reg [2:0] inp;
 		sv2v_cast_6BA3B = inp;
 	endfunction
 	assign o_syscall = sv2v_cast_6BA3B(areg_q);
@@ -0,0 +1,171 @@
+"""Benchmarks of the simulator, assembler and compiler, reported as JSON so
+that results can be compared across commits. Run with 'make bench'."""
+
+import argparse
+import datetime
+import json
+import os
+import platform
+import subprocess
+import time
+import definitions as defs
+
+ASM_BINARY = os.path.join(defs.BUILD_PREFIX, 'hexasm')
+SIM_BINARY = os.path.join(defs.BUILD_PREFIX, 'hexsim')
+CMP_BINARY = os.path.join(defs.BUILD_PREFIX, 'xcmp')
+
+ENGINES = ['switch', 'threaded', 'block']
+# The compiled X programs that run long enough for their simulation to
+# dominate start-up, and their inputs.
+X_PROGRAMS = [('xhexb.x', 'xhexb.x'), ('fib.x', b'\x18')]
+XHEXB_OUTPUT = 'tree size: 18631\nprogram size: 17101\nsize: 177105\n'
+
+def best_time(args, data, repeats):
+    # Return the best wall-clock time of several runs, and the last result.
+    best = None
+    for _ in range(repeats):
+        start = time.perf_counter()
+        result = subprocess.run(args, input=data, capture_output=True, check=False)
+        elapsed = time.perf_counter() - start
+        best = elapsed if best is None else min(best, elapsed)
+    return best, result
+
+def parse_fields(text):
+    # Return the values of the 'Name  value' lines of a report.
+    fields = {}
+    for line in text.splitlines():
+        name, _, value = line.rpartition('  ')
+        try:
+            fields[name.strip()] = float(value)
+        except ValueError:
+            pass
+    return fields
+
+def read(filename):
+    with open(filename, 'rb') as infile:
+        return infile.read()
+
+def bench_simulator(programs, repeats):
+    # Simulated MIPS of each engine, counting the instructions (excluding
+    # prefixes) from a run with statistics.
+    results = []
+    for name, binary, data in programs:
+        result = subprocess.run([SIM_BINARY, binary, '--stats'], input=data,
+                                capture_output=True, check=False)
+        fields = parse_fields(result.stderr.decode('utf-8'))
+        for engine in ENGINES:
+            seconds, _ = best_time([SIM_BINARY, binary, '--engine='+engine], data, repeats)
+            results.append({
+                'program': name,
+                'engine': engine,
+                'cycles': int(fields['Cycles']),
+                'instructions': int(fields['Instructions']),
+                'seconds': seconds,
+                'mips': fields['Instructions'] / seconds / 1e6,
+            })
+    return results
+
+def bench_assembler(repeats):
+    # Assembly of xhexb.S, with the times of its phases from the best run.
+    best = None
+    for _ in range(repeats):
+        start = time.perf_counter()
+        result = subprocess.run([ASM_BINARY, defs.XHEXB_SRC, '--stats', '-o', 'bench.bin'],
+                                capture_output=True, check=True)
+        elapsed = time.perf_counter() - start
+        if best is None or elapsed < best[0]:
+            best = (elapsed, parse_fields(result.stderr.decode('utf-8')))
+    seconds, fields = best
+    return {
+        'source': 'xhexb.S',
+        'seconds': seconds,
+        'directives': int(fields['Directives']),
+        'program_bytes': int(fields['Program bytes']),
+        'relax_iterations': int(fields['Relax iterations']),
+        'parse_ms': fields['Parse (ms)'],
+        'resolve_ms': fields['Resolve (ms)'],
+        'emit_ms': fields['Emit (ms)'],
+    }
+
+def bench_compiler(repeats):
+    # Compilation of xhexb.x, with the time of each pass from the best run.
+    source = os.path.join(defs.X_TEST_SRC_PREFIX, 'xhexb.x')
+    best = None
+    for _ in range(repeats):
+        start = time.perf_counter()
+        result = subprocess.run([CMP_BINARY, source, '--time-passes', '-o', 'bench.bin'],
+                                capture_output=True, check=True)
+        elapsed = time.perf_counter() - start
+        if best is None or elapsed < best[0]:
+            best = (elapsed, result.stderr.decode('utf-8'))
+    seconds, report = best
+    passes = {}
+    for line in report.splitlines()[1:]:
+        fields = line.split()
+        if len(fields) >= 2 and fields[0] != 'Total':
+            passes[fields[0]] = float(fields[1])
+    return {
+        'source': 'xhexb.x',
+        'seconds': seconds,
+        'passes_ms': passes,
+        'total_ms': sum(passes.values()),
+    }
+
+def bench_self_hosting(repeats):
+    # Assemble xhexb.S and run it compiling xhexb.x, checking the output.
+    data = read(os.path.join(defs.X_TEST_SRC_PREFIX, 'xhexb.x'))
+    best = None
+    for _ in range(repeats):
+        start = time.perf_counter()
+        subprocess.run([ASM_BINARY, defs.XHEXB_SRC, '-o', 'xhexb.bin'], check=True)
+        result = subprocess.run([SIM_BINARY, 'xhexb.bin'], input=data,
+                                capture_output=True, check=False)
+        elapsed = time.perf_counter() - start
+        best = elapsed if best is None else min(best, elapsed)
+    return {
+        'compiler': 'xhexb.bin',
+        'source': 'xhexb.x',
+        'seconds': best,
+        'passed': result.stdout.decode('utf-8') == XHEXB_OUTPUT,
+    }
+
+def commit():
+    result = subprocess.run(['git', '-C', defs.TEST_SRC_PREFIX, 'rev-parse', 'HEAD'],
+                            capture_output=True, check=False)
+    return result.stdout.decode('utf-8').strip() if result.returncode == 0 else None
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--repeats', type=int, default=3,
+                        help='Runs of each benchmark, of which the fastest is reported')
+    parser.add_argument('--output', default='bench.json',
+                        help='File to write the results to')
+    args = parser.parse_args()
+    # The simulated programs: xhexb.S and the compiled X programs, of which
+    # xhexb.x is given itself as input.
+    xhexb_input = read(os.path.join(defs.X_TEST_SRC_PREFIX, 'xhexb.x'))
+    subprocess.run([ASM_BINARY, defs.XHEXB_SRC, '-o', 'xhexb.bin'], check=True)
+    programs = [('xhexb.S', 'xhexb.bin', xhexb_input)]
+    for filename, data in X_PROGRAMS:
+        binary = 'bench_' + os.path.splitext(filename)[0] + '.bin'
+        subprocess.run([CMP_BINARY, os.path.join(defs.X_TEST_SRC_PREFIX, filename),
+                        '-o', binary], check=True)
+        if filename == data:
+            data = xhexb_input
+        programs.append((filename, binary, data))
+    results = {
+        'commit': commit(),
+        'date': datetime.datetime.now().isoformat(timespec='seconds'),
+        'host': platform.node(),
+        'repeats': args.repeats,
+        'simulator': bench_simulator(programs, args.repeats),
+        'assembler': bench_assembler(args.repeats),
+        'compiler': bench_compiler(args.repeats),
+        'self_hosting': bench_self_hosting(args.repeats),
+    }
+    with open(args.output, 'w') as outfile:
+        json.dump(results, outfile, indent=2)
+    print(json.dumps(results, indent=2))
+
+if __name__ == '__main__':
+    main()
@@ -1,4 +1,5 @@
 import os
+import re
 import subprocess
 import unittest
 import definitions as defs
@@ -6,8 +7,10 @@ import definitions as defs
 ASM_BINARY = os.path.join(defs.INSTALL_PREFIX, 'hexasm')
 SIM_BINARY = os.path.join(defs.INSTALL_PREFIX, 'hexsim')
 VTB_BINARY = os.path.join(defs.INSTALL_PREFIX, 'hextb')
+PTB_BINARY = os.path.join(defs.INSTALL_PREFIX, 'hextb-pipelined')
 CMP_BINARY = os.path.join(defs.INSTALL_PREFIX, 'xcmp')
 RUN_BINARY = os.path.join(defs.INSTALL_PREFIX, 'xrun')
+TRC_BINARY = os.path.join(defs.INSTALL_PREFIX, 'hextrace')
 
 class Tests(unittest.TestCase):
 
@@ -59,12 +62,192 @@ class Tests(unittest.TestCase):
         output = subprocess.run([SIM_BINARY, 'a.out'], input=bytes('x', encoding='utf-8'), capture_output=True)
         self.assertTrue(output.stdout.decode('utf-8') == 'x')
 
+    def test_x_stats(self):
+        # Test that statistics are reported on stderr without changing the output.
+        subprocess.run([CMP_BINARY, os.path.join(defs.X_TEST_SRC_PREFIX, 'hello_putval.x'), '-o', 'a.out'])
+        output = subprocess.run([SIM_BINARY, 'a.out', '--stats'], capture_output=True)
+        self.assertTrue(output.stdout.decode('utf-8') == 'hello world\n')
+        self.assertTrue('MIPS' in output.stderr.decode('utf-8'))
+        self.assertTrue('WRITE' in output.stderr.decode('utf-8'))
+        self.assertTrue('globals' in output.stderr.decode('utf-8'))
+
+    def test_x_profile(self):
+        # Test that a profile attributes cycles and calls to procedures.
+        subprocess.run([CMP_BINARY, os.path.join(defs.X_TEST_SRC_PREFIX, 'hello_prints.x'), '-o', 'a.out'])
+        output = subprocess.run([SIM_BINARY, 'a.out', '--profile', 'profile.folded'], capture_output=True)
+        self.assertTrue(output.stdout.decode('utf-8') == 'hello world\n')
+        self.assertTrue('prints' in output.stderr.decode('utf-8'))
+        with open('profile.folded') as infile:
+            stacks = infile.read()
+        self.assertTrue('[entry];main;prints ' in stacks)
+
+    def test_x_trace_bin(self):
+        # Test that a decoded binary trace matches the text trace.
+        subprocess.run([CMP_BINARY, os.path.join(defs.X_TEST_SRC_PREFIX, 'fac.x'), '-o', 'a.out'])
+        text = subprocess.run([SIM_BINARY, 'a.out', '-t', '--max-cycles', '2000'], input=b'5', capture_output=True)
+        for compress in [[], ['--trace-compress']]:
+            subprocess.run([SIM_BINARY, 'a.out', '--max-cycles', '2000', '--trace-bin', 'a.trace'] + compress, input=b'5')
+            output = subprocess.run([TRC_BINARY, 'a.trace'], capture_output=True)
+            self.assertTrue(output.stdout == text.stdout)
+        # Filter by symbol and cycle range.
+        output = subprocess.run([TRC_BINARY, 'a.trace', '--symbol', 'factorial', '--from', '100', '--to', '200'], capture_output=True)
+        lines = output.stdout.decode('utf-8').splitlines()
+        self.assertTrue(len(lines) > 0)
+        self.assertTrue(all(' factorial+' in line for line in lines))
+        self.assertTrue(all(100 <= int(line.split()[0]) <= 200 for line in lines))
+
+    def test_x_io_dir(self):
+        # Test that channel files can be placed in a directory with another name.
+        os.makedirs('io_dir', exist_ok=True)
+        with open(os.path.join(defs.X_TEST_SRC_PREFIX, 'hello_putval.x'), 'rb') as infile:
+            subprocess.run([SIM_BINARY, 'xhexb.bin', '--io-dir', 'io_dir', '--simout', 'out'], input=infile.read())
+        output = subprocess.run([SIM_BINARY, os.path.join('io_dir', 'out2')], capture_output=True)
+        self.assertTrue(output.stdout.decode('utf-8') == 'hello world\n')
+
+    def test_x_snapshot(self):
+        # Test that resuming from a snapshot part way through a run gives its output.
+        with open(os.path.join(defs.X_TEST_SRC_PREFIX, 'hello_putval.x'), 'rb') as infile:
+            source = infile.read()
+        subprocess.run([SIM_BINARY, 'xhexb.bin', '--snapshot-at', '50000', '--snapshot', 'xhexb.snapshot'], input=source)
+        subprocess.run([SIM_BINARY, 'xhexb.bin', '--resume', 'xhexb.snapshot'], input=source)
+        output = subprocess.run([SIM_BINARY, 'simout2'], capture_output=True)
+        self.assertTrue(output.stdout.decode('utf-8') == 'hello world\n')
+        # Resume after part of the binary has been written to simout2.
+        subprocess.run([SIM_BINARY, 'xhexb.bin', '--snapshot-at', '3000000', '--snapshot', 'xhexb.snapshot'], input=source)
+        self.assertTrue(os.path.getsize('simout2') > 0)
+        subprocess.run([SIM_BINARY, 'xhexb.bin', '--resume', 'xhexb.snapshot'], input=source)
+        output = subprocess.run([SIM_BINARY, 'simout2'], capture_output=True)
+        self.assertTrue(output.stdout.decode('utf-8') == 'hello world\n')
+        # A snapshot after the program exits is not written.
+        os.remove('xhexb.snapshot')
+        output = subprocess.run([SIM_BINARY, 'simout2', '--snapshot-at', '100000000', '--snapshot', 'xhexb.snapshot'], capture_output=True)
+        self.assertTrue('Warning' in output.stderr.decode('utf-8'))
+        self.assertFalse(os.path.exists('xhexb.snapshot'))
+        # A snapshot replaces a cycle limit, so they cannot be combined.
+        output = subprocess.run([SIM_BINARY, 'simout2', '--snapshot-at', '1000', '--max-cycles', '2000'], capture_output=True)
+        self.assertTrue(output.returncode == 1)
+        self.assertTrue('--max-cycles' in output.stderr.decode('utf-8'))
+
+    def test_truncated_binary(self):
+        # Test that a binary shorter than its header's program size is rejected.
+        with open('truncated.bin', 'wb') as outfile:
+            outfile.write((100).to_bytes(4, 'little') + bytes(16))
+        output = subprocess.run([SIM_BINARY, 'truncated.bin'], capture_output=True)
+        self.assertTrue(output.returncode == 1)
+        self.assertTrue('exceeds the file size' in output.stderr.decode('utf-8'))
+
+    def test_memory_size(self):
+        # Test that a memory too small for a program's stack is rejected, and
+        # that an access outside memory is an error rather than a crash.
+        subprocess.run([ASM_BINARY, os.path.join(defs.ASM_TEST_SRC_PREFIX, 'hello.S'), '-o', 'a.bin'])
+        output = subprocess.run([SIM_BINARY, 'a.bin', '--memory-size', '1000'], capture_output=True)
+        self.assertTrue(output.returncode == 1)
+        self.assertTrue('does not hold the stack' in output.stderr.decode('utf-8'))
+        output = subprocess.run([SIM_BINARY, 'a.bin', '--memory-size', '16384'], capture_output=True)
+        self.assertTrue(output.returncode == 1)
+        self.assertTrue('outside memory' in output.stderr.decode('utf-8'))
+
+    def test_x_output_file(self):
+        # Test that binaries are written to the named output files, and that
+        # the temporary files they are written through are renamed.
+        fac_src = os.path.join(defs.X_TEST_SRC_PREFIX, 'fac.x')
+        subprocess.run([CMP_BINARY, fac_src, '-o', 'fac.bin'])
+        subprocess.run([CMP_BINARY, fac_src, '-o', 'a.out'])
+        with open('fac.bin', 'rb') as infile, open('a.out', 'rb') as reference:
+            self.assertTrue(infile.read() == reference.read())
+        self.assertFalse([name for name in os.listdir('.') if name.startswith('fac.bin.tmp')])
+        output = subprocess.run([CMP_BINARY, fac_src, '-o', 'no_dir/fac.bin'], capture_output=True)
+        self.assertTrue(output.returncode == 1)
+
+    def test_x_batch(self):
+        # Test that a batch runs each job and reports whether its output matched.
+        subprocess.run([CMP_BINARY, os.path.join(defs.X_TEST_SRC_PREFIX, 'hello_putval.x'), '-o', 'a.out'])
+        with open('hello.expected', 'w') as outfile:
+            outfile.write('hello world\n')
+        with open('batch.manifest', 'w') as outfile:
+            for _ in range(8):
+                outfile.write('a.out - hello.expected\n')
+            outfile.write('a.out - hello.expected 100\n')
+            outfile.write('missing.bin - hello.expected\n')
+        output = subprocess.run([SIM_BINARY, '--batch', 'batch.manifest', '--jobs', '4'], capture_output=True)
+        lines = output.stdout.decode('utf-8').splitlines()
+        self.assertTrue(output.returncode == 1)
+        self.assertTrue(len(lines) == 10)
+        self.assertTrue(sorted(line.split()[1] for line in lines) == ['FAIL'] * 2 + ['PASS'] * 8)
+        self.assertTrue('missing.bin' in output.stdout.decode('utf-8'))
+
     def test_x_compiler_sim(self):
         # Compile xhexb.x with xhexb.bin on simulator.
         with open(os.path.join(defs.X_TEST_SRC_PREFIX, 'xhexb.x'), 'rb') as infile:
             output = subprocess.run([SIM_BINARY, 'xhexb.bin'], input=infile.read(), capture_output=True)
             self.assertTrue(output.stdout.decode('utf-8') == 'tree size: 18631\nprogram size: 17101\nsize: 177105\n')
 
+    def test_x_compiler_sim_threaded(self):
+        # Compile xhexb.x with xhexb.bin on simulator using the threaded engine.
+        with open(os.path.join(defs.X_TEST_SRC_PREFIX, 'xhexb.x'), 'rb') as infile:
+            output = subprocess.run([SIM_BINARY, 'xhexb.bin', '--engine=threaded'], input=infile.read(), capture_output=True)
+            self.assertTrue(output.stdout.decode('utf-8') == 'tree size: 18631\nprogram size: 17101\nsize: 177105\n')
+
+    def test_x_timing(self):
+        # Test that the pipelined core model is reported on stderr without changing the output.
+        subprocess.run([CMP_BINARY, os.path.join(defs.X_TEST_SRC_PREFIX, 'hello_putval.x'), '-o', 'a.out'])
+        output = subprocess.run([SIM_BINARY, 'a.out', '--timing'], capture_output=True)
+        self.assertTrue(output.stdout.decode('utf-8') == 'hello world\n')
+        self.assertTrue('CPI' in output.stderr.decode('utf-8'))
+        # Statistics and profiles are collected alongside the model.
+        output = subprocess.run([SIM_BINARY, 'a.out', '--timing', '--stats', '--profile', 'profile.folded'], capture_output=True)
+        self.assertTrue(output.stdout.decode('utf-8') == 'hello world\n')
+        self.assertTrue('CPI' in output.stderr.decode('utf-8'))
+        self.assertTrue('WRITE' in output.stderr.decode('utf-8'))
+        with open('profile.folded') as infile:
+            self.assertTrue('[entry];main' in infile.read())
+
+    def test_x_timing_verilator(self):
+        # Test that the pipelined core model counts the cycles of the pipelined RTL.
+        if (defs.USE_VERILATOR):
+            with open(os.path.join(defs.X_TEST_SRC_PREFIX, 'hello_putval.x'), 'rb') as infile:
+                source = infile.read()
+            model = subprocess.run([SIM_BINARY, 'xhexb.bin', '--timing'], input=source, capture_output=True)
+            rtl = subprocess.run([PTB_BINARY, 'xhexb.bin', '--cycles'], input=source, capture_output=True)
+            self.assertTrue(rtl.returncode == 0)
+            model_cycles = int(re.search(r'Pipelined core model:\n\s+Cycles\s+(\d+)', model.stderr.decode('utf-8')).group(1))
+            rtl_cycles = int(re.search(r'Cycles: (\d+)', rtl.stderr.decode('utf-8')).group(1))
+            self.assertTrue(abs(model_cycles - rtl_cycles) <= rtl_cycles // 100)
+            output = subprocess.run([SIM_BINARY, 'simout2'], capture_output=True)
+            self.assertTrue(output.stdout.decode('utf-8') == 'hello world\n')
+        else:
+            pass
+
+    def test_asm_store_next_verilator(self):
+        # Test that the pipelined RTL refetches an instruction its word is stored over.
+        if (defs.USE_VERILATOR):
+            subprocess.run([ASM_BINARY, os.path.join(defs.ASM_TEST_SRC_PREFIX, 'store_next.S'), '-o', 'a.bin'])
+            sim = subprocess.run([SIM_BINARY, 'a.bin'], capture_output=True)
+            rtl = subprocess.run([PTB_BINARY, 'a.bin'], capture_output=True)
+            self.assertTrue(sim.returncode == 151)
+            self.assertTrue(rtl.returncode == sim.returncode)
+        else:
+            pass
+
+    def test_x_compiler_sim_block(self):
+        # Compile xhexb.x with xhexb.bin on simulator using the block engine.
+        with open(os.path.join(defs.X_TEST_SRC_PREFIX, 'xhexb.x'), 'rb') as infile:
+            output = subprocess.run([SIM_BINARY, 'xhexb.bin', '--engine=block'], input=infile.read(), capture_output=True)
+            self.assertTrue(output.stdout.decode('utf-8') == 'tree size: 18631\nprogram size: 17101\nsize: 177105\n')
+
+    def test_x_trace_verilator(self):
+        # Test that the RTL traces the same instructions as hexsim from its first cycle.
+        if (defs.USE_VERILATOR):
+            subprocess.run([CMP_BINARY, os.path.join(defs.X_TEST_SRC_PREFIX, 'fac.x'), '-o', 'a.out'])
+            subprocess.run([SIM_BINARY, 'a.out', '--max-cycles', '2000', '--trace-bin', 'sim.trace'], input=b'5')
+            subprocess.run([VTB_BINARY, 'a.out', '--max-cycles', '2000', '--trace-bin', 'rtl.trace'], input=b'5')
+            sim = subprocess.run([TRC_BINARY, 'sim.trace'], capture_output=True)
+            rtl = subprocess.run([TRC_BINARY, 'rtl.trace'], capture_output=True)
+            self.assertTrue(len(sim.stdout) > 0)
+            self.assertTrue(rtl.stdout == sim.stdout)
+        else:
+            pass
+
     def test_x_compiler_verilator(self):
         # Compile xhexb.x with xhexb.bin on hex RTL.
         if (defs.USE_VERILATOR):
@@ -74,5 +257,29 @@ class Tests(unittest.TestCase):
         else:
             pass
 
+    def test_x_compiler_cosim(self):
+        # Compile xhexb.x with xhexb.bin on hex RTL, checked against hexsim.
+        if (defs.USE_VERILATOR):
+            with open(os.path.join(defs.X_TEST_SRC_PREFIX, 'xhexb.x'), 'rb') as infile:
+                source = infile.read()
+                expected = subprocess.run([SIM_BINARY, 'xhexb.bin'], input=source, capture_output=True)
+                output = subprocess.run([VTB_BINARY, 'xhexb.bin', '--cosim', '1000000'], input=source, capture_output=True)
+                self.assertTrue(output.returncode == expected.returncode)
+                self.assertTrue(output.stdout.decode('utf-8').endswith('tree size: 18631\nprogram size: 17101\nsize: 177105\n'))
+                self.assertTrue('Divergence' not in output.stderr.decode('utf-8'))
+        else:
+            pass
+
+    def test_x_compiler_cosim_fault(self):
+        # Test that a fault injected into the RTL is found at its cycle.
+        if (defs.USE_VERILATOR):
+            with open(os.path.join(defs.X_TEST_SRC_PREFIX, 'xhexb.x'), 'rb') as infile:
+                output = subprocess.run([VTB_BINARY, 'xhexb.bin', '--cosim', '1000000', '--cosim-fault', '1234567'], input=infile.read(), capture_output=True)
+                self.assertTrue(output.returncode == 1)
+                self.assertTrue('Divergence at cycle 1234567,' in output.stderr.decode('utf-8'))
+                self.assertTrue('mem[0x07ffff]' in output.stderr.decode('utf-8'))
+        else:
+            pass
+
 if __name__ == '__main__':
     unittest.main()
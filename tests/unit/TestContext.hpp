@@ -5,6 +5,7 @@
 
 #include "definitions.hpp"
 #include "hexasm.hpp"
+#include "hexcache.hpp"
 #include "hexsim.hpp"
 #include "xcmp.hpp"
 
@@ -15,6 +16,14 @@ struct TestContext {
 
   TestContext() {}
 
+  /// The cache shared by all tests when HEX_CACHE_DIR is set, or null.
+  static hex::BuildCache *getBuildCache() {
+    static std::unique_ptr<hex::BuildCache> cache(
+        hex::BuildCache::getEnvironmentDirectory() ?
+          new hex::BuildCache(hex::BuildCache::getEnvironmentDirectory()) : nullptr);
+    return cache.get();
+  }
+
   /// Return some interesting char values for testing operators.
   const std::vector<char> getCharValues() {
     return {-128, -10, -3, -2, -1, 0, 1, 2, 3, 10, 127};
@@ -54,13 +63,20 @@ struct TestContext {
   int simXBinary(const char *filename,
                  const std::string input={},
                  bool trace=false) {
+    return simXBinary(hexsim::MemoryImage(filename), input, trace);
+  }
+
+  /// Simulate a hex program binary held in memory.
+  int simXBinary(const hexsim::MemoryImage &image,
+                 const std::string input={},
+                 bool trace=false) {
     // Initialise in/out buffers.
     std::istringstream simInBuffer(input);
     simOutBuffer.str("");
     simOutBuffer.clear();
     // Run the program.
     hexsim::Processor processor(simInBuffer, simOutBuffer);
-    processor.load(filename);
+    processor.load(image);
     processor.setTracing(trace);
     processor.setTruncateInputs(false);
     return processor.run();
@@ -107,17 +123,22 @@ struct TestContext {
   int runHexProgramSrc(const std::string program,
                        const std::string input={},
                        bool trace=false) {
-    // Assemble the program.
-    hexasm::Lexer lexer;
-    hexasm::Parser parser(lexer);
-    lexer.loadBuffer(program);
-    fs::path path(CURRENT_BINARY_DIRECTORY);
-    path /= fs::path("a.bin").stem();
-    auto tree = parser.parseProgram();
-    auto codeGen = hexasm::CodeGen(tree);
-    codeGen.emitBin(path.c_str());
+    // Reuse or assemble the program.
+    std::string binary;
+    auto cacheKey = hex::BuildCache::getKey("hexasm", "", program);
+    if (!getBuildCache() || !getBuildCache()->lookup(cacheKey, binary)) {
+      hexasm::Lexer lexer;
+      hexasm::Parser parser(lexer);
+      lexer.loadBuffer(program);
+      auto tree = parser.parseProgram();
+      auto codeGen = hexasm::CodeGen(tree);
+      binary = codeGen.emitBinImage();
+      if (getBuildCache()) {
+        getBuildCache()->store(cacheKey, binary);
+      }
+    }
     // Simulate
-    return simXBinary(path.c_str(), input, trace);
+    return simXBinary(hexsim::MemoryImage(std::move(binary), "program"), input, trace);
   }
 
   /// Run an assembly program.
@@ -176,21 +197,12 @@ struct TestContext {
   int runXProgramSrc(const std::string program,
                      const std::string input={},
                      bool trace=false) {
-    // Compile and assemble the program.
+    // Compile and assemble the program into memory.
     xcmp::Driver driver(std::cout);
-    fs::path path(CURRENT_BINARY_DIRECTORY);
-    path /= fs::path("a.bin");
-    driver.run(xcmp::DriverAction::EMIT_BINARY, program, false, path.c_str());
-    // Initialise in/out buffers.
-    std::istringstream simInBuffer(input);
-    simOutBuffer.str("");
-    simOutBuffer.clear();
-    // Run the program.
-    hexsim::Processor processor(simInBuffer, simOutBuffer);
-    processor.load(path.c_str());
-    processor.setTracing(trace);
-    processor.setTruncateInputs(false);
-    return processor.run();
+    driver.setBuildCache(getBuildCache());
+    driver.run(xcmp::DriverAction::EMIT_BINARY_IMAGE, program, false);
+    // Simulate
+    return simXBinary(hexsim::MemoryImage(std::move(driver.getBinaryImage()), "program"), input, trace);
   }
 
   /// Run an X program from a file.
@@ -34,6 +34,22 @@ EOF
   BOOST_TEST(output == expected);
 }
 
+BOOST_AUTO_TEST_CASE(keyword_prefix_tokens) {
+  auto output = tokHexProgramSrc("BR BRZ BRZ_1 BRB2 LDA LDAMM data SVC").str();
+  std::string expected = ""
+R"(BR
+BRZ
+IDENTIFIER BRZ_1
+IDENTIFIER BRB2
+IDENTIFIER LDA
+IDENTIFIER LDAMM
+IDENTIFIER data
+SVC
+EOF
+)";
+  BOOST_TEST(output == expected);
+}
+
 BOOST_AUTO_TEST_CASE(exit_tree) {
   auto output = asmHexProgramFile(getAsmTestPath("exit0.S"), true).str();
   std::string expected = ""
@@ -77,6 +93,26 @@ BOOST_AUTO_TEST_CASE(hello_procedure_run) {
   BOOST_TEST(simOutBuffer.str() == "hello\n");
 }
 
+BOOST_AUTO_TEST_CASE(label_before_data) {
+  // The alignment of the data moves L0 while the instructions before it are
+  // relaxed, which must not leave the branch to L1 with a stale operand.
+  auto program = "L3\nBR L1\nLDAP L0\nBRN L3\nBRZ L0\nL1\nDATA 76255\nL0\n";
+  auto output = asmHexProgramSrc(program, true).str();
+  std::string expected = ""
+R"(00000000 L3                   (0 bytes)
+00000000 BR L1 (4)            (1 bytes)
+0x000001 LDAP L0 (10)         (1 bytes)
+0x000002 BRN L3 (-4)          (2 bytes)
+0x000004 BRZ L0 (7)           (1 bytes)
+0x000005 L1                   (0 bytes)
+0x000008 DATA 76255           (4 bytes)
+0x00000c L0                   (0 bytes)
+00000000 PADDING 0            (0 bytes)
+9 bytes
+)";
+  BOOST_TEST(output == expected);
+}
+
 //===---------------------------------------------------------------------===//
 // Error handling.
 //===---------------------------------------------------------------------===//
@@ -106,4 +142,38 @@ BOOST_AUTO_TEST_CASE(error_unknown_label) {
   BOOST_CHECK_THROW(asmHexProgramSrc(program), hexasm::UnknownLabelError);
 }
 
+//===---------------------------------------------------------------------===//
+// Pipelined core timing model.
+//===---------------------------------------------------------------------===//
+
+BOOST_AUTO_TEST_CASE(timing_store_to_next_word) {
+  // Check that a store to the word of the next instruction costs a refetch.
+  // STAM 2 overwrites the word at 8 holding it and the next two LDACs with
+  // LDAM 0, so the exit code is no longer 7, while STAM 5 is past the end.
+  auto cycles = [&](int address, uint64_t refetches) {
+    auto program = boost::format(R"(BR start
+DATA 16383 # sp
+start
+LDAC 0
+STAM %d
+LDAC 7
+LDAC 7
+LDBM 1
+STAI 2
+LDAC 0
+OPR SVC)") % address;
+    hexasm::Lexer lexer;
+    hexasm::Parser parser(lexer);
+    lexer.loadBuffer(program.str());
+    auto tree = parser.parseProgram();
+    hexsim::Processor processor(std::cin, simOutBuffer);
+    processor.load(hexsim::MemoryImage(hexasm::CodeGen(tree).emitBinImage(), "program"));
+    hexsim::PipelineModel model;
+    BOOST_TEST((processor.runModel(model) == 7) == (address != 2));
+    BOOST_TEST(model.getStoreRefetches() == refetches);
+    return model.getCycles();
+  };
+  BOOST_TEST(cycles(2, 1) == cycles(5, 0) + 1);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -102,8 +102,37 @@ proc main () is {
   BOOST_TEST(simOutBuffer.str() == "abc");
 }
 
-BOOST_AUTO_TEST_CASE(syscall_invalid_3) {
-  auto program = "proc main() is 3(0)";
+BOOST_AUTO_TEST_CASE(syscall_put_block) {
+  auto program = R"(
+val putblock = 3;
+array buf[3];
+proc main () is {
+  buf[0] := 'a';
+  buf[1] := 'b';
+  buf[2] := 'c';
+  putblock(buf, 3, 0)
+})";
+  runXProgramSrc(program);
+  BOOST_TEST(simOutBuffer.str() == "abc");
+}
+
+BOOST_AUTO_TEST_CASE(syscall_get_block) {
+  auto program = R"(
+val exit = 0;
+val putblock = 3;
+val getblock = 4;
+array buf[8];
+proc main () is {
+  putblock(buf, getblock(buf, 8, 0), 0);
+  exit(getblock(buf, 8, 0))
+})";
+  // The first read is short at the end of the input, and the second is empty.
+  BOOST_TEST(runXProgramSrc(program, "abcde") == 0);
+  BOOST_TEST(simOutBuffer.str() == "abcde");
+}
+
+BOOST_AUTO_TEST_CASE(syscall_invalid_5) {
+  auto program = "proc main() is 5(0)";
   BOOST_CHECK_THROW(runXProgramSrc(program), xcmp::InvalidSyscallError);
 }
 
@@ -112,8 +141,8 @@ BOOST_AUTO_TEST_CASE(syscall_invalid_val_minus_1) {
   BOOST_CHECK_THROW(runXProgramSrc(program), xcmp::InvalidSyscallError);
 }
 
-BOOST_AUTO_TEST_CASE(syscall_invalid_val_3) {
-  auto program = "val x=3; proc main() is x(0)";
+BOOST_AUTO_TEST_CASE(syscall_invalid_val_5) {
+  auto program = "val x=5; proc main() is x(0)";
   BOOST_CHECK_THROW(runXProgramSrc(program), xcmp::InvalidSyscallError);
 }
 
@@ -368,6 +397,48 @@ proc main() is 0(add3(add3(add3(nop(1)+1, nop(2)+1, nop(3)+1), nop(4)+1, nop(5)+
   BOOST_TEST(runXProgramSrc(program) == 35);
 }
 
+BOOST_AUTO_TEST_CASE(prepare_call_actuals_relational) {
+  // Check that relational operators in actuals containing calls are
+  // generated once for the temporary and again when it is loaded.
+  auto program = R"(
+func nop(val v) is return v
+proc main() is 0(nop((nop(1) = 1) + (nop(2) ~= 1) + (nop(3) < 4))))";
+  BOOST_TEST(runXProgramSrc(program) == 3);
+}
+
+BOOST_AUTO_TEST_CASE(prepare_call_actuals_spill) {
+  // Check that an actual without calls that needs stack space of its own
+  // does not overwrite the saved value of a later actual containing a call.
+  // The called function updates a global, so it is not inlined.
+  auto program = R"(
+var g;
+array a[2];
+func next(val v) is { g := g + v; return g }
+func sub2(val a0, val a1) is return a0 - a1
+proc main() is var x; {
+  g := 1; x := 3; a[0] := 20; a[1] := 9;
+  0(sub2((a[0] - a[1]) + (a[1] < x), next(2))) })";
+  BOOST_TEST(runXProgramSrc(program) == 11 - 3);
+}
+
+BOOST_AUTO_TEST_CASE(prepare_call_actuals_order) {
+  // Check that actuals are evaluated from left to right, so an actual
+  // without calls reads a global before a later actual's call updates it.
+  // put2 is inlined, and put2rec, which is recursive, is not.
+  auto program = R"(
+val put = 1;
+var g;
+func next(val v) is { g := g + v; return g }
+proc put2(val a0, val a1) is { put(a0, 0); put(a1, 0) }
+proc put2rec(val n, val a0, val a1) is
+  if n = 0 then put2(a0, a1) else put2rec(n - 1, a0, a1)
+proc main() is {
+  g := 1;
+  put2(g + 20, next(2));
+  put2rec(1, g, next(3)) })";
+  runXProgramSrc(program);
+  BOOST_TEST(simOutBuffer.str() == std::string({21, 3, 3, 6}));
+}
 //===---------------------------------------------------------------------===//
 // Unary operators.
 //===---------------------------------------------------------------------===//
@@ -614,6 +685,18 @@ BOOST_AUTO_TEST_CASE(bianry_or_constants) {
   }
 }
 
+BOOST_AUTO_TEST_CASE(binary_constant_operand_breg) {
+  // Check that a constant binary operation loaded as the breg operand of
+  // another operation is not generated into areg, over the other operand.
+  auto program = R"(
+val k = 4;
+array a[3];
+proc main () is var x; {
+  x := 3; a[2] := 5;
+  0((x + (2 + 3)) + (x - (k + 1)) + a[x - (k - 3)] + a[k - 2]) })";
+  BOOST_TEST(runXProgramSrc(program) == 8 - 2 + 5 + 5);
+}
+
 // Chained associative operators.
 
 BOOST_AUTO_TEST_CASE(binary_associative_plus4) {
@@ -646,6 +729,29 @@ BOOST_AUTO_TEST_CASE(binary_associative_or4) {
   BOOST_TEST(runXProgramSrc(program, {1, 1, 1, 1}) == 1);
 }
 
+// Operand ordering of nested operators, which avoids spilling operands.
+
+BOOST_AUTO_TEST_CASE(binary_operand_ordering) {
+  auto program = R"(
+    array a[4];
+    func f(val x) is return x + 1
+    proc main () is
+      var x; var y;
+    { x := 2(0); y := 2(0);
+      a[0] := x; a[1] := y; a[2] := x - (y - 1); a[3] := 10 - (x + (y - a[1]));
+      1(100 - (a[2] - (x + y)), 0);
+      1(a[3] + (x - (y + 3)), 0);
+      1((x + f(y)) - (y - f(x)), 0);
+      1(a[0] - f(a[1]), 0);
+      1(y = (x - 1), 0);
+      1(x = f(y), 0);
+      1((x < (y + 1)) + ((y + 2) < x), 0)
+    }
+  )";
+  runXProgramSrc(program, {7, 6});
+  BOOST_TEST(simOutBuffer.str() == std::string({111, 1, 16, 0, 1, 1, 0}));
+}
+
 //===---------------------------------------------------------------------===//
 // Assign statement
 //===---------------------------------------------------------------------===//
@@ -877,12 +983,266 @@ BOOST_AUTO_TEST_CASE(proc_no_frame_return) {
   BOOST_TEST(runXProgramSrc(program) == 42);
 }
 
+BOOST_AUTO_TEST_CASE(proc_layout_profile) {
+  // Check a profile places the data accessed by the hottest proc first.
+  auto program = R"(
+    var x;
+    proc f(val n) is while x < n do x := x + 100001
+    proc g(val n) is while x < n do x := x + 200002
+    proc main() is { x := 0; f(1); g(300000); 0(x) }
+  )";
+  auto listing = [&](const std::string &profileFilename) {
+    std::ostringstream outBuffer;
+    xcmp::Driver driver(outBuffer);
+    driver.run(xcmp::DriverAction::EMIT_INTERMEDIATE_INSTS, program, false,
+               "a.out", false, profileFilename);
+    auto text = outBuffer.str();
+    return text.find("DATA 100001") < text.find("DATA 200002");
+  };
+  fs::path path(CURRENT_BINARY_DIRECTORY);
+  path /= fs::path("layout.prof");
+  std::ofstream profileFile(path);
+  profileFile << "[entry];main 10\n[entry];main;f 20\n[entry];main;g 300\n";
+  profileFile.close();
+  BOOST_TEST(listing("") == true);
+  BOOST_TEST(listing(path.string()) == false);
+  BOOST_CHECK_THROW(listing("missing.prof"), xcmp::ProfileError);
+  BOOST_TEST(runXProgramSrc(program) == 300003);
+}
+
+BOOST_AUTO_TEST_CASE(proc_tail_call) {
+  // Check a recursive proc with more calls than fit on the stack.
+  auto program = R"(
+    var x;
+    proc count(val n) is if n = 0 then skip else { x := x + 2; count(n - 1) }
+    proc main() is { x := 0; count(100000); 0(x) }
+  )";
+  BOOST_TEST(runXProgramSrc(program) == 200000);
+}
+
+BOOST_AUTO_TEST_CASE(func_tail_call_swapped_args) {
+  // Check a tail call whose actuals refer to the other formals.
+  auto program = R"(
+    func fib(val n, val a, val b) is
+      if n = 0 then return a else return fib(n - 1, b, a + b)
+    func swap(val n, val a, val b) is
+      if n = 0 then return a - b else return swap(n - 1, b, a)
+    proc main() is 0(fib(10, 0, 1) + swap(3, 10, 1))
+  )";
+  BOOST_TEST(runXProgramSrc(program) == 46);
+}
+
+BOOST_AUTO_TEST_CASE(inline_leaf_calls) {
+  // Check calls of small leaf procs and funcs, which are inlined.
+  auto program = R"(
+    var x;
+    func inc(val a) is return a + 1
+    func max(val a, val b) is if a > b then return a else return b
+    func neg(val a) is if a < 0 then return true else return false
+    proc put(val c) is 1(c, 0)
+    proc main() is {
+      x := -1;
+      put(max(3, inc(4)));
+      put(max(9, 2) + max(inc(x), 7));
+      if (x > 0) or neg(x) then put(inc(inc(x))) else skip
+    }
+  )";
+  runXProgramSrc(program);
+  BOOST_TEST(simOutBuffer.str() == std::string({5, 16, 1}));
+}
+
+//===---------------------------------------------------------------------===//
+// Passes
+//===---------------------------------------------------------------------===//
+
+BOOST_AUTO_TEST_CASE(passes_fuse_expr) {
+  // Check fusing ConstProp and OptimiseExpr gives the same program.
+  auto program = R"(
+    val n = (3 ~= 4) + 5;
+    var x;
+    proc main() is { x := 2(0); if (x >= n) and (x ~= 7) then 0(x - n) else 0(-x) }
+  )";
+  auto compile = [&](bool fuse) {
+    std::ostringstream outBuffer;
+    xcmp::Driver driver(outBuffer);
+    driver.getPassManager().setFuseExprPasses(fuse);
+    driver.run(xcmp::DriverAction::EMIT_ASM, program, false);
+    return outBuffer.str();
+  };
+  BOOST_TEST(compile(true) == compile(false));
+  BOOST_TEST(runXProgramSrc(program, "\x09") == 3);
+  BOOST_TEST(runXProgramSrc(program, "\x07") == -7);
+}
+
+BOOST_AUTO_TEST_CASE(passes_disable) {
+  // Check the optional passes can be disabled, and the others cannot.
+  auto program = R"(
+    func f(val a) is return a + 1
+    proc main() is 0(f(f(2(0))))
+  )";
+  xcmp::Driver driver(std::cout);
+  driver.getPassManager().disable("OptimiseCalls");
+  driver.getPassManager().disable("LayoutProgram");
+  driver.getPassManager().disable("OptimiseDirectives");
+  driver.getPassManager().setTiming(true);
+  driver.run(xcmp::DriverAction::EMIT_BINARY_IMAGE, program, false);
+  BOOST_TEST(simXBinary(hexsim::MemoryImage(std::move(driver.getBinaryImage()), "program"), "\x05") == 7);
+  std::ostringstream report;
+  driver.getPassManager().report(report);
+  BOOST_TEST(report.str().find("CodeGen") != std::string::npos);
+  BOOST_TEST(report.str().find("OptimiseCalls") == std::string::npos);
+  BOOST_CHECK_THROW(driver.getPassManager().disable("CodeGen"), xcmp::RequiredPassError);
+  BOOST_CHECK_THROW(driver.getPassManager().disable("Foo"), xcmp::UnknownPassError);
+}
+
+BOOST_AUTO_TEST_CASE(passes_inline_limit) {
+  // Check the inline budget controls which calls are inlined.
+  auto program = R"(
+    val put = 1;
+    proc put2(val a, val b) is { put(a, 0); put(b, 0) }
+    proc main() is { put2(1, 2); put2(3, 4) }
+  )";
+  auto compile = [&](size_t limit) {
+    std::ostringstream outBuffer;
+    xcmp::Driver driver(outBuffer);
+    driver.getPassManager().setInlineSizeLimit(limit);
+    driver.run(xcmp::DriverAction::EMIT_OPTIMISED_TREE, program, false);
+    return outBuffer.str();
+  };
+  BOOST_TEST(compile(xcmp::DEFAULT_INLINE_SIZE_LIMIT).find("call put2") == std::string::npos);
+  BOOST_TEST(compile(0).find("call put2") != std::string::npos);
+  xcmp::PassManager passManager;
+  BOOST_TEST(passManager.getOptions().find("inline-limit") == std::string::npos);
+  passManager.setInlineSizeLimit(0);
+  BOOST_TEST(passManager.getOptions().find("inline-limit-0") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(stats_memory_regions) {
+  // Check the binary records its static data, and that accesses to it and to
+  // the arrays above the stack are counted as globals.
+  auto program = R"(
+    var x;
+    array a[4];
+    proc main() is {
+      x := 3;
+      a[x] := x;
+      0(a[x])
+    }
+  )";
+  xcmp::Driver driver(std::cout);
+  driver.run(xcmp::DriverAction::EMIT_BINARY_IMAGE, program, false);
+  hexsim::MemoryImage image(std::move(driver.getBinaryImage()), "program");
+  BOOST_TEST(image.getDataBegin() == 4);
+  BOOST_TEST(image.getDataEnd() > image.getDataBegin());
+  std::istringstream in;
+  std::ostringstream out;
+  hexsim::Processor processor(in, out);
+  processor.load(image);
+  processor.setStats(true);
+  BOOST_TEST(processor.run() == 3);
+  auto &stats = processor.getStats();
+  BOOST_TEST(stats.loads[hexsim::Statistics::PROGRAM] == 0);
+  BOOST_TEST(stats.stores[hexsim::Statistics::PROGRAM] == 0);
+  BOOST_TEST(stats.loads[hexsim::Statistics::GLOBALS] > 0);
+  BOOST_TEST(stats.stores[hexsim::Statistics::GLOBALS] >= 2);
+  BOOST_TEST(stats.stores[hexsim::Statistics::STACK] > 0);
+}
+
+BOOST_AUTO_TEST_CASE(cache_binaries) {
+  // Check a second compilation of a program reuses the first binary, and
+  // a change to the program or the passes does not.
+  auto program = R"(
+    func f(val a) is return a + 1
+    proc main() is 0(f(2(0)))
+  )";
+  auto directory = fs::path(CURRENT_BINARY_DIRECTORY) / "cache_binaries";
+  fs::remove_all(directory);
+  hex::BuildCache cache(directory.string());
+  auto compile = [&](const std::string &source, bool disable) {
+    xcmp::Driver driver(std::cout);
+    driver.setBuildCache(&cache);
+    if (disable) {
+      driver.getPassManager().disable("OptimiseDirectives");
+    }
+    driver.run(xcmp::DriverAction::EMIT_BINARY_IMAGE, source, false);
+    return simXBinary(hexsim::MemoryImage(std::move(driver.getBinaryImage()), "program"), "\x05");
+  };
+  BOOST_TEST(compile(program, false) == 6);
+  BOOST_TEST(cache.getHits() == 0);
+  BOOST_TEST(compile(program, false) == 6);
+  BOOST_TEST(cache.getHits() == 1);
+  BOOST_TEST(compile(program, true) == 6);
+  BOOST_TEST(cache.getHits() == 1);
+  BOOST_TEST(compile(std::string(program) + " ", false) == 6);
+  BOOST_TEST(cache.getHits() == 1);
+  BOOST_TEST(cache.getMisses() == 3);
+  fs::remove_all(directory);
+}
+
+BOOST_AUTO_TEST_CASE(cache_entries) {
+  // Check the key does not depend on the order passes are disabled in, and
+  // that a truncated entry, or an entry of another key, is a miss.
+  xcmp::PassManager first, second;
+  first.disable("OptimiseDirectives");
+  first.disable("OptimiseCalls");
+  second.disable("OptimiseCalls");
+  second.disable("OptimiseDirectives");
+  BOOST_TEST(first.getOptions() == second.getOptions());
+  auto directory = fs::path(CURRENT_BINARY_DIRECTORY) / "cache_entries";
+  fs::remove_all(directory);
+  hex::BuildCache cache(directory.string());
+  auto key = hex::BuildCache::getKey("xcmp", "", "source");
+  auto path = directory / (key.name + ".bin");
+  std::string binary;
+  cache.store(key, "binary");
+  BOOST_TEST(cache.lookup(key, binary));
+  BOOST_TEST(binary == "binary");
+  fs::resize_file(path, fs::file_size(path) - 1);
+  BOOST_TEST(!cache.lookup(key, binary));
+  cache.store(key, "binary");
+  auto other = hex::BuildCache::getKey("xcmp", "", "other");
+  fs::copy_file(path, directory / (other.name + ".bin"));
+  BOOST_TEST(!cache.lookup(other, binary));
+  BOOST_TEST(cache.getHits() == 1);
+  BOOST_TEST(cache.getMisses() == 2);
+  fs::remove_all(directory);
+}
+
+//===---------------------------------------------------------------------===//
+// Tokens
+//===---------------------------------------------------------------------===//
+
+BOOST_AUTO_TEST_CASE(keyword_prefix_tokens) {
+  auto output = tokeniseXProgramSrc("if iff do done val value is isnt").str();
+  std::string expected = ""
+R"(if
+IDENTIFIER iff
+do
+IDENTIFIER done
+val
+IDENTIFIER value
+is
+IDENTIFIER isnt
+EOF
+)";
+  BOOST_TEST(output == expected);
+}
+
 //===---------------------------------------------------------------------===//
 // Error handling.
 //===---------------------------------------------------------------------===//
 
 // Token errors
 
+BOOST_AUTO_TEST_CASE(token_error_line) {
+  xcmp::Lexer lexer;
+  std::ostringstream output;
+  lexer.loadBuffer("val foo = 1;\nval bar = ?;\n");
+  BOOST_CHECK_THROW(lexer.emitTokens(output), xcmp::TokenError);
+  BOOST_TEST(lexer.getLineNumber() == 1);
+  BOOST_TEST(lexer.getLine() == "val bar = ?");
+}
+
 BOOST_AUTO_TEST_CASE(token_error_char_const_escape) {
   auto program = "val foo = '\\x';";
   BOOST_CHECK_THROW(asmXProgramSrc(program), xcmp::CharConstError);
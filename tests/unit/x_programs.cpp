@@ -145,4 +145,22 @@ size: 414
   BOOST_TEST(simOutBuffer.str() == "hello world\n");
 }
 
+BOOST_AUTO_TEST_CASE(shared_image) {
+  // Run several processors on one shared image, which they each write to.
+  xcmp::Driver driver(std::cout);
+  fs::path path(CURRENT_BINARY_DIRECTORY);
+  path /= fs::path("a.bin");
+  driver.run(xcmp::DriverAction::EMIT_BINARY, readFile(getXTestPath("bubblesort.x")), false,
+             path.c_str());
+  hexsim::MemoryImage image(path.c_str());
+  image.share();
+  for (size_t i = 0; i < 4; i++) {
+    std::istringstream in;
+    std::ostringstream out;
+    hexsim::Processor processor(in, out);
+    processor.load(image);
+    BOOST_TEST(processor.run() == 0);
+  }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -1,8 +1,16 @@
 #ifndef UTIL_HPP
 #define UTIL_HPP
 
+#include <array>
 #include <cstdint>
 #include <exception>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <boost/format.hpp>
 
 namespace hexutil {
@@ -36,6 +44,136 @@ public:
   const Location &getLocation() const { return location; }
 };
 
+/// The text of a source file, mapped read-only, or a string held in memory,
+/// for a lexer to scan in place and to hand out views of.
+class SourceBuffer {
+  const char *data;
+  size_t size;
+  bool mapped;
+  std::string contents;
+
+  void unmap() {
+    if (mapped) {
+      ::munmap(const_cast<char*>(data), size);
+      mapped = false;
+    }
+    data = "";
+    size = 0;
+  }
+
+public:
+  SourceBuffer() : data(""), size(0), mapped(false) {}
+  SourceBuffer(const SourceBuffer&) = delete;
+  SourceBuffer &operator=(const SourceBuffer&) = delete;
+  ~SourceBuffer() { unmap(); }
+
+  /// Map a file.
+  void open(const char *filename) {
+    unmap();
+    int fd = ::open(filename, O_RDONLY);
+    struct stat status;
+    if (fd < 0 || ::fstat(fd, &status) != 0) {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+      throw std::runtime_error("could not open file");
+    }
+    if (status.st_size > 0) {
+      void *mapping = ::mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapping == MAP_FAILED) {
+        ::close(fd);
+        throw std::runtime_error("could not open file");
+      }
+      data = static_cast<const char*>(mapping);
+      size = status.st_size;
+      mapped = true;
+    }
+    ::close(fd);
+  }
+
+  /// Hold a copy of a string.
+  void load(const std::string &buffer) {
+    unmap();
+    contents = buffer;
+    data = contents.data();
+    size = contents.size();
+  }
+
+  std::string_view view() const { return std::string_view(data, size); }
+};
+
+/// A keyword and the token it is lexed as.
+template<typename T>
+struct Keyword {
+  std::string_view name{};
+  T token{};
+};
+
+/// A perfect hash table of keywords, built at compile time. The hash of a name
+/// is FNV-1a from a seed, which the constructor chooses so that no two
+/// keywords share a slot, so a lookup is one hash and one comparison.
+template<typename T, size_t N>
+class KeywordTable {
+  static constexpr size_t nextPowerOfTwo(size_t value) {
+    size_t result = 1;
+    while (result < value) {
+      result <<= 1;
+    }
+    return result;
+  }
+
+  static constexpr size_t NUM_SLOTS = nextPowerOfTwo(2 * N);
+  static constexpr uint32_t MAX_SEED = 1 << 16;
+
+  std::array<Keyword<T>, NUM_SLOTS> slots;
+  uint32_t seed;
+  size_t maxLength;
+
+  static constexpr size_t hash(uint32_t seed, std::string_view name) {
+    uint32_t value = 2166136261U ^ seed;
+    for (char c : name) {
+      value = (value ^ static_cast<uint8_t>(c)) * 16777619U;
+    }
+    return (value ^ (value >> 16)) & (NUM_SLOTS - 1);
+  }
+
+  static constexpr bool isPerfect(uint32_t seed, const Keyword<T> (&keywords)[N]) {
+    std::array<bool, NUM_SLOTS> used{};
+    for (size_t i=0; i<N; i++) {
+      size_t slot = hash(seed, keywords[i].name);
+      if (used[slot]) {
+        return false;
+      }
+      used[slot] = true;
+    }
+    return true;
+  }
+
+public:
+  constexpr KeywordTable(const Keyword<T> (&keywords)[N]) :
+      slots(), seed(0), maxLength(0) {
+    while (!isPerfect(seed, keywords)) {
+      if (++seed == MAX_SEED) {
+        throw std::logic_error("no perfect hash of the keywords");
+      }
+    }
+    for (size_t i=0; i<N; i++) {
+      slots[hash(seed, keywords[i].name)] = keywords[i];
+      maxLength = keywords[i].name.size() > maxLength ? keywords[i].name.size() : maxLength;
+    }
+  }
+
+  /// Return the token of a keyword, or a default for any other name. Empty
+  /// slots have an empty name, which no identifier matches.
+  constexpr T lookup(std::string_view name, T otherwise) const {
+    if (name.size() > maxLength) {
+      return otherwise;
+    }
+    auto &slot = slots[hash(seed, name)];
+    return slot.name == name ? slot.token : otherwise;
+  }
+};
+
 } // End namespace hexutil
 
 #endif // UTIL_HPP
@@ -11,6 +11,7 @@ module hex
   logic             req_f_valid;
   hex_pkg::iaddr_t  req_f_addr;
   hex_pkg::instr_t  res_f_data;
+  hex_pkg::data_t   res_f_word;
   // Memory data read/write interface
   logic             req_d_valid;
   logic             req_d_we;
@@ -24,6 +25,9 @@ module hex
     .o_f_valid       (req_f_valid),
     .o_f_addr        (req_f_addr),
     .i_f_data        (res_f_data),
+`ifdef HEX_PIPELINED
+    .i_f_word        (res_f_word),
+`endif
     .o_d_valid       (req_d_valid),
     .o_d_we          (req_d_we),
     .o_d_addr        (req_d_addr),
@@ -39,6 +43,7 @@ module hex
     .i_f_valid (req_f_valid),
     .i_f_addr  (req_f_addr),
     .o_f_data  (res_f_data),
+    .o_f_word  (res_f_word),
     .i_d_valid (req_d_valid),
     .i_d_addr  (req_d_addr),
     .i_d_we    (req_d_we),
@@ -46,6 +51,7 @@ module hex
     .o_d_data  (res_d_data)
   );
 
+`ifdef HEX_VCD
   initial begin
     if ($test$plusargs("trace") != 0) begin
        $display("[%0t] Tracing to logs/vlt_dump.vcd...\n", $time);
@@ -53,5 +59,6 @@ module hex
        $dumpvars();
     end
   end
+`endif
 
 endmodule
@@ -10,7 +10,7 @@ package hex_pkg;
   localparam INSTR_OPC_WIDTH = 4;
   localparam INSTR_OPR_WIDTH = 4;
   localparam INSTR_WIDTH = INSTR_OPC_WIDTH + INSTR_OPR_WIDTH;
-  localparam SYSCALL_OPC_WIDTH = 2;
+  localparam SYSCALL_OPC_WIDTH = 3;
 
   typedef logic [MEM_ADDR_WIDTH-1:0]  iaddr_t; // Byte/instruction address
   typedef logic [MEM_ADDR_WIDTH-1:2]  waddr_t; // Word address
@@ -43,9 +43,11 @@ package hex_pkg;
   } opr_opcode_t;
 
   typedef enum logic [SYSCALL_OPC_WIDTH-1:0] {
-    EXIT  = 0,
-    WRITE = 1,
-    READ  = 2
+    EXIT       = 0,
+    WRITE      = 1,
+    READ       = 2,
+    WRITEBLOCK = 3,
+    READBLOCK  = 4
   } syscall_t;
 
   typedef struct packed {
@@ -6,6 +6,7 @@ module memory
     input  logic             i_f_valid,
     input  hex_pkg::iaddr_t  i_f_addr,
     output hex_pkg::instr_t  o_f_data,
+    output hex_pkg::data_t   o_f_word,
     // Read/write data port.
     input  logic             i_d_valid,
     input  logic             i_d_we,
@@ -14,7 +15,7 @@ module memory
     output hex_pkg::data_t   o_d_data
   );
 
-  logic [hex_pkg::MEM_WIDTH-1:0] memory_q [hex_pkg::MEM_DEPTH-1:0] /* verilator public */;
+  logic [hex_pkg::MEM_WIDTH-1:0] memory_q [hex_pkg::MEM_DEPTH-1:0] /* verilator public_flat_rw */;
 
   always_ff @(posedge i_clk or posedge i_rst)
     if (i_d_valid && i_d_we) begin
@@ -25,6 +26,7 @@ module memory
   assign fetch_byte_addr = {3'b000, i_f_addr[1:0]} << 3;
 
   assign o_f_data = memory_q[i_f_addr[hex_pkg::MEM_ADDR_WIDTH-1:2]][fetch_byte_addr +: 8];
+  assign o_f_word = memory_q[i_f_addr[hex_pkg::MEM_ADDR_WIDTH-1:2]];
   assign o_d_data = memory_q[i_d_addr];
 
 endmodule
@@ -17,11 +17,11 @@ module processor
     output hex_pkg::syscall_t o_syscall
   );
 
-  // State
-  hex_pkg::iaddr_t   pc_q /* verilator public */;
-  hex_pkg::data_t    areg_q;
-  hex_pkg::data_t    breg_q;
-  hex_pkg::data_t    oreg_q;
+  // State, which the testbench writes to seed a reset or a snapshot.
+  hex_pkg::iaddr_t   pc_q /* verilator public_flat_rw */;
+  hex_pkg::data_t    areg_q /* verilator public_flat_rw */;
+  hex_pkg::data_t    breg_q /* verilator public_flat_rw */;
+  hex_pkg::data_t    oreg_q /* verilator public_flat_rw */;
 
   // Nets
   hex_pkg::instr_t   instr /* verilator public */;
@@ -0,0 +1,285 @@
+// A pipelined variant of the processor, selected by building with
+// HEX_PIPELINED defined, with the same interface and a fetch port that also
+// returns the whole word of the fetch address.
+//
+// The fetch stage reads the word holding the fetch address and consumes the
+// PFIX/NFIX prefixes in it up to and including the next instruction, which
+// it passes to the execute stage with its operand, so prefixes in the same
+// word as their instruction take no cycles. A prefix chain that runs to the
+// end of a word is held in foreg_q while the next word is fetched. Fetch
+// follows BR to its target, predicts BRZ and BRN with a table of two-bit
+// counters indexed by the low bits of their address, and predicts that
+// OPR BRB falls through. The execute stage resolves the next address, and
+// when it differs from the prediction it squashes the fetch of that cycle
+// and redirects fetch. A store to the word of the next instruction, which
+// fetch read in the same cycle, also squashes and redirects fetch, so
+// self-modifying code runs as it does on the multi-cycle core. hexsim
+// --timing models the cycles of this core.
+module processor
+  (
+    input logic               i_rst,
+    input logic               i_clk,
+    // Fetch memory port
+    output logic              o_f_valid,
+    output hex_pkg::iaddr_t   o_f_addr,
+    input  hex_pkg::instr_t   i_f_data,
+    input  hex_pkg::data_t    i_f_word,
+    // Data memory port
+    output logic              o_d_valid,
+    output logic              o_d_we,
+    output hex_pkg::waddr_t   o_d_addr,
+    output hex_pkg::data_t    o_d_data,
+    input  hex_pkg::data_t    i_d_data,
+    // Syscall interface
+    output logic              o_syscall_valid,
+    output hex_pkg::syscall_t o_syscall
+  );
+
+  localparam BHT_ENTRIES = 256;
+  localparam BHT_INDEX_WIDTH = 8;
+
+  // Fetch state
+  hex_pkg::iaddr_t   fpc_q /* verilator public_flat_rw */;
+  hex_pkg::data_t    foreg_q /* verilator public_flat_rw */;
+  logic [1:0]        bht_q [BHT_ENTRIES-1:0];
+
+  // Execute state: the instruction, the prefix part of its operand and the
+  // address fetch predicted would follow it.
+  logic              valid_q /* verilator public_flat_rw */;
+  hex_pkg::iaddr_t   pc_q /* verilator public */;
+  hex_pkg::instr_t   instr_q;
+  hex_pkg::data_t    oreg_q /* verilator public */;
+  hex_pkg::iaddr_t   pred_q;
+  hex_pkg::data_t    areg_q /* verilator public_flat_rw */;
+  hex_pkg::data_t    breg_q /* verilator public_flat_rw */;
+
+  // Fetch nets
+  hex_pkg::instr_t   f_byte;
+  hex_pkg::instr_t   f_instr;
+  logic              f_found;
+  logic [1:0]        f_index;
+  hex_pkg::data_t    f_oreg;
+  hex_pkg::data_t    f_opr;
+  hex_pkg::iaddr_t   f_pc;
+  hex_pkg::iaddr_t   f_next;
+  hex_pkg::iaddr_t   f_target;
+  hex_pkg::iaddr_t   f_pred;
+  logic [BHT_INDEX_WIDTH-1:0] f_bht_index;
+
+  // Execute nets
+  hex_pkg::instr_t   instr /* verilator public */;
+  logic              instr_svc;
+  logic              instr_brc;
+  logic              taken;
+  logic              store_hazard;
+  logic              redirect;
+  hex_pkg::iaddr_t   npc;
+  hex_pkg::iaddr_t   pc_d;
+  hex_pkg::data_t    areg_d;
+  hex_pkg::data_t    breg_d;
+  hex_pkg::data_t    opr_d;
+  logic [BHT_INDEX_WIDTH-1:0] bht_index;
+
+  //===--------------------------------------------------------------------===//
+  // Fetch
+  //===--------------------------------------------------------------------===//
+
+  assign o_f_valid = 1'b1;
+  assign o_f_addr = fpc_q;
+
+  // Consume the prefixes from the fetch address to the next instruction.
+  always_comb begin
+    f_oreg = foreg_q;
+    f_found = 1'b0;
+    f_instr = '0;
+    f_index = fpc_q[1:0];
+    f_byte = '0;
+    for (int i = 0; i < 4; i++) begin
+      f_byte = i_f_word[i*8 +: 8];
+      if (!f_found && i >= int'(fpc_q[1:0])) begin
+        if (f_byte.opcode == hex_pkg::PFIX) begin
+          f_oreg = (f_oreg | {28'b0, f_byte.operand}) << 4;
+        end else if (f_byte.opcode == hex_pkg::NFIX) begin
+          f_oreg = 32'hFFFFFF00 | ((f_oreg | {28'b0, f_byte.operand}) << 4);
+        end else begin
+          f_found = 1'b1;
+          f_instr = f_byte;
+          f_index = 2'(i);
+        end
+      end
+    end
+  end
+
+  assign f_opr = f_oreg | {28'b0, f_instr.operand};
+  assign f_pc = {fpc_q[hex_pkg::MEM_ADDR_WIDTH-1:2], f_index};
+  assign f_next = f_pc + 1'b1;
+  assign f_target = f_next + signed'(f_opr[hex_pkg::MEM_ADDR_WIDTH-1:0]);
+  assign f_bht_index = f_pc[BHT_INDEX_WIDTH-1:0];
+
+  // Predict the next address.
+  always_comb begin
+    f_pred = f_next;
+    case (f_instr.opcode)
+      hex_pkg::BR:
+        f_pred = f_target;
+      hex_pkg::BRZ,
+      hex_pkg::BRN:
+        f_pred = bht_q[f_bht_index][1] ? f_target : f_next;
+      default:;
+    endcase
+  end
+
+  always_ff @(posedge i_clk or posedge i_rst)
+    if (i_rst) begin
+      fpc_q   <= '0;
+      foreg_q <= '0;
+      valid_q <= 1'b0;
+      pc_q    <= '0;
+      instr_q <= '0;
+      oreg_q  <= '0;
+      pred_q  <= '0;
+    end else if (redirect) begin
+      fpc_q   <= pc_d;
+      foreg_q <= '0;
+      valid_q <= 1'b0;
+    end else begin
+      fpc_q   <= f_found ? f_pred : {fpc_q[hex_pkg::MEM_ADDR_WIDTH-1:2] + 1'b1, 2'b00};
+      foreg_q <= f_found ? '0 : f_oreg;
+      valid_q <= f_found;
+      pc_q    <= f_pc;
+      instr_q <= f_instr;
+      oreg_q  <= f_oreg;
+      pred_q  <= f_pred;
+    end
+
+  //===--------------------------------------------------------------------===//
+  // Execute
+  //===--------------------------------------------------------------------===//
+
+  assign instr = instr_q;
+  assign instr_svc = valid_q && instr_q.opcode == hex_pkg::OPR && instr_q.operand == hex_pkg::SVC;
+  assign instr_brc = valid_q && instr_q.opcode inside {hex_pkg::BRZ, hex_pkg::BRN};
+
+  // Current operand value.
+  assign opr_d = oreg_q | {28'b0, instr_q.operand};
+  assign npc = pc_q + 1'b1;
+
+  // Next address, and a redirect of fetch when it was not predicted.
+  always_comb begin
+    pc_d = npc;
+    taken = 1'b0;
+    case (instr_q.opcode)
+      hex_pkg::BR:
+        pc_d = npc + signed'(opr_d[hex_pkg::MEM_ADDR_WIDTH-1:0]);
+      hex_pkg::BRZ: begin
+        taken = areg_q == '0;
+        pc_d = taken ? npc + signed'(opr_d[hex_pkg::MEM_ADDR_WIDTH-1:0]) : npc;
+      end
+      hex_pkg::BRN: begin
+        taken = signed'(areg_q) < 0;
+        pc_d = taken ? npc + signed'(opr_d[hex_pkg::MEM_ADDR_WIDTH-1:0]) : npc;
+      end
+      hex_pkg::OPR:
+        pc_d = (instr_q.operand == hex_pkg::BRB) ? breg_q[hex_pkg::MEM_ADDR_WIDTH-1:0] : npc;
+      default:;
+    endcase
+  end
+
+  // A store to the word of the next instruction, which is where fetch is in
+  // this cycle, since a store is not a branch, makes that fetch stale.
+  assign store_hazard = o_d_we && o_d_addr == npc[hex_pkg::MEM_ADDR_WIDTH-1:2];
+
+  assign redirect = valid_q && (pc_d != pred_q || store_hazard);
+
+  // areg update
+  always_comb begin
+    areg_d = areg_q;
+    case (instr_q.opcode)
+      hex_pkg::LDAM: areg_d = i_d_data;
+      hex_pkg::LDAC: areg_d = opr_d;
+      hex_pkg::LDAP: areg_d = {11'b0, npc + signed'(opr_d[hex_pkg::MEM_ADDR_WIDTH-1:0])};
+      hex_pkg::LDAI: areg_d = i_d_data;
+      hex_pkg::OPR:
+        case (instr_q.operand)
+          hex_pkg::ADD: areg_d = {areg_q + breg_q};
+          hex_pkg::SUB: areg_d = {areg_q - breg_q};
+          default:;
+        endcase
+      default:;
+    endcase
+  end
+
+  // breg update
+  always_comb begin
+    breg_d = breg_q;
+    case (instr_q.opcode)
+      hex_pkg::LDBM,
+      hex_pkg::LDBI: breg_d = i_d_data;
+      hex_pkg::LDBC: breg_d = opr_d;
+      default:;
+    endcase
+  end
+
+  always_ff @(posedge i_clk or posedge i_rst)
+    if (i_rst) begin
+      areg_q <= '0;
+      breg_q <= '0;
+    end else if (valid_q) begin
+      areg_q <= areg_d;
+      breg_q <= breg_d;
+    end
+
+  // Branch history update, when a conditional branch executes.
+  assign bht_index = pc_q[BHT_INDEX_WIDTH-1:0];
+
+  always_ff @(posedge i_clk or posedge i_rst)
+    if (i_rst) begin
+      for (int i = 0; i < BHT_ENTRIES; i++) begin
+        bht_q[i] <= 2'b01;
+      end
+    end else if (instr_brc) begin
+      if (taken && bht_q[bht_index] != 2'b11) begin
+        bht_q[bht_index] <= bht_q[bht_index] + 2'b01;
+      end else if (!taken && bht_q[bht_index] != 2'b00) begin
+        bht_q[bht_index] <= bht_q[bht_index] - 2'b01;
+      end
+    end
+
+  // Memory valid
+  assign o_d_valid = valid_q && instr_q.opcode inside {hex_pkg::LDAM, hex_pkg::LDBM, hex_pkg::STAM,
+                                                       hex_pkg::LDAI, hex_pkg::LDBI, hex_pkg::STAI};
+
+  // Memory write enable
+  assign o_d_we = valid_q && instr_q.opcode inside {hex_pkg::STAM, hex_pkg::STAI};
+
+  // Memory address generation
+  always_comb begin
+    o_d_addr = '0;
+    case (instr_q.opcode)
+      hex_pkg::LDAM,
+      hex_pkg::LDBM,
+      hex_pkg::STAM:
+        o_d_addr = opr_d[hex_pkg::MEM_ADDR_WIDTH-3:0];
+      hex_pkg::LDAI:
+        o_d_addr = {areg_q[hex_pkg::MEM_ADDR_WIDTH-3:0]
+                     + signed'(opr_d[hex_pkg::MEM_ADDR_WIDTH-3:0])};
+      hex_pkg::LDBI,
+      hex_pkg::STAI:
+        o_d_addr = {breg_q[hex_pkg::MEM_ADDR_WIDTH-3:0]
+                     + signed'(opr_d[hex_pkg::MEM_ADDR_WIDTH-3:0])};
+      default:;
+    endcase
+  end
+
+  // Data is always driven by the areg.
+  assign o_d_data = areg_q;
+
+  // Syscalls
+  assign o_syscall_valid = instr_svc;
+  assign o_syscall = hex_pkg::syscall_t'(areg_q);
+
+  // The byte fetch port is not used.
+  logic unused_f_data;
+  assign unused_f_data = ^i_f_data;
+
+endmodule
@@ -32,6 +32,14 @@ static void help(const char *argv[]) {
   std::cout << "  --insts-lowered   Display the lowered instructions only\n";
   std::cout << "  --insts-optimised Display the lowered optimised instructions only\n";
   std::cout << "  --memory-info     Report memory information\n";
+  std::cout << "  --profile-use FILE Lay out the program using a profile from hexsim --profile\n";
+  std::cout << "  --time-passes     Report the time, memory and output size of each pass on stderr\n";
+  std::cout << "  --disable-pass NAME Skip an optional pass (OptimiseCalls, LayoutProgram or OptimiseDirectives)\n";
+  std::cout << "  --fuse-expr-passes Run ConstProp and OptimiseExpr in a single traversal\n";
+  std::cout << "  --inline-limit N  Inline procedures and functions of at most N nodes (default "
+            << xcmp::DEFAULT_INLINE_SIZE_LIMIT << ")\n";
+  std::cout << "  --cache-dir DIR   Reuse binaries from a cache in DIR (default: $HEX_CACHE_DIR)\n";
+  std::cout << "  --cache-stats     Report cache hits and misses on stderr\n";
   std::cout << "  -S                Emit the assembly program\n";
   std::cout << "  --insts-asm       Display the assembled instructions only\n";
   std::cout << "  -o,--output file  Specify a file for output (default a.out)\n";
@@ -46,6 +54,10 @@ int main(int argc, const char *argv[]) {
     const char *inputFilename = nullptr;
     const char *outputFilename = "a.out";
     bool reportMemoryInfo = false;
+    const char *profileFilename = "";
+    bool timePasses = false;
+    const char *cacheDirectory = hex::BuildCache::getEnvironmentDirectory();
+    bool cacheStats = false;
     for (int i = 1; i < argc; ++i) {
       if (std::strcmp(argv[i], "-h") == 0 ||
           std::strcmp(argv[i], "--help") == 0) {
@@ -69,6 +81,21 @@ int main(int argc, const char *argv[]) {
         driverAction = xcmp::DriverAction::EMIT_TREE;
       } else if (std::strcmp(argv[i], "--memory-info") == 0) {
         reportMemoryInfo = true;
+      } else if (std::strcmp(argv[i], "--profile-use") == 0) {
+        profileFilename = argv[++i];
+      } else if (std::strcmp(argv[i], "--time-passes") == 0) {
+        timePasses = true;
+        driver.getPassManager().setTiming(true);
+      } else if (std::strcmp(argv[i], "--disable-pass") == 0) {
+        driver.getPassManager().disable(argv[++i]);
+      } else if (std::strcmp(argv[i], "--fuse-expr-passes") == 0) {
+        driver.getPassManager().setFuseExprPasses(true);
+      } else if (std::strcmp(argv[i], "--inline-limit") == 0) {
+        driver.getPassManager().setInlineSizeLimit(std::stoull(argv[++i]));
+      } else if (std::strcmp(argv[i], "--cache-dir") == 0) {
+        cacheDirectory = argv[++i];
+      } else if (std::strcmp(argv[i], "--cache-stats") == 0) {
+        cacheStats = true;
       } else if (std::strcmp(argv[i], "--output") == 0 ||
                  std::strcmp(argv[i], "-o") == 0) {
         outputFilename = argv[++i];
@@ -87,8 +114,22 @@ int main(int argc, const char *argv[]) {
       help(argv);
       std::exit(1);
     }
+    // Use a cache of binaries.
+    std::unique_ptr<hex::BuildCache> buildCache;
+    if (cacheDirectory) {
+      buildCache = std::make_unique<hex::BuildCache>(cacheDirectory);
+      driver.setBuildCache(buildCache.get());
+    }
     // Run.
-    return driver.runCatchExceptions(driverAction, inputFilename, outputFilename, "a.out", reportMemoryInfo);
+    auto result = driver.runCatchExceptions(driverAction, inputFilename, true, outputFilename,
+                                            reportMemoryInfo, profileFilename);
+    if (timePasses) {
+      driver.getPassManager().report(std::cerr);
+    }
+    if (buildCache && cacheStats) {
+      buildCache->reportStats(std::cerr);
+    }
+    return result;
   } catch (const std::exception &e) {
     std::cerr << boost::format("Error: %s\n") % e.what();
     return 1;
@@ -1,21 +1,31 @@
 #ifndef X_CMP_HPP
 #define X_CMP_HPP
 
+#include <algorithm>
 #include <cctype>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <fstream>
 #include <iostream>
 #include <memory>
 #include <optional>
 #include <ostream>
 #include <string>
+#include <string_view>
 #include <stack>
+#include <unordered_map>
 #include <vector>
 #include <map>
 #include <boost/format.hpp>
+#include <sys/resource.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
+#include "hexcache.hpp"
 #include "util.hpp"
 
 // A compiler for the X language, based on xhexb.x and with inspiration from
@@ -189,79 +199,92 @@ struct InvalidSyscallError : public Error {
     Error(location, (boost::format("invalid syscall: %d") % sysCallId).str()) {}
 };
 
+struct ProfileError : public Error {
+  ProfileError(const std::string &filename, const std::string &message) :
+    Error((boost::format("profile %s: %s") % filename % message).str()) {}
+};
+
 //===---------------------------------------------------------------------===//
 // Lexer
 //===---------------------------------------------------------------------===//
 
-class TokenTable {
-  std::map<std::string, Token> table;
-
-public:
-  void insert(const std::string &name, const Token token) {
-    table.insert(std::make_pair(name, token));
-  }
-
-  /// Lookup a token type by identifier.
-  Token lookup(const std::string &name) {
-    auto it = table.find(name);
-    if (it != table.end()) {
-      return it->second;
-    }
-    table.insert(std::make_pair(name, Token::IDENTIFIER));
-    return Token::IDENTIFIER;
-  }
-};
-
+constexpr hexutil::KeywordTable<Token, 18> keywords({
+  {"and",    Token::AND},
+  {"array",  Token::ARRAY},
+  {"do",     Token::DO},
+  {"else",   Token::ELSE},
+  {"false",  Token::FALSE},
+  {"func",   Token::FUNC},
+  {"if",     Token::IF},
+  {"is",     Token::IS},
+  {"or",     Token::OR},
+  {"proc",   Token::PROC},
+  {"return", Token::RETURN},
+  {"skip",   Token::SKIP},
+  {"stop",   Token::STOP},
+  {"then",   Token::THEN},
+  {"true",   Token::TRUE},
+  {"val",    Token::VAL},
+  {"var",    Token::VAR},
+  {"while",  Token::WHILE},
+});
+
+/// The lexer scans a source buffer in place, so identifiers are views of the
+/// buffer, which are valid for the lifetime of the lexer. The current line,
+/// for reporting errors, is also a view, from the start of the line to the
+/// last character read.
 class Lexer {
 
-  TokenTable                    table;
-  std::unique_ptr<std::istream> file;
+  hexutil::SourceBuffer         buffer;
+  const char                   *data;
+  size_t                        size;
+  // The position of the next character to read.
+  size_t                        position;
+  size_t                        lineStart;
   char                          lastChar;
-  std::string                   identifier;
+  std::string_view              identifier;
   std::string                   string;
   unsigned                      value;
   Token                         lastToken;
   size_t                        currentLineNumber;
   size_t                        currentCharNumber;
-  std::string                   currentLine;
-
-  void declareKeywords() {
-    table.insert("and",    Token::AND);
-    table.insert("array",  Token::ARRAY);
-    table.insert("do",     Token::DO);
-    table.insert("else",   Token::ELSE);
-    table.insert("false",  Token::FALSE);
-    table.insert("func",   Token::FUNC);
-    table.insert("if",     Token::IF);
-    table.insert("is",     Token::IS);
-    table.insert("or",     Token::OR);
-    table.insert("proc",   Token::PROC);
-    table.insert("return", Token::RETURN);
-    table.insert("skip",   Token::SKIP);
-    table.insert("stop",   Token::STOP);
-    table.insert("then",   Token::THEN);
-    table.insert("true",   Token::TRUE);
-    table.insert("val",    Token::VAL);
-    table.insert("var",    Token::VAR);
-    table.insert("while",  Token::WHILE);
-  }
 
   int readChar() {
-    file->get(lastChar);
-    currentLine += lastChar;
-    if (file->eof()) {
-      lastChar = EOF;
-    }
+    lastChar = position < size ? data[position] : EOF;
+    position++;
     currentCharNumber++;
     return lastChar;
   }
 
+  void newLine() {
+    currentLineNumber++;
+    currentCharNumber = 0;
+    lineStart = position;
+  }
+
+  /// The characters from a position up to the last character read.
+  std::string_view readFrom(size_t start) const {
+    return std::string_view(data + start, std::min(position - 1, size) - start);
+  }
+
+  void start() {
+    data = buffer.view().data();
+    size = buffer.view().size();
+    position = 0;
+    lineStart = 0;
+    currentLineNumber = 0;
+    currentCharNumber = 0;
+    readChar();
+  }
+
+  static unsigned toUnsigned(std::string_view digits, int base) {
+    return std::strtoul(std::string(digits).c_str(), nullptr, base);
+  }
+
    void readDecInt() {
-      std::string number(1, lastChar);
-      while (std::isdigit(readChar())) {
-        number += lastChar;
-      }
-      value = std::strtoul(number.c_str(), nullptr, 10);
+      size_t start = position - 1;
+      while (std::isdigit(readChar())) {}
+      value = toUnsigned(readFrom(start), 10);
    }
 
   bool isHexDigit(char c) {
@@ -271,11 +294,9 @@ class Lexer {
   }
 
   void readHexInt() {
-    std::string number;
-    while (isHexDigit(readChar())) {
-      number += lastChar;
-    }
-    value = std::strtoul(number.c_str(), nullptr, 16);
+    size_t start = position;
+    while (isHexDigit(readChar())) {}
+    value = toUnsigned(readFrom(start), 16);
   }
 
   char readCharConst() {
@@ -311,9 +332,7 @@ class Lexer {
     // Skip whitespace.
     while (std::isspace(lastChar)) {
       if (lastChar == '\n') {
-        currentLineNumber++;
-        currentCharNumber = 0;
-        currentLine.clear();
+        newLine();
       }
       readChar();
     }
@@ -323,20 +342,17 @@ class Lexer {
         readChar();
       } while (lastChar != EOF && lastChar != '\n');
       if (lastChar == '\n') {
-        currentLineNumber++;
-        currentCharNumber = 0;
-        currentLine.clear();
+        newLine();
         readChar();
       }
       return readToken();
     }
     // Identifier.
     if (std::isalpha(lastChar)) {
-      identifier = std::string(1, lastChar);
-      while (std::isalnum(readChar()) || lastChar == '_') {
-        identifier += lastChar;
-      }
-      return table.lookup(identifier);
+      size_t start = position - 1;
+      while (std::isalnum(readChar()) || lastChar == '_') {}
+      identifier = readFrom(start);
+      return keywords.lookup(identifier, Token::IDENTIFIER);
     }
     // Decimal number.
     if (std::isdigit(lastChar)) {
@@ -412,12 +428,9 @@ class Lexer {
       readChar();
       break;
     case EOF:
-      if (auto ifstream = dynamic_cast<std::ifstream*>(file.get())) {
-        ifstream->close();
-      }
       token = Token::END_OF_FILE;
       readChar();
-      currentLine.clear();
+      lineStart = position;
       break;
     default:
       throw TokenError(getLocation(), std::string("unexpected character ")+lastChar);
@@ -427,35 +440,32 @@ class Lexer {
 
 public:
 
-  Lexer() : currentLineNumber(0), currentCharNumber(0) {
-    declareKeywords();
-  }
+  Lexer() : data(""), size(0), position(0), lineStart(0),
+            currentLineNumber(0), currentCharNumber(0) {}
 
   Token getNextToken() {
     return lastToken = readToken();
   }
 
-  /// Open a file using ifstream.
+  /// Map a file and read its first character.
   void openFile(const char *filename) {
-    auto ifstream = std::make_unique<std::ifstream>();
-    ifstream->open(filename, std::ifstream::in);
-    if (!ifstream->is_open()) {
-      throw std::runtime_error("could not open file");
-    }
-    file.reset(ifstream.release());
-    readChar();
+    buffer.open(filename);
+    start();
   }
 
   void openFile(const std::string &filename) {
     openFile(filename.c_str());
   }
 
-  /// Load a string using istringstream.
-  void loadBuffer(const std::string &buffer) {
-    file = std::make_unique<std::istringstream>(buffer);
-    readChar();
+  /// Load a copy of a string and read its first character.
+  void loadBuffer(const std::string &input) {
+    buffer.load(input);
+    start();
   }
 
+  /// The source being lexed.
+  std::string_view getSource() const { return buffer.view(); }
+
   /// Tokenise the input only and report the tokens.
   void emitTokens(std::ostream &out) {
     while (true) {
@@ -479,14 +489,17 @@ public:
     }
   }
 
-  const std::string &getIdentifier() const { return identifier; }
+  std::string_view getIdentifier() const { return identifier; }
   int getNumber() const { return value; }
   const std::string &getString() const { return string; }
   Token getLastToken() const { return lastToken; }
   size_t getLineNumber() const { return currentLineNumber; }
   size_t getCharNumber() const { return currentCharNumber; }
-  bool hasLine() const { return !currentLine.empty(); }
-  const std::string &getLine() const { return currentLine; }
+  bool hasLine() const { return std::min(position, size) > lineStart; }
+  std::string_view getLine() const {
+    return hasLine() ? std::string_view(data + lineStart, std::min(position, size) - lineStart)
+                     : std::string_view();
+  }
   const Location getLocation() const { return Location(currentLineNumber,
                                                        currentCharNumber); }
 };
@@ -495,6 +508,132 @@ public:
 // AST
 //===---------------------------------------------------------------------===//
 
+/// A list of nodes, held as an array of pointers in an Arena. The pointers
+/// can be replaced, but the list cannot grow.
+template<typename T>
+class NodeList {
+  T **items;
+  size_t count;
+public:
+  NodeList() : items(nullptr), count(0) {}
+  NodeList(T **items, size_t count) : items(items), count(count) {}
+  T **begin() const { return items; }
+  T **end() const { return items + count; }
+  T *operator[](size_t index) const { return items[index]; }
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+};
+
+/// A bump allocator for the nodes of a syntax tree, and the lists and
+/// strings they refer to, which are all freed together with the arena.
+/// Objects in an arena are never destroyed, so only trivially destructible
+/// types can be created in one.
+class Arena {
+  static constexpr size_t BLOCK_SIZE = 64 * 1024;
+  std::vector<std::unique_ptr<char[]>> blocks;
+  char *next;
+  size_t remaining;
+  size_t bytesAllocated;
+
+  void *allocate(size_t size, size_t alignment) {
+    size_t padding = -reinterpret_cast<uintptr_t>(next) & (alignment - 1);
+    if (padding + size > remaining) {
+      size_t blockSize = std::max(BLOCK_SIZE, size + alignment);
+      blocks.push_back(std::unique_ptr<char[]>(new char[blockSize]));
+      next = blocks.back().get();
+      remaining = blockSize;
+      padding = -reinterpret_cast<uintptr_t>(next) & (alignment - 1);
+    }
+    void *result = next + padding;
+    next += padding + size;
+    remaining -= padding + size;
+    bytesAllocated += size;
+    return result;
+  }
+
+public:
+  Arena() : next(nullptr), remaining(0), bytesAllocated(0) {}
+  Arena(const Arena&) = delete;
+  Arena &operator=(const Arena&) = delete;
+
+  /// Create an object in the arena.
+  template<typename T, typename... Args>
+  T *create(Args&&... args) {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "objects in an arena are never destroyed");
+    return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+  }
+
+  /// Copy a list of nodes into the arena.
+  template<typename T>
+  NodeList<T> createList(const std::vector<T*> &nodes) {
+    if (nodes.empty()) {
+      return NodeList<T>();
+    }
+    auto items = static_cast<T**>(allocate(nodes.size() * sizeof(T*), alignof(T*)));
+    std::copy(nodes.begin(), nodes.end(), items);
+    return NodeList<T>(items, nodes.size());
+  }
+
+  /// Copy a string into the arena.
+  std::string_view copyString(std::string_view value) {
+    if (value.empty()) {
+      return std::string_view();
+    }
+    auto data = static_cast<char*>(allocate(value.size(), 1));
+    std::memcpy(data, value.data(), value.size());
+    return std::string_view(data, value.size());
+  }
+
+  size_t getBytesAllocated() const { return bytesAllocated; }
+};
+
+/// An identifier, interned by a NameTable so that two names are the same if
+/// and only if their ids are. The empty name, with id 0, is the name of the
+/// global scope.
+class Name {
+  uint32_t id;
+  std::string_view text;
+public:
+  Name() : id(0) {}
+  Name(uint32_t id, std::string_view text) : id(id), text(text) {}
+  uint32_t getId() const { return id; }
+  std::string_view str() const { return text; }
+  bool empty() const { return id == 0; }
+  bool operator==(const Name &other) const { return id == other.id; }
+  bool operator!=(const Name &other) const { return id != other.id; }
+};
+
+inline std::ostream &operator<<(std::ostream &out, const Name &name) {
+  return out << name.str();
+}
+
+/// Intern identifiers, copying the text of each into an arena once.
+class NameTable {
+  Arena &arena;
+  std::unordered_map<std::string_view, uint32_t> ids;
+public:
+  NameTable(Arena &arena) : arena(arena) {
+    ids.emplace(std::string_view(), 0);
+  }
+  NameTable(const NameTable&) = delete;
+  NameTable &operator=(const NameTable&) = delete;
+
+  /// Return the name of an identifier, adding it if it is new.
+  Name intern(std::string_view text) {
+    auto it = ids.find(text);
+    if (it != ids.end()) {
+      return Name(it->second, it->first);
+    }
+    auto copy = arena.copyString(text);
+    uint32_t id = ids.size();
+    ids.emplace(copy, id);
+    return Name(id, copy);
+  }
+
+  size_t size() const { return ids.size(); }
+};
+
 // Concrete AstNode forward references.
 class Proc;
 class Program;
@@ -521,6 +660,7 @@ class IfStatement;
 class WhileStatement;
 class SeqStatement;
 class CallStatement;
+class TailCallStatement;
 class AssStatement;
 
 /// A visitor base class for the AST.
@@ -529,10 +669,10 @@ class AstVisitor {
   bool recurseCalls; // Expr
   bool recurseStmts; // Stmts
   // Track the current scope.
-  std::stack<std::string> scope;
+  std::stack<Name> scope;
   // Useful reference "Visitor Pattern, replacing objects" on this strategy.
   // https://softwareengineering.stackexchange.com/questions/313783/visitor-pattern-replacing-objects
-  std::unique_ptr<Expr> exprReplacement;
+  Expr *exprReplacement;
 
 public:
   AstVisitor(bool recurseOp=true, bool recurseCalls=true, bool recurseStmts=true) :
@@ -542,14 +682,18 @@ public:
   bool shouldRecurseCalls() const { return recurseCalls; }
   bool shouldRecurseStmts() const { return recurseStmts; }
   bool hasExprReplacement() const { return exprReplacement != nullptr; }
-  void setExprReplacement(std::unique_ptr<Expr> expr) { exprReplacement = std::move(expr); }
-  std::unique_ptr<Expr> &getExprReplacement() { return exprReplacement; }
+  void setExprReplacement(Expr *expr) { exprReplacement = expr; }
+  Expr *takeExprReplacement() {
+    auto expr = exprReplacement;
+    exprReplacement = nullptr;
+    return expr;
+  }
   // Scoping
-  void enterProgram() { scope.push(""); }
+  void enterProgram() { scope.push(Name()); }
   void exitProgram() { scope.pop(); }
-  void enterProc(const std::string &name) { scope.push(name); }
+  void enterProc(Name name) { scope.push(name); }
   void exitProc() { scope.pop(); }
-  const std::string getCurrentScope() const {
+  Name getCurrentScope() const {
     assert(scope.size() > 0 && "scope stack empty");
     return scope.top();
   }
@@ -602,26 +746,31 @@ public:
   virtual void visitPost(SeqStatement&) {}
   virtual void visitPre(CallStatement&) {}
   virtual void visitPost(CallStatement&) {}
+  virtual void visitPre(TailCallStatement&) {}
+  virtual void visitPost(TailCallStatement&) {}
   virtual void visitPre(AssStatement&) {}
   virtual void visitPost(AssStatement&) {}
 };
 
-/// AST node base class.
+/// AST node base class. Nodes are created in the Arena of their Program, and
+/// refer to their children, which they do not own, by pointer.
 class AstNode {
   Location location;
 public:
   AstNode() : location(Location(0, 0)) {}
   AstNode(Location location) : location(location) {}
-  virtual ~AstNode() = default;
   virtual void accept(AstVisitor* visitor) = 0;
   const Location &getLocation() const { return location; }
-  void replaceExpr(std::unique_ptr<Expr> &expr, AstVisitor *visitor) {
-    // If the visitor wishes to replcae the expression, it will have created a
-    // replacement, which can be moved in place of the original.
+  void replaceExpr(Expr *&expr, AstVisitor *visitor) {
+    // If the visitor wishes to replace the expression, it will have created a
+    // replacement, which is put in place of the original.
     if (visitor->hasExprReplacement()) {
-      expr = std::move(visitor->getExprReplacement());
+      expr = visitor->takeExprReplacement();
     }
   }
+protected:
+  // Nodes are never destroyed individually.
+  ~AstNode() = default;
 };
 
 // Expressions ============================================================= //
@@ -637,48 +786,45 @@ public:
 };
 
 class VarRefExpr : public Expr {
-  std::string name;
-  std::unique_ptr<Expr> expr;
+  Name name;
 public:
-  VarRefExpr(Location location, std::string name) : Expr(location), name(name) {}
+  VarRefExpr(Location location, Name name) : Expr(location), name(name) {}
   virtual void accept(AstVisitor *visitor) override {
     visitor->visitPre(*this);
-    //expr->accept(visitor);
-    //replaceExpr(expr, visitor);
     visitor->visitPost(*this);
   }
-  const std::string &getName() const { return name; }
+  Name getName() const { return name; }
 };
 
 class ArraySubscriptExpr : public Expr {
-  std::string name;
-  std::unique_ptr<Expr> expr;
+  Name name;
+  Expr *expr;
 public:
-  ArraySubscriptExpr(Location location, std::string name, std::unique_ptr<Expr> expr) :
-      Expr(location), name(name), expr(std::move(expr)) {}
+  ArraySubscriptExpr(Location location, Name name, Expr *expr) :
+      Expr(location), name(name), expr(expr) {}
   virtual void accept(AstVisitor *visitor) override {
     visitor->visitPre(*this);
     expr->accept(visitor);
     replaceExpr(expr, visitor);
     visitor->visitPost(*this);
   }
-  const std::string &getName() const { return name; }
-  const std::unique_ptr<Expr> &getExpr() { return expr; }
+  Name getName() const { return name; }
+  Expr *getExpr() { return expr; }
 };
 
 class CallExpr : public Expr {
   int sysCallId;
-  std::string name;
-  std::vector<std::unique_ptr<Expr>> args;
+  Name name;
+  NodeList<Expr> args;
 public:
   CallExpr(Location location, int sysCallId) :
       Expr(location), sysCallId(sysCallId) {}
-  CallExpr(Location location, int sysCallId, std::vector<std::unique_ptr<Expr>> args) :
-      Expr(location), sysCallId(sysCallId), args(std::move(args)) {}
-  CallExpr(Location location, std::string name) :
+  CallExpr(Location location, int sysCallId, NodeList<Expr> args) :
+      Expr(location), sysCallId(sysCallId), args(args) {}
+  CallExpr(Location location, Name name) :
       Expr(location), sysCallId(-1), name(name) {}
-  CallExpr(Location location, std::string name, std::vector<std::unique_ptr<Expr>> args) :
-      Expr(location), sysCallId(-1), name(name), args(std::move(args)) {}
+  CallExpr(Location location, Name name, NodeList<Expr> args) :
+      Expr(location), sysCallId(-1), name(name), args(args) {}
   virtual void accept(AstVisitor *visitor) override {
     visitor->visitPre(*this);
     if (visitor->shouldRecurseCalls()) {
@@ -692,8 +838,8 @@ public:
   bool isSysCall() const { return sysCallId != -1; }
   int getSysCallId() const { return sysCallId; }
   void setSysCallId(int value) { sysCallId = value; }
-  const std::string &getName() const { return name; }
-  const std::vector<std::unique_ptr<Expr>> &getArgs() { return args; }
+  Name getName() const { return name; }
+  const NodeList<Expr> &getArgs() { return args; }
 };
 
 class NumberExpr : public Expr {
@@ -721,23 +867,24 @@ public:
 };
 
 class StringExpr : public Expr {
-  std::string value;
+  // A copy in the arena.
+  std::string_view value;
 public:
-  StringExpr(Location location, std::string value) :
+  StringExpr(Location location, std::string_view value) :
       Expr(location), value(value) {}
   virtual void accept(AstVisitor *visitor) override {
     visitor->visitPre(*this);
     visitor->visitPost(*this);
   }
-  std::string getValue() const { return value; }
+  std::string_view getValue() const { return value; }
 };
 
 class UnaryOpExpr : public Expr {
   Token op;
-  std::unique_ptr<Expr> element;
+  Expr *element;
 public:
-  UnaryOpExpr(Location location, Token op, std::unique_ptr<Expr> element) :
-      Expr(location), op(op), element(std::move(element)) {}
+  UnaryOpExpr(Location location, Token op, Expr *element) :
+      Expr(location), op(op), element(element) {}
   virtual void accept(AstVisitor *visitor) override {
     visitor->visitPre(*this);
     if (!isConst() && visitor->shouldRecurseOp()) {
@@ -747,15 +894,15 @@ public:
     visitor->visitPost(*this);
   }
   Token getOp() const { return op; }
-  std::unique_ptr<Expr> &getElement() { return element; }
+  Expr *getElement() { return element; }
 };
 
 class BinaryOpExpr : public Expr {
   Token op;
-  std::unique_ptr<Expr> LHS, RHS;
+  Expr *LHS, *RHS;
 public:
-  BinaryOpExpr(Location location, Token op, std::unique_ptr<Expr> LHS, std::unique_ptr<Expr> RHS) :
-      Expr(location), op(op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+  BinaryOpExpr(Location location, Token op, Expr *LHS, Expr *RHS) :
+      Expr(location), op(op), LHS(LHS), RHS(RHS) {}
   virtual void accept(AstVisitor *visitor) override {
     visitor->visitPre(*this);
     if (!isConst() && visitor->shouldRecurseOp()) {
@@ -767,41 +914,39 @@ public:
     visitor->visitPost(*this);
   }
   Token getOp() const { return op; }
-  std::unique_ptr<Expr> &getLHS() { return LHS; }
-  std::unique_ptr<Expr> &getRHS() { return RHS; }
-  void setLHS(std::unique_ptr<Expr> &newLHS) { LHS = std::move(newLHS); }
-  void setRHS(std::unique_ptr<Expr> &newRHS) { RHS = std::move(newRHS); }
+  Expr *getLHS() { return LHS; }
+  Expr *getRHS() { return RHS; }
 };
 
 // Declarations ============================================================ //
 
 class Decl : public AstNode {
-  std::string name;
+  Name name;
 public:
-  Decl(Location location, std::string name) : AstNode(location), name(name) {}
-  std::string getName() const { return name; }
+  Decl(Location location, Name name) : AstNode(location), name(name) {}
+  Name getName() const { return name; }
 };
 
 class ValDecl : public Decl {
-  std::unique_ptr<Expr> expr;
+  Expr *expr;
   int exprValue;
 public:
-  ValDecl(Location location, std::string name, std::unique_ptr<Expr> expr) :
-      Decl(location, name), expr(std::move(expr)) {}
+  ValDecl(Location location, Name name, Expr *expr) :
+      Decl(location, name), expr(expr) {}
   virtual void accept(AstVisitor *visitor) override {
     visitor->visitPre(*this);
     expr->accept(visitor);
     replaceExpr(expr, visitor);
     visitor->visitPost(*this);
   }
-  Expr *getExpr() const { return expr.get(); }
+  Expr *getExpr() const { return expr; }
   int getValue() const { return exprValue; }
   void setValue(int value) { exprValue = value; }
 };
 
 class VarDecl : public Decl {
 public:
-  VarDecl(Location location, std::string name) : Decl(location, name) {}
+  VarDecl(Location location, Name name) : Decl(location, name) {}
   virtual void accept(AstVisitor *visitor) override {
     visitor->visitPre(*this);
     visitor->visitPost(*this);
@@ -809,10 +954,10 @@ public:
 };
 
 class ArrayDecl : public Decl {
-  std::unique_ptr<Expr> expr;
+  Expr *expr;
 public:
-  ArrayDecl(Location location, std::string name, std::unique_ptr<Expr> expr) :
-      Decl(location, name), expr(std::move(expr)) {}
+  ArrayDecl(Location location, Name name, Expr *expr) :
+      Decl(location, name), expr(expr) {}
   virtual void accept(AstVisitor *visitor) override {
     visitor->visitPre(*this);
     expr->accept(visitor);
@@ -821,7 +966,7 @@ public:
   }
   int getSize() {
     if (!expr->isConst()) {
-      throw NonConstArrayLengthError(getLocation(), getName());
+      throw NonConstArrayLengthError(getLocation(), std::string(getName().str()));
     }
     return expr->getValue();
   }
@@ -830,15 +975,15 @@ public:
 // Formals ================================================================= //
 
 class Formal : public AstNode {
-  std::string name;
+  Name name;
 public:
-  Formal(Location location, std::string name) : AstNode(location), name(name) {}
-  std::string getName() const { return name; }
+  Formal(Location location, Name name) : AstNode(location), name(name) {}
+  Name getName() const { return name; }
 };
 
 class ValFormal : public Formal {
 public:
-  ValFormal(Location location, std::string name) : Formal(location, name) {}
+  ValFormal(Location location, Name name) : Formal(location, name) {}
   virtual void accept(AstVisitor *visitor) override {
     visitor->visitPre(*this);
     visitor->visitPost(*this);
@@ -847,7 +992,7 @@ public:
 
 class ArrayFormal : public Formal {
 public:
-  ArrayFormal(Location location, std::string name) : Formal(location, name) {}
+  ArrayFormal(Location location, Name name) : Formal(location, name) {}
   virtual void accept(AstVisitor *visitor) override {
     visitor->visitPre(*this);
     visitor->visitPost(*this);
@@ -856,7 +1001,7 @@ public:
 
 class ProcFormal : public Formal {
 public:
-  ProcFormal(Location location, std::string name) : Formal(location, name) {}
+  ProcFormal(Location location, Name name) : Formal(location, name) {}
   virtual void accept(AstVisitor *visitor) override {
     visitor->visitPre(*this);
     visitor->visitPost(*this);
@@ -865,7 +1010,7 @@ public:
 
 class FuncFormal : public Formal {
 public:
-  FuncFormal(Location location, std::string name) : Formal(location, name) {}
+  FuncFormal(Location location, Name name) : Formal(location, name) {}
   virtual void accept(AstVisitor *visitor) override {
     visitor->visitPre(*this);
     visitor->visitPost(*this);
@@ -897,10 +1042,10 @@ public:
 };
 
 class ReturnStatement : public Statement {
-  std::unique_ptr<Expr> expr;
+  Expr *expr;
 public:
-  ReturnStatement(Location location, std::unique_ptr<Expr> expr) :
-      Statement(location), expr(std::move(expr)) {}
+  ReturnStatement(Location location, Expr *expr) :
+      Statement(location), expr(expr) {}
   virtual void accept(AstVisitor *visitor) override {
     visitor->visitPre(*this);
     if (visitor->shouldRecurseStmts()) {
@@ -909,23 +1054,24 @@ public:
     }
     visitor->visitPost(*this);
   }
-  Expr *getExpr() { return expr.get(); }
+  Expr *getExpr() { return expr; }
+  void setExpr(Expr *newExpr) { expr = newExpr; }
 };
 
 
 class IfStatement : public Statement {
-  std::unique_ptr<Expr> condition;
-  std::unique_ptr<Statement> thenStmt;
-  std::unique_ptr<Statement> elseStmt;
+  Expr *condition;
+  Statement *thenStmt;
+  Statement *elseStmt;
 public:
   IfStatement(Location location,
-              std::unique_ptr<Expr> condition,
-              std::unique_ptr<Statement> thenStmt,
-              std::unique_ptr<Statement> elseStmt) :
+              Expr *condition,
+              Statement *thenStmt,
+              Statement *elseStmt) :
       Statement(location),
-      condition(std::move(condition)),
-      thenStmt(std::move(thenStmt)),
-      elseStmt(std::move(elseStmt)) {}
+      condition(condition),
+      thenStmt(thenStmt),
+      elseStmt(elseStmt) {}
   virtual void accept(AstVisitor *visitor) override {
     visitor->visitPre(*this);
     if (visitor->shouldRecurseStmts()) {
@@ -936,21 +1082,24 @@ public:
     }
     visitor->visitPost(*this);
   }
-  const std::unique_ptr<Expr> &getCondition() { return condition; }
-  const std::unique_ptr<Statement> &getThenStmt() { return thenStmt; }
-  const std::unique_ptr<Statement> &getElseStmt() { return elseStmt; }
+  Expr *getCondition() { return condition; }
+  void setCondition(Expr *expr) { condition = expr; }
+  Statement *getThenStmt() { return thenStmt; }
+  Statement *getElseStmt() { return elseStmt; }
+  void setThenStmt(Statement *stmt) { thenStmt = stmt; }
+  void setElseStmt(Statement *stmt) { elseStmt = stmt; }
 };
 
 class WhileStatement : public Statement {
-  std::unique_ptr<Expr> condition;
-  std::unique_ptr<Statement> stmt;
+  Expr *condition;
+  Statement *stmt;
 public:
-  WhileStatement(Location location, 
-                 std::unique_ptr<Expr> condition,
-                 std::unique_ptr<Statement> stmt) :
+  WhileStatement(Location location,
+                 Expr *condition,
+                 Statement *stmt) :
       Statement(location),
-      condition(std::move(condition)),
-      stmt(std::move(stmt)) {}
+      condition(condition),
+      stmt(stmt) {}
   virtual void accept(AstVisitor *visitor) override {
     visitor->visitPre(*this);
     if (visitor->shouldRecurseStmts()) {
@@ -960,29 +1109,31 @@ public:
     }
     visitor->visitPost(*this);
   }
-  const std::unique_ptr<Expr> &getCondition() { return condition; }
-  const std::unique_ptr<Statement> &getStmt() { return stmt; }
+  Expr *getCondition() { return condition; }
+  Statement *getStmt() { return stmt; }
+  void setStmt(Statement *newStmt) { stmt = newStmt; }
 };
 
 class SeqStatement : public Statement {
-  std::vector<std::unique_ptr<Statement>> stmts;
+  NodeList<Statement> stmts;
 public:
-  SeqStatement(Location location, std::vector<std::unique_ptr<Statement>> stmts) :
-      Statement(location), stmts(std::move(stmts)) {}
+  SeqStatement(Location location, NodeList<Statement> stmts) :
+      Statement(location), stmts(stmts) {}
   virtual void accept(AstVisitor *visitor) override {
     visitor->visitPre(*this);
-    for (auto &stmt : stmts) {
+    for (auto stmt : stmts) {
       stmt->accept(visitor);
     }
     visitor->visitPost(*this);
   }
+  const NodeList<Statement> &getStmts() { return stmts; }
 };
 
 class CallStatement : public Statement {
-  std::unique_ptr<CallExpr> call;
+  CallExpr *call;
 public:
-  CallStatement(Location location, std::unique_ptr<CallExpr> call) :
-      Statement(location), call(std::move(call)) {}
+  CallStatement(Location location, CallExpr *call) :
+      Statement(location), call(call) {}
   virtual void accept(AstVisitor *visitor) override {
     visitor->visitPre(*this);
     if (visitor->shouldRecurseStmts()) {
@@ -991,16 +1142,34 @@ public:
     }
     visitor->visitPost(*this);
   }
-  CallExpr *getCall() { return call.get(); }
+  CallExpr *getCall() { return call; }
+};
+
+/// A call of a procedure or function to itself in tail position, which
+/// assigns the actuals to the formals and branches back to the start of the
+/// body, instead of creating a new frame.
+class TailCallStatement : public Statement {
+  CallExpr *call;
+public:
+  TailCallStatement(Location location, CallExpr *call) :
+      Statement(location), call(call) {}
+  virtual void accept(AstVisitor *visitor) override {
+    visitor->visitPre(*this);
+    if (visitor->shouldRecurseStmts()) {
+      call->accept(visitor);
+    }
+    visitor->visitPost(*this);
+  }
+  CallExpr *getCall() { return call; }
 };
 
 class AssStatement : public Statement {
-  std::unique_ptr<Expr> LHS, RHS;
+  Expr *LHS, *RHS;
 public:
   AssStatement(Location location,
-               std::unique_ptr<Expr> LHS,
-               std::unique_ptr<Expr> RHS) :
-      Statement(location), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+               Expr *LHS,
+               Expr *RHS) :
+      Statement(location), LHS(LHS), RHS(RHS) {}
   virtual void accept(AstVisitor *visitor) override {
     visitor->visitPre(*this);
     if (visitor->shouldRecurseStmts()) {
@@ -1011,35 +1180,36 @@ public:
     }
     visitor->visitPost(*this);
   }
-  const std::unique_ptr<Expr> &getLHS() { return LHS; }
-  const std::unique_ptr<Expr> &getRHS() { return RHS; }
+  Expr *getLHS() { return LHS; }
+  Expr *getRHS() { return RHS; }
+  void setRHS(Expr *expr) { RHS = expr; }
 };
 
 // Procedures and functions ================================================= //
 
 class Proc : public AstNode {
   bool function;
-  std::string name;
-  std::vector<std::unique_ptr<Formal>> formals;
-  std::vector<std::unique_ptr<Decl>> decls;
-  std::unique_ptr<Statement> statement;
+  Name name;
+  NodeList<Formal> formals;
+  NodeList<Decl> decls;
+  Statement *statement;
+  bool tailCalls;
 public:
   Proc(Location location,
        bool isFunction,
-       std::string name,
-       std::vector<std::unique_ptr<Formal>> formals,
-       std::vector<std::unique_ptr<Decl>> decls,
-       std::unique_ptr<Statement> statement) :
+       Name name,
+       NodeList<Formal> formals,
+       NodeList<Decl> decls,
+       Statement *statement) :
       AstNode(location), function(isFunction), name(name),
-      formals(std::move(formals)), decls(std::move(decls)),
-      statement(std::move(statement)) {}
+      formals(formals), decls(decls), statement(statement), tailCalls(false) {}
   virtual void accept(AstVisitor *visitor) override {
     visitor->visitPre(*this);
     visitor->enterProc(name);
-    for (auto &formal : formals) {
+    for (auto formal : formals) {
       formal->accept(visitor);
     }
-    for (auto &decl : decls) {
+    for (auto decl : decls) {
       decl->accept(visitor);
     }
     statement->accept(visitor);
@@ -1047,31 +1217,43 @@ public:
     visitor->visitPost(*this);
   }
   bool isFunction() const { return function; }
-  const std::string &getName() const { return name; }
-  std::vector<std::unique_ptr<Formal>> &getFormals() { return formals; }
-  std::vector<std::unique_ptr<Decl>> &getDecls() { return decls; }
-  const std::unique_ptr<Statement> &getStatement() { return statement; }
+  Name getName() const { return name; }
+  const NodeList<Formal> &getFormals() { return formals; }
+  const NodeList<Decl> &getDecls() { return decls; }
+  Statement *getStatement() { return statement; }
+  void setDecls(NodeList<Decl> newDecls) { decls = newDecls; }
+  void setStatement(Statement *stmt) { statement = stmt; }
+  bool hasTailCalls() const { return tailCalls; }
+  void setTailCalls() { tailCalls = true; }
 };
 
-class Program : public AstNode {
-  std::vector<std::unique_ptr<Decl>> globalDecls;
-  std::vector<std::unique_ptr<Proc>> procDecls;
+/// The root of a syntax tree, which owns the arena holding the nodes and the
+/// names of the tree, so destroying a program frees the whole tree at once.
+class Program final : public AstNode {
+  Arena arena;
+  NameTable names;
+  NodeList<Decl> globalDecls;
+  NodeList<Proc> procDecls;
 public:
-  Program(std::vector<std::unique_ptr<Decl>> globals,
-          std::vector<std::unique_ptr<Proc>> procs) :
-      globalDecls(std::move(globals)), procDecls(std::move(procs)) {}
+  Program() : names(arena) {}
   virtual void accept(AstVisitor *visitor) override {
     visitor->visitPre(*this);
     visitor->enterProgram();
-    for (auto &decl : globalDecls) {
+    for (auto decl : globalDecls) {
       decl->accept(visitor);
     }
-    for (auto &proc : procDecls) {
+    for (auto proc : procDecls) {
       proc->accept(visitor);
     }
     visitor->exitProgram();
     visitor->visitPost(*this);
   }
+  void setDecls(NodeList<Decl> globals, NodeList<Proc> procs) {
+    globalDecls = globals;
+    procDecls = procs;
+  }
+  Arena &getArena() { return arena; }
+  NameTable &getNames() { return names; }
 };
 
 // AST printer visitor ===================================================== //
@@ -1238,6 +1420,13 @@ public:
   void visitPost(CallStatement &stmt) override {
     indentCount--;
   };
+  void visitPre(TailCallStatement &stmt) override {
+    indent(); outs << boost::format("tailcallstmt %s%s\n") % stmt.getCall()->getName() % locString(stmt);
+    indentCount++;
+  };
+  void visitPost(TailCallStatement &stmt) override {
+    indentCount--;
+  };
   void visitPre(AssStatement &stmt) override {
     indent(); outs << boost::format("assstmt%s\n") % locString(stmt);
     indentCount++;
@@ -1253,6 +1442,14 @@ public:
 
 class Parser {
   Lexer &lexer;
+  Arena *arena;
+  NameTable *names;
+
+  /// Create a node in the arena of the program being parsed.
+  template<typename T, typename... Args>
+  T *create(Args&&... args) {
+    return arena->create<T>(std::forward<Args>(args)...);
+  }
 
   /// Expect the given last token, otherwise raise an error.
   void expect(Token token) const {
@@ -1263,9 +1460,9 @@ class Parser {
   }
 
   /// identifier
-  std::string parseIdentifier() {
+  Name parseIdentifier() {
     if (lexer.getLastToken() == Token::IDENTIFIER) {
-      auto name = lexer.getIdentifier();
+      auto name = names->intern(lexer.getIdentifier());
       lexer.getNextToken();
       return name;
     } else {
@@ -1285,13 +1482,13 @@ class Parser {
   /// binary-op-RHS :=
   ///   <binary-op> <element> <binary-op>
   ///   <element>
-  std::unique_ptr<Expr> parseBinOpRHS(Token op) {
+  Expr *parseBinOpRHS(Token op) {
     auto location = lexer.getLocation();
     auto element = parseElement();
     if (isAssociative(op) && op == lexer.getLastToken()) {
       lexer.getNextToken();
       auto RHS = parseBinOpRHS(op);
-      return std::make_unique<BinaryOpExpr>(location, op, std::move(element), std::move(RHS));
+      return create<BinaryOpExpr>(location, op, element, RHS);
     } else {
       return element;
     }
@@ -1302,19 +1499,19 @@ class Parser {
   ///   "~" <element>
   ///   <element> <binary-op-RHS>
   ///   <element>
-  std::unique_ptr<Expr> parseExpr() {
+  Expr *parseExpr() {
     auto location = lexer.getLocation();
     // Unary operations.
     if (lexer.getLastToken() == Token::MINUS) {
       auto location = lexer.getLocation();
       lexer.getNextToken();
       auto element = parseElement();
-      return std::make_unique<UnaryOpExpr>(location, Token::MINUS, std::move(element));
+      return create<UnaryOpExpr>(location, Token::MINUS, element);
     }
     if (lexer.getLastToken() == Token::NOT) {
       lexer.getNextToken();
       auto element = parseElement();
-      return std::make_unique<UnaryOpExpr>(location, Token::NOT, std::move(element));
+      return create<UnaryOpExpr>(location, Token::NOT, element);
     }
     auto element = parseElement();
     auto op = lexer.getLastToken();
@@ -1322,7 +1519,7 @@ class Parser {
       // Binary operation.
       lexer.getNextToken();
       auto RHS = parseBinOpRHS(op);
-      return std::make_unique<BinaryOpExpr>(location, op, std::move(element), std::move(RHS));
+      return create<BinaryOpExpr>(location, op, element, RHS);
     }
     // Otherwise just return an element.
     return element;
@@ -1330,14 +1527,14 @@ class Parser {
 
   /// expression-list :=
   ///   <expr> [ "," <expr> ]
-  std::vector<std::unique_ptr<Expr>> parseExprList() {
-    std::vector<std::unique_ptr<Expr>> exprList;
+  NodeList<Expr> parseExprList() {
+    std::vector<Expr*> exprList;
     exprList.push_back(parseExpr());
     while (lexer.getLastToken() == Token::COMMA) {
       lexer.getNextToken();
       exprList.push_back(parseExpr());
     }
-    return exprList;
+    return arena->createList(exprList);
   }
 
   /// element :=
@@ -1351,7 +1548,7 @@ class Parser {
   ///   "false"
   ///   "(" ")"
   ///   "(" <expr> ")"
-  std::unique_ptr<Expr> parseElement() {
+  Expr *parseElement() {
     auto location = lexer.getLocation();
     switch (lexer.getLastToken()) {
     case Token::IDENTIFIER: {
@@ -1361,20 +1558,20 @@ class Parser {
         lexer.getNextToken();
         auto expr = parseExpr();
         expect(Token::RBRACKET);
-        return std::make_unique<ArraySubscriptExpr>(location, name, std::move(expr));
+        return create<ArraySubscriptExpr>(location, name, expr);
       // Procedure call.
       } else if (lexer.getLastToken() == Token::LPAREN) {
         if (lexer.getNextToken() == Token::RPAREN) {
           lexer.getNextToken();
-          return std::make_unique<CallExpr>(location, name);
+          return create<CallExpr>(location, name);
         } else {
           auto exprList = parseExprList();
           expect(Token::RPAREN);
-          return std::make_unique<CallExpr>(location, name, std::move(exprList));
+          return create<CallExpr>(location, name, exprList);
         }
       // Variable reference.
       } else {
-        return std::make_unique<VarRefExpr>(location, name);
+        return create<VarRefExpr>(location, name);
       }
     }
     case Token::NUMBER: {
@@ -1384,26 +1581,26 @@ class Parser {
       if (lexer.getLastToken() == Token::LPAREN) {
         if (lexer.getNextToken() == Token::RPAREN) {
           lexer.getNextToken();
-          return std::make_unique<CallExpr>(location, value);
+          return create<CallExpr>(location, value);
         } else {
           auto exprList = parseExprList();
           expect(Token::RPAREN);
-          return std::make_unique<CallExpr>(location, value, std::move(exprList));
+          return create<CallExpr>(location, value, exprList);
         }
       } else {
         // Number.
-        return std::make_unique<NumberExpr>(location, value);
+        return create<NumberExpr>(location, value);
       }
     }
     case Token::STRING:
       lexer.getNextToken();
-      return std::make_unique<StringExpr>(location, lexer.getString());
+      return create<StringExpr>(location, arena->copyString(lexer.getString()));
     case Token::TRUE:
       lexer.getNextToken();
-      return std::make_unique<BooleanExpr>(location, true);
+      return create<BooleanExpr>(location, true);
     case Token::FALSE:
       lexer.getNextToken();
-      return std::make_unique<BooleanExpr>(location, false);
+      return create<BooleanExpr>(location, false);
     case Token::LPAREN: {
       lexer.getNextToken();
       auto expr = parseExpr();
@@ -1419,7 +1616,7 @@ class Parser {
   ///   "val" <identifier> "=" <expr> ";"
   ///   "var" <identifier> ";"
   ///   "array" <identifier> "[" <expr> "]" ";"
-  std::unique_ptr<Decl> parseDecl() {
+  Decl *parseDecl() {
     auto location = lexer.getLocation();
     switch (lexer.getLastToken()) {
     case Token::VAL: {
@@ -1428,13 +1625,13 @@ class Parser {
       expect(Token::EQ);
       auto expr = parseExpr();
       expect(Token::SEMICOLON);
-      return std::make_unique<ValDecl>(location, name, std::move(expr));
+      return create<ValDecl>(location, name, expr);
     }
     case Token::VAR: {
       lexer.getNextToken();
       auto name = parseIdentifier();
       expect(Token::SEMICOLON);
-      return std::make_unique<VarDecl>(location, name);
+      return create<VarDecl>(location, name);
     }
     case Token::ARRAY: {
       lexer.getNextToken();
@@ -1443,7 +1640,7 @@ class Parser {
       auto expr = parseExpr();
       expect(Token::RBRACKET);
       expect(Token::SEMICOLON);
-      return std::make_unique<ArrayDecl>(location, name, std::move(expr));
+      return create<ArrayDecl>(location, name, expr);
     }
     default:
       throw ParserTokenError(location, "invalid declaration", lexer.getLastToken());
@@ -1455,13 +1652,13 @@ class Parser {
   /// local-decl :=
   ///   "val" ...
   ///   "var" ...
-  std::vector<std::unique_ptr<Decl>> parseLocalDecls() {
-    std::vector<std::unique_ptr<Decl>> decls;
+  NodeList<Decl> parseLocalDecls() {
+    std::vector<Decl*> decls;
     while (lexer.getLastToken() == Token::VAL ||
            lexer.getLastToken() == Token::VAR) {
       decls.push_back(parseDecl());
     }
-    return decls;
+    return arena->createList(decls);
   }
 
   /// global-decls :=
@@ -1470,20 +1667,20 @@ class Parser {
   ///   "val" ...
   ///   "var" ...
   ///   "global" ...
-  std::vector<std::unique_ptr<Decl>> parseGlobalDecls() {
-    std::vector<std::unique_ptr<Decl>> decls;
+  NodeList<Decl> parseGlobalDecls() {
+    std::vector<Decl*> decls;
     while (lexer.getLastToken() == Token::VAL ||
            lexer.getLastToken() == Token::VAR ||
            lexer.getLastToken() == Token::ARRAY) {
       decls.push_back(parseDecl());
     }
-    return decls;
+    return arena->createList(decls);
   }
 
   /// formals :=
   ///   [0 <formal> "," ]
-  std::vector<std::unique_ptr<Formal>> parseFormals() {
-    std::vector<std::unique_ptr<Formal>> formals;
+  NodeList<Formal> parseFormals() {
+    std::vector<Formal*> formals;
       while (true) {
       formals.push_back(parseFormal());
       if (lexer.getLastToken() == Token::COMMA) {
@@ -1492,7 +1689,7 @@ class Parser {
         break;
       }
     }
-    return formals;
+    return arena->createList(formals);
   }
 
   /// formal :=
@@ -1500,21 +1697,21 @@ class Parser {
   ///   "array" <name>
   ///   "proc" <name>
   ///   "func" <name>
-  std::unique_ptr<Formal> parseFormal() {
+  Formal *parseFormal() {
     auto location = lexer.getLocation();
     switch (lexer.getLastToken()) {
     case Token::VAL:
       lexer.getNextToken();
-      return std::make_unique<ValFormal>(location, parseIdentifier());
+      return create<ValFormal>(location, parseIdentifier());
     case Token::ARRAY:
       lexer.getNextToken();
-      return std::make_unique<ArrayFormal>(location, parseIdentifier());
+      return create<ArrayFormal>(location, parseIdentifier());
     case Token::PROC:
       lexer.getNextToken();
-      return std::make_unique<ProcFormal>(location, parseIdentifier());
+      return create<ProcFormal>(location, parseIdentifier());
     case Token::FUNC:
       lexer.getNextToken();
-      return std::make_unique<FuncFormal>(location, parseIdentifier());
+      return create<FuncFormal>(location, parseIdentifier());
     default:
       throw ParserTokenError(location, "invalid formal", lexer.getLastToken());
     }
@@ -1522,14 +1719,14 @@ class Parser {
 
   /// statements :=
   ///   [1 <stmt> "," ]
-  std::vector<std::unique_ptr<Statement>> parseStatements() {
-    std::vector<std::unique_ptr<Statement>> stmts;
+  NodeList<Statement> parseStatements() {
+    std::vector<Statement*> stmts;
     stmts.push_back(parseStatement());
     while (lexer.getLastToken() == Token::SEMICOLON) {
       lexer.getNextToken();
       stmts.push_back(parseStatement());
     }
-    return stmts;
+    return arena->createList(stmts);
   }
 
   /// statement :=
@@ -1542,18 +1739,18 @@ class Parser {
   ///   <identifier> ":=" <expr>
   ///   <identifier> "(" <expr-list> ")"
   ///   <number> "(" [ <expr-list> ")"
-  std::unique_ptr<Statement> parseStatement() {
+  Statement *parseStatement() {
     auto location = lexer.getLocation();
     switch (lexer.getLastToken()) {
     case Token::SKIP:
       lexer.getNextToken();
-      return std::make_unique<SkipStatement>(location);
+      return create<SkipStatement>(location);
     case Token::STOP:
       lexer.getNextToken();
-      return std::make_unique<StopStatement>(location);
+      return create<StopStatement>(location);
     case Token::RETURN:
       lexer.getNextToken();
-      return std::make_unique<ReturnStatement>(location, parseExpr());
+      return create<ReturnStatement>(location, parseExpr());
     case Token::IF: {
       lexer.getNextToken();
       auto condition = parseExpr();
@@ -1561,43 +1758,36 @@ class Parser {
       auto thenStmt = parseStatement();
       expect(Token::ELSE);
       auto elseStmt = parseStatement();
-      return std::make_unique<IfStatement>(location,
-                                           std::move(condition),
-                                           std::move(thenStmt),
-                                           std::move(elseStmt));
+      return create<IfStatement>(location, condition, thenStmt, elseStmt);
     }
     case Token::WHILE: {
       lexer.getNextToken();
       auto condition = parseExpr();
       expect(Token::DO);
       auto stmt = parseStatement();
-      return std::make_unique<WhileStatement>(location,
-                                              std::move(condition),
-                                              std::move(stmt));
+      return create<WhileStatement>(location, condition, stmt);
     }
     case Token::BEGIN: {
       lexer.getNextToken();
       auto body = parseStatements();
       expect(Token::END);
-      return std::make_unique<SeqStatement>(location, std::move(body));
+      return create<SeqStatement>(location, body);
     }
     case Token::IDENTIFIER: {
       auto element = parseElement();
       // Procedure call
-      if (dynamic_cast<CallExpr*>(element.get())) {
-        auto callExpr = std::unique_ptr<CallExpr>(static_cast<CallExpr*>(element.release()));
-        return std::make_unique<CallStatement>(location, std::move(callExpr));
+      if (auto callExpr = dynamic_cast<CallExpr*>(element)) {
+        return create<CallStatement>(location, callExpr);
       }
       // Assignment
       expect(Token::ASS);
-      return std::make_unique<AssStatement>(location, std::move(element), parseExpr());
+      return create<AssStatement>(location, element, parseExpr());
     }
     case Token::NUMBER: {
       auto element = parseElement();
       // System call
-      if (dynamic_cast<CallExpr*>(element.get())) {
-        auto callExpr = std::unique_ptr<CallExpr>(static_cast<CallExpr*>(element.release()));
-        return std::make_unique<CallStatement>(location, std::move(callExpr));
+      if (auto callExpr = dynamic_cast<CallExpr*>(element)) {
+        return create<CallStatement>(location, callExpr);
       } else {
         throw ParserTokenError(location, "invalid statement beginning with number", lexer.getLastToken());
       }
@@ -1609,7 +1799,7 @@ class Parser {
 
   /// proc-decl :=
   ///  "proc" <name> "(" <formals> ")" "is" [0 <var-decl> ] <statement>
-  std::unique_ptr<Proc> parseProcDecl() {
+  Proc *parseProcDecl() {
     auto location = lexer.getLocation();
     bool isFunction = lexer.getLastToken() == Token::FUNC;
     lexer.getNextToken();
@@ -1617,7 +1807,7 @@ class Parser {
     auto name = parseIdentifier();
     // Formals
     expect(Token::LPAREN);
-    std::vector<std::unique_ptr<Formal>> formals;
+    NodeList<Formal> formals;
     if (lexer.getLastToken() == Token::RPAREN) {
       lexer.getNextToken();
     } else {
@@ -1627,38 +1817,40 @@ class Parser {
     // "is"
     expect(Token::IS);
     // Declarations
-    std::vector<std::unique_ptr<Decl>> decls;
+    NodeList<Decl> decls;
     if (lexer.getLastToken() == Token::VAL ||
         lexer.getLastToken() == Token::VAR) {
       decls = parseLocalDecls();
     }
     auto statement = parseStatement();
-    return std::make_unique<Proc>(location, isFunction, name, std::move(formals),
-                                  std::move(decls), std::move(statement));
+    return create<Proc>(location, isFunction, name, formals, decls, statement);
   }
 
   /// proc-decls :=
   ///   [1 <proc-decl> ]
-  std::vector<std::unique_ptr<Proc>> parseProcDecls() {
-    std::vector<std::unique_ptr<Proc>> procDecls;
+  NodeList<Proc> parseProcDecls() {
+    std::vector<Proc*> procDecls;
     while (lexer.getLastToken() == Token::PROC ||
            lexer.getLastToken() == Token::FUNC) {
       procDecls.push_back(parseProcDecl());
     }
-    return procDecls;
+    return arena->createList(procDecls);
   }
 
 public:
-  Parser(Lexer &lexer) : lexer(lexer) {}
+  Parser(Lexer &lexer) : lexer(lexer), arena(nullptr), names(nullptr) {}
 
   std::unique_ptr<Program> parseProgram() {
+    auto program = std::make_unique<Program>();
+    arena = &program->getArena();
+    names = &program->getNames();
     lexer.getNextToken();
     auto globalDecls = parseGlobalDecls();
     auto procDecls = parseProcDecls();
     lexer.getNextToken();
     expect(Token::END_OF_FILE);
-    return std::make_unique<Program>(std::move(globalDecls),
-                                     std::move(procDecls));
+    program->setDecls(globalDecls, procDecls);
+    return program;
   }
 };
 
@@ -1686,6 +1878,8 @@ class Frame {
   size_t size;
   // Exit label.
   std::string exitLabel;
+  // Label of the start of the body, which is the target of tail calls.
+  std::string entryLabel;
 
 public:
   Frame(std::string exitLabel) : offset(0), size(0), exitLabel(exitLabel) {}
@@ -1700,6 +1894,8 @@ public:
   void setOffset(int value) { offset = value; }
   size_t getOffset() { return offset; }
   const std::string &getExitLabel() const { return exitLabel; }
+  const std::string &getEntryLabel() const { return entryLabel; }
+  void setEntryLabel(const std::string &label) { entryLabel = label; }
 };
 
 /// A class to represent a symbol in the program, recording type, scope, AST
@@ -1707,54 +1903,109 @@ public:
 class Symbol {
   SymbolType type;
   AstNode *node;
-  const std::string scope;
-  const std::string name;
-  std::shared_ptr<Frame> frame;
+  Name scope;
+  Name name;
+  Frame *frame;
   int stackOffset;
   std::string globalLabel;
 
 public:
-  Symbol(SymbolType type, AstNode *node, const std::string &scope, const std::string &name) :
-      type(type), node(node), scope(scope), name(name) {}
+  Symbol(SymbolType type, AstNode *node, Name scope, Name name) :
+      type(type), node(node), scope(scope), name(name), frame(nullptr),
+      stackOffset(0) {}
   SymbolType getType() const { return type; }
-  const std::string &getScope() const { return scope; }
+  Name getScope() const { return scope; }
   AstNode *getNode() const { return node; }
-  const std::string &getName() const { return name; }
-  void setFrame(std::shared_ptr<Frame> newFrame) { frame = newFrame; }
-  Frame *getFrame() { return frame.get(); }
+  Name getName() const { return name; }
+  void setFrame(Frame *newFrame) { frame = newFrame; }
+  Frame *getFrame() { return frame; }
   int getStackOffset() const { return stackOffset; }
   void setStackOffset(int value) { stackOffset = value; }
   const std::string &getGlobalLabel() const { return globalLabel; }
   void setGlobalLabel(const std::string &value) { globalLabel = value; }
 };
 
-using SymbolID = std::pair<const std::string, const std::string>;
-using SymbolIDRef = std::pair<const std::string&, const std::string&>;
-
+/// A flat hash table of symbols, keyed on the interned scope and name of each,
+/// so a lookup compares integers and never the text of an identifier. A name
+/// that is not found in a procedure's scope is looked up again in the global
+/// scope, which is the chain of scopes in X. The table holds the frames of the
+/// procedures, to which symbols refer.
 class SymbolTable {
-  std::map<SymbolID, std::unique_ptr<Symbol>> symbolMap;
+  struct Slot {
+    uint64_t key;
+    uint32_t index;
+  };
+  static constexpr uint32_t EMPTY = UINT32_MAX;
+  std::vector<Slot> slots;
+  std::deque<Symbol> symbols;
+  std::deque<Frame> frames;
+
+  static uint64_t makeKey(Name scope, Name name) {
+    return (static_cast<uint64_t>(scope.getId()) << 32) | name.getId();
+  }
+
+  size_t findSlot(uint64_t key) const {
+    size_t mask = slots.size() - 1;
+    size_t i = (key * 0x9E3779B97F4A7C15ULL) >> 32 & mask;
+    while (slots[i].index != EMPTY && slots[i].key != key) {
+      i = (i + 1) & mask;
+    }
+    return i;
+  }
+
+  void grow() {
+    std::vector<Slot> oldSlots(slots.size() * 2, Slot{0, EMPTY});
+    oldSlots.swap(slots);
+    for (auto &slot : oldSlots) {
+      if (slot.index != EMPTY) {
+        slots[findSlot(slot.key)] = slot;
+      }
+    }
+  }
+
+  Symbol *find(Name scope, Name name) {
+    auto &slot = slots[findSlot(makeKey(scope, name))];
+    return slot.index == EMPTY ? nullptr : &symbols[slot.index];
+  }
 
 public:
-  void insert(SymbolIDRef identifier, std::unique_ptr<Symbol> symbol) {
-    //std::cout << "insert " << identifier.first << ", " << identifier.second <<"\n";
-    symbolMap[identifier] = std::move(symbol);
+  SymbolTable() : slots(64, Slot{0, EMPTY}) {}
+  SymbolTable(const SymbolTable&) = delete;
+  SymbolTable &operator=(const SymbolTable&) = delete;
+
+  /// Insert a symbol, replacing any with the same scope and name.
+  void insert(const Symbol &symbol) {
+    auto key = makeKey(symbol.getScope(), symbol.getName());
+    auto &slot = slots[findSlot(key)];
+    if (slot.index != EMPTY) {
+      symbols[slot.index] = symbol;
+      return;
+    }
+    slot = Slot{key, static_cast<uint32_t>(symbols.size())};
+    symbols.push_back(symbol);
+    if (symbols.size() * 2 > slots.size()) {
+      grow();
+    }
   }
 
   /// Lookup a symbol, and throw an exception if not found.
-  Symbol* lookup(SymbolIDRef identifier, const Location &location) {
-    //std::cout << "lookup " << identifier.first << ", " << identifier.second <<"\n";
-    auto it = symbolMap.find(identifier);
-    if (it != symbolMap.end()) {
-      return it->second.get();
+  Symbol* lookup(Name scope, Name name, const Location &location) {
+    if (auto symbol = find(scope, name)) {
+      return symbol;
     }
     // Check the global scope if no match found.
-    if (!identifier.first.empty()) {
-      it = symbolMap.find(std::make_pair("", identifier.second));
-      if (it != symbolMap.end()) {
-        return it->second.get();
+    if (!scope.empty()) {
+      if (auto symbol = find(Name(), name)) {
+        return symbol;
       }
     }
-    throw UnknownSymbolError(location, identifier.second);
+    throw UnknownSymbolError(location, std::string(name.str()));
+  }
+
+  /// Create a frame, which lives as long as the table.
+  Frame *createFrame(const std::string &exitLabel) {
+    frames.emplace_back(exitLabel);
+    return &frames.back();
   }
 };
 
@@ -1769,36 +2020,28 @@ public:
     AstVisitor(false, false, false), symbolTable(symbolTable) {}
   void visitPre(Proc &proc) {
     auto symbolType = proc.isFunction() ? SymbolType::FUNC : SymbolType::PROC;
-    symbolTable.insert(std::make_pair(getCurrentScope(), proc.getName()),
-                       std::make_unique<Symbol>(symbolType, &proc, getCurrentScope(), proc.getName()));
+    symbolTable.insert(Symbol(symbolType, &proc, getCurrentScope(), proc.getName()));
   }
   void visitPre(ArrayDecl &decl) {
-    symbolTable.insert(std::make_pair(getCurrentScope(), decl.getName()),
-                       std::make_unique<Symbol>(SymbolType::ARRAY, &decl, getCurrentScope(), decl.getName()));
+    symbolTable.insert(Symbol(SymbolType::ARRAY, &decl, getCurrentScope(), decl.getName()));
   }
   void visitPre(VarDecl &decl) {
-    symbolTable.insert(std::make_pair(getCurrentScope(), decl.getName()),
-                       std::make_unique<Symbol>(SymbolType::VAR, &decl, getCurrentScope(), decl.getName()));
+    symbolTable.insert(Symbol(SymbolType::VAR, &decl, getCurrentScope(), decl.getName()));
   }
   void visitPre(ValDecl &decl) {
-    symbolTable.insert(std::make_pair(getCurrentScope(), decl.getName()),
-                       std::make_unique<Symbol>(SymbolType::VAL, &decl, getCurrentScope(), decl.getName()));
+    symbolTable.insert(Symbol(SymbolType::VAL, &decl, getCurrentScope(), decl.getName()));
   }
   void visitPre(ValFormal &formal) {
-    symbolTable.insert(std::make_pair(getCurrentScope(), formal.getName()),
-                       std::make_unique<Symbol>(SymbolType::VAL, &formal, getCurrentScope(), formal.getName()));
+    symbolTable.insert(Symbol(SymbolType::VAL, &formal, getCurrentScope(), formal.getName()));
   }
   void visitPre(ArrayFormal &formal) {
-    symbolTable.insert(std::make_pair(getCurrentScope(), formal.getName()),
-                       std::make_unique<Symbol>(SymbolType::ARRAY, &formal, getCurrentScope(), formal.getName()));
+    symbolTable.insert(Symbol(SymbolType::ARRAY, &formal, getCurrentScope(), formal.getName()));
   }
   void visitPre(ProcFormal &formal) {
-    symbolTable.insert(std::make_pair(getCurrentScope(), formal.getName()),
-                       std::make_unique<Symbol>(SymbolType::PROC, &formal, getCurrentScope(), formal.getName()));
+    symbolTable.insert(Symbol(SymbolType::PROC, &formal, getCurrentScope(), formal.getName()));
   }
   void visitPre(FuncFormal &formal) {
-    symbolTable.insert(std::make_pair(getCurrentScope(), formal.getName()),
-                       std::make_unique<Symbol>(SymbolType::FUNC, &formal, getCurrentScope(), formal.getName()));
+    symbolTable.insert(Symbol(SymbolType::FUNC, &formal, getCurrentScope(), formal.getName()));
   }
 };
 
@@ -1817,8 +2060,8 @@ public:
     }
   }
   void visitPost(BinaryOpExpr &expr) {
-    auto &LHS = expr.getLHS();
-    auto &RHS = expr.getRHS();
+    auto LHS = expr.getLHS();
+    auto RHS = expr.getRHS();
     if (LHS->isConst() && RHS->isConst()) {
       // Evaluate binary expression.
       int result;
@@ -1840,7 +2083,7 @@ public:
     }
   }
   void visitPost(UnaryOpExpr &expr) {
-    auto &element = expr.getElement();
+    auto element = expr.getElement();
     if (element->isConst()) {
       // Evaluate unary expression.
       int result;
@@ -1863,8 +2106,7 @@ public:
   void visitPost(CallExpr &expr) {
     // Propagate constant values for syscalls.
     if (!expr.isSysCall()) {
-      auto symbol = symbolTable.lookup(std::make_pair(getCurrentScope(), expr.getName()),
-                                       expr.getLocation());
+      auto symbol = symbolTable.lookup(getCurrentScope(), expr.getName(), expr.getLocation());
       if (auto symbolExpr = dynamic_cast<const ValDecl*>(symbol->getNode())) {
         expr.setSysCallId(symbolExpr->getValue());
       } else {
@@ -1880,8 +2122,7 @@ public:
   void visitPost(ArraySubscriptExpr &expr) {}
   void visitPost(VarRefExpr &expr) {
     // Propagate constant values to variable references.
-    auto symbol = symbolTable.lookup(std::make_pair(getCurrentScope(), expr.getName()),
-                                     expr.getLocation());
+    auto symbol = symbolTable.lookup(getCurrentScope(), expr.getName(), expr.getLocation());
     if (auto symbolExpr = dynamic_cast<const ValDecl*>(symbol->getNode())) {
       expr.setValue(symbolExpr->getValue());
     }
@@ -1893,48 +2134,42 @@ public:
 //===---------------------------------------------------------------------===//
 
 class OptimiseExpr : public AstVisitor {
+  Arena &arena;
 public:
-  OptimiseExpr() {}
+  OptimiseExpr(Arena &arena) : arena(arena) {}
   void visitPost(BinaryOpExpr &expr) {
+    // Constant expressions are generated from their values.
+    if (expr.isConst()) {
+      return;
+    }
     // Translate relational operators ~=, >=, >, <= to expressions only using
     // <, =, ~.
     switch (expr.getOp()) {
       case Token::NE: {
         // LHS ~= RHS -> not(LHS = RHS)
-        auto eq = std::make_unique<BinaryOpExpr>(expr.getLocation(), Token::EQ,
-                                                 std::move(expr.getLHS()),
-                                                 std::move(expr.getRHS()));
-        auto replace = std::make_unique<UnaryOpExpr>(expr.getLocation(),
-                                                     Token::NOT, std::move(eq));
-        setExprReplacement(std::move(replace));
+        auto eq = arena.create<BinaryOpExpr>(expr.getLocation(), Token::EQ,
+                                             expr.getLHS(), expr.getRHS());
+        setExprReplacement(arena.create<UnaryOpExpr>(expr.getLocation(), Token::NOT, eq));
         break;
       }
       case Token::GE: {
         // LHS >= RHS -> not(LHS < RHS)
-        auto eq = std::make_unique<BinaryOpExpr>(expr.getLocation(), Token::LS,
-                                                 std::move(expr.getLHS()),
-                                                 std::move(expr.getRHS()));
-        auto replace = std::make_unique<UnaryOpExpr>(expr.getLocation(),
-                                                     Token::NOT, std::move(eq));
-        setExprReplacement(std::move(replace));
+        auto eq = arena.create<BinaryOpExpr>(expr.getLocation(), Token::LS,
+                                             expr.getLHS(), expr.getRHS());
+        setExprReplacement(arena.create<UnaryOpExpr>(expr.getLocation(), Token::NOT, eq));
         break;
       }
       case Token::GR: {
         // LHS > RHS -> RHS < LHS
-        auto replace = std::make_unique<BinaryOpExpr>(expr.getLocation(), Token::LS,
-                                                      std::move(expr.getRHS()),
-                                                      std::move(expr.getLHS()));
-        setExprReplacement(std::move(replace));
+        setExprReplacement(arena.create<BinaryOpExpr>(expr.getLocation(), Token::LS,
+                                                      expr.getRHS(), expr.getLHS()));
         break;
       }
       case Token::LE: {
         // LHS <= RHS -> not(RHS < LHS)
-        auto ls = std::make_unique<BinaryOpExpr>(expr.getLocation(), Token::LS,
-                                                 std::move(expr.getRHS()),
-                                                 std::move(expr.getLHS()));
-        auto replace = std::make_unique<UnaryOpExpr>(expr.getLocation(),
-                                                     Token::NOT, std::move(ls));
-        setExprReplacement(std::move(replace));
+        auto ls = arena.create<BinaryOpExpr>(expr.getLocation(), Token::LS,
+                                             expr.getRHS(), expr.getLHS());
+        setExprReplacement(arena.create<UnaryOpExpr>(expr.getLocation(), Token::NOT, ls));
         break;
       }
       default: break;
@@ -1943,203 +2178,855 @@ public:
   void visitPost(UnaryOpExpr &expr) {
     if (!expr.isConst() && expr.getOp() == Token::MINUS) {
       // Transform -x to 0 - x
-      auto zero = std::make_unique<NumberExpr>(expr.getLocation(), 0);
-      auto replace = std::make_unique<BinaryOpExpr>(expr.getLocation(), expr.getOp(),
-                                                    std::move(zero), std::move(expr.getElement()));
-      setExprReplacement(std::move(replace));
+      auto zero = arena.create<NumberExpr>(expr.getLocation(), 0);
+      setExprReplacement(arena.create<BinaryOpExpr>(expr.getLocation(), expr.getOp(),
+                                                    zero, expr.getElement()));
     }
   }
 };
 
 //===---------------------------------------------------------------------===//
-// Code generation.
+// Optimise calls.
 //===---------------------------------------------------------------------===//
 
-const int SP_OFFSET = 1;
-const int MAX_ADDRESS = hex::MAX_MEMORY_SIZE_WORDS;
-const int SP_LINK_VALUE_OFFSET = 0;
-const int SP_RETURN_VALUE_OFFSET = 1;
-const int FB_PARAM_OFFSET_FUNC = 2;
-const int FB_PARAM_OFFSET_PROC = 1;
-
-enum class Reg { A, B };
+/// The default maximum number of statements and expressions in the body of a
+/// procedure or function that is inlined at its call sites.
+const size_t DEFAULT_INLINE_SIZE_LIMIT = 16;
 
-class IntermediateDirective : public hexasm::Directive {
+/// Measure the body of a procedure or function, and record the names it
+/// refers to, to decide whether it can be inlined.
+class InlineCost : public AstVisitor {
 public:
-  IntermediateDirective(hexasm::Token token) : hexasm::Directive(token) {}
-  bool operandIsLabel() const { return false; }
-  size_t getSize() const { return 0; }
-  int getValue() const { return 0; }
+  size_t size;
+  size_t calls;
+  size_t sysCalls;
+  size_t returns;
+  size_t tailCalls;
+  size_t loops;
+  size_t subscriptAssigns;
+  std::vector<Name> varRefs;
+  std::vector<Name> subscripts;
+  std::vector<Name> assigned;
+  InlineCost() :
+    AstVisitor(true, true, true), size(0), calls(0), sysCalls(0), returns(0),
+    tailCalls(0), loops(0), subscriptAssigns(0) {}
+  void visitPost(BinaryOpExpr&) override { size++; }
+  void visitPost(UnaryOpExpr&) override { size++; }
+  void visitPost(StringExpr&) override { size++; }
+  void visitPost(BooleanExpr&) override { size++; }
+  void visitPost(NumberExpr&) override { size++; }
+  void visitPost(CallExpr &expr) override {
+    size++;
+    if (expr.isSysCall()) {
+      sysCalls++;
+    } else {
+      calls++;
+    }
+  }
+  void visitPost(ArraySubscriptExpr &expr) override {
+    size++;
+    subscripts.push_back(expr.getName());
+  }
+  void visitPost(VarRefExpr &expr) override {
+    size++;
+    if (!expr.isConst()) {
+      varRefs.push_back(expr.getName());
+    }
+  }
+  void visitPost(SkipStatement&) override { size++; }
+  void visitPost(StopStatement&) override { size++; }
+  void visitPost(ReturnStatement&) override { size++; returns++; }
+  void visitPost(IfStatement&) override { size++; }
+  void visitPost(WhileStatement&) override { size++; loops++; }
+  void visitPost(SeqStatement&) override { size++; }
+  void visitPost(CallStatement&) override { size++; }
+  void visitPost(TailCallStatement&) override { size++; tailCalls++; }
+  void visitPost(AssStatement &stmt) override {
+    size++;
+    if (auto varRef = dynamic_cast<VarRefExpr*>(stmt.getLHS())) {
+      assigned.push_back(varRef->getName());
+    } else {
+      subscriptAssigns++;
+    }
+  }
+  size_t countVarRefs(Name name) const {
+    return std::count(varRefs.begin(), varRefs.end(), name);
+  }
 };
 
-class SPValue : public IntermediateDirective {
-public:
-  SPValue() : IntermediateDirective(hexasm::Token::SP_VALUE) {}
-  std::string toString() const { return "SP_VALUE"; }
-};
+/// Optimise calls between procedures and functions, after OptimiseExpr:
+///  - A call of a procedure to itself as its last statement, or a return of
+///    a call of a function to itself, is replaced by a TailCallStatement,
+///    which branches to the start of the body instead of creating a frame.
+///  - A call of a small leaf procedure (that makes no calls other than
+///    syscalls) is replaced by its body, with its formals and locals renamed
+///    to locals added to the caller, so they are allocated in the caller's
+///    frame. The actuals are assigned to the formals' locals first.
+///  - A call of a small leaf function whose body is a single return is
+///    replaced by the returned expression, with the actuals substituted for
+///    its formals. Since the actuals of such a call must not contain calls,
+///    the expression has no side effects and the evaluation of the actuals
+///    can be duplicated or removed.
+///  - A call of a small pure function with returns only in tail position is
+///    hoisted out of the expressions of an assignment, if, return or call
+///    statement into statements before it, with the returns replaced by
+///    assignments to a local that replaces the call. Since the other calls
+///    of the statement must also be pure, hoisting does not change its
+///    result.
+/// Inlined names are suffixed with the index of the call site, and contain a
+/// '.', so they cannot clash with the identifiers of a program.
+class OptimiseCalls : public AstVisitor {
+  struct Substitution {
+    // Formals of a function and their actuals.
+    std::unordered_map<uint32_t, Expr*> exprs;
+    // Formals and locals of a procedure and the locals that replace them.
+    std::unordered_map<uint32_t, Name> names;
+    // The local that is assigned the values returned by a hoisted function.
+    Name result;
+  };
+  SymbolTable &st;
+  Arena &arena;
+  NameTable &names;
+  Proc *currentProc;
+  // A call statement, whose call cannot be replaced by an expression.
+  CallExpr *stmtCall;
+  std::vector<Decl*> decls;
+  std::map<Proc*, InlineCost> costs;
+  size_t numInlined;
+  size_t sizeLimit;
+
+  const InlineCost &getCost(Proc *proc) {
+    auto it = costs.find(proc);
+    if (it == costs.end()) {
+      it = costs.emplace(proc, InlineCost()).first;
+      proc->getStatement()->accept(&it->second);
+    }
+    return it->second;
+  }
 
-/// Procedure/function prologue.
-class Prologue : public IntermediateDirective {
-  Symbol *symbol;
-public:
-  Prologue(Symbol *symbol) : IntermediateDirective(hexasm::Token::PROLOGUE), symbol(symbol) {}
-  std::string toString() const { return "PROLOGUE " + symbol->getName(); }
-  Symbol *getSymbol() { return symbol; }
-  Frame *getFrame() { return symbol->getFrame(); }
-};
+  /// Return the procedure or function that a call refers to, or null if it is
+  /// a syscall or a formal.
+  Proc *getCallee(CallExpr *call) {
+    if (call->isSysCall()) {
+      return nullptr;
+    }
+    auto symbol = st.lookup(currentProc->getName(), call->getName(), call->getLocation());
+    auto callee = dynamic_cast<Proc*>(symbol->getNode());
+    if (!callee || callee->getFormals().size() != call->getArgs().size()) {
+      return nullptr;
+    }
+    return callee;
+  }
 
-/// Procedure/function epilogue.
-class Epilogue : public IntermediateDirective {
-  Symbol *symbol;
-public:
-  Epilogue(Symbol *symbol) : IntermediateDirective(hexasm::Token::EPILOGUE), symbol(symbol) {}
-  std::string toString() const { return "EPILOGUE " + symbol->getName(); }
-  Symbol *getSymbol() { return symbol; }
-  Frame *getFrame() { return symbol->getFrame(); }
-};
+  /// Return true if a callee is a leaf that fits the budget and only has
+  /// value and array formals.
+  bool isInlinable(Proc *callee) {
+    if (callee == currentProc) {
+      return false;
+    }
+    auto &cost = getCost(callee);
+    if (cost.calls > 0 || cost.tailCalls > 0 || cost.size > sizeLimit) {
+      return false;
+    }
+    for (auto formal : callee->getFormals()) {
+      if (!dynamic_cast<ValFormal*>(formal) && !dynamic_cast<ArrayFormal*>(formal)) {
+        return false;
+      }
+    }
+    return true;
+  }
 
-/// Instruction relative offset to stack frame base.
-class InstrStackOffset : public hexasm::InstrImm {
-  Frame *frame;
-  int offset;
-public:
-  InstrStackOffset(hexasm::Token token, Frame *frame, int offset) :
-      InstrImm(token, 0), frame(frame), offset(offset) {}
-  std::string toString() const {
-    return (boost::format("%s %d") % hexasm::tokenEnumStr(getToken()) % offset).str();
+  /// Return true if the names a callee refers to, other than those that are
+  /// substituted, refer to the same symbols in the caller.
+  bool resolvesSame(Proc *callee, const std::vector<Name> &refs,
+                    const Substitution &subst) {
+    for (auto name : refs) {
+      if (subst.exprs.count(name.getId()) || subst.names.count(name.getId())) {
+        continue;
+      }
+      auto location = callee->getLocation();
+      if (st.lookup(callee->getName(), name, location) !=
+          st.lookup(currentProc->getName(), name, location)) {
+        return false;
+      }
+    }
+    return true;
   }
-  Frame *getFrame() { return frame; }
-  int getOffset() { return offset; }
-};
 
-class CodeBuffer {
-  SymbolTable &symbolTable;
-  std::vector<std::unique_ptr<hexasm::Directive>> instrs;
-  std::vector<std::unique_ptr<hexasm::Directive>> data;
-  std::map<int, std::string> constMap;
-  size_t constCount;
-  size_t stringCount;
-  size_t labelCount;
-  Frame *currentFrame;
+  /// Create a local of the current procedure for a name of an inlined one.
+  Name createLocal(Proc *callee, Name name, Location location) {
+    auto text = (boost::format("%s.%s.%d") % callee->getName() % name % numInlined).str();
+    auto local = names.intern(text);
+    auto decl = arena.create<VarDecl>(location, local);
+    st.insert(Symbol(SymbolType::VAR, decl, currentProc->getName(), local));
+    decls.push_back(decl);
+    return local;
+  }
 
-public:
-  CodeBuffer(SymbolTable &symbolTable) :
-    symbolTable(symbolTable), constCount(0), stringCount(0), labelCount(0) {}
+  NodeList<Expr> cloneArgs(const NodeList<Expr> &args, const Substitution *subst) {
+    std::vector<Expr*> clones;
+    for (auto arg : args) {
+      clones.push_back(cloneExpr(arg, subst));
+    }
+    return arena.createList(clones);
+  }
+
+  /// Copy an expression, replacing formals and locals if there is a
+  /// substitution. Substituted actuals are copied without one.
+  Expr *cloneExpr(Expr *expr, const Substitution *subst) {
+    Expr *clone = nullptr;
+    auto location = expr->getLocation();
+    if (auto varRef = dynamic_cast<VarRefExpr*>(expr)) {
+      auto name = varRef->getName();
+      if (subst && subst->exprs.count(name.getId())) {
+        return cloneExpr(subst->exprs.at(name.getId()), nullptr);
+      }
+      if (subst && subst->names.count(name.getId())) {
+        name = subst->names.at(name.getId());
+      }
+      clone = arena.create<VarRefExpr>(location, name);
+    } else if (auto subscript = dynamic_cast<ArraySubscriptExpr*>(expr)) {
+      auto name = subscript->getName();
+      if (subst && subst->exprs.count(name.getId())) {
+        name = static_cast<VarRefExpr*>(subst->exprs.at(name.getId()))->getName();
+      }
+      if (subst && subst->names.count(name.getId())) {
+        name = subst->names.at(name.getId());
+      }
+      clone = arena.create<ArraySubscriptExpr>(location, name,
+                                               cloneExpr(subscript->getExpr(), subst));
+    } else if (auto call = dynamic_cast<CallExpr*>(expr)) {
+      auto args = cloneArgs(call->getArgs(), subst);
+      if (call->isSysCall()) {
+        clone = arena.create<CallExpr>(location, call->getSysCallId(), args);
+      } else {
+        clone = arena.create<CallExpr>(location, call->getName(), args);
+      }
+    } else if (auto number = dynamic_cast<NumberExpr*>(expr)) {
+      clone = arena.create<NumberExpr>(location, number->getValue());
+    } else if (auto boolean = dynamic_cast<BooleanExpr*>(expr)) {
+      clone = arena.create<BooleanExpr>(location, boolean->getValue());
+    } else if (auto string = dynamic_cast<StringExpr*>(expr)) {
+      clone = arena.create<StringExpr>(location, string->getValue());
+    } else if (auto unaryOp = dynamic_cast<UnaryOpExpr*>(expr)) {
+      clone = arena.create<UnaryOpExpr>(location, unaryOp->getOp(),
+                                        cloneExpr(unaryOp->getElement(), subst));
+    } else if (auto binaryOp = dynamic_cast<BinaryOpExpr*>(expr)) {
+      clone = arena.create<BinaryOpExpr>(location, binaryOp->getOp(),
+                                         cloneExpr(binaryOp->getLHS(), subst),
+                                         cloneExpr(binaryOp->getRHS(), subst));
+    } else {
+      assert(0 && "unexpected expression in clone");
+    }
+    if (expr->isConst()) {
+      clone->setValue(expr->getValue());
+    }
+    return clone;
+  }
 
-  const std::string getLabel() { return std::string("lab") + std::to_string(labelCount++); }
-  void insertInstr(std::unique_ptr<hexasm::Directive> instr) { instrs.push_back(std::move(instr)); }
-  void insertData(std::unique_ptr<hexasm::Directive> data) { instrs.push_back(std::move(data)); }
+  /// Copy the statements of a leaf procedure or function, with a
+  /// substitution.
+  Statement *cloneStmt(Statement *stmt, const Substitution *subst) {
+    auto location = stmt->getLocation();
+    if (dynamic_cast<SkipStatement*>(stmt)) {
+      return arena.create<SkipStatement>(location);
+    }
+    if (dynamic_cast<StopStatement*>(stmt)) {
+      return arena.create<StopStatement>(location);
+    }
+    if (auto seq = dynamic_cast<SeqStatement*>(stmt)) {
+      std::vector<Statement*> stmts;
+      for (auto item : seq->getStmts()) {
+        stmts.push_back(cloneStmt(item, subst));
+      }
+      return arena.create<SeqStatement>(location, arena.createList(stmts));
+    }
+    if (auto ifStmt = dynamic_cast<IfStatement*>(stmt)) {
+      return arena.create<IfStatement>(location, cloneExpr(ifStmt->getCondition(), subst),
+                                       cloneStmt(ifStmt->getThenStmt(), subst),
+                                       cloneStmt(ifStmt->getElseStmt(), subst));
+    }
+    if (auto whileStmt = dynamic_cast<WhileStatement*>(stmt)) {
+      return arena.create<WhileStatement>(location, cloneExpr(whileStmt->getCondition(), subst),
+                                          cloneStmt(whileStmt->getStmt(), subst));
+    }
+    if (auto callStmt = dynamic_cast<CallStatement*>(stmt)) {
+      auto call = static_cast<CallExpr*>(cloneExpr(callStmt->getCall(), subst));
+      return arena.create<CallStatement>(location, call);
+    }
+    if (auto assStmt = dynamic_cast<AssStatement*>(stmt)) {
+      return arena.create<AssStatement>(location, cloneExpr(assStmt->getLHS(), subst),
+                                        cloneExpr(assStmt->getRHS(), subst));
+    }
+    if (auto returnStmt = dynamic_cast<ReturnStatement*>(stmt)) {
+      // A return of a hoisted function, which is in tail position.
+      assert(subst && !subst->result.empty() && "unexpected return in clone");
+      auto lhs = arena.create<VarRefExpr>(location, subst->result);
+      return arena.create<AssStatement>(location, lhs, cloneExpr(returnStmt->getExpr(), subst));
+    }
+    assert(0 && "unexpected statement in clone");
+    return nullptr;
+  }
 
-  /// Directive generation -------------------------------------------------///
-  void genData(uint32_t value)        { data.push_back(std::make_unique<hexasm::Data>(hexasm::Token::DATA, value)); }
-  void genDataLabel(std::string name) { data.push_back(std::make_unique<hexasm::Label>(hexasm::Token::IDENTIFIER, name)); }
-  void genInstrData(uint32_t value)   { instrs.push_back(std::make_unique<hexasm::Data>(hexasm::Token::DATA, value)); }
-  void genLabel(std::string name)     { instrs.push_back(std::make_unique<hexasm::Label>(hexasm::Token::IDENTIFIER, name)); }
-  void genFunc(std::string name)      { instrs.push_back(std::make_unique<hexasm::Func>(hexasm::Token::FUNC, name)); }
-  void genProc(std::string name)      { instrs.push_back(std::make_unique<hexasm::Proc>(hexasm::Token::PROC, name)); }
+  /// Return true if a callee has no array locals, which cannot be copied into
+  /// the caller, and its names other than its formals and locals refer to the
+  /// same symbols in the caller.
+  bool hasCopyableNames(Proc *callee) {
+    Substitution subst;
+    for (auto formal : callee->getFormals()) {
+      subst.names.emplace(formal->getName().getId(), Name());
+    }
+    for (auto decl : callee->getDecls()) {
+      if (dynamic_cast<ArrayDecl*>(decl)) {
+        return false;
+      }
+      subst.names.emplace(decl->getName().getId(), Name());
+    }
+    auto &cost = getCost(callee);
+    return resolvesSame(callee, cost.varRefs, subst) &&
+           resolvesSame(callee, cost.subscripts, subst);
+  }
+
+  /// Add locals to the current procedure for the formals and locals of a
+  /// callee, and assign the actuals of a call to the formals' locals.
+  void substituteLocals(Proc *callee, CallExpr *call, Substitution &subst,
+                        std::vector<Statement*> &stmts) {
+    auto location = call->getLocation();
+    auto &formals = callee->getFormals();
+    for (size_t i=0; i<formals.size(); i++) {
+      auto local = createLocal(callee, formals[i]->getName(), location);
+      subst.names[formals[i]->getName().getId()] = local;
+      auto lhs = arena.create<VarRefExpr>(location, local);
+      stmts.push_back(arena.create<AssStatement>(location, lhs, call->getArgs()[i]));
+    }
+    // Copy the values of vals.
+    for (auto decl : callee->getDecls()) {
+      if (auto valDecl = dynamic_cast<ValDecl*>(decl)) {
+        auto text = (boost::format("%s.%s.%d") % callee->getName() % decl->getName() % numInlined).str();
+        auto local = names.intern(text);
+        auto newDecl = arena.create<ValDecl>(decl->getLocation(), local, valDecl->getExpr());
+        newDecl->setValue(valDecl->getValue());
+        st.insert(Symbol(SymbolType::VAL, newDecl, currentProc->getName(), local));
+        decls.push_back(newDecl);
+        subst.names[decl->getName().getId()] = local;
+      } else {
+        subst.names[decl->getName().getId()] =
+            createLocal(callee, decl->getName(), decl->getLocation());
+      }
+    }
+  }
 
-  /// Instruction generation -----------------------------------------------///
-  void genLDAM(int value)         { instrs.push_back(std::make_unique<hexasm::InstrImm>(hexasm::Token::LDAM, value)); }
-  void genLDBM(int value)         { instrs.push_back(std::make_unique<hexasm::InstrImm>(hexasm::Token::LDBM, value)); }
-  void genSTAM(int value)         { instrs.push_back(std::make_unique<hexasm::InstrImm>(hexasm::Token::STAM, value)); }
-  void genLDAM(std::string label) { instrs.push_back(std::make_unique<hexasm::InstrLabel>(hexasm::Token::LDAM, label, false)); }
-  void genLDBM(std::string label) { instrs.push_back(std::make_unique<hexasm::InstrLabel>(hexasm::Token::LDBM, label, false)); }
-  void genSTAM(std::string label) { instrs.push_back(std::make_unique<hexasm::InstrLabel>(hexasm::Token::STAM, label, false)); }
-  void genLDAC(int value)         { instrs.push_back(std::make_unique<hexasm::InstrImm>(hexasm::Token::LDAC, value)); }
-  void genLDBC(int value)         { instrs.push_back(std::make_unique<hexasm::InstrImm>(hexasm::Token::LDBC, value)); }
-  void genLDAP(int value)         { instrs.push_back(std::make_unique<hexasm::InstrImm>(hexasm::Token::LDAP, value)); }
-  void genLDAC(std::string label) { instrs.push_back(std::make_unique<hexasm::InstrLabel>(hexasm::Token::LDAC, label, false)); }
-  void genLDBC(std::string label) { instrs.push_back(std::make_unique<hexasm::InstrLabel>(hexasm::Token::LDBC, label, true)); }
-  void genLDAP(std::string label) { instrs.push_back(std::make_unique<hexasm::InstrLabel>(hexasm::Token::LDAP, label, true)); }
-  void genLDAI(int value)         { instrs.push_back(std::make_unique<hexasm::InstrImm>(hexasm::Token::LDAI, value)); }
-  void genLDBI(int value)         { instrs.push_back(std::make_unique<hexasm::InstrImm>(hexasm::Token::LDBI, value)); }
-  void genSTAI(int value)         { instrs.push_back(std::make_unique<hexasm::InstrImm>(hexasm::Token::STAI, value)); }
-  void genBR(std::string label)   { instrs.push_back(std::make_unique<hexasm::InstrLabel>(hexasm::Token::BR, label, true)); }
-  void genBRZ(std::string label)  { instrs.push_back(std::make_unique<hexasm::InstrLabel>(hexasm::Token::BRZ, label, true)); }
-  void genBRN(std::string label)  { instrs.push_back(std::make_unique<hexasm::InstrLabel>(hexasm::Token::BRN, label, true)); }
-  void genOPR(hexasm::Token op)   { instrs.push_back(std::make_unique<hexasm::InstrOp>(hexasm::Token::OPR, op)); }
+  /// Replace a call of a leaf procedure by its body, or return null.
+  Statement *inlineProcCall(CallStatement *stmt) {
+    auto call = stmt->getCall();
+    auto callee = getCallee(call);
+    if (!callee || callee->isFunction() || !isInlinable(callee) ||
+        getCost(callee).returns > 0 || !hasCopyableNames(callee)) {
+      return nullptr;
+    }
+    Substitution subst;
+    std::vector<Statement*> stmts;
+    substituteLocals(callee, call, subst, stmts);
+    stmts.push_back(cloneStmt(callee->getStatement(), &subst));
+    numInlined++;
+    return arena.create<SeqStatement>(stmt->getLocation(), arena.createList(stmts));
+  }
+
+  /// Return the expression of a function whose body is a single return.
+  static Expr *getReturnExpr(Proc *proc) {
+    auto stmt = proc->getStatement();
+    if (auto seq = dynamic_cast<SeqStatement*>(stmt)) {
+      if (seq->getStmts().size() != 1) {
+        return nullptr;
+      }
+      stmt = seq->getStmts()[0];
+    }
+    if (auto returnStmt = dynamic_cast<ReturnStatement*>(stmt)) {
+      return returnStmt->getExpr();
+    }
+    return nullptr;
+  }
 
-  /// Intermediate instruction for placeholder SP value --------------------///
-  void genSPValue() { instrs.push_back(std::make_unique<SPValue>()); }
+  /// Replace a call of a leaf function with its returned expression, or
+  /// return null.
+  Expr *inlineFuncCall(CallExpr *call) {
+    auto callee = getCallee(call);
+    if (!callee || !callee->isFunction() || !isInlinable(callee) ||
+        !callee->getDecls().empty()) {
+      return nullptr;
+    }
+    auto expr = getReturnExpr(callee);
+    if (!expr) {
+      return nullptr;
+    }
+    auto &cost = getCost(callee);
+    auto &formals = callee->getFormals();
+    auto &args = call->getArgs();
+    Substitution subst;
+    for (size_t i=0; i<formals.size(); i++) {
+      auto name = formals[i]->getName();
+      auto arg = args[i];
+      InlineCost argCost;
+      arg->accept(&argCost);
+      if (argCost.calls > 0 || argCost.sysCalls > 0) {
+        return nullptr;
+      }
+      // Only duplicate actuals that are as cheap as loading the formal.
+      bool simple = arg->isConst() || dynamic_cast<VarRefExpr*>(arg);
+      if (cost.countVarRefs(name) > 1 && !simple) {
+        return nullptr;
+      }
+      // A subscripted formal must be replaced by the name of an array.
+      auto varRef = dynamic_cast<VarRefExpr*>(arg);
+      if (std::count(cost.subscripts.begin(), cost.subscripts.end(), name) > 0 &&
+          (!varRef || varRef->isConst())) {
+        return nullptr;
+      }
+      subst.exprs.emplace(name.getId(), arg);
+    }
+    if (!resolvesSame(callee, cost.varRefs, subst) ||
+        !resolvesSame(callee, cost.subscripts, subst)) {
+      return nullptr;
+    }
+    numInlined++;
+    return cloneExpr(expr, &subst);
+  }
 
-  /// Intermediate instructions for procedure calling ----------------------///
-  void genPrologue(Symbol *symbol) { instrs.push_back(std::make_unique<Prologue>(symbol)); }
-  void genEpilogue(Symbol *symbol) { instrs.push_back(std::make_unique<Epilogue>(symbol)); }
+  /// Return true if the returns of a statement are only in tail position.
+  static bool hasTailReturns(Statement *stmt, bool tail) {
+    if (auto seq = dynamic_cast<SeqStatement*>(stmt)) {
+      auto &stmts = seq->getStmts();
+      for (size_t i=0; i<stmts.size(); i++) {
+        if (!hasTailReturns(stmts[i], tail && i + 1 == stmts.size())) {
+          return false;
+        }
+      }
+      return true;
+    }
+    if (auto ifStmt = dynamic_cast<IfStatement*>(stmt)) {
+      return hasTailReturns(ifStmt->getThenStmt(), tail) &&
+             hasTailReturns(ifStmt->getElseStmt(), tail);
+    }
+    if (auto whileStmt = dynamic_cast<WhileStatement*>(stmt)) {
+      return hasTailReturns(whileStmt->getStmt(), false);
+    }
+    if (dynamic_cast<ReturnStatement*>(stmt)) {
+      return tail;
+    }
+    return true;
+  }
 
-  /// Intermediate instructions for frame-base relative accesses -----------///
-  void genLDAI_FB(Frame *frame, int offset) { instrs.push_back(std::make_unique<InstrStackOffset>(hexasm::Token::LDAI_FB, frame, offset)); }
-  void genLDBI_FB(Frame *frame, int offset) { instrs.push_back(std::make_unique<InstrStackOffset>(hexasm::Token::LDBI_FB, frame, offset)); }
-  void genSTAI_FB(Frame *frame, int offset) { instrs.push_back(std::make_unique<InstrStackOffset>(hexasm::Token::STAI_FB, frame, offset)); }
+  static bool isLocalName(Proc *proc, Name name) {
+    for (auto formal : proc->getFormals()) {
+      if (formal->getName() == name) {
+        return true;
+      }
+    }
+    for (auto decl : proc->getDecls()) {
+      if (decl->getName() == name) {
+        return true;
+      }
+    }
+    return false;
+  }
 
-  /// Helpers --------------------------------------------------------------///
-  void genBRB() { genOPR(hexasm::Token::OPR); }
-  void genADD() { genOPR(hexasm::Token::ADD); }
-  void genSUB() { genOPR(hexasm::Token::SUB); }
-  void genSVC() { genOPR(hexasm::Token::SVC); }
+  /// Return true if a callee has no side effects: it is a leaf that makes no
+  /// syscalls and only assigns its own formals and locals.
+  bool isPure(Proc *callee) {
+    auto &cost = getCost(callee);
+    if (cost.calls > 0 || cost.sysCalls > 0 || cost.subscriptAssigns > 0) {
+      return false;
+    }
+    for (auto name : cost.assigned) {
+      if (!isLocalName(callee, name)) {
+        return false;
+      }
+    }
+    return true;
+  }
 
-  /// Code generation visitors ---------------------------------------------///
+  /// Return true if a call of a small pure function, whose body is not a
+  /// single return but whose returns are all in tail position, can be hoisted
+  /// out of an expression into statements before it. A call that may not be
+  /// evaluated, in the operand of a short-circuit operator, is only hoisted if
+  /// it contains no loops, which may not terminate, and no subscripts, which
+  /// may be out of range.
+  bool isHoistable(CallExpr *call, Proc *callee, bool conditional) {
+    if (!callee->isFunction() || !isInlinable(callee) || !isPure(callee) ||
+        getReturnExpr(callee) || !hasTailReturns(callee->getStatement(), true) ||
+        !hasCopyableNames(callee)) {
+      return false;
+    }
+    auto &cost = getCost(callee);
+    if (conditional && (cost.loops > 0 || !cost.subscripts.empty())) {
+      return false;
+    }
+    for (auto arg : call->getArgs()) {
+      InlineCost argCost;
+      arg->accept(&argCost);
+      if (argCost.calls > 0 || argCost.sysCalls > 0 ||
+          (conditional && !argCost.subscripts.empty())) {
+        return false;
+      }
+    }
+    return true;
+  }
 
-  class ContainsCall : public AstVisitor {
-    bool flag;
+  /// Append the body of a hoisted function to a list of statements, with its
+  /// returns assigning a new local, and return a reference to the local.
+  Expr *hoistFuncCall(CallExpr *call, Proc *callee, std::vector<Statement*> &stmts) {
+    Substitution subst;
+    substituteLocals(callee, call, subst, stmts);
+    // A keyword, so the name cannot clash with those of the callee.
+    subst.result = createLocal(callee, names.intern("return"), call->getLocation());
+    stmts.push_back(cloneStmt(callee->getStatement(), &subst));
+    numInlined++;
+    return arena.create<VarRefExpr>(call->getLocation(), subst.result);
+  }
+
+  /// Find the hoistable calls in the expressions of a statement, and replace
+  /// them if all the other calls are of pure functions, so that evaluating
+  /// the hoisted calls first does not change the result of the statement.
+  class HoistCalls : public AstVisitor {
+    OptimiseCalls &oc;
+    bool replace;
+    // The number of enclosing short-circuit operators.
+    size_t conditional;
   public:
-    ContainsCall() : flag(false) {}
-    void visitPost(CallExpr&) { flag = true; }
-    bool getFlag() { return flag; }
+    bool valid;
+    size_t numHoistable;
+    std::vector<Statement*> stmts;
+    HoistCalls(OptimiseCalls &oc, bool replace) :
+      AstVisitor(true, true, true), oc(oc), replace(replace), conditional(0),
+      valid(true), numHoistable(0) {}
+    static bool isShortCircuit(BinaryOpExpr &expr) {
+      return expr.getOp() == Token::AND || expr.getOp() == Token::OR;
+    }
+    void visitPre(BinaryOpExpr &expr) override {
+      if (isShortCircuit(expr)) {
+        conditional++;
+      }
+    }
+    void visitPost(BinaryOpExpr &expr) override {
+      if (isShortCircuit(expr)) {
+        conditional--;
+      }
+    }
+    void visitPost(CallExpr &call) override {
+      auto callee = oc.getCallee(&call);
+      if (!callee || !oc.isPure(callee)) {
+        valid = false;
+        return;
+      }
+      if (oc.isHoistable(&call, callee, conditional > 0)) {
+        numHoistable++;
+        if (replace) {
+          setExprReplacement(oc.hoistFuncCall(&call, callee, stmts));
+        }
+      }
+    }
   };
 
-  class ExprCodeGen : public AstVisitor {
-    SymbolTable &st;
+  static Expr *hoistCalls(Expr *expr, HoistCalls &visitor) {
+    expr->accept(&visitor);
+    return visitor.hasExprReplacement() ? visitor.takeExprReplacement() : expr;
+  }
+
+  /// Visit the expressions of a statement that are evaluated before it makes
+  /// any calls or assignments, replacing them.
+  static void hoistCalls(Statement *stmt, HoistCalls &visitor) {
+    if (auto assStmt = dynamic_cast<AssStatement*>(stmt)) {
+      assStmt->setRHS(hoistCalls(assStmt->getRHS(), visitor));
+      // Calls in a subscript of the LHS are not hoisted.
+      InlineCost lhsCost;
+      assStmt->getLHS()->accept(&lhsCost);
+      visitor.valid &= lhsCost.calls == 0 && lhsCost.sysCalls == 0;
+    } else if (auto ifStmt = dynamic_cast<IfStatement*>(stmt)) {
+      ifStmt->setCondition(hoistCalls(ifStmt->getCondition(), visitor));
+    } else if (auto returnStmt = dynamic_cast<ReturnStatement*>(stmt)) {
+      returnStmt->setExpr(hoistCalls(returnStmt->getExpr(), visitor));
+    } else if (auto callStmt = dynamic_cast<CallStatement*>(stmt)) {
+      for (auto &arg : callStmt->getCall()->getArgs()) {
+        arg = hoistCalls(arg, visitor);
+      }
+    } else if (auto tailCallStmt = dynamic_cast<TailCallStatement*>(stmt)) {
+      for (auto &arg : tailCallStmt->getCall()->getArgs()) {
+        arg = hoistCalls(arg, visitor);
+      }
+    } else {
+      visitor.valid = false;
+    }
+  }
+
+  /// Hoist the calls of small pure functions out of the expressions of a
+  /// statement, returning its replacement.
+  Statement *hoistFuncCalls(Statement *stmt) {
+    HoistCalls check(*this, false);
+    hoistCalls(stmt, check);
+    if (!check.valid || check.numHoistable == 0) {
+      return stmt;
+    }
+    HoistCalls hoist(*this, true);
+    hoistCalls(stmt, hoist);
+    hoist.stmts.push_back(stmt);
+    return arena.create<SeqStatement>(stmt->getLocation(), arena.createList(hoist.stmts));
+  }
+
+  /// Return true if a call is of the current procedure or function to itself.
+  bool isSelfCall(CallExpr *call) {
+    return getCallee(call) == currentProc;
+  }
+
+  /// Replace the tail calls, inline the procedure calls and hoist the
+  /// function calls of a statement, returning its replacement.
+  Statement *optimiseStmt(Statement *stmt, bool tail) {
+    if (auto seq = dynamic_cast<SeqStatement*>(stmt)) {
+      auto &stmts = seq->getStmts();
+      for (size_t i=0; i<stmts.size(); i++) {
+        stmts.begin()[i] = optimiseStmt(stmts[i], tail && i + 1 == stmts.size());
+      }
+    } else if (auto ifStmt = dynamic_cast<IfStatement*>(stmt)) {
+      ifStmt->setThenStmt(optimiseStmt(ifStmt->getThenStmt(), tail));
+      ifStmt->setElseStmt(optimiseStmt(ifStmt->getElseStmt(), tail));
+    } else if (auto whileStmt = dynamic_cast<WhileStatement*>(stmt)) {
+      whileStmt->setStmt(optimiseStmt(whileStmt->getStmt(), false));
+    } else if (auto returnStmt = dynamic_cast<ReturnStatement*>(stmt)) {
+      // A return is always in tail position.
+      auto call = dynamic_cast<CallExpr*>(returnStmt->getExpr());
+      if (call && currentProc->isFunction() && isSelfCall(call)) {
+        currentProc->setTailCalls();
+        stmt = arena.create<TailCallStatement>(stmt->getLocation(), call);
+      }
+    } else if (auto callStmt = dynamic_cast<CallStatement*>(stmt)) {
+      if (tail && !currentProc->isFunction() && isSelfCall(callStmt->getCall())) {
+        currentProc->setTailCalls();
+        stmt = arena.create<TailCallStatement>(stmt->getLocation(), callStmt->getCall());
+      } else if (auto body = inlineProcCall(callStmt)) {
+        return body;
+      }
+    }
+    return hoistFuncCalls(stmt);
+  }
+
+public:
+  OptimiseCalls(SymbolTable &st, Program &program,
+                size_t sizeLimit=DEFAULT_INLINE_SIZE_LIMIT) :
+    AstVisitor(true, true, true), st(st), arena(program.getArena()),
+    names(program.getNames()), currentProc(nullptr), stmtCall(nullptr),
+    numInlined(0), sizeLimit(sizeLimit) {}
+  void visitPre(Proc &proc) override {
+    currentProc = &proc;
+    decls.assign(proc.getDecls().begin(), proc.getDecls().end());
+    proc.setStatement(optimiseStmt(proc.getStatement(), true));
+    if (decls.size() != proc.getDecls().size()) {
+      proc.setDecls(arena.createList(decls));
+    }
+  }
+  void visitPre(CallStatement &stmt) override { stmtCall = stmt.getCall(); }
+  void visitPre(TailCallStatement &stmt) override { stmtCall = stmt.getCall(); }
+  void visitPost(CallExpr &expr) override {
+    if (currentProc && &expr != stmtCall) {
+      setExprReplacement(inlineFuncCall(&expr));
+    }
+  }
+};
+
+//===---------------------------------------------------------------------===//
+// Code generation.
+//===---------------------------------------------------------------------===//
+
+const int SP_OFFSET = 1;
+const int MAX_ADDRESS = hex::MAX_MEMORY_SIZE_WORDS;
+const int SP_LINK_VALUE_OFFSET = 0;
+const int SP_RETURN_VALUE_OFFSET = 1;
+const int FB_PARAM_OFFSET_FUNC = 2;
+const int FB_PARAM_OFFSET_PROC = 1;
+
+enum class Reg { A, B };
+
+/// Code generation emits a stream of assembly directives (see
+/// hexasm::DirectiveStream), including the intermediate directives SP_VALUE,
+/// PROLOGUE, EPILOGUE and the frame-base relative accesses LDAI_FB, LDBI_FB
+/// and STAI_FB, which are replaced by LowerDirectives. A prologue or epilogue
+/// is labelled with the name of its procedure, and its value is the index of
+/// the procedure's symbol in the CodeBuffer. The value of a frame-base
+/// relative access is its offset in the frame of the enclosing procedure.
+class CodeBuffer {
+  SymbolTable &symbolTable;
+  hexasm::DirectiveStream instrs;
+  hexasm::DirectiveStream data;
+  std::vector<Symbol*> procSymbols;
+  std::map<int, std::string> constMap;
+  size_t constCount;
+  size_t stringCount;
+  size_t labelCount;
+  Frame *currentFrame;
+
+public:
+  CodeBuffer(SymbolTable &symbolTable) :
+    symbolTable(symbolTable), constCount(0), stringCount(0), labelCount(0) {}
+
+  const std::string getLabel() { return std::string("lab") + std::to_string(labelCount++); }
+
+  /// Directive generation -------------------------------------------------///
+  void genData(uint32_t value)               { data.addData(value); }
+  void genDataLabel(std::string_view name)   { data.addLabel(hexasm::Token::IDENTIFIER, name); }
+  void genInstrData(uint32_t value)          { instrs.addData(value); }
+  void genDataMarker(hexasm::Token token)    { instrs.addDataMarker(token); }
+  void genLabel(std::string_view name)       { instrs.addLabel(hexasm::Token::IDENTIFIER, name); }
+  void genFunc(std::string_view name)        { instrs.addLabel(hexasm::Token::FUNC, name); }
+  void genProc(std::string_view name)        { instrs.addLabel(hexasm::Token::PROC, name); }
+
+  /// Instruction generation -----------------------------------------------///
+  void genLDAM(int value)                { instrs.addInstrImm(hexasm::Token::LDAM, value); }
+  void genLDBM(int value)                { instrs.addInstrImm(hexasm::Token::LDBM, value); }
+  void genSTAM(int value)                { instrs.addInstrImm(hexasm::Token::STAM, value); }
+  void genLDAM(std::string_view label)   { instrs.addInstrLabel(hexasm::Token::LDAM, label, false); }
+  void genLDBM(std::string_view label)   { instrs.addInstrLabel(hexasm::Token::LDBM, label, false); }
+  void genSTAM(std::string_view label)   { instrs.addInstrLabel(hexasm::Token::STAM, label, false); }
+  void genLDAC(int value)                { instrs.addInstrImm(hexasm::Token::LDAC, value); }
+  void genLDBC(int value)                { instrs.addInstrImm(hexasm::Token::LDBC, value); }
+  void genLDAP(int value)                { instrs.addInstrImm(hexasm::Token::LDAP, value); }
+  void genLDAC(std::string_view label)   { instrs.addInstrLabel(hexasm::Token::LDAC, label, false); }
+  void genLDBC(std::string_view label)   { instrs.addInstrLabel(hexasm::Token::LDBC, label, true); }
+  void genLDAP(std::string_view label)   { instrs.addInstrLabel(hexasm::Token::LDAP, label, true); }
+  void genLDAI(int value)                { instrs.addInstrImm(hexasm::Token::LDAI, value); }
+  void genLDBI(int value)                { instrs.addInstrImm(hexasm::Token::LDBI, value); }
+  void genSTAI(int value)                { instrs.addInstrImm(hexasm::Token::STAI, value); }
+  void genBR(std::string_view label)     { instrs.addInstrLabel(hexasm::Token::BR, label, true); }
+  void genBRZ(std::string_view label)    { instrs.addInstrLabel(hexasm::Token::BRZ, label, true); }
+  void genBRN(std::string_view label)    { instrs.addInstrLabel(hexasm::Token::BRN, label, true); }
+  void genOPR(hexasm::Token op)          { instrs.addInstrOp(op); }
+
+  /// Intermediate instruction for placeholder SP value --------------------///
+  void genSPValue() { instrs.addIntermediate(hexasm::Token::SP_VALUE, 0); }
+
+  /// Intermediate instructions for procedure calling ----------------------///
+  void genPrologue(Symbol *symbol) { genProcMarker(hexasm::Token::PROLOGUE, symbol); }
+  void genEpilogue(Symbol *symbol) { genProcMarker(hexasm::Token::EPILOGUE, symbol); }
+  void genProcMarker(hexasm::Token token, Symbol *symbol) {
+    instrs.addIntermediate(token, procSymbols.size(), symbol->getName().str());
+    procSymbols.push_back(symbol);
+  }
+
+  /// Intermediate instructions for frame-base relative accesses -----------///
+  void genLDAI_FB(int offset) { instrs.addIntermediate(hexasm::Token::LDAI_FB, offset); }
+  void genLDBI_FB(int offset) { instrs.addIntermediate(hexasm::Token::LDBI_FB, offset); }
+  void genSTAI_FB(int offset) { instrs.addIntermediate(hexasm::Token::STAI_FB, offset); }
+
+  /// Helpers --------------------------------------------------------------///
+  void genBRB() { genOPR(hexasm::Token::OPR); }
+  void genADD() { genOPR(hexasm::Token::ADD); }
+  void genSUB() { genOPR(hexasm::Token::SUB); }
+  void genSVC() { genOPR(hexasm::Token::SVC); }
+
+  /// Code generation visitors ---------------------------------------------///
+
+  class ContainsCall : public AstVisitor {
+    bool flag;
+  public:
+    ContainsCall() : flag(false) {}
+    void visitPost(CallExpr&) { flag = true; }
+    bool getFlag() { return flag; }
+  };
+
+  class ContainsName : public AstVisitor {
+    Name name;
+    bool flag;
+  public:
+    ContainsName(Name name) : name(name), flag(false) {}
+    void visitPost(VarRefExpr &expr) { flag |= !expr.isConst() && expr.getName() == name; }
+    void visitPost(ArraySubscriptExpr &expr) { flag |= expr.getName() == name; }
+    bool getFlag() { return flag; }
+  };
+
+  class ExprCodeGen : public AstVisitor {
+    SymbolTable &st;
     CodeBuffer &cb;
-    const std::string &currentScope;
+    Name currentScope;
     Reg reg;
   public:
     ExprCodeGen(SymbolTable &st, CodeBuffer &cb,
-                const std::string &currentScope, Reg reg) :
+                Name currentScope, Reg reg) :
       AstVisitor(false, false, false), st(st), cb(cb),
       currentScope(currentScope), reg(reg) {}
-    /// Return true if the expr needs to be materialised in an A register.
-    bool needsAReg(std::unique_ptr<Expr> &expr) {
-      return !(expr->isConst() || dynamic_cast<StringExpr*>(expr.get()) || dynamic_cast<VarRefExpr*>(expr.get()));
-    }
-    void genBinopOperands(BinaryOpExpr &expr) {
-      // For ADD and SUB binary operations:
-      //  - LHS materialise in areg.
-      //  - RHS materialise in breg.
-      // NOTE: this does not respect left-to-right ordering of operations.
-      if (needsAReg(expr.getRHS())) {
-        // Switch RHS areg into breg after generating LHS.
+    /// Return true if the expr is a leaf that can be loaded straight into
+    /// either register without disturbing the other one: a constant, a
+    /// string, a variable or an array element with a constant subscript.
+    bool isLeaf(Expr *expr) {
+      if (expr->isConst() || dynamic_cast<StringExpr*>(expr) || dynamic_cast<VarRefExpr*>(expr)) {
+        return true;
+      }
+      if (auto *arraySub = dynamic_cast<ArraySubscriptExpr*>(expr)) {
+        return arraySub->getExpr()->isConst();
+      }
+      return false;
+    }
+    /// Return true if the expr is an addition or subtraction with a leaf RHS.
+    bool isAddSubLeaf(Expr *expr) {
+      auto *binop = dynamic_cast<BinaryOpExpr*>(expr);
+      return binop && !binop->isConst() &&
+             (binop->getOp() == Token::PLUS || binop->getOp() == Token::MINUS) &&
+             isLeaf(binop->getRHS());
+    }
+    /// Generate 'LHS op RHS' into areg, where op is PLUS or MINUS. The LHS
+    /// must be materialised in areg and the RHS in breg, so operands are
+    /// ordered to avoid spilling an intermediate value to the stack.
+    void genAddSub(Location location, Token op, Expr *LHS, Expr *RHS) {
+      if (isLeaf(RHS)) {
+        // Evaluate the LHS into areg, then load the RHS straight into breg.
+        cb.genExpr(LHS, currentScope);
+        cb.genExpr(RHS, currentScope, Reg::B);
+      } else if (op == Token::PLUS && isLeaf(LHS)) {
+        // Addition commutes, so evaluate the RHS into areg and load the LHS
+        // into breg. The RHS is evaluated first, as it is when spilling.
+        cb.genExpr(RHS, currentScope);
+        cb.genExpr(LHS, currentScope, Reg::B);
+      } else if (isAddSubLeaf(RHS) && !cb.containsCall(LHS) && !cb.containsCall(RHS)) {
+        // Without calls the order of evaluation is not observable, so
+        // reassociate 'LHS op (X op' Y)' as '(LHS op X) op'' Y', where Y is a
+        // leaf. The rewritten expression is built from temporary AST nodes
+        // that share the operands of this one.
+        auto *inner = static_cast<BinaryOpExpr*>(RHS);
+        Token outerOp = inner->getOp();
+        if (op == Token::MINUS) {
+          outerOp = outerOp == Token::PLUS ? Token::MINUS : Token::PLUS;
+        }
+        BinaryOpExpr partial(location, op, LHS, inner->getLHS());
+        genAddSub(location, outerOp, &partial, inner->getRHS());
+        return;
+      } else {
+        // Evaluate the RHS and save it to the stack, since evaluating the
+        // LHS may require both registers.
         auto currentFrame = cb.getCurrentFrame();
-        size_t stackOffset = cb.getCurrentFrame()->getOffset();
-        // Gen RHS and save to stack.
-        cb.genExpr(expr.getRHS(), currentScope);
+        size_t stackOffset = currentFrame->getOffset();
+        cb.genExpr(RHS, currentScope);
         auto offset = currentFrame->getOffset();
         currentFrame->incOffset(1);
         cb.genLDBM(SP_OFFSET);
-        cb.genSTAI_FB(currentFrame, -offset);
+        cb.genSTAI_FB(-offset);
         // Gen LHS.
-        cb.genExpr(expr.getLHS(), currentScope);
+        cb.genExpr(LHS, currentScope);
         // Restore RHS from stack into breg.
         cb.genLDBM(SP_OFFSET);
-        cb.genLDBI_FB(currentFrame, -offset);
+        cb.genLDBI_FB(-offset);
         currentFrame->setOffset(stackOffset);
+      }
+      if (op == Token::PLUS) {
+        cb.genADD();
       } else {
-        cb.genExpr(expr.getLHS(), currentScope);
-        cb.genExpr(expr.getRHS(), currentScope, Reg::B);
+        cb.genSUB();
       }
     }
     void visitPost(BinaryOpExpr &expr) {
       if (expr.isConst()) {
-        cb.genConst(Reg::A, expr.getValue());
+        cb.genConst(reg, expr.getValue());
       } else {
         // Generate a binary op.
         switch (expr.getOp()) {
           case Token::PLUS:
-            genBinopOperands(expr);
-            cb.genADD();
-            break;
           case Token::MINUS:
-            genBinopOperands(expr);
-            cb.genSUB();
+            genAddSub(expr.getLocation(), expr.getOp(), expr.getLHS(), expr.getRHS());
             break;
           case Token::AND: {
             // Logical AND of operands. If first operand is false, result is
@@ -2170,14 +3057,12 @@ public:
               cb.genExpr(expr.getRHS(), currentScope);
             }else if (expr.getRHS()->isConstZero()) {
               cb.genExpr(expr.getLHS(), currentScope);
+            } else if (isLeaf(expr.getLHS()) && !isLeaf(expr.getRHS())) {
+              // Equality is symmetric, so generate 'RHS - LHS' to load the
+              // leaf LHS straight into breg.
+              genAddSub(expr.getLocation(), Token::MINUS, expr.getRHS(), expr.getLHS());
             } else {
-              // Create a new AST node on the fly to generate the expression
-              // 'LHS - RHS'. Note that this modifies the program's AST,
-              // precluding this code from running again.
-              auto subtract = std::make_unique<BinaryOpExpr>(expr.getLocation(), Token::MINUS,
-                                                             std::move(expr.getLHS()),
-                                                             std::move(expr.getRHS()));
-              cb.genExpr(subtract.get(), currentScope);
+              genAddSub(expr.getLocation(), Token::MINUS, expr.getLHS(), expr.getRHS());
             }
             auto trueLabel = cb.getLabel();
             auto endLabel = cb.getLabel();
@@ -2195,14 +3080,7 @@ public:
               // If RHS is zero, then only consider is LHS is negative.
               cb.genExpr(expr.getLHS(), currentScope);
             } else {
-              // Compute LHS - RHS by creating a subtraction AST node.
-              auto subtract = std::make_unique<BinaryOpExpr>(expr.getLocation(), Token::MINUS,
-                                                             std::move(expr.getLHS()),
-                                                             std::move(expr.getRHS()));
-              cb.genExpr(subtract.get(), currentScope);
-              // Restore the operand pointers.
-              expr.setLHS(subtract->getLHS());
-              expr.setRHS(subtract->getRHS());
+              genAddSub(expr.getLocation(), Token::MINUS, expr.getLHS(), expr.getRHS());
             }
             auto trueLabel = cb.getLabel();
             auto endLabel = cb.getLabel();
@@ -2253,8 +3131,7 @@ public:
       if (expr.isSysCall()) {
         cb.genSysCall(expr.getSysCallId(), expr.getArgs(), currentScope);
       } else {
-        auto symbol = st.lookup(std::make_pair(currentScope, expr.getName()),
-                                expr.getLocation());
+        auto symbol = st.lookup(currentScope, expr.getName(), expr.getLocation());
         if (symbol->getType() == SymbolType::FUNC) {
           cb.genFuncCall(expr.getName(), expr.getArgs(), currentScope);
         } else {
@@ -2266,11 +3143,14 @@ public:
     }
     void visitPost(ArraySubscriptExpr &expr) {
       // Generate array subscript.
-      auto baseSymbol = st.lookup(std::make_pair(currentScope, expr.getName()),
-                                                 expr.getLocation());
+      auto baseSymbol = st.lookup(currentScope, expr.getName(), expr.getLocation());
       if (expr.getExpr()->isConst()) {
-        cb.genVar(Reg::A, baseSymbol);
-        cb.genLDAI(expr.getExpr()->getValue());
+        // A constant subscript is a leaf that can be loaded into either register.
+        cb.genVar(reg, baseSymbol);
+        switch (reg) {
+        case Reg::A: cb.genLDAI(expr.getExpr()->getValue()); break;
+        case Reg::B: cb.genLDBI(expr.getExpr()->getValue()); break;
+        }
       } else {
         cb.genExpr(expr.getExpr(), currentScope);
         cb.genVar(Reg::B, baseSymbol);
@@ -2282,8 +3162,7 @@ public:
       if (expr.isConst()) {
         cb.genConst(reg, expr.getValue());
       } else {
-        cb.genVar(reg, st.lookup(std::make_pair(currentScope, expr.getName()),
-                                 expr.getLocation()));
+        cb.genVar(reg, st.lookup(currentScope, expr.getName(), expr.getLocation()));
       }
     }
   };
@@ -2291,9 +3170,9 @@ public:
   class StmtCodeGen : public AstVisitor {
     SymbolTable &st;
     CodeBuffer &cb;
-    const std::string &currentScope;
+    Name currentScope;
   public:
-    StmtCodeGen(SymbolTable &st, CodeBuffer &cb, const std::string &currentScope) :
+    StmtCodeGen(SymbolTable &st, CodeBuffer &cb, Name currentScope) :
       AstVisitor(false, false, false), st(st), cb(cb), currentScope(currentScope) {}
 
     void visitPost(SkipStatement&) {
@@ -2311,14 +3190,13 @@ public:
     void visitPost(ReturnStatement &stmt) {
       // TODO: Check a process cannot contain a return.
       // TODO: Check a function must end with a return.
-      // TODO: handle tail function calls
       cb.genExpr(stmt.getExpr(), currentScope);
       cb.genBR(cb.getCurrentFrame()->getExitLabel());
     }
 
     void visitPost(IfStatement &stmt) {
-      bool skipThen = dynamic_cast<SkipStatement*>(stmt.getThenStmt().get());
-      bool skipElse = dynamic_cast<SkipStatement*>(stmt.getElseStmt().get());
+      bool skipThen = dynamic_cast<SkipStatement*>(stmt.getThenStmt());
+      bool skipElse = dynamic_cast<SkipStatement*>(stmt.getElseStmt());
       if (skipThen && skipElse) {
         // Do nothing.
       } else if (skipElse) {
@@ -2374,38 +3252,49 @@ public:
       }
     }
 
+    void visitPost(TailCallStatement &stmt) {
+      auto symbol = st.lookup(currentScope, stmt.getCall()->getName(), stmt.getLocation());
+      cb.genTailCall(static_cast<Proc*>(symbol->getNode()), stmt.getCall()->getArgs(), currentScope);
+    }
+
     void visitPost(AssStatement &expr) {
-      if (auto *varRefLHS = dynamic_cast<VarRefExpr*>(expr.getLHS().get())) {
+      if (auto *varRefLHS = dynamic_cast<VarRefExpr*>(expr.getLHS())) {
         // Generate RHS value into areg.
         cb.genExpr(expr.getRHS(), currentScope);
         // LHS variable reference.
-        auto symbol = st.lookup(std::make_pair(currentScope, varRefLHS->getName()),
-                                expr.getLocation());
+        auto symbol = st.lookup(currentScope, varRefLHS->getName(), expr.getLocation());
         if (symbol->getScope().empty()) {
           // Global scope.
           cb.genSTAM(symbol->getGlobalLabel());
         } else {
           // Local scope.
           cb.genLDBM(SP_OFFSET);
-          cb.genSTAI_FB(cb.getCurrentFrame(), symbol->getStackOffset());
+          cb.genSTAI_FB(symbol->getStackOffset());
         }
-      } else if (auto *arraySubLHS = dynamic_cast<ArraySubscriptExpr*>(expr.getLHS().get())) {
+      } else if (auto *arraySubLHS = dynamic_cast<ArraySubscriptExpr*>(expr.getLHS());
+                 arraySubLHS && arraySubLHS->getExpr()->isConst()) {
+        // Handle LHS subscript with a constant index.
+        // Generate the RHS expression, then load the array base into breg and
+        // store areg at the constant offset from it.
+        cb.genExpr(expr.getRHS(), currentScope);
+        cb.genVar(Reg::B, st.lookup(currentScope, arraySubLHS->getName(), arraySubLHS->getLocation()));
+        cb.genSTAI(arraySubLHS->getExpr()->getValue());
+      } else if (auto *arraySubLHS = dynamic_cast<ArraySubscriptExpr*>(expr.getLHS())) {
         // Handle LHS subscript.
         // Note that arrays are always global.
         // Generate the array element address and save it to the stack.
         cb.genExpr(arraySubLHS->getExpr(), currentScope);
-        cb.genVar(Reg::B, st.lookup(std::make_pair(currentScope, arraySubLHS->getName()),
-                                    arraySubLHS->getLocation()));
+        cb.genVar(Reg::B, st.lookup(currentScope, arraySubLHS->getName(), arraySubLHS->getLocation()));
         cb.genADD();
         auto stackOffset = cb.getCurrentFrame()->getOffset();
         cb.getCurrentFrame()->incOffset(1);
         cb.genLDBM(SP_OFFSET);
-        cb.genSTAI_FB(cb.getCurrentFrame(), -stackOffset);
+        cb.genSTAI_FB(-stackOffset);
         // Generate the RHS expression.
         cb.genExpr(expr.getRHS(), currentScope);
         // Load the array address into breg.
         cb.genLDBM(SP_OFFSET);
-        cb.genLDBI_FB(cb.getCurrentFrame(), -stackOffset);
+        cb.genLDBI_FB(-stackOffset);
         // Save areg into mem[breg].
         cb.genSTAI(0);
         cb.getCurrentFrame()->decOffset(1);
@@ -2416,33 +3305,32 @@ public:
   };
 
   /// Generate code for an expression using the ExprCodeGen visitor.
-  void genExpr(const std::unique_ptr<Expr> &expr,
-               const std::string &currentScope,
-               Reg reg=Reg::A) {
-    ExprCodeGen visitor(symbolTable, *this, currentScope, reg);
-    expr->accept(&visitor);
-  }
-
-  void genExpr(Expr *expr, const std::string &currentScope,
+  void genExpr(Expr *expr, Name currentScope,
                Reg reg=Reg::A) {
     ExprCodeGen visitor(symbolTable, *this, currentScope, reg);
     expr->accept(&visitor);
   }
 
   /// Generate code for a statement using the StmtCodeGen visitor.
-  void genStmt(const std::unique_ptr<Statement> &stmt,
-               const std::string &currentScope) {
+  void genStmt(Statement *stmt, Name currentScope) {
     StmtCodeGen visitor(symbolTable, *this, currentScope);
     stmt->accept(&visitor);
   }
 
   /// Return true if the expression contains a call.
-  bool containsCall(const std::unique_ptr<Expr> &expr) {
+  bool containsCall(Expr *expr) {
     ContainsCall visitor;
     expr->accept(&visitor);
     return visitor.getFlag();
   }
 
+  /// Return true if the expression refers to a name.
+  bool containsName(Expr *expr, Name name) {
+    ContainsName visitor(name);
+    expr->accept(&visitor);
+    return visitor.getFlag();
+  }
+
   /// Code generation ------------------------------------------------------///
 
   /// Generate a constant pool entry if required, return the label to it.
@@ -2477,7 +3365,7 @@ public:
   }
 
   /// Generate an address to a string literal.
-  void genString(Reg reg, const std::string value) {
+  void genString(Reg reg, std::string_view value) {
     // Add string to pool and assign label.
     // Create the label.
     auto label = (boost::format("_string%d") % stringCount++).str();
@@ -2517,54 +3405,71 @@ public:
       switch (reg) {
       case Reg::A:
         genLDAM(SP_OFFSET);
-        genLDAI_FB(symbol->getFrame(), symbol->getStackOffset());
+        genLDAI_FB(symbol->getStackOffset());
         break;
       case Reg::B:
         genLDBM(SP_OFFSET);
-        genLDBI_FB(symbol->getFrame(), symbol->getStackOffset());
+        genLDBI_FB(symbol->getStackOffset());
         break;
       }
     }
   }
 
-  /// Generate actual parameters that contain calls.
-  void genCallActuals(const std::vector<std::unique_ptr<Expr>> &args,
-                      const std::string &currentScope) {
-    size_t stackOffset = currentFrame->getOffset();
-    for (auto &arg : args) {
-      if (containsCall(arg)) {
-        // For each actual expression containing one or more calls, allocate a
-        // stack word (FB relative) for the result of that call since it cannot
-        // be written directly into the parameter slots until all calls have
-        // been resolved.
-        genExpr(arg.get(), currentScope);
+  /// Return true if an actual is evaluated into a temporary before any of the
+  /// actuals are stored to the parameter slots, which are overwritten by a
+  /// call. These are the actuals up to the last one containing a call, other
+  /// than constants, so that the actuals are evaluated from left to right.
+  bool isSavedActual(const NodeList<Expr> &args, size_t index) {
+    if (args[index]->isConst()) {
+      return false;
+    }
+    for (size_t i=index; i<args.size(); i++) {
+      if (containsCall(args[i])) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /// Generate the actual parameters that are evaluated before the others,
+  /// returning the frame offset of the first temporary holding their values.
+  /// The temporaries remain allocated, so that evaluating the other actuals,
+  /// which may need stack space of their own, does not overwrite them.
+  size_t genCallActuals(const NodeList<Expr> &args,
+                        Name currentScope) {
+    size_t temporaryOffset = currentFrame->getOffset();
+    for (size_t i=0; i<args.size(); i++) {
+      if (isSavedActual(args, i)) {
+        // For each actual expression containing or followed by one or more
+        // calls, allocate a stack word (FB relative) for its value since it
+        // cannot be written directly into the parameter slots until all
+        // calls have been resolved.
+        genExpr(args[i], currentScope);
         genLDBM(SP_OFFSET);
-        genSTAI_FB(currentFrame, -currentFrame->getOffset());
+        genSTAI_FB(-currentFrame->getOffset());
         currentFrame->incOffset(1);
       }
     }
-    // Restore the stack pointer offset so loadActuals can sequence through
-    // the call actual locations again.
-    currentFrame->setOffset(stackOffset);
+    return temporaryOffset;
   }
 
-  void loadActuals(const std::vector<std::unique_ptr<Expr>> &args, size_t parameterOffset,
-                   const std::string &currentScope) {
+  void loadActuals(const NodeList<Expr> &args, size_t parameterOffset,
+                   size_t temporaryOffset, Name currentScope) {
     size_t parameterIndex = parameterOffset;
-    for (auto &arg : args) {
-      if (containsCall(arg)) {
-        // For each actual expression containing one or more calls, load the
-        // expression value saved to a temporary stack location and store it
-        // to the actual parameter location.
+    for (size_t i=0; i<args.size(); i++) {
+      if (isSavedActual(args, i)) {
+        // For each actual expression evaluated before the others, load the
+        // value saved to a temporary stack location and store it to the
+        // actual parameter location.
         genLDAM(SP_OFFSET);
-        genLDAI_FB(currentFrame, -currentFrame->getOffset());
-        currentFrame->incOffset(1);
+        genLDAI_FB(-temporaryOffset);
+        temporaryOffset++;
         genLDBM(SP_OFFSET);
         genSTAI(parameterIndex);
       } else {
         // For all other actual expressions, generate the value and store it to
         // the actual parameter location.
-        genExpr(arg.get(), currentScope);
+        genExpr(args[i], currentScope);
         genLDBM(SP_OFFSET);
         genSTAI(parameterIndex);
       }
@@ -2572,12 +3477,12 @@ public:
     }
   }
 
-  void genSysCall(int syscallId, const std::vector<std::unique_ptr<Expr>> &args,
-                  const std::string &currentScope) {
+  void genSysCall(int syscallId, const NodeList<Expr> &args,
+                  Name currentScope) {
     auto stackOffset = currentFrame->getOffset();
     // Actual parameters.
-    genCallActuals(args, currentScope);
-    loadActuals(args, FB_PARAM_OFFSET_FUNC, currentScope);
+    auto temporaryOffset = genCallActuals(args, currentScope);
+    loadActuals(args, FB_PARAM_OFFSET_FUNC, temporaryOffset, currentScope);
     currentFrame->incOffset(args.size() + FB_PARAM_OFFSET_FUNC);
     // Perform syscall.
     genLDAC(syscallId);
@@ -2588,17 +3493,17 @@ public:
     currentFrame->setOffset(stackOffset);
   }
 
-  void genFuncCall(const std::string &name, const std::vector<std::unique_ptr<Expr>> &args,
-                   const std::string &currentScope) {
+  void genFuncCall(Name name, const NodeList<Expr> &args,
+                   Name currentScope) {
     auto stackOffset = currentFrame->getOffset();
     // Actual parameters.
-    genCallActuals(args, currentScope);
-    loadActuals(args, FB_PARAM_OFFSET_FUNC, currentScope);
+    auto temporaryOffset = genCallActuals(args, currentScope);
+    loadActuals(args, FB_PARAM_OFFSET_FUNC, temporaryOffset, currentScope);
     currentFrame->incOffset(args.size() + FB_PARAM_OFFSET_FUNC);
     // Branch and link.
     auto linkLabel = getLabel();
     genLDAP(linkLabel);
-    genBR(name);
+    genBR(name.str());
     genLabel(linkLabel);
     // Load the result of the function call into areg.
     genLDAM(SP_OFFSET);
@@ -2606,46 +3511,98 @@ public:
     currentFrame->setOffset(stackOffset);
   }
 
-  void genProcCall(const std::string &name, const std::vector<std::unique_ptr<Expr>> &args,
-                   const std::string &currentScope) {
+  void genProcCall(Name name, const NodeList<Expr> &args,
+                   Name currentScope) {
     auto stackOffset = currentFrame->getOffset();
     // Actual parameters.
-    genCallActuals(args, currentScope);
-    loadActuals(args, FB_PARAM_OFFSET_PROC, currentScope);
+    auto temporaryOffset = genCallActuals(args, currentScope);
+    loadActuals(args, FB_PARAM_OFFSET_PROC, temporaryOffset, currentScope);
     currentFrame->incOffset(args.size() + FB_PARAM_OFFSET_PROC);
     // Branch and link.
     auto linkLabel = getLabel();
     genLDAP(linkLabel);
-    genBR(name);
+    genBR(name.str());
     genLabel(linkLabel);
     currentFrame->setOffset(stackOffset);
   }
 
+  /// Generate a tail call of the current procedure to itself. Each actual
+  /// that is not the value of its own formal is evaluated and stored directly
+  /// into the formal if no later actual refers to it, or otherwise into a
+  /// temporary stack location that is copied into the formal once all of the
+  /// actuals have been evaluated. Control then branches to the start of the
+  /// body, reusing the frame.
+  void genTailCall(Proc *proc, const NodeList<Expr> &args,
+                   Name currentScope) {
+    auto &formals = proc->getFormals();
+    std::vector<Symbol*> formalSymbols;
+    std::vector<bool> unchanged;
+    for (size_t i=0; i<args.size(); i++) {
+      formalSymbols.push_back(symbolTable.lookup(proc->getName(), formals[i]->getName(),
+                                                 formals[i]->getLocation()));
+      auto varRef = dynamic_cast<VarRefExpr*>(args[i]);
+      unchanged.push_back(varRef && !varRef->isConst() &&
+                          varRef->getName() == formals[i]->getName());
+    }
+    size_t stackOffset = currentFrame->getOffset();
+    std::vector<int> temporaries;
+    for (size_t i=0; i<args.size(); i++) {
+      if (unchanged[i]) {
+        continue;
+      }
+      bool referencedLater = false;
+      for (size_t j=i+1; j<args.size(); j++) {
+        referencedLater |= !unchanged[j] && containsName(args[j], formals[i]->getName());
+      }
+      genExpr(args[i], currentScope);
+      genLDBM(SP_OFFSET);
+      if (referencedLater) {
+        temporaries.push_back(i);
+        genSTAI_FB(-currentFrame->getOffset());
+        currentFrame->incOffset(1);
+      } else {
+        genSTAI_FB(formalSymbols[i]->getStackOffset());
+      }
+    }
+    currentFrame->setOffset(stackOffset);
+    for (auto i : temporaries) {
+      genLDAM(SP_OFFSET);
+      genLDAI_FB(-currentFrame->getOffset());
+      currentFrame->incOffset(1);
+      genLDBM(SP_OFFSET);
+      genSTAI_FB(formalSymbols[i]->getStackOffset());
+    }
+    currentFrame->setOffset(stackOffset);
+    genBR(currentFrame->getEntryLabel());
+  }
+
   /// Reporting -------------------------------------------------------------//
   void emitInstrs(std::ostream &out) {
-    for (auto &directive : instrs) {
-      if (directive->getToken() == hexasm::Token::PROC ||
-          directive->getToken() == hexasm::Token::FUNC ||
-          directive->getToken() == hexasm::Token::PROLOGUE) {
+    for (size_t i=0; i<instrs.size(); i++) {
+      auto token = instrs.getToken(i);
+      if (token == hexasm::Token::PROC ||
+          token == hexasm::Token::FUNC ||
+          token == hexasm::Token::PROLOGUE) {
         // Add some new lines for these section markers.
-        out << boost::format("\n%-20s\n") % directive->toString();
-      } else if (directive->getToken() == hexasm::Token::SP_VALUE) {
+        out << boost::format("\n%-20s\n") % instrs.toString(i);
+      } else if (token == hexasm::Token::SP_VALUE) {
         // SP value and data section are emitted together.
-        out << boost::format("%-20s\n") % directive->toString();
-        for (auto &directive : data) {
-          out << boost::format("%-20s\n") % directive->toString();
+        out << boost::format("%-20s\n") % instrs.toString(i);
+        for (size_t j=0; j<data.size(); j++) {
+          out << boost::format("%-20s\n") % data.toString(j);
         }
       } else {
         // All other directives.
-        out << boost::format("%-20s\n") % directive->toString();
+        out << boost::format("%-20s\n") % instrs.toString(i);
       }
     }
     out << "\n";
   }
 
   /// Member access --------------------------------------------------------//
-  std::vector<std::unique_ptr<hexasm::Directive>> &getInstrs() { return instrs; }
-  std::vector<std::unique_ptr<hexasm::Directive>> &getData() { return data; }
+  hexasm::DirectiveStream &getInstrs() { return instrs; }
+  hexasm::DirectiveStream &getData() { return data; }
+  Symbol *getProcSymbol(size_t index) { return procSymbols[index]; }
   void setCurrentFrame(Frame *frame) { currentFrame = frame; }
   Frame *getCurrentFrame() { return currentFrame; }
 };
@@ -2657,18 +3614,17 @@ public:
 /// frame-base indexing.
 class FormalLocations : public AstVisitor {
   SymbolTable &st;
-  const std::string &currentScope;
-  std::shared_ptr<Frame> &frame;
+  Name currentScope;
+  Frame *frame;
   size_t frameBaseOffset;
   void assignLocation(Formal &formal) {
-    auto symbol = st.lookup(std::make_pair(currentScope, formal.getName()),
-                            formal.getLocation());
+    auto symbol = st.lookup(currentScope, formal.getName(), formal.getLocation());
     symbol->setStackOffset(frameBaseOffset++);
     symbol->setFrame(frame);
   }
 public:
-  FormalLocations(SymbolTable &st, const std::string &currentScope,
-                  std::shared_ptr<Frame> &frame, bool isFunction) :
+  FormalLocations(SymbolTable &st, Name currentScope,
+                  Frame *frame, bool isFunction) :
     AstVisitor(false, false, false), st(st), currentScope(currentScope), frame(frame),
     frameBaseOffset(1 + (isFunction ? FB_PARAM_OFFSET_FUNC : FB_PARAM_OFFSET_PROC)) {}
   void visitPost(ValFormal &formal) { assignLocation(formal); }
@@ -2680,20 +3636,19 @@ public:
 /// Assign stack locations to local variables, starting from the base of the frame.
 class LocalDeclLocations : public AstVisitor {
   SymbolTable &st;
-  const std::string &currentScope;
-  std::shared_ptr<Frame> &frame;
+  Name currentScope;
+  Frame *frame;
   size_t count;
   void assignLocation(Decl &decl, size_t size) {
-    auto symbol = st.lookup(std::make_pair(currentScope, decl.getName()),
-                            decl.getLocation());
+    auto symbol = st.lookup(currentScope, decl.getName(), decl.getLocation());
     symbol->setStackOffset(-count);
     symbol->setFrame(frame);
     frame->incOffset(size);
     count += size;
   }
 public:
-  LocalDeclLocations(SymbolTable &st, const std::string &currentScope,
-                     std::shared_ptr<Frame> &frame) :
+  LocalDeclLocations(SymbolTable &st, Name currentScope,
+                     Frame *frame) :
     AstVisitor(false, false, false), st(st), currentScope(currentScope),
     frame(frame), count(0) {}
   void visitPost(ArrayDecl &decl) { assignLocation(decl, decl.getSize()); }
@@ -2733,35 +3688,36 @@ public:
   /// Procedure call setup.
   void visitPre(Proc &proc) {
     // Setup a frame object for the proc/func.
-    auto symbol = st.lookup(std::make_pair(getCurrentScope(), proc.getName()),
-                            proc.getLocation());
-    auto frame = std::make_shared<Frame>(cb.getLabel());
+    auto symbol = st.lookup(getCurrentScope(), proc.getName(), proc.getLocation());
+    auto frame = st.createFrame(cb.getLabel());
     symbol->setFrame(frame);
-    cb.setCurrentFrame(symbol->getFrame());
+    cb.setCurrentFrame(frame);
     // Allocate storage locations to formals.
     FormalLocations formalLocations(st, proc.getName(), frame, proc.isFunction());
     proc.accept(&formalLocations);
     // Allocate storage locations to local declarations.
     LocalDeclLocations localDeclLocations(st, proc.getName(), frame);
     proc.accept(&localDeclLocations);
-    // Generate the prologue.
+    // Generate the prologue, followed by the target of any tail calls.
     cb.genPrologue(symbol);
+    if (proc.hasTailCalls()) {
+      frame->setEntryLabel(cb.getLabel());
+      cb.genLabel(frame->getEntryLabel());
+    }
     // Generate the body.
     cb.genStmt(proc.getStatement(), proc.getName());
   }
 
   /// Proceudre call completion.
   void visitPost(Proc &proc) {
-    auto symbol = st.lookup(std::make_pair(getCurrentScope(), proc.getName()),
-                            proc.getLocation());
+    auto symbol = st.lookup(getCurrentScope(), proc.getName(), proc.getLocation());
     cb.genEpilogue(symbol);
   }
 
   /// Global variables. Allocate a word with a DATA directive and assign them
   /// a label.
   void visitPost(VarDecl &decl) {
-    auto symbol = st.lookup(std::make_pair(getCurrentScope(), decl.getName()),
-                            decl.getLocation());
+    auto symbol = st.lookup(getCurrentScope(), decl.getName(), decl.getLocation());
     auto label = cb.getLabel();
     symbol->setGlobalLabel(label);
     cb.genDataLabel(label);
@@ -2771,8 +3727,7 @@ public:
   /// Global arrays. Allocate space at the end of memory, generate a DATA
   /// directive with the address and assign it a label.
   void visitPost(ArrayDecl &decl) {
-    auto symbol = st.lookup(std::make_pair(getCurrentScope(), decl.getName()),
-                            decl.getLocation());
+    auto symbol = st.lookup(getCurrentScope(), decl.getName(), decl.getLocation());
     globalsOffset += decl.getSize();
     size_t address = MAX_ADDRESS - globalsOffset;
     auto label = cb.getLabel();
@@ -2787,60 +3742,365 @@ public:
   void emitInstrs(std::ostream &out) { cb.emitInstrs(out); }
 };
 
+//===---------------------------------------------------------------------===//
+// Layout.
+//===---------------------------------------------------------------------===//
+
+/// The cycles of a run of a program, read from the folded stacks written by
+/// hexsim --profile, which have one "outer;...;inner cycles" line per call
+/// stack. Self cycles are charged to the innermost symbol of each stack, and
+/// call cycles to the edge from its caller.
+class Profile {
+  std::unordered_map<std::string, double> selfCycles;
+  std::map<std::pair<std::string, std::string>, double> callCycles;
+
+public:
+  Profile() {}
+
+  void read(const std::string &filename) {
+    std::ifstream file(filename);
+    if (!file) {
+      throw ProfileError(filename, "could not open file");
+    }
+    std::string line;
+    size_t lineNumber = 0;
+    while (std::getline(file, line)) {
+      lineNumber++;
+      if (line.empty()) {
+        continue;
+      }
+      auto space = line.rfind(' ');
+      char *end = nullptr;
+      double cycles = space == std::string::npos ? 0 : std::strtod(line.c_str() + space + 1, &end);
+      if (space == 0 || space == std::string::npos || *end != '\0') {
+        throw ProfileError(filename, (boost::format("malformed line %d") % lineNumber).str());
+      }
+      std::string_view stack(line.data(), space);
+      auto last = stack.rfind(';');
+      auto callee = std::string(last == std::string::npos ? stack : stack.substr(last + 1));
+      selfCycles[callee] += cycles;
+      if (last != std::string::npos && last > 0) {
+        auto previous = stack.rfind(';', last - 1);
+        auto begin = previous == std::string::npos ? 0 : previous + 1;
+        callCycles[{std::string(stack.substr(begin, last - begin)), callee}] += cycles;
+      }
+    }
+  }
+
+  bool empty() const { return selfCycles.empty(); }
+
+  double getSelfCycles(const std::string &name) const {
+    auto it = selfCycles.find(name);
+    return it == selfCycles.end() ? 0 : it->second;
+  }
+
+  const std::map<std::pair<std::string, std::string>, double> &getCallCycles() const {
+    return callCycles;
+  }
+};
+
+/// Lay out the procedures and the data (globals, constants and strings) of
+/// the intermediate program to minimise the prefixes of their operands.
+/// Data is placed at the lowest word addresses, following the SP value, in
+/// order of accesses per word, since its labels are absolute operands.
+/// Procedures are placed next to their callers by merging chains of
+/// procedures along the heaviest call edges first (Pettis and Hansen), so
+/// that relative branches between them are short.
+///
+/// Weights are taken from a profile where one is given, estimating the
+/// accesses of an instruction as the self cycles of its procedure divided by
+/// its length, and otherwise from static use counts, which also break ties.
+class LayoutProgram {
+
+  /// A profiled weight, then a static one, compared lexicographically.
+  using Weight = std::pair<double, double>;
+
+  struct Segment {
+    size_t begin, end;
+    std::string name;
+    double accessWeight; // Estimated executions of each instruction.
+  };
+
+  CodeBuffer &cb;
+  const Profile &profile;
+  std::vector<Segment> procs;
+  std::unordered_map<std::string, size_t> procIndex;
+
+  static bool weightGreater(const std::pair<Weight, size_t> &a,
+                            const std::pair<Weight, size_t> &b) {
+    return a.first != b.first ? a.first > b.first : a.second < b.second;
+  }
+
+  /// Divide the instructions into the preamble and a segment for each
+  /// procedure, from its prologue to the next one.
+  void findProcs() {
+    auto &instrs = cb.getInstrs();
+    for (size_t i=0; i<instrs.size(); i++) {
+      if (instrs.getToken(i) == hexasm::Token::PROLOGUE) {
+        if (!procs.empty()) {
+          procs.back().end = i;
+        }
+        procIndex[instrs.getLabelName(i)] = procs.size();
+        procs.push_back({i, instrs.size(), instrs.getLabelName(i), 0});
+      }
+    }
+    for (auto &proc : procs) {
+      proc.accessWeight = profile.getSelfCycles(proc.name) / (proc.end - proc.begin);
+    }
+  }
+
+  size_t getPreambleEnd() const {
+    return procs.empty() ? cb.getInstrs().size() : procs.front().begin;
+  }
+
+  /// Order the data by the accesses per word of each labelled item.
+  void layoutData() {
+    auto &instrs = cb.getInstrs();
+    auto &data = cb.getData();
+    // Find the items, each of which is a label followed by its words.
+    std::vector<size_t> itemBegins;
+    std::unordered_map<std::string, size_t> itemIndex;
+    size_t firstItem = data.size();
+    for (size_t i=0; i<data.size(); i++) {
+      if (data.isLabel(i)) {
+        firstItem = std::min(firstItem, i);
+        itemIndex[data.getLabelName(i)] = itemBegins.size();
+        itemBegins.push_back(i);
+      }
+    }
+    itemBegins.push_back(data.size());
+    // Count the accesses of each item.
+    std::vector<std::pair<Weight, size_t>> items;
+    for (size_t i=0; i+1<itemBegins.size(); i++) {
+      items.push_back({{0, 0}, i});
+    }
+    double preambleWeight = profile.getSelfCycles("[entry]") / std::max<size_t>(getPreambleEnd(), 1);
+    for (size_t proc=0, i=0; i<instrs.size(); i++) {
+      while (proc < procs.size() && i >= procs[proc].end) {
+        proc++;
+      }
+      if (instrs.operandIsLabel(i)) {
+        auto it = itemIndex.find(instrs.getLabelName(i));
+        if (it != itemIndex.end()) {
+          auto &weight = items[it->second].first;
+          weight.first += i < getPreambleEnd() ? preambleWeight : procs[proc].accessWeight;
+          weight.second += 1;
+        }
+      }
+    }
+    for (auto &item : items) {
+      double words = itemBegins[item.second + 1] - itemBegins[item.second] - 1;
+      item.first.first /= std::max(words, 1.0);
+      item.first.second /= std::max(words, 1.0);
+    }
+    std::stable_sort(items.begin(), items.end(), weightGreater);
+    // Append the items in their new order and remove the old ones.
+    size_t end = data.size();
+    data.appendRange(0, firstItem);
+    for (auto &item : items) {
+      data.appendRange(itemBegins[item.second], itemBegins[item.second + 1]);
+    }
+    data.erase(0, end);
+  }
+
+  /// Return the distance from the middle of the caller to the start of the
+  /// callee in a chain.
+  size_t callDistance(const std::vector<size_t> &chain, size_t caller, size_t callee) {
+    size_t offset = 0, callerMiddle = 0, calleeBegin = 0;
+    for (auto proc : chain) {
+      if (proc == caller) {
+        callerMiddle = offset + (procs[proc].end - procs[proc].begin) / 2;
+      }
+      if (proc == callee) {
+        calleeBegin = offset;
+      }
+      offset += procs[proc].end - procs[proc].begin;
+    }
+    return callerMiddle > calleeBegin ? callerMiddle - calleeBegin : calleeBegin - callerMiddle;
+  }
+
+  /// Order the procedures by merging chains of them along the heaviest call
+  /// edges.
+  void layoutProcs() {
+    auto &instrs = cb.getInstrs();
+    // Weight the call edges between procedures.
+    std::map<std::pair<size_t, size_t>, Weight> callWeights;
+    for (size_t proc=0; proc<procs.size(); proc++) {
+      for (size_t i=procs[proc].begin; i<procs[proc].end; i++) {
+        if (instrs.getToken(i) == hexasm::Token::BR && instrs.operandIsLabel(i)) {
+          auto it = procIndex.find(instrs.getLabelName(i));
+          if (it != procIndex.end() && it->second != proc) {
+            callWeights[{proc, it->second}].second += 1;
+          }
+        }
+      }
+    }
+    for (auto &call : profile.getCallCycles()) {
+      auto caller = procIndex.find(call.first.first);
+      auto callee = procIndex.find(call.first.second);
+      if (caller != procIndex.end() && callee != procIndex.end() &&
+          caller->second != callee->second) {
+        callWeights[{caller->second, callee->second}].first += call.second;
+      }
+    }
+    std::vector<std::pair<Weight, size_t>> edges;
+    std::vector<std::pair<size_t, size_t>> calls;
+    for (auto &callWeight : callWeights) {
+      edges.push_back({callWeight.second, calls.size()});
+      calls.push_back(callWeight.first);
+    }
+    std::stable_sort(edges.begin(), edges.end(), weightGreater);
+    // Start with a chain for each procedure, and merge the chains of the
+    // caller and callee of each edge, choosing the orientation of the two
+    // chains that places the callee closest to the caller.
+    std::vector<std::vector<size_t>> chains(procs.size());
+    std::vector<size_t> chainOf(procs.size());
+    for (size_t proc=0; proc<procs.size(); proc++) {
+      chains[proc].push_back(proc);
+      chainOf[proc] = proc;
+    }
+    for (auto &edge : edges) {
+      auto [caller, callee] = calls[edge.second];
+      size_t a = chainOf[caller], b = chainOf[callee];
+      if (a == b) {
+        continue;
+      }
+      std::vector<size_t> best;
+      size_t bestDistance = SIZE_MAX;
+      for (int reverseA=0; reverseA<2; reverseA++) {
+        for (int reverseB=0; reverseB<2; reverseB++) {
+          std::vector<size_t> chain(chains[a]);
+          if (reverseA) {
+            std::reverse(chain.begin(), chain.end());
+          }
+          if (reverseB) {
+            chain.insert(chain.end(), chains[b].rbegin(), chains[b].rend());
+          } else {
+            chain.insert(chain.end(), chains[b].begin(), chains[b].end());
+          }
+          auto distance = callDistance(chain, caller, callee);
+          if (distance < bestDistance) {
+            best.swap(chain);
+            bestDistance = distance;
+          }
+        }
+      }
+      for (auto proc : chains[b]) {
+        chainOf[proc] = a;
+      }
+      chains[a].swap(best);
+      chains[b].clear();
+    }
+    // Order the chains by their profiled cycles, then by their first
+    // procedure in the program.
+    std::vector<std::pair<Weight, size_t>> order;
+    for (size_t i=0; i<chains.size(); i++) {
+      if (!chains[i].empty()) {
+        double cycles = 0;
+        for (auto proc : chains[i]) {
+          cycles += profile.getSelfCycles(procs[proc].name);
+        }
+        auto first = *std::min_element(chains[i].begin(), chains[i].end());
+        order.push_back({{cycles, -static_cast<double>(first)}, i});
+      }
+    }
+    std::stable_sort(order.begin(), order.end(), weightGreater);
+    // Append the preamble and procedures in their new order and remove the
+    // old ones.
+    size_t end = instrs.size();
+    instrs.appendRange(0, getPreambleEnd());
+    for (auto &chain : order) {
+      for (auto proc : chains[chain.second]) {
+        instrs.appendRange(procs[proc].begin, procs[proc].end);
+      }
+    }
+    instrs.erase(0, end);
+  }
+
+public:
+  LayoutProgram(CodeGen &codeGen, const Profile &profile) :
+      cb(codeGen.getCodeBuffer()), profile(profile) {
+    findProcs();
+    layoutData();
+    layoutProcs();
+  }
+};
+
 //===---------------------------------------------------------------------===//
 // Lower directives.
 //===---------------------------------------------------------------------===//
 
 /// Lower the intermediate output produced by code generation into assembly
-/// directives that can be consumed by hexasm.
+/// directives that can be consumed by hexasm. Frame-base relative accesses
+/// are rewritten in place, and the lowered program is then appended to the
+/// stream of code generation, with the SP value, prologues and epilogues
+/// expanded, before the intermediate program is removed from the front of it.
 class LowerDirectives {
-  CodeBuffer cb;
+  CodeBuffer &cb;
 
 public:
-  LowerDirectives(SymbolTable &symbolTable, CodeGen &cg) : cb(symbolTable) {
+  LowerDirectives(CodeGen &cg) : cb(cg.getCodeBuffer()) {
+    auto &instrs = cb.getInstrs();
+    size_t numIntermediate = instrs.size();
+    instrs.reserve(2 * numIntermediate + cb.getData().size());
+    // The frame of the procedure being lowered.
+    Frame *frame = nullptr;
+    // The start of the directives since the last one that was expanded,
+    // which are copied once lowered.
+    size_t copyBegin = 0;
     // Lower intermediate instruction directives.
-    for (auto &instr : cg.getCodeBuffer().getInstrs()) {
-      auto token = instr->getToken();
+    for (size_t i=0; i<numIntermediate; i++) {
+      auto token = instrs.getToken(i);
+      if (token == hexasm::Token::SP_VALUE ||
+          token == hexasm::Token::PROLOGUE ||
+          token == hexasm::Token::EPILOGUE) {
+        instrs.appendRange(copyBegin, i);
+        copyBegin = i + 1;
+      }
       switch (token) {
       case hexasm::Token::SP_VALUE: {
-        // SP value.
+        // SP value, which is a global variable with the static data.
+        cb.genDataMarker(hexasm::Token::DATA_BEGIN);
         cb.genInstrData(MAX_ADDRESS - cg.getGlobalsOffset() - 1);
         // Emit data directives for globals, constants and strings.
-        for (auto &data : cg.getCodeBuffer().getData()) {
-          cb.insertInstr(std::move(data));
+        auto &data = cb.getData();
+        for (size_t j=0; j<data.size(); j++) {
+          instrs.append(data, j);
         }
+        cb.genDataMarker(hexasm::Token::DATA_END);
         break;
       }
       case hexasm::Token::PROLOGUE: {
-        auto prologue = dynamic_cast<Prologue*>(instr.get());
-        auto name = prologue->getSymbol()->getName();
-        if (prologue->getSymbol()->getType() == SymbolType::FUNC) {
+        auto symbol = cb.getProcSymbol(instrs.getValue(i));
+        auto name = symbol->getName().str();
+        frame = symbol->getFrame();
+        if (symbol->getType() == SymbolType::FUNC) {
           cb.genFunc(name);
         }
-        if (prologue->getSymbol()->getType() == SymbolType::PROC) {
+        if (symbol->getType() == SymbolType::PROC) {
           cb.genProc(name);
         }
         // Save current stack pointer.
         cb.genLDBM(SP_OFFSET);
         cb.genSTAI(0);
-        if (prologue->getFrame()->getSize() > 0) {
+        if (frame->getSize() > 0) {
           // Extend the stack pointer by the frame size.
-          cb.genLDAC(-prologue->getFrame()->getSize());
+          cb.genLDAC(-frame->getSize());
           cb.genOPR(hexasm::Token::ADD);
           cb.genSTAM(SP_OFFSET);
         }
         break;
       }
       case hexasm::Token::EPILOGUE: {
-        auto epilogue = dynamic_cast<Epilogue*>(instr.get());
-        auto frameSize = epilogue->getFrame()->getSize();
-        cb.genLabel(epilogue->getFrame()->getExitLabel());
+        auto symbol = cb.getProcSymbol(instrs.getValue(i));
+        auto frameSize = symbol->getFrame()->getSize();
+        cb.genLabel(symbol->getFrame()->getExitLabel());
         // Function
-        if (epilogue->getSymbol()->getType() == SymbolType::FUNC) {
+        if (symbol->getType() == SymbolType::FUNC) {
           // Store return value in areg.
           cb.genLDBM(SP_OFFSET);
           cb.genSTAI(frameSize + 1);
-          if (epilogue->getFrame()->getSize() > 0) {
+          if (frameSize > 0) {
             // Contract the stack poiner.
             cb.genLDAC(frameSize);
             cb.genOPR(hexasm::Token::ADD);
@@ -2853,9 +4113,9 @@ public:
           break;
         }
         // Process
-        if (epilogue->getSymbol()->getType() == SymbolType::PROC) {
+        if (symbol->getType() == SymbolType::PROC) {
           cb.genLDBM(SP_OFFSET);
-          if (epilogue->getFrame()->getSize() > 0) {
+          if (frameSize > 0) {
             // Contract the stack poiner.
             cb.genLDAC(frameSize);
             cb.genOPR(hexasm::Token::ADD);
@@ -2867,19 +4127,20 @@ public:
           cb.genOPR(hexasm::Token::BRB);
           break;
         }
+        break;
       }
       case hexasm::Token::LDAI_FB:
       case hexasm::Token::LDBI_FB:
       case hexasm::Token::STAI_FB: {
-        auto oldInstr = dynamic_cast<InstrStackOffset*>(instr.get());
+        assert(frame && "frame-base relative access outside a procedure");
         // Calculate the new offset from the SP: frame size plus frame-base
         // offset (negative to access current frame, positive to access
         // previous frame).
-        int newOffset = oldInstr->getFrame()->getSize() - 1 + oldInstr->getOffset();
+        int newOffset = frame->getSize() - 1 + instrs.getValue(i);
         switch (token) {
-        case hexasm::Token::LDAI_FB: cb.genLDAI(newOffset); break;
-        case hexasm::Token::LDBI_FB: cb.genLDBI(newOffset); break;
-        case hexasm::Token::STAI_FB: cb.genSTAI(newOffset); break;
+        case hexasm::Token::LDAI_FB: instrs.setInstrImm(i, hexasm::Token::LDAI, newOffset); break;
+        case hexasm::Token::LDBI_FB: instrs.setInstrImm(i, hexasm::Token::LDBI, newOffset); break;
+        case hexasm::Token::STAI_FB: instrs.setInstrImm(i, hexasm::Token::STAI, newOffset); break;
         default:
           assert(0 && "unexpected token in lowering of FB-relative memory accesses");
           break;
@@ -2887,11 +4148,12 @@ public:
         break;
       }
       default:
-        // Otherwise just copy the directive.
-        cb.insertInstr(std::move(instr));
+        // Otherwise the directive is copied unchanged.
         break;
       }
     }
+    instrs.appendRange(copyBegin, numIntermediate);
+    instrs.erase(0, numIntermediate);
   }
 
   /// Reporting -------------------------------------------------------------//
@@ -2899,95 +4161,374 @@ public:
 
   /// Member access ---------------------------------------------------------//
   CodeBuffer &getCodeBuffer() { return cb; }
-  std::vector<std::unique_ptr<hexasm::Directive>> &getInstrs() {
-    return cb.getInstrs();
-  }
+  hexasm::DirectiveStream &getInstrs() { return cb.getInstrs(); }
 };
 
 //===---------------------------------------------------------------------===//
 // Optimise directives.
 //===---------------------------------------------------------------------===//
 
+/// An element of a peephole pattern, which matches a directive by its token
+/// or by a class of tokens, and optionally by its operand.
+struct PeepholeElement {
+  enum Match : uint8_t {
+    TOKEN,       // The token of the element.
+    LABEL,       // Any label.
+    INSTR,       // Any instruction.
+    BRANCH,      // BR, BRZ or BRN.
+    COND_BRANCH, // BRZ or BRN.
+    LOAD_A,      // LDAC, LDAM or LDAP, which set areg without reading it.
+    LOAD_B,      // LDBC or LDBM, which set breg without reading it.
+    KEEP_B       // An instruction that preserves breg and all but the memory
+                 // that is addressed relative to breg.
+  };
+  enum Operand : uint8_t {
+    ANY,
+    SP,          // The address of the stack pointer.
+    ZERO,        // A constant of zero.
+    NONZERO,     // A constant that is not zero.
+    NONNEGATIVE, // A constant that is not negative.
+    SAME,        // The same constant or label as the element ref.
+    SAME_ONCE    // The same label as the element ref, which is only
+                 // referenced once.
+  };
+  Match match;
+  hexasm::Token token;
+  Operand operand;
+  uint8_t ref;
+
+  static PeepholeElement is(hexasm::Token token, Operand operand=ANY, uint8_t ref=0) {
+    return PeepholeElement{TOKEN, token, operand, ref};
+  }
+  static PeepholeElement is(Match match, Operand operand=ANY, uint8_t ref=0) {
+    return PeepholeElement{match, hexasm::Token::NONE, operand, ref};
+  }
+};
+
+/// A directive of the replacement of a peephole pattern: one of the matched
+/// directives, optionally with its label operand taken from another.
+struct PeepholeOutput {
+  uint8_t index;
+  int8_t labelFrom;
+  PeepholeOutput(uint8_t index, int8_t labelFrom=-1) :
+      index(index), labelFrom(labelFrom) {}
+};
+
+/// The maximum length of a peephole pattern.
+const size_t MAX_PATTERN = 8;
+
+struct PeepholeRule {
+  const char *name;
+  std::vector<PeepholeElement> pattern;
+  std::vector<PeepholeOutput> replacement;
+};
+
+/// The peephole rules, which are tried in order at each directive. The rules
+/// on stack-pointer-relative accesses rely on the frames of a program never
+/// overlapping the stack pointer itself, and the ones that remove a load of
+/// a register on code generation never using the value of a register after
+/// it is overwritten.
+inline const std::vector<PeepholeRule> &getPeepholeRules() {
+  using E = PeepholeElement;
+  using hexasm::Token;
+  static const std::vector<PeepholeRule> rules = {
+    // BR <x>; <x> -> <x>
+    {"branch-to-next",
+     {E::is(E::BRANCH), E::is(E::LABEL, E::SAME, 0)},
+     {1}},
+    // BR <x>; <y>; <x> -> <y>; <x>
+    {"branch-over-label",
+     {E::is(E::BRANCH), E::is(E::LABEL), E::is(E::LABEL, E::SAME, 0)},
+     {1, 2}},
+    // BR <x>; <instr> -> BR <x>
+    {"unreachable",
+     {E::is(Token::BR), E::is(E::INSTR)},
+     {0}},
+    // STAM <x>; LDAM <x> -> STAM <x>
+    {"store-then-load",
+     {E::is(Token::STAM), E::is(Token::LDAM, E::SAME, 0)},
+     {0}},
+    // LDBM 1; STAI <x>; LDAM 1; LDAI <x> -> LDBM 1; STAI <x>
+    {"frame-store-then-load",
+     {E::is(Token::LDBM, E::SP), E::is(Token::STAI),
+      E::is(Token::LDAM, E::SP), E::is(Token::LDAI, E::SAME, 1)},
+     {0, 1}},
+    // LDBM 1; <keeps breg>; LDBM 1 -> LDBM 1; <keeps breg>
+    {"sp-reload",
+     {E::is(Token::LDBM, E::SP), E::is(E::KEEP_B), E::is(Token::LDBM, E::SP)},
+     {0, 1}},
+    // LDBM 1; <keeps breg>; <keeps breg>; LDBM 1 -> LDBM 1; <keeps breg>; <keeps breg>
+    {"sp-reload-2",
+     {E::is(Token::LDBM, E::SP), E::is(E::KEEP_B), E::is(E::KEEP_B),
+      E::is(Token::LDBM, E::SP)},
+     {0, 1, 2}},
+    // <load areg>; <load areg> -> <load areg>
+    {"dead-areg-load",
+     {E::is(E::LOAD_A), E::is(E::LOAD_A)},
+     {1}},
+    // <load breg>; <load breg> -> <load breg>
+    {"dead-breg-load",
+     {E::is(E::LOAD_B), E::is(E::LOAD_B)},
+     {1}},
+    // LDAC <non-zero>; BRZ <x> -> LDAC <non-zero>
+    {"const-brz",
+     {E::is(Token::LDAC, E::NONZERO), E::is(Token::BRZ)},
+     {0}},
+    // LDAC <non-negative>; BRN <x> -> LDAC <non-negative>
+    {"const-brn",
+     {E::is(Token::LDAC, E::NONNEGATIVE), E::is(Token::BRN)},
+     {0}},
+    // A branch on a boolean that is materialised from a comparison, which
+    // branches directly to the target when the boolean is false.
+    // BRZ <t>; LDAC 0; BR <e>; <t>; LDAC 1; <e>; BRZ <x>
+    //   -> BRZ <t>; LDAC 0; BR <x>; <t>; LDAC 1; <e>
+    {"branch-on-boolean",
+     {E::is(E::COND_BRANCH), E::is(Token::LDAC, E::ZERO), E::is(Token::BR),
+      E::is(E::LABEL, E::SAME, 0), E::is(Token::LDAC, E::NONZERO),
+      E::is(E::LABEL, E::SAME_ONCE, 2), E::is(Token::BRZ)},
+     {0, 1, PeepholeOutput(2, 6), 3, 4, 5}},
+  };
+  return rules;
+}
+
+/// Optimise the lowered stream in place by applying the peephole rules
+/// repeatedly until none of them matches. A rule is only applied if its
+/// replacement costs less than the directives it matches.
 class OptimiseDirectives {
-  std::vector<std::unique_ptr<hexasm::Directive>> &instrs;
-  CodeBuffer cb;
+  CodeBuffer &cb;
+  hexasm::DirectiveStream &instrs;
+  const std::vector<PeepholeRule> &rules;
+  // The number of label operands that refer to each label.
+  std::vector<uint32_t> references;
+  std::vector<size_t> hits;
+  size_t passes;
+  // The rules that can match from a directive, by its token.
+  std::vector<std::vector<size_t>> rulesByToken;
+
+  /// The cost of directives: the bytes of their encodings, each a one-cycle
+  /// instruction or prefix, then the number of instructions. The size of a
+  /// label operand is an estimate, since it is not known until assembly.
+  struct Cost {
+    size_t bytes;
+    size_t instrs;
+    bool operator<(const Cost &other) const {
+      return bytes < other.bytes ||
+             (bytes == other.bytes && instrs < other.instrs);
+    }
+  };
 
-  /// Match BR <label>; <label>
-  bool matchBranchZero(size_t index) {
-    if (instrs[index+0]->getToken() == hexasm::Token::BR &&
-        instrs[index+1]->getToken() == hexasm::Token::IDENTIFIER) {
-      auto branch = dynamic_cast<hexasm::InstrLabel*>(instrs[index].get());
-      auto label = dynamic_cast<hexasm::Label*>(instrs[index+1].get());
-      return branch != nullptr && label != nullptr && branch->getLabel() == label->getLabel();
+  void addCost(Cost &cost, size_t index) const {
+    if (matchClass(PeepholeElement::is(PeepholeElement::INSTR), instrs.getToken(index))) {
+      cost.bytes += instrs.getSize(index);
+      cost.instrs++;
     }
-    return false;
   }
 
-  /// Match STAM <x>; LDAM <x>
-  bool matchStoreThenLoad(size_t index) {
-    if (instrs[index+0]->getToken() == hexasm::Token::STAM &&
-        instrs[index+1]->getToken() == hexasm::Token::LDAM) {
-      auto inst0 = dynamic_cast<hexasm::Directive*>(instrs[index+0].get());
-      auto inst1 = dynamic_cast<hexasm::Directive*>(instrs[index+1].get());
-      return !inst0->operandIsLabel() &&
-             !inst1->operandIsLabel() &&
-             inst0->getValue() == inst1->getValue();
+  bool isConst(size_t index) const { return !instrs.operandIsLabel(index); }
+
+  bool sameOperand(size_t index, size_t other) const {
+    if (instrs.getLabel(index) != hexasm::DirectiveStream::NO_LABEL ||
+        instrs.getLabel(other) != hexasm::DirectiveStream::NO_LABEL) {
+      return instrs.getLabel(index) == instrs.getLabel(other);
+    }
+    return instrs.getValue(index) == instrs.getValue(other);
+  }
+
+  static bool matchClass(const PeepholeElement &element, hexasm::Token token) {
+    switch (element.match) {
+    case PeepholeElement::TOKEN:
+      return token == element.token;
+    case PeepholeElement::LABEL:
+      return token == hexasm::Token::IDENTIFIER ||
+             token == hexasm::Token::FUNC ||
+             token == hexasm::Token::PROC;
+    case PeepholeElement::INSTR:
+      return token != hexasm::Token::IDENTIFIER &&
+             token != hexasm::Token::FUNC &&
+             token != hexasm::Token::PROC &&
+             token != hexasm::Token::DATA &&
+             token != hexasm::Token::PADDING &&
+             token != hexasm::Token::DATA_BEGIN &&
+             token != hexasm::Token::DATA_END;
+    case PeepholeElement::BRANCH:
+      return token == hexasm::Token::BR ||
+             token == hexasm::Token::BRZ ||
+             token == hexasm::Token::BRN;
+    case PeepholeElement::COND_BRANCH:
+      return token == hexasm::Token::BRZ ||
+             token == hexasm::Token::BRN;
+    case PeepholeElement::LOAD_A:
+      return token == hexasm::Token::LDAC ||
+             token == hexasm::Token::LDAM ||
+             token == hexasm::Token::LDAP;
+    case PeepholeElement::LOAD_B:
+      return token == hexasm::Token::LDBC ||
+             token == hexasm::Token::LDBM;
+    case PeepholeElement::KEEP_B:
+      // OPR is narrowed to ADD and SUB by matchToken().
+      return token == hexasm::Token::LDAC ||
+             token == hexasm::Token::LDAM ||
+             token == hexasm::Token::LDAP ||
+             token == hexasm::Token::LDAI ||
+             token == hexasm::Token::STAI ||
+             token == hexasm::Token::OPR;
     }
     return false;
   }
 
-  /// Match LDBM 1; STAI <x>; LDAM 1; LDAI <x>
-  bool matchIndexStoreThenLoad(size_t index) {
-    if (instrs[index+0]->getToken() == hexasm::Token::LDBM &&
-        instrs[index+1]->getToken() == hexasm::Token::STAI &&
-        instrs[index+2]->getToken() == hexasm::Token::LDAM &&
-        instrs[index+3]->getToken() == hexasm::Token::LDAI) {
-      auto inst0 = dynamic_cast<hexasm::Directive*>(instrs[index+0].get());
-      auto inst1 = dynamic_cast<hexasm::Directive*>(instrs[index+1].get());
-      auto inst2 = dynamic_cast<hexasm::Directive*>(instrs[index+2].get());
-      auto inst3 = dynamic_cast<hexasm::Directive*>(instrs[index+3].get());
-      return inst0->getValue() == 1 &&
-             inst2->getValue() == 1 &&
-             !inst1->operandIsLabel() &&
-             !inst3->operandIsLabel() &&
-             inst1->getValue() == inst3->getValue();
+  bool matchToken(const PeepholeElement &element, size_t index) const {
+    auto token = instrs.getToken(index);
+    if (!matchClass(element, token)) {
+      return false;
+    }
+    if (element.match == PeepholeElement::KEEP_B && token == hexasm::Token::OPR) {
+      return instrs.isOpr(index, hexasm::Token::ADD) ||
+             instrs.isOpr(index, hexasm::Token::SUB);
+    }
+    return true;
+  }
+
+  bool matchOperand(const PeepholeElement &element, size_t index, size_t base) const {
+    switch (element.operand) {
+    case PeepholeElement::ANY:
+      return true;
+    case PeepholeElement::SP:
+      return isConst(index) && instrs.getValue(index) == SP_OFFSET;
+    case PeepholeElement::ZERO:
+      return isConst(index) && instrs.getValue(index) == 0;
+    case PeepholeElement::NONZERO:
+      return isConst(index) && instrs.getValue(index) != 0;
+    case PeepholeElement::NONNEGATIVE:
+      return isConst(index) && instrs.getValue(index) >= 0;
+    case PeepholeElement::SAME:
+      return sameOperand(index, base + element.ref);
+    case PeepholeElement::SAME_ONCE:
+      return sameOperand(index, base + element.ref) &&
+             instrs.getLabel(index) != hexasm::DirectiveStream::NO_LABEL &&
+             references[instrs.getLabel(index)] == 1;
     }
     return false;
   }
 
-public:
-  OptimiseDirectives(SymbolTable &symbolTable, CodeBuffer &previousCodeBuffer) :
-      instrs(previousCodeBuffer.getInstrs()), cb(symbolTable) {
-    // Lower intermediate instruction directives.
+  /// Return true if a rule matches the directives from an index and its
+  /// replacement costs less.
+  bool match(const PeepholeRule &rule, size_t index) const {
+    if (index + rule.pattern.size() > instrs.size()) {
+      return false;
+    }
+    Cost cost{0, 0};
+    for (size_t i=0; i<rule.pattern.size(); i++) {
+      if (!matchToken(rule.pattern[i], index + i) ||
+          !matchOperand(rule.pattern[i], index + i, index)) {
+        return false;
+      }
+      addCost(cost, index + i);
+    }
+    Cost replacementCost{0, 0};
+    for (auto &output : rule.replacement) {
+      addCost(replacementCost, index + output.index);
+    }
+    return replacementCost < cost;
+  }
+
+  /// Write the replacement of the directives matched from an index to the
+  /// front of the stream, which is never ahead of them, returning the number
+  /// of directives written.
+  size_t apply(const PeepholeRule &rule, size_t index, size_t to) {
+    // Drop the references of the directives that are removed.
+    bool kept[MAX_PATTERN] = {};
+    for (auto &output : rule.replacement) {
+      kept[output.index] = true;
+    }
+    for (size_t i=0; i<rule.pattern.size(); i++) {
+      if (!kept[i] && instrs.operandIsLabel(index + i)) {
+        references[instrs.getLabel(index + i)]--;
+      }
+    }
+    // Read the labels of the replacement before they are overwritten.
+    uint32_t labels[MAX_PATTERN];
+    for (size_t i=0; i<rule.replacement.size(); i++) {
+      auto labelFrom = rule.replacement[i].labelFrom;
+      labels[i] = labelFrom < 0 ? hexasm::DirectiveStream::NO_LABEL :
+                                  instrs.getLabel(index + labelFrom);
+    }
+    for (size_t i=0; i<rule.replacement.size(); i++) {
+      instrs.move(to + i, index + rule.replacement[i].index);
+      if (labels[i] != hexasm::DirectiveStream::NO_LABEL) {
+        references[instrs.getLabel(to + i)]--;
+        references[labels[i]]++;
+        instrs.setLabel(to + i, labels[i]);
+      }
+    }
+    return rule.replacement.size();
+  }
+
+  /// Apply rules in a single forward pass, returning true if any applied.
+  bool runPass() {
+    references.assign(instrs.getLabels().size(), 0);
     for (size_t i=0; i<instrs.size(); i++) {
-      if (matchBranchZero(i)) {
-        // Omit branch.
-        cb.insertInstr(std::move(instrs[i+1]));
-        i += 1;
-      } else if (matchStoreThenLoad(i)) {
-        cb.insertInstr(std::move(instrs[i]));
-        // Omit load.
-        i += 1;
-      } else if (matchIndexStoreThenLoad(i)) {
-        cb.insertInstr(std::move(instrs[i]));
-        cb.insertInstr(std::move(instrs[i+1]));
-        // Omit load.
-        i += 3;
+      if (instrs.operandIsLabel(i)) {
+        references[instrs.getLabel(i)]++;
+      }
+    }
+    bool changed = false;
+    size_t count = 0;
+    size_t i = 0;
+    while (i < instrs.size()) {
+      auto &candidates = rulesByToken[static_cast<size_t>(instrs.getToken(i))];
+      size_t ruleIndex = rules.size();
+      for (auto candidate : candidates) {
+        if (match(rules[candidate], i)) {
+          ruleIndex = candidate;
+          break;
+        }
+      }
+      if (ruleIndex < rules.size()) {
+        count += apply(rules[ruleIndex], i, count);
+        i += rules[ruleIndex].pattern.size();
+        hits[ruleIndex]++;
+        changed = true;
       } else {
         // Otherwise just copy the directive.
-        cb.insertInstr(std::move(instrs[i]));
+        instrs.move(count++, i++);
       }
     }
+    instrs.erase(count, instrs.size());
+    return changed;
+  }
+
+public:
+  OptimiseDirectives(CodeBuffer &codeBuffer) :
+      cb(codeBuffer), instrs(codeBuffer.getInstrs()), rules(getPeepholeRules()),
+      hits(rules.size(), 0), passes(1),
+      rulesByToken(static_cast<size_t>(hexasm::Token::NONE) + 1) {
+    for (size_t token=0; token<rulesByToken.size(); token++) {
+      for (size_t i=0; i<rules.size(); i++) {
+        if (matchClass(rules[i].pattern.front(), static_cast<hexasm::Token>(token))) {
+          rulesByToken[token].push_back(i);
+        }
+      }
+    }
+    while (runPass()) {
+      passes++;
+    }
   }
 
   /// Reporting -------------------------------------------------------------//
   void emitInstrs(std::ostream &out) { cb.emitInstrs(out); }
 
+  /// Report the number of times each rule was applied.
+  void reportRuleHits(std::ostream &out) const {
+    out << boost::format("Peephole rules applied in %d passes\n") % passes;
+    for (size_t i=0; i<rules.size(); i++) {
+      out << boost::format("  %-22s %d\n") % rules[i].name % hits[i];
+    }
+    out << "\n";
+  }
+
   /// Member access ---------------------------------------------------------//
   CodeBuffer &getCodeBuffer() { return cb; }
-  std::vector<std::unique_ptr<hexasm::Directive>> &getInstrs() {
-    return cb.getInstrs();
-  }
+  hexasm::DirectiveStream &getInstrs() { return cb.getInstrs(); }
 };
 
 //===---------------------------------------------------------------------===//
@@ -2996,7 +4537,7 @@ public:
 
 class ReportMemoryInfo : public AstVisitor {
   SymbolTable &st;
-  const std::vector<std::unique_ptr<hexasm::Directive>> &directives;
+  const hexasm::DirectiveStream &directives;
   std::ostream &outs;
   void reportFrame(Frame *frame, Proc &proc) {
     outs << boost::format("Frame for %s\n") % proc.getName();
@@ -3006,8 +4547,7 @@ class ReportMemoryInfo : public AstVisitor {
     } else {
       outs << "  Formals:\n";
       for (auto &decl : proc.getFormals()) {
-        auto symbol = st.lookup(std::make_pair(proc.getName(), decl->getName()),
-                                decl->getLocation());
+        auto symbol = st.lookup(proc.getName(), decl->getName(), decl->getLocation());
         auto index = symbol->getFrame()->getSize() - 1 + symbol->getStackOffset();
         outs << boost::format("    %s at index %d\n") % symbol->getName() % index;
       }
@@ -3017,8 +4557,7 @@ class ReportMemoryInfo : public AstVisitor {
     } else {
       outs << "  Locals:\n";
       for (auto &decl : proc.getDecls()) {
-        auto symbol = st.lookup(std::make_pair(proc.getName(), decl->getName()),
-                                decl->getLocation());
+        auto symbol = st.lookup(proc.getName(), decl->getName(), decl->getLocation());
         auto index = symbol->getFrame()->getSize() - 1 + symbol->getStackOffset();
         outs << boost::format("    %s at index %d\n") % symbol->getName() % index;
       }
@@ -3027,23 +4566,248 @@ class ReportMemoryInfo : public AstVisitor {
   }
 public:
   ReportMemoryInfo(SymbolTable &symbolTable,
-                   const std::vector<std::unique_ptr<hexasm::Directive>> &directives,
+                   const hexasm::DirectiveStream &directives,
                    std::ostream &outs) :
     AstVisitor(false, false, false), st(symbolTable), directives(directives), outs(outs) {}
   void visitPre(Program &program) {
-    auto stackPointer = dynamic_cast<hexasm::Data*>(directives[1].get())->getValue();
+    auto stackPointer = directives.getValue(1);
     outs << boost::format("Memory range 0x%x - 0x%x\n") % 0 % MAX_ADDRESS;
     outs << boost::format("Stack pointer initialised to 0x%x\n") % stackPointer;
     outs << boost::format("Arrays allocated 0x%x - 0x%x\n") % (stackPointer+1) % MAX_ADDRESS;
     outs << "\n";
   }
   void visitPre(Proc &proc) {
-    auto procSymbol = st.lookup(std::make_pair(getCurrentScope(), proc.getName()),
-                                proc.getLocation());
+    auto procSymbol = st.lookup(getCurrentScope(), proc.getName(), proc.getLocation());
     reportFrame(procSymbol->getFrame(), proc);
   }
 };
 
+//===---------------------------------------------------------------------===//
+// Pass manager.
+//===---------------------------------------------------------------------===//
+
+/// Count the nodes of an AST.
+class CountNodes : public AstVisitor {
+  size_t count;
+public:
+  CountNodes() : count(0) {}
+  void visitPost(Program&) { count++; }
+  void visitPost(Proc&) { count++; }
+  void visitPost(ArrayDecl&) { count++; }
+  void visitPost(VarDecl&) { count++; }
+  void visitPost(ValDecl&) { count++; }
+  void visitPost(BinaryOpExpr&) { count++; }
+  void visitPost(UnaryOpExpr&) { count++; }
+  void visitPost(StringExpr&) { count++; }
+  void visitPost(BooleanExpr&) { count++; }
+  void visitPost(NumberExpr&) { count++; }
+  void visitPost(CallExpr&) { count++; }
+  void visitPost(ArraySubscriptExpr&) { count++; }
+  void visitPost(VarRefExpr&) { count++; }
+  void visitPost(ValFormal&) { count++; }
+  void visitPost(ArrayFormal&) { count++; }
+  void visitPost(ProcFormal&) { count++; }
+  void visitPost(FuncFormal&) { count++; }
+  void visitPost(SkipStatement&) { count++; }
+  void visitPost(StopStatement&) { count++; }
+  void visitPost(ReturnStatement&) { count++; }
+  void visitPost(IfStatement&) { count++; }
+  void visitPost(WhileStatement&) { count++; }
+  void visitPost(SeqStatement&) { count++; }
+  void visitPost(CallStatement&) { count++; }
+  void visitPost(TailCallStatement&) { count++; }
+  void visitPost(AssStatement&) { count++; }
+  size_t getCount() const { return count; }
+};
+
+/// Run ConstProp and OptimiseExpr in a single traversal, which gives the
+/// same tree as running them in turn since OptimiseExpr only rewrites
+/// expressions that ConstProp has not evaluated.
+class ConstPropOptimiseExpr : public ConstProp {
+  OptimiseExpr optimiseExpr;
+  template<typename T>
+  void optimise(T &expr) {
+    optimiseExpr.visitPost(expr);
+    if (optimiseExpr.hasExprReplacement()) {
+      setExprReplacement(optimiseExpr.takeExprReplacement());
+    }
+  }
+public:
+  ConstPropOptimiseExpr(SymbolTable &symbolTable, Arena &arena) :
+    ConstProp(symbolTable), optimiseExpr(arena) {}
+  using ConstProp::visitPost;
+  void visitPost(BinaryOpExpr &expr) override {
+    ConstProp::visitPost(expr);
+    optimise(expr);
+  }
+  void visitPost(UnaryOpExpr &expr) override {
+    ConstProp::visitPost(expr);
+    optimise(expr);
+  }
+};
+
+/// The passes of the compiler, in the order they run. Optional passes only
+/// improve the program and can be disabled.
+struct PassInfo {
+  const char *name;
+  bool optional;
+};
+
+const PassInfo PASSES[] = {
+  {"Parse",              false},
+  {"CreateSymbols",      false},
+  {"ConstProp",          false},
+  {"OptimiseExpr",       false},
+  {"OptimiseCalls",      true},
+  {"CodeGen",            false},
+  {"LayoutProgram",      true},
+  {"LowerDirectives",    false},
+  {"OptimiseDirectives", true},
+  {"Assemble",           false},
+};
+
+struct UnknownPassError : public Error {
+  UnknownPassError(const std::string &name) :
+    Error((boost::format("unknown pass %s") % name).str()) {}
+};
+
+struct RequiredPassError : public Error {
+  RequiredPassError(const std::string &name) :
+    Error((boost::format("pass %s cannot be disabled") % name).str()) {}
+};
+
+/// Run the passes of the compiler, skipping any that are disabled. When
+/// timing is enabled, record the wall time of each pass, the change in heap
+/// in use and the peak resident set of the process after it, and the size
+/// of its output in AST nodes or directives, to report in the manner of
+/// -ftime-report.
+class PassManager {
+  struct PassRecord {
+    std::string name;
+    double seconds;
+    long heapBytes;
+    long peakKBytes;
+    size_t size;
+    const char *units;
+  };
+
+  std::vector<std::string> disabled;
+  std::vector<PassRecord> records;
+  bool timing;
+  bool fuseExprPasses;
+  size_t inlineSizeLimit;
+
+  static long getHeapBytes() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    auto info = mallinfo2();
+    return static_cast<long>(info.uordblks + info.hblkhd);
+#elif defined(__GLIBC__)
+    // mallinfo() has int fields, which wrap beyond 2GB.
+    auto info = mallinfo();
+    return static_cast<long>(static_cast<unsigned>(info.uordblks) +
+                             static_cast<unsigned>(info.hblkhd));
+#else
+    return 0;
+#endif
+  }
+
+  static long getPeakKBytes() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+  }
+
+  static const PassInfo &lookup(const std::string &name) {
+    for (auto &pass : PASSES) {
+      if (name == pass.name) {
+        return pass;
+      }
+    }
+    throw UnknownPassError(name);
+  }
+
+public:
+  PassManager() :
+    timing(false), fuseExprPasses(false), inlineSizeLimit(DEFAULT_INLINE_SIZE_LIMIT) {}
+
+  /// Disable an optional pass.
+  void disable(const std::string &name) {
+    if (!lookup(name).optional) {
+      throw RequiredPassError(name);
+    }
+    disabled.push_back(name);
+  }
+
+  bool isEnabled(const std::string &name) const {
+    return std::find(disabled.begin(), disabled.end(), name) == disabled.end();
+  }
+
+  /// Run a pass unless it is disabled, returning true if it ran. The size
+  /// of its output is only measured when timing.
+  template<typename Pass, typename Size>
+  bool run(const std::string &name, Pass pass, Size size, const char *units) {
+    if (!isEnabled(name)) {
+      return false;
+    }
+    if (!timing) {
+      pass();
+      return true;
+    }
+    auto heapBytes = getHeapBytes();
+    auto start = std::chrono::steady_clock::now();
+    pass();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    records.push_back({name, elapsed.count(), getHeapBytes() - heapBytes,
+                       getPeakKBytes(), size(), units});
+    return true;
+  }
+
+  /// Clear the records of a previous run.
+  void reset() { records.clear(); }
+
+  /// Return a description of the options that change the output of the
+  /// passes, for a cache key.
+  std::string getOptions() const {
+    std::string options = fuseExprPasses ? "fuse-expr-passes" : "";
+    // The order in which passes are disabled does not change the output.
+    auto names = disabled;
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+    for (auto &name : names) {
+      options += " no-" + name;
+    }
+    if (inlineSizeLimit != DEFAULT_INLINE_SIZE_LIMIT) {
+      options += " inline-limit-" + std::to_string(inlineSizeLimit);
+    }
+    return options;
+  }
+
+  void setTiming(bool value) { timing = value; }
+  bool getTiming() const { return timing; }
+  void setFuseExprPasses(bool value) { fuseExprPasses = value; }
+  bool getFuseExprPasses() const { return fuseExprPasses; }
+  void setInlineSizeLimit(size_t value) { inlineSizeLimit = value; }
+  size_t getInlineSizeLimit() const { return inlineSizeLimit; }
+
+  /// Print a table of the passes that ran.
+  void report(std::ostream &out) const {
+    double totalSeconds = 0;
+    for (auto &record : records) {
+      totalSeconds += record.seconds;
+    }
+    out << boost::format("%-34s %10s %7s %12s %14s %10s\n")
+             % "Pass" % "Wall (ms)" % "Wall%" % "Heap (KB)" % "Peak RSS (KB)" % "Size";
+    for (auto &record : records) {
+      out << boost::format("%-34s %10.3f %6.2f%% %12d %14d %10d %s\n")
+               % record.name % (record.seconds * 1000.0)
+               % (totalSeconds > 0 ? 100.0 * record.seconds / totalSeconds : 0.0)
+               % (record.heapBytes / 1024) % record.peakKBytes
+               % record.size % record.units;
+    }
+    out << boost::format("%-34s %10.3f\n") % "Total" % (totalSeconds * 1000.0);
+  }
+};
+
 //===---------------------------------------------------------------------===//
 // Driver.
 //===---------------------------------------------------------------------===//
@@ -3056,23 +4820,28 @@ enum class DriverAction {
   EMIT_LOWERED_INSTS,
   EMIT_OPTIMISED_INSTS,
   EMIT_ASM,
-  EMIT_BINARY
+  EMIT_BINARY,
+  EMIT_BINARY_IMAGE // Into memory, see getBinaryImage().
 };
 
 class Driver {
   Lexer lexer;
   Parser parser;
+  PassManager passManager;
+  hex::BuildCache *buildCache;
   std::ostream &outStream;
+  std::string binaryImage;
 
 public:
   Driver(std::ostream &outStream) :
-    parser(lexer), outStream(outStream) {}
+    parser(lexer), buildCache(nullptr), outStream(outStream) {}
 
   int run(DriverAction action,
           const std::string &input,
           bool inputIsFilename,
           const std::string outputBinaryFilename="a.out",
-          bool reportMemoryInfo=false) {
+          bool reportMemoryInfo=false,
+          const std::string profileFilename="") {
 
     // Open the file.
     if (inputIsFilename) {
@@ -3087,29 +4856,70 @@ public:
       return 0;
     }
 
+    // Reuse a binary from the cache, unless the compilation is reported on
+    // or depends on a profile, which is not part of the key.
+    hex::BuildCache::Key cacheKey;
+    if (buildCache && profileFilename.empty() && !reportMemoryInfo && !passManager.getTiming() &&
+        (action == DriverAction::EMIT_BINARY || action == DriverAction::EMIT_BINARY_IMAGE)) {
+      cacheKey = hex::BuildCache::getKey("xcmp", passManager.getOptions(), lexer.getSource());
+      if (buildCache->lookup(cacheKey, binaryImage)) {
+        if (action == DriverAction::EMIT_BINARY) {
+          hex::writeBinaryFile(outputBinaryFilename, binaryImage);
+        }
+        return 0;
+      }
+    }
+
+    passManager.reset();
+    std::unique_ptr<Program> tree;
+    auto countNodes = [&]() {
+      CountNodes visitor;
+      tree->accept(&visitor);
+      return visitor.getCount();
+    };
+
     // Parse the program.
-    auto tree = parser.parseProgram();
+    passManager.run("Parse", [&]() { tree = parser.parseProgram(); }, countNodes, "nodes");
 
     SymbolTable symbolTable;
 
     // Populate the symbol table;
-    CreateSymbols createSymbols(symbolTable);
-    tree->accept(&createSymbols);
-
-    // Constant propagation.
-    ConstProp constProp(symbolTable);
-    tree->accept(&constProp);
+    passManager.run("CreateSymbols", [&]() {
+      CreateSymbols createSymbols(symbolTable);
+      tree->accept(&createSymbols);
+    }, countNodes, "nodes");
+
+    // Constant propagation and expression optimisation, which can be fused
+    // into one traversal unless the tree between them is printed.
+    if (passManager.getFuseExprPasses() && action != DriverAction::EMIT_TREE) {
+      passManager.run("ConstProp+OptimiseExpr", [&]() {
+        ConstPropOptimiseExpr constPropOptimiseExpr(symbolTable, tree->getArena());
+        tree->accept(&constPropOptimiseExpr);
+      }, countNodes, "nodes");
+    } else {
+      passManager.run("ConstProp", [&]() {
+        ConstProp constProp(symbolTable);
+        tree->accept(&constProp);
+      }, countNodes, "nodes");
+
+      // Parse and print program only.
+      if (action == DriverAction::EMIT_TREE) {
+        xcmp::AstPrinter printer(outStream);
+        tree->accept(&printer);
+        return 0;
+      }
 
-    // Parse and print program only.
-    if (action == DriverAction::EMIT_TREE) {
-      xcmp::AstPrinter printer(outStream);
-      tree->accept(&printer);
-      return 0;
+      passManager.run("OptimiseExpr", [&]() {
+        OptimiseExpr optimiseExpr(tree->getArena());
+        tree->accept(&optimiseExpr);
+      }, countNodes, "nodes");
     }
 
-    // Optimise expressions.
-    OptimiseExpr optimiseExpr;
-    tree->accept(&optimiseExpr);
+    // Replace tail calls and inline small procedures and functions.
+    passManager.run("OptimiseCalls", [&]() {
+      OptimiseCalls optimiseCalls(symbolTable, *tree, passManager.getInlineSizeLimit());
+      tree->accept(&optimiseCalls);
+    }, countNodes, "nodes");
 
     // Parse and print program only.
     if (action == DriverAction::EMIT_OPTIMISED_TREE) {
@@ -3120,7 +4930,18 @@ public:
 
     // Perform code generation.
     CodeGen codeGen(symbolTable);
-    tree->accept(&codeGen);
+    auto &cb = codeGen.getCodeBuffer();
+    auto countDirectives = [&cb]() { return cb.getInstrs().size() + cb.getData().size(); };
+    passManager.run("CodeGen", [&]() { tree->accept(&codeGen); }, countDirectives, "directives");
+
+    // Lay out the procedures and data, weighted by a profile if one is given.
+    passManager.run("LayoutProgram", [&]() {
+      Profile profile;
+      if (!profileFilename.empty()) {
+        profile.read(profileFilename);
+      }
+      LayoutProgram layoutProgram(codeGen, profile);
+    }, countDirectives, "directives");
 
     // Emit the generated intermediate instructions only.
     if (action == DriverAction::EMIT_INTERMEDIATE_INSTS) {
@@ -3129,40 +4950,57 @@ public:
     }
 
     // Lower the generated (intermediate code) to assembly directives.
-    xcmp::LowerDirectives lowerDirectives(symbolTable, codeGen);
+    passManager.run("LowerDirectives", [&]() {
+      xcmp::LowerDirectives lowerDirectives(codeGen);
+    }, countDirectives, "directives");
 
     // Report frame information.
     if (reportMemoryInfo) {
-      xcmp::ReportMemoryInfo reportMemoryInfo(symbolTable, lowerDirectives.getInstrs(), std::cout);
+      xcmp::ReportMemoryInfo reportMemoryInfo(symbolTable, cb.getInstrs(), std::cout);
       tree->accept(&reportMemoryInfo);
     }
 
     // Emit the lowered instructions only.
     if (action == DriverAction::EMIT_LOWERED_INSTS) {
-      lowerDirectives.emitInstrs(outStream);
+      codeGen.emitInstrs(outStream);
       return 0;
     }
 
     // Optimise the final set of assembly directives.
-    xcmp::OptimiseDirectives optimiseDirectives(symbolTable, lowerDirectives.getCodeBuffer());
+    passManager.run("OptimiseDirectives", [&]() {
+      xcmp::OptimiseDirectives optimiseDirectives(cb);
+      // Report the optimisations applied.
+      if (reportMemoryInfo) {
+        optimiseDirectives.reportRuleHits(std::cout);
+      }
+    }, countDirectives, "directives");
 
     // Emit the lowered instructions only.
     if (action == DriverAction::EMIT_OPTIMISED_INSTS) {
-      optimiseDirectives.emitInstrs(outStream);
+      codeGen.emitInstrs(outStream);
       return 0;
     }
 
     // Assemble the instructions.
-    hexasm::CodeGen asmCodeGen(optimiseDirectives.getInstrs());
+    std::optional<hexasm::CodeGen> asmCodeGen;
+    passManager.run("Assemble", [&]() { asmCodeGen.emplace(cb.getInstrs()); },
+                    countDirectives, "directives");
 
     // Print the assembly instructions only.
     if (action == DriverAction::EMIT_ASM) {
-      asmCodeGen.emitProgramText(outStream);
+      asmCodeGen->emitProgramText(outStream);
       return 0;
     }
 
-    if (action == DriverAction::EMIT_BINARY) {
-      asmCodeGen.emitBin(outputBinaryFilename);
+    if (action == DriverAction::EMIT_BINARY ||
+        action == DriverAction::EMIT_BINARY_IMAGE) {
+      binaryImage = asmCodeGen->emitBinImage();
+      if (!cacheKey.name.empty()) {
+        buildCache->store(cacheKey, binaryImage);
+      }
+      if (action == DriverAction::EMIT_BINARY) {
+        hex::writeBinaryFile(outputBinaryFilename, binaryImage);
+      }
       return 0;
     }
 
@@ -3174,9 +5012,11 @@ public:
                          const std::string &input,
                          bool inputIsFilename,
                          const std::string outputBinaryFilename="a.out",
-                         bool reportMemoryInfo=false) {
+                         bool reportMemoryInfo=false,
+                         const std::string profileFilename="") {
     try {
-      return run(action, input, inputIsFilename, outputBinaryFilename, reportMemoryInfo);
+      return run(action, input, inputIsFilename, outputBinaryFilename, reportMemoryInfo,
+                 profileFilename);
     } catch (const hexutil::Error &e) {
       if (e.hasLocation()) {
         std::cerr << boost::format("Error %s: %s\n") % e.getLocation().str() % e.what();
@@ -3190,6 +5030,12 @@ public:
     }
   }
 
+  /// Consult a cache of binaries for EMIT_BINARY and EMIT_BINARY_IMAGE.
+  void setBuildCache(hex::BuildCache *cache) { buildCache = cache; }
+  /// The passes, to configure them before a run and report on them after.
+  PassManager &getPassManager() { return passManager; }
+  /// The binary from the last EMIT_BINARY_IMAGE run, which can be moved from.
+  std::string &getBinaryImage() { return binaryImage; }
   Lexer &getLexer() { return lexer; }
   Parser &getParser() { return parser; }
 };
@@ -1,3 +1,4 @@
+#include <chrono>
 #include <iostream>
 
 #include "hexasm.hpp"
@@ -18,12 +19,23 @@ static void help(char *argv[]) {
   std::cout << "  -h,--help         Display this message\n";
   std::cout << "  -t,--trace      Enable instruction tracing\n";
   std::cout << "  --max-cycles N  Limit the number of simulation cycles (default: 0)\n";
+  std::cout << "  --stats         Report execution statistics on stderr\n";
+  std::cout << "  --profile FILE  Report cycles per symbol on stderr and write folded stacks to FILE\n";
+  std::cout << "  --profile-use FILE Lay out the program using a profile from --profile\n";
+  std::cout << "  --cache-dir DIR Reuse binaries from a cache in DIR (default: $HEX_CACHE_DIR)\n";
+  std::cout << "  --cache-stats   Report cache hits and misses on stderr\n";
 }
 
 int main(int argc, char *argv[]) {
   char *inputFilename = nullptr;
   bool trace = false;
   size_t maxCycles = 0;
+  bool stats = false;
+  const char *profileFilename = nullptr;
+  const char *profileUseFilename = "";
+  const char *cacheDirectory = hex::BuildCache::getEnvironmentDirectory();
+  bool cacheStats = false;
+  std::unique_ptr<hex::BuildCache> buildCache;
   xcmp::Driver driver(std::cout);
   try {
     for (int i = 1; i < argc; ++i) {
@@ -36,6 +48,16 @@ int main(int argc, char *argv[]) {
         trace = true;
       } else if (std::strcmp(argv[i], "--max-cycles") == 0) {
         maxCycles = std::stoull(argv[++i]);
+      } else if (std::strcmp(argv[i], "--stats") == 0) {
+        stats = true;
+      } else if (std::strcmp(argv[i], "--profile") == 0) {
+        profileFilename = argv[++i];
+      } else if (std::strcmp(argv[i], "--profile-use") == 0) {
+        profileUseFilename = argv[++i];
+      } else if (std::strcmp(argv[i], "--cache-dir") == 0) {
+        cacheDirectory = argv[++i];
+      } else if (std::strcmp(argv[i], "--cache-stats") == 0) {
+        cacheStats = true;
       } else if (argv[i][0] == '-') {
           throw std::runtime_error(std::string("unrecognised argument: ")+argv[i]);
       } else {
@@ -46,11 +68,31 @@ int main(int argc, char *argv[]) {
         }
       }
     }
-    if (driver.runCatchExceptions(xcmp::DriverAction::EMIT_BINARY, inputFilename, true, "a.bin", false) == 0) {
+    if (cacheDirectory) {
+      buildCache = std::make_unique<hex::BuildCache>(cacheDirectory);
+      driver.setBuildCache(buildCache.get());
+    }
+    if (driver.runCatchExceptions(xcmp::DriverAction::EMIT_BINARY_IMAGE, inputFilename, true,
+                                  "a.out", false, profileUseFilename) == 0) {
       hexsim::Processor processor(std::cin, std::cout, maxCycles);
       processor.setTracing(trace);
-      processor.load("a.bin");
+      processor.setStats(stats);
+      processor.setProfiling(profileFilename != nullptr);
+      processor.load(hexsim::MemoryImage(std::move(driver.getBinaryImage()), inputFilename));
+      auto start = std::chrono::steady_clock::now();
       processor.run();
+      if (stats) {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        processor.getStats().report(std::cerr, processor.getCycles(), elapsed.count());
+      }
+      if (profileFilename) {
+        processor.getProfiler()->report(std::cerr);
+        std::ofstream profileFile(profileFilename);
+        processor.getProfiler()->writeFoldedStacks(profileFile);
+      }
+    }
+    if (buildCache && cacheStats) {
+      buildCache->reportStats(std::cerr);
     }
   } catch (const std::exception &e) {
     std::cerr << boost::format("Error: %s\n") % e.what();